@@ -86,21 +86,31 @@ struct aes_cnt_cipher {
 };
 
 aes_cnt_cipher_t *
-aes_new_cipher(const char *key, const char *iv)
+aes_init_cipher_in(void *mem, const char *key, const char *iv)
 {
-  aes_cnt_cipher_t *cipher;
-  cipher = tor_malloc_zero(sizeof(aes_cnt_cipher_t));
+  aes_cnt_cipher_t *cipher = mem;
+  memset(cipher, 0, sizeof(aes_cnt_cipher_t));
   EVP_EncryptInit(&cipher->evp, EVP_aes_128_ctr(),
                   (const unsigned char*)key, (const unsigned char *)iv);
   return cipher;
 }
+aes_cnt_cipher_t *
+aes_new_cipher(const char *key, const char *iv)
+{
+  return aes_init_cipher_in(tor_malloc(sizeof(aes_cnt_cipher_t)), key, iv);
+}
+void
+aes_cipher_clear(aes_cnt_cipher_t *cipher)
+{
+  EVP_CIPHER_CTX_cleanup(&cipher->evp);
+  memwipe(cipher, 0, sizeof(aes_cnt_cipher_t));
+}
 void
 aes_cipher_free(aes_cnt_cipher_t *cipher)
 {
   if (!cipher)
     return;
-  EVP_CIPHER_CTX_cleanup(&cipher->evp);
-  memwipe(cipher, 0, sizeof(aes_cnt_cipher_t));
+  aes_cipher_clear(cipher);
   tor_free(cipher);
 }
 void
@@ -295,13 +305,16 @@ static void aes_set_key(aes_cnt_cipher_t *cipher, const char *key,
 static void aes_set_iv(aes_cnt_cipher_t *cipher, const char *iv);
 
 /**
- * Return a newly allocated counter-mode AES128 cipher implementation,
- * using the 128-bit key <b>key</b> and the 128-bit IV <b>iv</b>.
+ * Initialize a counter-mode AES128 cipher in the AES_CNT_CIPHER_MAX_SIZE
+ * bytes at <b>mem</b>, using the 128-bit key <b>key</b> and the 128-bit IV
+ * <b>iv</b>, and return it.  <b>mem</b> must be suitably aligned for any
+ * type.  Release it with aes_cipher_clear(), not aes_cipher_free().
  */
-aes_cnt_cipher_t*
-aes_new_cipher(const char *key, const char *iv)
+aes_cnt_cipher_t *
+aes_init_cipher_in(void *mem, const char *key, const char *iv)
 {
-  aes_cnt_cipher_t* result = tor_malloc_zero(sizeof(aes_cnt_cipher_t));
+  aes_cnt_cipher_t *result = mem;
+  memset(result, 0, sizeof(aes_cnt_cipher_t));
 
   aes_set_key(result, key, 128);
   aes_set_iv(result, iv);
@@ -309,6 +322,16 @@ aes_new_cipher(const char *key, const char *iv)
   return result;
 }
 
+/**
+ * Return a newly allocated counter-mode AES128 cipher implementation,
+ * using the 128-bit key <b>key</b> and the 128-bit IV <b>iv</b>.
+ */
+aes_cnt_cipher_t*
+aes_new_cipher(const char *key, const char *iv)
+{
+  return aes_init_cipher_in(tor_malloc(sizeof(aes_cnt_cipher_t)), key, iv);
+}
+
 /** Set the key of <b>cipher</b> to <b>key</b>, which is
  * <b>key_bits</b> bits long (must be 128, 192, or 256).  Also resets
  * the counter to 0.
@@ -348,17 +371,26 @@ aes_set_key(aes_cnt_cipher_t *cipher, const char *key, int key_bits)
     aes_fill_buf_(cipher);
 }
 
-/** Release storage held by <b>cipher</b>
+/** Release any resources held by <b>cipher</b> and wipe it, without freeing
+ * the memory it occupies.
  */
 void
-aes_cipher_free(aes_cnt_cipher_t *cipher)
+aes_cipher_clear(aes_cnt_cipher_t *cipher)
 {
-  if (!cipher)
-    return;
   if (cipher->using_evp) {
     EVP_CIPHER_CTX_cleanup(&cipher->key.evp);
   }
   memwipe(cipher, 0, sizeof(aes_cnt_cipher_t));
+}
+
+/** Release storage held by <b>cipher</b>
+ */
+void
+aes_cipher_free(aes_cnt_cipher_t *cipher)
+{
+  if (!cipher)
+    return;
+  aes_cipher_clear(cipher);
   tor_free(cipher);
 }
 
@@ -494,3 +526,8 @@ aes_set_iv(aes_cnt_cipher_t *cipher, const char *iv)
 
 #endif
 
+/* Fail to compile if AES_CNT_CIPHER_MAX_SIZE is too small to hold an
+ * aes_cnt_cipher_t. */
+typedef char aes_cnt_cipher_max_size_is_too_small[
+             (sizeof(aes_cnt_cipher_t) <= AES_CNT_CIPHER_MAX_SIZE) ? 1 : -1];
+
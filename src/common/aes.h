@@ -16,7 +16,15 @@
 struct aes_cnt_cipher;
 typedef struct aes_cnt_cipher aes_cnt_cipher_t;
 
+/** Upper bound on sizeof(aes_cnt_cipher_t), so that callers can set aside
+ * room for a cipher inside their own structures and initialize it there
+ * with aes_init_cipher_in().  Checked at compile time in aes.c. */
+#define AES_CNT_CIPHER_MAX_SIZE 384
+
 aes_cnt_cipher_t* aes_new_cipher(const char *key, const char *iv);
+aes_cnt_cipher_t *aes_init_cipher_in(void *mem, const char *key,
+                                     const char *iv);
+void aes_cipher_clear(aes_cnt_cipher_t *cipher);
 void aes_cipher_free(aes_cnt_cipher_t *cipher);
 void aes_crypt(aes_cnt_cipher_t *cipher, const char *input, size_t len,
                char *output);
@@ -1058,6 +1058,21 @@ tor_ftruncate(int fd)
 #endif
 }
 
+/** Flush everything that we've written to <b>fd</b> out to the disk.  Return
+ * -1 on error, 0 on success.  If we have no way to do this, succeed. */
+int
+tor_fsync(int fd)
+{
+#ifdef _WIN32
+  return _commit(fd);
+#elif defined(HAVE_FSYNC)
+  return fsync(fd);
+#else
+  (void)fd;
+  return 0;
+#endif
+}
+
 #undef DEBUG_SOCKET_COUNTING
 #ifdef DEBUG_SOCKET_COUNTING
 /** A bitarray of all fds that should be passed to tor_socket_close(). Only
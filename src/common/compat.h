@@ -404,6 +404,7 @@ off_t tor_fd_getpos(int fd);
 int tor_fd_setpos(int fd, off_t pos);
 int tor_fd_seekend(int fd);
 int tor_ftruncate(int fd);
+int tor_fsync(int fd);
 
 #ifdef _WIN32
 #define PATH_SEPARATOR "\\"
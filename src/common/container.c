@@ -22,6 +22,7 @@
 #include <assert.h>
 
 #include "ht.h"
+#include "oaht.h"
 
 /** All newly allocated smartlists have this capacity. */
 #define SMARTLIST_DEFAULT_CAPACITY 16
@@ -1036,22 +1037,26 @@ smartlist_uniq_digests256(smartlist_t *sl)
 }
 
 /** Helper: Declare an entry type and a map type to implement a mapping using
- * ht.h.  The map type will be called <b>maptype</b>.  The key part of each
- * entry is declared using the C declaration <b>keydecl</b>.  All functions
- * and types associated with the map get prefixed with <b>prefix</b> */
-#define DEFINE_MAP_STRUCTS(maptype, keydecl, prefix)      \
+ * ht.h (if <b>ht</b> is HT) or oaht.h (if <b>ht</b> is OAHT).  The map type
+ * will be called <b>maptype</b>.  The key part of each entry is declared
+ * using the C declaration <b>keydecl</b>.  All functions and types
+ * associated with the map get prefixed with <b>prefix</b> */
+#define DEFINE_MAP_STRUCTS(maptype, keydecl, prefix, ht)  \
   typedef struct prefix ## entry_t {                      \
-    HT_ENTRY(prefix ## entry_t) node;                     \
+    ht ## _ENTRY(prefix ## entry_t) node;                 \
     void *val;                                            \
     keydecl;                                              \
   } prefix ## entry_t;                                    \
   struct maptype {                                        \
-    HT_HEAD(prefix ## impl, prefix ## entry_t) head;      \
+    ht ## _HEAD(prefix ## impl, prefix ## entry_t) head;  \
   }
 
-DEFINE_MAP_STRUCTS(strmap_t, char *key, strmap_);
-DEFINE_MAP_STRUCTS(digestmap_t, char key[DIGEST_LEN], digestmap_);
-DEFINE_MAP_STRUCTS(digest256map_t, uint8_t key[DIGEST256_LEN], digest256map_);
+DEFINE_MAP_STRUCTS(strmap_t, char *key, strmap_, HT);
+/* Digest maps are looked up on many hot paths, and their keys hash well, so
+ * we use the open-addressing table for them. */
+DEFINE_MAP_STRUCTS(digestmap_t, char key[DIGEST_LEN], digestmap_, OAHT);
+DEFINE_MAP_STRUCTS(digest256map_t, uint8_t key[DIGEST256_LEN], digest256map_,
+                   HT);
 
 /** Helper: compare strmap_entry_t objects by key value. */
 static INLINE int
@@ -1101,10 +1106,10 @@ HT_PROTOTYPE(strmap_impl, strmap_entry_t, node, strmap_entry_hash,
 HT_GENERATE2(strmap_impl, strmap_entry_t, node, strmap_entry_hash,
              strmap_entries_eq, 0.6, tor_reallocarray_, tor_free_)
 
-HT_PROTOTYPE(digestmap_impl, digestmap_entry_t, node, digestmap_entry_hash,
-             digestmap_entries_eq)
-HT_GENERATE2(digestmap_impl, digestmap_entry_t, node, digestmap_entry_hash,
-             digestmap_entries_eq, 0.6, tor_reallocarray_, tor_free_)
+OAHT_PROTOTYPE(digestmap_impl, digestmap_entry_t, node, digestmap_entry_hash,
+               digestmap_entries_eq)
+OAHT_GENERATE2(digestmap_impl, digestmap_entry_t, node, digestmap_entry_hash,
+               digestmap_entries_eq, 0.75, tor_reallocarray_, tor_free_)
 
 HT_PROTOTYPE(digest256map_impl, digest256map_entry_t, node,
              digest256map_entry_hash,
@@ -1167,9 +1172,10 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
  * prefix_entry_free_() function to free entries (and their keys), a
  * prefix_assign_tmp_key() function to temporarily set a stack-allocated
  * entry to hold a key, and a prefix_assign_key() function to set a
- * heap-allocated entry to hold a key.
+ * heap-allocated entry to hold a key.  <b>ht</b> must match the argument
+ * given to DEFINE_MAP_STRUCTS.
  */
-#define IMPLEMENT_MAP_FNS(maptype, keytype, prefix)                     \
+#define IMPLEMENT_MAP_FNS(maptype, keytype, prefix, ht)                 \
   /** Create and return a new empty map. */                             \
   MOCK_IMPL(maptype *,                                                  \
   prefix##_new,(void))                                                  \
@@ -1214,7 +1220,7 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
     /* trips to the hash table that we would do in the unoptimized */   \
     /* version of this code. (Each of HT_INSERT and HT_FIND calls */     \
     /* HT_SET_HASH and HT_FIND_P.) */                                   \
-    HT_FIND_OR_INSERT_(prefix##_impl, node, prefix##_entry_hash,        \
+    ht##_FIND_OR_INSERT_(prefix##_impl, node, prefix##_entry_hash,      \
                        &(map->head),                                    \
                        prefix##_entry_t, &search, ptr,                  \
                        {                                                \
@@ -1229,7 +1235,7 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
                            tor_malloc_zero(sizeof(prefix##_entry_t));   \
                          prefix##_assign_key(newent, key);              \
                          newent->val = val;                             \
-                         HT_FOI_INSERT_(node, &(map->head),             \
+                         ht##_FOI_INSERT_(node, &(map->head),           \
                             &search, newent, ptr);                      \
                          return NULL;                                   \
     });                                                                 \
@@ -1375,9 +1381,9 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
     return iter == NULL;                                                \
   }
 
-IMPLEMENT_MAP_FNS(strmap_t, char *, strmap)
-IMPLEMENT_MAP_FNS(digestmap_t, char *, digestmap)
-IMPLEMENT_MAP_FNS(digest256map_t, uint8_t *, digest256map)
+IMPLEMENT_MAP_FNS(strmap_t, char *, strmap, HT)
+IMPLEMENT_MAP_FNS(digestmap_t, char *, digestmap, OAHT)
+IMPLEMENT_MAP_FNS(digest256map_t, uint8_t *, digest256map, HT)
 
 /** Same as strmap_set, but first converts <b>key</b> to lowercase. */
 void *
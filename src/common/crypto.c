@@ -548,6 +548,52 @@ crypto_cipher_free(crypto_cipher_t *env)
   tor_free(env);
 }
 
+/** The layout of a crypto_cipher_t that lives in a crypto_cipher_storage_t:
+ * the cipher, followed by room for its AES state. */
+typedef struct crypto_cipher_inline_t {
+  crypto_cipher_t env;
+  union {
+    uint64_t align_u64_;
+    void *align_ptr_;
+    char mem[AES_CNT_CIPHER_MAX_SIZE];
+  } aes;
+} crypto_cipher_inline_t;
+
+/* Fail to compile if CRYPTO_CIPHER_STORAGE_LEN is too small. */
+typedef char crypto_cipher_storage_is_too_small[
+       (sizeof(crypto_cipher_inline_t) <= CRYPTO_CIPHER_STORAGE_LEN) ? 1 : -1];
+
+/** Set up a new crypto_cipher_t in <b>storage</b> with the provided
+ * <b>key</b> (or a random key if <b>key</b> is NULL) and an IV of all zero
+ * bytes, and return it.  Unlike crypto_cipher_new(), this makes no heap
+ * allocations of its own.  Release the cipher with crypto_cipher_clear(). */
+crypto_cipher_t *
+crypto_cipher_init_in(crypto_cipher_storage_t *storage, const char *key)
+{
+  crypto_cipher_inline_t *in = (crypto_cipher_inline_t *)storage->mem;
+  crypto_cipher_t *env = &in->env;
+
+  if (key == NULL)
+    crypto_rand(env->key, CIPHER_KEY_LEN);
+  else
+    memcpy(env->key, key, CIPHER_KEY_LEN);
+  memset(env->iv, 0, CIPHER_IV_LEN);
+
+  env->cipher = aes_init_cipher_in(in->aes.mem, env->key, env->iv);
+
+  return env;
+}
+
+/** Release everything held by <b>env</b>, a cipher set up with
+ * crypto_cipher_init_in(), and wipe it.  Does not free <b>env</b>. */
+void
+crypto_cipher_clear(crypto_cipher_t *env)
+{
+  tor_assert(env->cipher);
+  aes_cipher_clear(env->cipher);
+  memwipe(env, 0, sizeof(crypto_cipher_t));
+}
+
 /* public key crypto */
 
 /** Generate a <b>bits</b>-bit new public/private keypair in <b>env</b>.
@@ -1706,6 +1752,29 @@ crypto_digest_free(crypto_digest_t *digest)
   tor_free(digest);
 }
 
+/* Fail to compile if CRYPTO_DIGEST_STORAGE_LEN is too small. */
+typedef char crypto_digest_storage_is_too_small[
+       (sizeof(crypto_digest_t) <= CRYPTO_DIGEST_STORAGE_LEN) ? 1 : -1];
+
+/** Set up a new digest object to compute SHA1 digests in <b>storage</b>,
+ * and return it.  Release it with crypto_digest_clear(). */
+crypto_digest_t *
+crypto_digest_init_in(crypto_digest_storage_t *storage)
+{
+  crypto_digest_t *r = CRYPTO_DIGEST_IN(storage);
+  SHA1_Init(&r->d.sha1);
+  r->algorithm = DIGEST_SHA1;
+  return r;
+}
+
+/** Wipe <b>digest</b>, a digest object set up with crypto_digest_init_in().
+ * Does not free <b>digest</b>. */
+void
+crypto_digest_clear(crypto_digest_t *digest)
+{
+  memwipe(digest, 0, sizeof(crypto_digest_t));
+}
+
 /** Add <b>len</b> bytes from <b>data</b> to the digest object.
  */
 void
@@ -1792,6 +1861,49 @@ crypto_digest_assign(crypto_digest_t *into,
   memcpy(into,from,sizeof(crypto_digest_t));
 }
 
+/** Return the number of bytes of hash state that a digest object using
+ * <b>algorithm</b> actually uses. */
+static INLINE size_t
+crypto_digest_state_len(digest_algorithm_t algorithm)
+{
+  switch (algorithm) {
+    case DIGEST_SHA1:
+      return sizeof(SHA_CTX);
+    case DIGEST_SHA256:
+      return sizeof(SHA256_CTX);
+    default:
+      tor_fragile_assert();
+      return sizeof(((crypto_digest_t *)NULL)->d);
+  }
+}
+
+/* Fail to compile if a checkpoint can't hold every kind of hash state. */
+typedef char crypto_digest_checkpoint_is_too_small[
+       (sizeof(((crypto_digest_t *)NULL)->d) <=
+        sizeof(((crypto_digest_checkpoint_t *)NULL)->state)) ? 1 : -1];
+
+/** Save the current state of <b>digest</b> into <b>checkpoint</b>.  Only
+ * the hash state that <b>digest</b>'s algorithm uses gets copied. */
+void
+crypto_digest_checkpoint(crypto_digest_checkpoint_t *checkpoint,
+                         const crypto_digest_t *digest)
+{
+  memcpy(checkpoint->state.mem, &digest->d,
+         crypto_digest_state_len(digest->algorithm));
+  checkpoint->algorithm = digest->algorithm;
+}
+
+/** Roll <b>digest</b> back to the state saved in <b>checkpoint</b>, which
+ * must have been taken from a digest using the same algorithm. */
+void
+crypto_digest_restore(crypto_digest_t *digest,
+                      const crypto_digest_checkpoint_t *checkpoint)
+{
+  tor_assert(digest->algorithm == checkpoint->algorithm);
+  memcpy(&digest->d, checkpoint->state.mem,
+         crypto_digest_state_len(digest->algorithm));
+}
+
 /** Given a list of strings in <b>lst</b>, set the <b>len_out</b>-byte digest
  * at <b>digest_out</b> to the hash of the concatenation of those strings,
  * plus the optional string <b>append</b>, computed with the algorithm
@@ -108,6 +108,49 @@ typedef struct crypto_cipher_t crypto_cipher_t;
 typedef struct crypto_digest_t crypto_digest_t;
 typedef struct crypto_dh_t crypto_dh_t;
 
+/** Number of bytes in a crypto_cipher_storage_t. */
+#define CRYPTO_CIPHER_STORAGE_LEN 432
+/** Number of bytes in a crypto_digest_storage_t. */
+#define CRYPTO_DIGEST_STORAGE_LEN 128
+
+/** Room for a crypto_cipher_t inside another structure, so that a cipher
+ * that lives exactly as long as its owner doesn't need heap allocations of
+ * its own.  Set one up with crypto_cipher_init_in(), get at the cipher with
+ * CRYPTO_CIPHER_IN(), and release it with crypto_cipher_clear() -- never
+ * with crypto_cipher_free(). */
+typedef union crypto_cipher_storage_t {
+  uint64_t align_u64_; /**< Unused; here for alignment. */
+  void *align_ptr_; /**< Unused; here for alignment. */
+  char mem[CRYPTO_CIPHER_STORAGE_LEN]; /**< Opaque storage. */
+} crypto_cipher_storage_t;
+
+/** As crypto_cipher_storage_t, but for a crypto_digest_t.  See
+ * crypto_digest_init_in(), CRYPTO_DIGEST_IN(), and crypto_digest_clear(). */
+typedef union crypto_digest_storage_t {
+  uint64_t align_u64_; /**< Unused; here for alignment. */
+  void *align_ptr_; /**< Unused; here for alignment. */
+  char mem[CRYPTO_DIGEST_STORAGE_LEN]; /**< Opaque storage. */
+} crypto_digest_storage_t;
+
+/** A saved copy of the running state of a crypto_digest_t, small enough to
+ * keep on the stack.  Use crypto_digest_checkpoint() to take one and
+ * crypto_digest_restore() to roll the digest back to it; unlike
+ * crypto_digest_dup(), neither needs a heap allocation. */
+typedef struct crypto_digest_checkpoint_t {
+  union {
+    uint64_t align_u64_; /**< Unused; here for alignment. */
+    char mem[CRYPTO_DIGEST_STORAGE_LEN]; /**< Opaque storage. */
+  } state;
+  uint8_t algorithm; /**< The algorithm of the digest we came from. */
+} crypto_digest_checkpoint_t;
+
+/** Return the crypto_cipher_t held in the crypto_cipher_storage_t
+ * <b>storage</b>. */
+#define CRYPTO_CIPHER_IN(storage) ((crypto_cipher_t *)(storage)->mem)
+/** Return the crypto_digest_t held in the crypto_digest_storage_t
+ * <b>storage</b>. */
+#define CRYPTO_DIGEST_IN(storage) ((crypto_digest_t *)(storage)->mem)
+
 /* global state */
 const char * crypto_openssl_get_version_str(void);
 const char * crypto_openssl_get_header_version_str(void);
@@ -126,6 +169,9 @@ void crypto_set_tls_dh_prime(void);
 crypto_cipher_t *crypto_cipher_new(const char *key);
 crypto_cipher_t *crypto_cipher_new_with_iv(const char *key, const char *iv);
 void crypto_cipher_free(crypto_cipher_t *env);
+crypto_cipher_t *crypto_cipher_init_in(crypto_cipher_storage_t *storage,
+                                       const char *key);
+void crypto_cipher_clear(crypto_cipher_t *env);
 
 /* public key crypto */
 int crypto_pk_generate_key_with_bits(crypto_pk_t *env, int bits);
@@ -222,6 +268,8 @@ int crypto_digest_algorithm_parse_name(const char *name);
 crypto_digest_t *crypto_digest_new(void);
 crypto_digest_t *crypto_digest256_new(digest_algorithm_t algorithm);
 void crypto_digest_free(crypto_digest_t *digest);
+crypto_digest_t *crypto_digest_init_in(crypto_digest_storage_t *storage);
+void crypto_digest_clear(crypto_digest_t *digest);
 void crypto_digest_add_bytes(crypto_digest_t *digest, const char *data,
                              size_t len);
 void crypto_digest_get_digest(crypto_digest_t *digest,
@@ -229,6 +277,10 @@ void crypto_digest_get_digest(crypto_digest_t *digest,
 crypto_digest_t *crypto_digest_dup(const crypto_digest_t *digest);
 void crypto_digest_assign(crypto_digest_t *into,
                           const crypto_digest_t *from);
+void crypto_digest_checkpoint(crypto_digest_checkpoint_t *checkpoint,
+                              const crypto_digest_t *digest);
+void crypto_digest_restore(crypto_digest_t *digest,
+                           const crypto_digest_checkpoint_t *checkpoint);
 void crypto_hmac_sha256(char *hmac_out,
                         const char *key, size_t key_len,
                         const char *msg, size_t msg_len);
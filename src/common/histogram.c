@@ -0,0 +1,123 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file histogram.c
+ * \brief Log-linear histograms for latency measurements.
+ *
+ * Values below 2*HISTOGRAM_N_SUB_BUCKETS each get their own bucket.  Above
+ * that, every range [2^k, 2^(k+1)) is split into HISTOGRAM_N_SUB_BUCKETS
+ * buckets of equal width, indexed by the HISTOGRAM_SUB_BUCKET_BITS bits
+ * that follow the value's highest set bit.
+ **/
+
+#define HISTOGRAM_PRIVATE
+#include "orconfig.h"
+#include <string.h>
+#include "util.h"
+#include "histogram.h"
+
+/** Return the index of the bucket that counts <b>value</b>. */
+STATIC int
+histogram_bucket_for_value(uint32_t value)
+{
+  int k, shift;
+  if (value < 2*HISTOGRAM_N_SUB_BUCKETS)
+    return (int)value;
+  k = tor_log2(value);
+  shift = k - HISTOGRAM_SUB_BUCKET_BITS;
+  return shift * HISTOGRAM_N_SUB_BUCKETS + (int)(value >> shift);
+}
+
+/** Return the largest value that would be counted in <b>bucket</b>. */
+STATIC uint32_t
+histogram_bucket_max(int bucket)
+{
+  int shift;
+  uint64_t top;
+  if (bucket < 2*HISTOGRAM_N_SUB_BUCKETS)
+    return (uint32_t)bucket;
+  shift = bucket / HISTOGRAM_N_SUB_BUCKETS - 1;
+  top = HISTOGRAM_N_SUB_BUCKETS + bucket % HISTOGRAM_N_SUB_BUCKETS;
+  return (uint32_t)(((top + 1) << shift) - 1);
+}
+
+/** Count <b>value</b> in <b>h</b>. */
+void
+histogram_record(histogram_t *h, uint32_t value)
+{
+  ++h->counts[histogram_bucket_for_value(value)];
+  ++h->n_values;
+  h->total += value;
+  if (value > h->max)
+    h->max = value;
+}
+
+/** Return a value such that about <b>percentile</b> percent of the values
+ * in <b>h</b> are no larger than it.  (Specifically, return the largest
+ * value that shares a bucket with the value at that percentile, but no
+ * more than the largest value recorded.)  Return 0 if <b>h</b> is
+ * empty. */
+uint32_t
+histogram_get_percentile(const histogram_t *h, double percentile)
+{
+  uint64_t target, seen = 0;
+  int i;
+  if (!h->n_values)
+    return 0;
+  if (percentile >= 100.0)
+    return h->max;
+  if (percentile < 0.0)
+    percentile = 0.0;
+  target = (uint64_t)(h->n_values * (percentile / 100.0));
+  if (target < 1)
+    target = 1;
+  for (i = 0; i < HISTOGRAM_N_BUCKETS; ++i) {
+    seen += h->counts[i];
+    if (seen >= target) {
+      uint32_t v = histogram_bucket_max(i);
+      return v < h->max ? v : h->max;
+    }
+  }
+  return h->max;
+}
+
+/** Return the mean of the values in <b>h</b>, or 0.0 if it's empty. */
+double
+histogram_get_mean(const histogram_t *h)
+{
+  if (!h->n_values)
+    return 0.0;
+  return U64_TO_DBL(h->total) / U64_TO_DBL(h->n_values);
+}
+
+/** Set <b>out</b> to hold the values that are in <b>a</b> but not in
+ * <b>b</b>, where <b>b</b> is an earlier snapshot of <b>a</b>.  The
+ * maximum can't be subtracted, so <b>out</b> gets the largest value in the
+ * highest non-empty bucket. */
+void
+histogram_subtract(histogram_t *out, const histogram_t *a,
+                   const histogram_t *b)
+{
+  int i, highest = -1;
+  for (i = 0; i < HISTOGRAM_N_BUCKETS; ++i) {
+    out->counts[i] = a->counts[i] - b->counts[i];
+    if (out->counts[i])
+      highest = i;
+  }
+  out->n_values = a->n_values - b->n_values;
+  out->total = a->total - b->total;
+  out->max = 0;
+  if (highest >= 0) {
+    uint32_t v = histogram_bucket_max(highest);
+    out->max = v < a->max ? v : a->max;
+  }
+}
+
+/** Remove every value from <b>h</b>. */
+void
+histogram_clear(histogram_t *h)
+{
+  memset(h, 0, sizeof(*h));
+}
+
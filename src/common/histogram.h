@@ -0,0 +1,49 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file histogram.h
+ * \brief Headers for histogram.c
+ **/
+
+#ifndef TOR_HISTOGRAM_H
+#define TOR_HISTOGRAM_H
+
+#include "torint.h"
+
+/** Each power-of-two range of values is split into this many (log2)
+ * equal-sized buckets. */
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+/** Number of buckets in each power-of-two range. */
+#define HISTOGRAM_N_SUB_BUCKETS (1<<HISTOGRAM_SUB_BUCKET_BITS)
+/** Total number of buckets: enough to hold any 32-bit value. */
+#define HISTOGRAM_N_BUCKETS \
+  ((32 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_N_SUB_BUCKETS)
+
+/** A log-linear histogram of 32-bit values, in the style of HdrHistogram:
+ * every value is counted in a bucket whose width is at most 1/8 of the
+ * values it holds, so percentiles are accurate to within about 12%, no
+ * matter how widely the values range.  Recording a value is a handful of
+ * arithmetic operations and one increment.  Initialize these with
+ * memset(0). */
+typedef struct histogram_t {
+  uint64_t counts[HISTOGRAM_N_BUCKETS]; /**< Number of values per bucket. */
+  uint64_t n_values; /**< Number of values recorded. */
+  uint64_t total; /**< Sum of all values recorded. */
+  uint32_t max; /**< Largest value recorded. */
+} histogram_t;
+
+void histogram_record(histogram_t *h, uint32_t value);
+uint32_t histogram_get_percentile(const histogram_t *h, double percentile);
+double histogram_get_mean(const histogram_t *h);
+void histogram_subtract(histogram_t *out, const histogram_t *a,
+                        const histogram_t *b);
+void histogram_clear(histogram_t *h);
+
+#ifdef HISTOGRAM_PRIVATE
+STATIC int histogram_bucket_for_value(uint32_t value);
+STATIC uint32_t histogram_bucket_max(int bucket);
+#endif
+
+#endif
+
@@ -410,6 +410,38 @@ logfile_wants_message(const logfile_t *lf, int severity,
   return 1;
 }
 
+/** Send the message <b>msg_after_prefix</b>, whose full length with prefix
+ * is <b>msg_len</b>, to the system log facility at <b>severity</b>. */
+static void
+syslog_deliver(const char *msg_after_prefix, size_t msg_len, int severity)
+{
+#ifdef HAVE_SYSLOG_H
+#ifdef MAXLINE
+  /* Some syslog implementations have limits on the length of what you can
+   * pass them, and some very old ones do not detect overflow so well.
+   * Regrettably, they call their maximum line length MAXLINE. */
+#if MAXLINE < 64
+#warn "MAXLINE is a very low number; it might not be from syslog.h after all"
+#endif
+  char *m = (char *)msg_after_prefix;
+  if (msg_len >= MAXLINE)
+    m = tor_strndup(msg_after_prefix, MAXLINE-1);
+  syslog(severity, "%s", m);
+  if (m != msg_after_prefix) {
+    tor_free(m);
+  }
+#else
+  /* We have syslog but not MAXLINE.  That's promising! */
+  (void)msg_len;
+  syslog(severity, "%s", msg_after_prefix);
+#endif
+#else
+  (void)msg_after_prefix;
+  (void)msg_len;
+  (void)severity;
+#endif
+}
+
 /** Send a message to <b>lf</b>.  The full message, with time prefix and
  * severity, is in <b>buf</b>.  The message itself is in
  * <b>msg_after_prefix</b>.  If <b>callbacks_deferred</b> points to true, then
@@ -423,26 +455,7 @@ logfile_deliver(logfile_t *lf, const char *buf, size_t msg_len,
 {
 
   if (lf->is_syslog) {
-#ifdef HAVE_SYSLOG_H
-#ifdef MAXLINE
-    /* Some syslog implementations have limits on the length of what you can
-     * pass them, and some very old ones do not detect overflow so well.
-     * Regrettably, they call their maximum line length MAXLINE. */
-#if MAXLINE < 64
-#warn "MAXLINE is a very low number; it might not be from syslog.h after all"
-#endif
-    char *m = msg_after_prefix;
-    if (msg_len >= MAXLINE)
-      m = tor_strndup(msg_after_prefix, MAXLINE-1);
-    syslog(severity, "%s", m);
-    if (m != msg_after_prefix) {
-      tor_free(m);
-    }
-#else
-    /* We have syslog but not MAXLINE.  That's promising! */
-    syslog(severity, "%s", msg_after_prefix);
-#endif
-#endif
+    syslog_deliver(msg_after_prefix, msg_len, severity);
   } else if (lf->callback) {
     if (domain & LD_NOCB) {
       if (!*callbacks_deferred && pending_cb_messages) {
@@ -462,6 +475,395 @@ logfile_deliver(logfile_t *lf, const char *buf, size_t msg_len,
   }
 }
 
+/* Asynchronous logging.
+ *
+ * When asynchronous logging is on, logv() still formats each message while
+ * holding log_mutex, but instead of writing it to file and syslog logs
+ * directly, it appends a record to a fixed-size buffer belonging to the
+ * calling thread.  A writer thread wakes up periodically (or when a buffer
+ * starts to fill, or when something important is logged), swaps each
+ * buffer with an empty spare, and writes out the records in the order they
+ * were logged.  Callers never wait for a disk or for syslogd; when a buffer
+ * is full, we drop the message and count it instead.  Callback logs are
+ * always delivered synchronously.
+ *
+ * Locking: the async_log_buffer_t fields other than <b>spare</b>, and the
+ * <b>seems_dead</b> flag of every logfile_t, are protected by log_mutex.
+ * <b>spare</b>, and the right to write records out, are protected by
+ * async_log_drain_mutex.  Always take log_mutex before async_log_drain_mutex
+ * or async_log_writer_mutex.  We drain every buffer before closing or
+ * freeing any logfile_t, so a queued record never outlives its log.
+ */
+
+/** How many threads get their own buffer?  Any further threads share the
+ * last one. */
+#define MAX_ASYNC_LOG_BUFFERS 16
+/** How often does the writer thread wake up if nobody signals it? */
+#define ASYNC_LOG_WRITER_INTERVAL_MSEC 100
+/** How many logs can we notice failing in a single drain? */
+#define MAX_ASYNC_DEAD_LOGS 8
+/** Round <b>n</b> up to the alignment of an async_log_record_t. */
+#define ASYNC_LOG_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/** Header for one message waiting in an async_log_buffer_t.  The
+ * NUL-terminated message follows immediately. */
+typedef struct async_log_record_t {
+  uint64_t seq; /**< Position of this message in the global log order. */
+  logfile_t *lf; /**< The log that this message is for. */
+  int fd; /**< The fd to write the message to, or -1 for syslog. */
+  int severity; /**< The severity of the message. */
+  uint32_t msg_len; /**< Length of the message, with its prefix. */
+  uint32_t prefix_len; /**< Length of the message prefix. */
+} async_log_record_t;
+
+/** A buffer of log messages that one thread has generated, and that the
+ * writer thread has not yet written. */
+typedef struct async_log_buffer_t {
+  int in_use; /**< True iff this buffer has been assigned to a thread. */
+  unsigned long thread_id; /**< The thread that logs to this buffer. */
+  char *mem; /**< Records waiting to be written. */
+  size_t used; /**< Number of bytes of <b>mem</b> in use. */
+  char *spare; /**< Buffer for the writer to swap with <b>mem</b>. */
+  uint64_t n_dropped; /**< Messages dropped since the last drain. */
+} async_log_buffer_t;
+
+/** True iff logv() should queue messages for the writer thread. */
+static int log_async_enabled = 0;
+/** Size of each async log buffer, in bytes. */
+static size_t async_log_buffer_size = 0;
+/** Per-thread buffers of messages for the writer thread. */
+static async_log_buffer_t async_log_buffers[MAX_ASYNC_LOG_BUFFERS];
+/** Sequence number to give to the next queued message. */
+static uint64_t async_log_next_seq = 0;
+/** Total number of messages dropped because a buffer was full. */
+static uint64_t async_log_n_dropped = 0;
+/** Number of dropped messages that we haven't warned about yet. */
+static uint64_t async_log_n_dropped_unreported = 0;
+/** True iff we have written the queued messages from a crash handler. */
+static volatile int async_log_flushed_for_crash = 0;
+
+/** True iff the mutexes and condition below are initialized. */
+static int async_log_sync_initialized = 0;
+/** Mutex held while swapping out and writing queued messages. */
+static tor_mutex_t async_log_drain_mutex;
+/** Mutex protecting the writer thread's state. */
+static tor_mutex_t async_log_writer_mutex;
+/** Condition used to wake the writer thread, and to tell us it has exited.*/
+static tor_cond_t async_log_writer_cond;
+/** True iff the writer thread is running. */
+static int async_log_writer_running = 0;
+/** True iff the writer thread should exit. */
+static int async_log_writer_should_exit = 0;
+
+/** Return the async log buffer for the current thread, claiming a new one if
+ * we need to.  Caller must hold log_mutex. */
+static async_log_buffer_t *
+async_log_buffer_for_thread(void)
+{
+  const unsigned long id = tor_get_thread_id();
+  int i;
+  for (i = 0; i < MAX_ASYNC_LOG_BUFFERS; ++i) {
+    async_log_buffer_t *b = &async_log_buffers[i];
+    if (! b->in_use) {
+      b->in_use = 1;
+      b->thread_id = id;
+      b->mem = tor_malloc(async_log_buffer_size);
+      b->spare = tor_malloc(async_log_buffer_size);
+      b->used = 0;
+      return b;
+    }
+    if (b->thread_id == id)
+      return b;
+  }
+  return &async_log_buffers[MAX_ASYNC_LOG_BUFFERS-1];
+}
+
+/** Queue the message in <b>buf</b> for delivery to <b>lf</b> by the writer
+ * thread.  Return true iff the writer thread should wake up now.  Caller
+ * must hold log_mutex. */
+static int
+async_log_enqueue(logfile_t *lf, const char *buf, size_t msg_len,
+                  const char *msg_after_prefix, int severity)
+{
+  async_log_buffer_t *b = async_log_buffer_for_thread();
+  const size_t rec_len =
+    ASYNC_LOG_ALIGN(sizeof(async_log_record_t) + msg_len + 1);
+  async_log_record_t *rec;
+
+  if (rec_len > async_log_buffer_size - b->used) {
+    ++b->n_dropped;
+    return 1;
+  }
+  rec = (async_log_record_t *)(b->mem + b->used);
+  rec->seq = async_log_next_seq++;
+  rec->lf = lf;
+  rec->fd = lf->is_syslog ? -1 : lf->fd;
+  rec->severity = severity;
+  rec->msg_len = (uint32_t)msg_len;
+  rec->prefix_len = (uint32_t)(msg_after_prefix - buf);
+  memcpy(rec+1, buf, msg_len);
+  ((char *)(rec+1))[msg_len] = '\0';
+  b->used += rec_len;
+
+  return severity <= LOG_WARN || b->used >= async_log_buffer_size / 2;
+}
+
+/** Helper: given <b>n_bufs</b> buffers of records in <b>bufs</b>, with
+ * <b>lens</b> bytes used in each, return the record with the lowest
+ * sequence number after the positions in <b>pos</b>, and advance past it.
+ * Return NULL when all buffers are exhausted.  Doesn't allocate or lock,
+ * so it's safe to call from a signal handler. */
+static const async_log_record_t *
+async_log_next_record(char * const *bufs, const size_t *lens, size_t *pos,
+                      int n_bufs)
+{
+  const async_log_record_t *best = NULL;
+  int i, best_idx = -1;
+  for (i = 0; i < n_bufs; ++i) {
+    const async_log_record_t *rec;
+    if (pos[i] >= lens[i])
+      continue;
+    rec = (const async_log_record_t *)(bufs[i] + pos[i]);
+    if (!best || rec->seq < best->seq) {
+      best = rec;
+      best_idx = i;
+    }
+  }
+  if (best)
+    pos[best_idx] +=
+      ASYNC_LOG_ALIGN(sizeof(async_log_record_t) + best->msg_len + 1);
+  return best;
+}
+
+/** Write out every message queued for the writer thread.  If
+ * <b>logs_locked</b> is true, the caller already holds log_mutex. */
+static void
+async_log_drain(int logs_locked)
+{
+  char *bufs[MAX_ASYNC_LOG_BUFFERS];
+  size_t lens[MAX_ASYNC_LOG_BUFFERS], pos[MAX_ASYNC_LOG_BUFFERS];
+  const async_log_record_t *rec;
+  logfile_t *dead_logs[MAX_ASYNC_DEAD_LOGS];
+  logfile_t *lf;
+  uint64_t n_to_report = 0;
+  int i, n_dead = 0;
+
+  if (!logs_locked)
+    LOCK_LOGS();
+  if (!async_log_sync_initialized) {
+    if (!logs_locked)
+      UNLOCK_LOGS();
+    return;
+  }
+  tor_mutex_acquire(&async_log_drain_mutex);
+  for (i = 0; i < MAX_ASYNC_LOG_BUFFERS; ++i) {
+    async_log_buffer_t *b = &async_log_buffers[i];
+    char *tmp;
+    bufs[i] = NULL;
+    lens[i] = pos[i] = 0;
+    if (!b->in_use)
+      continue;
+    tmp = b->mem;
+    b->mem = b->spare;
+    b->spare = tmp;
+    bufs[i] = tmp;
+    lens[i] = b->used;
+    b->used = 0;
+    async_log_n_dropped += b->n_dropped;
+    async_log_n_dropped_unreported += b->n_dropped;
+    b->n_dropped = 0;
+  }
+  if (!logs_locked) {
+    n_to_report = async_log_n_dropped_unreported;
+    async_log_n_dropped_unreported = 0;
+    UNLOCK_LOGS();
+  }
+
+  while ((rec = async_log_next_record(bufs, lens, pos,
+                                      MAX_ASYNC_LOG_BUFFERS))) {
+    const char *msg = (const char *)(rec+1);
+    if (rec->fd < 0) {
+      syslog_deliver(msg + rec->prefix_len, rec->msg_len, rec->severity);
+    } else if (write_all(rec->fd, msg, rec->msg_len, 0) < 0) {
+      /* As in logfile_deliver, don't log the error; just stop using the
+       * log, once we hold log_mutex again. */
+      for (i = 0; i < n_dead; ++i) {
+        if (dead_logs[i] == rec->lf)
+          break;
+      }
+      if (i == n_dead && n_dead < MAX_ASYNC_DEAD_LOGS)
+        dead_logs[n_dead++] = rec->lf;
+    }
+  }
+  tor_mutex_release(&async_log_drain_mutex);
+
+  if (n_dead) {
+    /* A log can get closed as soon as we release async_log_drain_mutex, so
+     * only mark the ones that are still around. */
+    if (!logs_locked)
+      LOCK_LOGS();
+    for (lf = logfiles; lf; lf = lf->next) {
+      for (i = 0; i < n_dead; ++i) {
+        if (lf == dead_logs[i])
+          lf->seems_dead = 1;
+      }
+    }
+    if (!logs_locked)
+      UNLOCK_LOGS();
+  }
+
+  if (n_to_report) {
+    log_warn(LD_GENERAL, "Dropped "U64_FORMAT" log messages because the "
+             "asynchronous log buffer was full. You may want to increase "
+             "LogAsyncBufferSize.", U64_PRINTF_ARG(n_to_report));
+  }
+}
+
+/** Main function for the asynchronous log writer thread. */
+static void
+async_log_writer_main(void *arg)
+{
+  (void)arg;
+  tor_mutex_acquire(&async_log_writer_mutex);
+  while (!async_log_writer_should_exit) {
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = ASYNC_LOG_WRITER_INTERVAL_MSEC * 1000;
+    tor_cond_wait(&async_log_writer_cond, &async_log_writer_mutex, &tv);
+    tor_mutex_release(&async_log_writer_mutex);
+    async_log_drain(0);
+    tor_mutex_acquire(&async_log_writer_mutex);
+  }
+  async_log_writer_running = 0;
+  tor_cond_signal_all(&async_log_writer_cond);
+  tor_mutex_release(&async_log_writer_mutex);
+  spawn_exit();
+}
+
+/** Write every message still queued for the writer thread to its fd,
+ * without locking or allocating.  Messages for syslog are lost, as are any
+ * that the writer thread is writing at the time.  Only the first call does
+ * anything.  Called from tor_log_err_sigsafe(). */
+static void
+async_log_flush_sigsafe(void)
+{
+  char *bufs[MAX_ASYNC_LOG_BUFFERS];
+  size_t lens[MAX_ASYNC_LOG_BUFFERS], pos[MAX_ASYNC_LOG_BUFFERS];
+  const async_log_record_t *rec;
+  int i;
+
+  if (!log_async_enabled || async_log_flushed_for_crash)
+    return;
+  async_log_flushed_for_crash = 1;
+  log_async_enabled = 0;
+
+  for (i = 0; i < MAX_ASYNC_LOG_BUFFERS; ++i) {
+    const async_log_buffer_t *b = &async_log_buffers[i];
+    bufs[i] = b->in_use ? b->mem : NULL;
+    lens[i] = b->in_use ? b->used : 0;
+    pos[i] = 0;
+  }
+  while ((rec = async_log_next_record(bufs, lens, pos,
+                                      MAX_ASYNC_LOG_BUFFERS))) {
+    if (rec->fd >= 0) {
+      ssize_t r = write(rec->fd, rec+1, rec->msg_len);
+      (void)r;
+    }
+  }
+}
+
+/** Stop the asynchronous log writer thread, writing out everything it
+ * hasn't written yet, and release all the buffers. */
+static void
+async_log_stop(void)
+{
+  int i;
+
+  LOCK_LOGS();
+  if (!log_async_enabled) {
+    UNLOCK_LOGS();
+    return;
+  }
+  async_log_drain(1);
+  log_async_enabled = 0;
+  UNLOCK_LOGS();
+
+  tor_mutex_acquire(&async_log_writer_mutex);
+  async_log_writer_should_exit = 1;
+  while (async_log_writer_running) {
+    tor_cond_signal_all(&async_log_writer_cond);
+    tor_cond_wait(&async_log_writer_cond, &async_log_writer_mutex, NULL);
+  }
+  tor_mutex_release(&async_log_writer_mutex);
+
+  /* Nothing can have been queued since we drained, but the writer may have
+   * been in the middle of writing when we disabled it. */
+  LOCK_LOGS();
+  tor_mutex_acquire(&async_log_drain_mutex);
+  for (i = 0; i < MAX_ASYNC_LOG_BUFFERS; ++i) {
+    async_log_buffer_t *b = &async_log_buffers[i];
+    tor_free(b->mem);
+    tor_free(b->spare);
+  }
+  memset(async_log_buffers, 0, sizeof(async_log_buffers));
+  tor_mutex_release(&async_log_drain_mutex);
+  UNLOCK_LOGS();
+}
+
+/** Turn asynchronous logging on or off, depending on <b>enabled</b>.  When
+ * it's on, messages to file and syslog logs go through per-thread buffers
+ * of <b>buffer_size</b> bytes each, and a separate thread writes them out.
+ * Return 0 on success, -1 on failure.
+ *
+ * Don't call this before forking (e.g. in start_daemon()): the writer
+ * thread won't survive a fork. */
+int
+logs_set_async(int enabled, size_t buffer_size)
+{
+  if (log_async_enabled &&
+      (!enabled || buffer_size != async_log_buffer_size))
+    async_log_stop();
+  if (!enabled || log_async_enabled)
+    return 0;
+
+  tor_assert(buffer_size >= 1024);
+  tor_assert(buffer_size <= UINT32_MAX);
+  if (!async_log_sync_initialized) {
+    tor_mutex_init(&async_log_drain_mutex);
+    tor_mutex_init_for_cond(&async_log_writer_mutex);
+    tor_cond_init(&async_log_writer_cond);
+    async_log_sync_initialized = 1;
+  }
+
+  LOCK_LOGS();
+  async_log_buffer_size = buffer_size;
+  async_log_writer_should_exit = 0;
+  async_log_writer_running = 1;
+  if (spawn_func(async_log_writer_main, NULL) < 0) {
+    async_log_writer_running = 0;
+    UNLOCK_LOGS();
+    return -1;
+  }
+  log_async_enabled = 1;
+  UNLOCK_LOGS();
+  return 0;
+}
+
+/** Return the number of log messages we have dropped because an
+ * asynchronous log buffer was full. */
+uint64_t
+logs_get_n_async_dropped(void)
+{
+  uint64_t n;
+  int i;
+  LOCK_LOGS();
+  n = async_log_n_dropped;
+  for (i = 0; i < MAX_ASYNC_LOG_BUFFERS; ++i)
+    n += async_log_buffers[i].n_dropped;
+  UNLOCK_LOGS();
+  return n;
+}
+
 /** Helper: sends a message to the appropriate logfiles, at loglevel
  * <b>severity</b>.  If provided, <b>funcname</b> is prepended to the
  * message.  The actual message is derived as from tor_snprintf(format,ap).
@@ -476,6 +878,7 @@ logv,(int severity, log_domain_mask_t domain, const char *funcname,
   logfile_t *lf;
   char *end_of_prefix=NULL;
   int callbacks_deferred = 0;
+  int wake_writer = 0;
 
   /* Call assert, not tor_assert, since tor_assert calls log on failure. */
   assert(format);
@@ -499,6 +902,12 @@ logv,(int severity, log_domain_mask_t domain, const char *funcname,
     pending_startup_messages_len += msg_len;
   }
 
+  if (log_async_enabled && severity == LOG_ERR) {
+    /* Errors often come right before we exit: write them, and everything
+     * queued before them, right away. */
+    async_log_drain(1);
+  }
+
   for (lf = logfiles; lf; lf = lf->next) {
     if (! logfile_wants_message(lf, severity, domain))
       continue;
@@ -510,9 +919,20 @@ logv,(int severity, log_domain_mask_t domain, const char *funcname,
       formatted = 1;
     }
 
+    if (log_async_enabled && severity != LOG_ERR && !lf->callback) {
+      wake_writer |= async_log_enqueue(lf, buf, msg_len, end_of_prefix,
+                                       severity);
+      continue;
+    }
+
     logfile_deliver(lf, buf, msg_len, end_of_prefix, domain, severity,
       &callbacks_deferred);
   }
+  if (wake_writer) {
+    tor_mutex_acquire(&async_log_writer_mutex);
+    tor_cond_signal_one(&async_log_writer_cond);
+    tor_mutex_release(&async_log_writer_mutex);
+  }
   UNLOCK_LOGS();
 }
 
@@ -567,6 +987,7 @@ tor_log_err_sigsafe(const char *m, ...)
 
   if (!m)
     return;
+  async_log_flush_sigsafe();
   if (log_time_granularity >= 2000) {
     int g = log_time_granularity / 1000;
     now -= now % g;
@@ -722,6 +1143,7 @@ logs_free_all(void)
 {
   logfile_t *victim, *next;
   smartlist_t *messages, *messages2;
+  async_log_stop();
   LOCK_LOGS();
   next = logfiles;
   logfiles = NULL;
@@ -766,6 +1188,8 @@ static void
 delete_log(logfile_t *victim)
 {
   logfile_t *tmpl;
+  if (log_async_enabled)
+    async_log_drain(1);
   if (victim == logfiles)
     logfiles = victim->next;
   else {
@@ -1018,6 +1442,8 @@ close_temp_logs(void)
   logfile_t *lf, **p;
 
   LOCK_LOGS();
+  if (log_async_enabled)
+    async_log_drain(1);
   for (p = &logfiles; *p; ) {
     if ((*p)->is_temporary) {
       lf = *p;
@@ -1361,6 +1787,8 @@ void
 truncate_logs(void)
 {
   logfile_t *lf;
+  if (log_async_enabled)
+    async_log_drain(0);
   for (lf = logfiles; lf; lf = lf->next) {
     if (lf->fd >= 0) {
       tor_ftruncate(lf->fd);
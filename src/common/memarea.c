@@ -78,6 +78,8 @@ realign_pointer(void *ptr)
 typedef struct memarea_chunk_t {
   /** Next chunk in this area. Only kept around so we can free it. */
   struct memarea_chunk_t *next_chunk;
+  size_t chunk_size; /**< How many bytes did we allocate for this chunk,
+                      * including the header and the sentinel? */
   size_t mem_size; /**< How much RAM is available in mem, total? */
   char *next_mem; /**< Next position in mem to allocate data at.  If it's
                    * greater than or equal to mem+mem_size, this chunk is
@@ -96,73 +98,173 @@ typedef struct memarea_chunk_t {
  * of a chunk? */
 #define CHUNK_HEADER_SIZE STRUCT_OFFSET(memarea_chunk_t, U_MEM)
 
-/** What's the smallest that we'll allocate a chunk? */
+/** What's the smallest that we'll allocate a chunk?  This is also the
+ * default chunk size for a memarea. */
 #define CHUNK_SIZE 4096
 
+/** How many size classes of chunk do we keep freelists for?  Size class
+ * <b>i</b> holds chunks of exactly CHUNK_SIZE &lt;&lt; <b>i</b> bytes, so
+ * these go from 4 KB up to 2 MB. */
+#define N_SIZE_CLASSES 10
+/** The size of the chunks in the largest size class. */
+#define MAX_CLASS_CHUNK_SIZE (((size_t)CHUNK_SIZE) << (N_SIZE_CLASSES-1))
+
 /** A memarea_t is an allocation region for a set of small memory requests
  * that will all be freed at once. */
 struct memarea_t {
   memarea_chunk_t *first; /**< Top of the chunk stack: never NULL. */
+  size_t chunk_size; /**< How big are this area's ordinary chunks? */
+  size_t allocated; /**< Bytes allocated in all of this area's chunks, as
+                     * memarea_get_stats() counts them. */
+  size_t used_in_old_chunks; /**< Bytes used in all of this area's chunks
+                              * but <b>first</b>. */
+  size_t peak_allocated; /**< Most bytes this area has ever had allocated
+                          * at once. */
+  size_t peak_used; /**< Most bytes this area has had in use, as of the
+                     * last time it got a new chunk or was cleared. */
 };
 
-/** How many chunks will we put into the freelist before freeing them? */
+/** How many chunks of each size class will we put into the freelist before
+ * freeing them? */
 #define MAX_FREELIST_LEN 4
-/** The number of memarea chunks currently in our freelist. */
-static int freelist_len=0;
-/** A linked list of unused memory area chunks.  Used to prevent us from
- * spinning in malloc/free loops. */
-static memarea_chunk_t *freelist = NULL;
+/** How many bytes, in total, will we keep in all the freelists? */
+#define MAX_FREELIST_BYTES (8*1024*1024)
+/** The number of memarea chunks currently in each of our freelists. */
+static int freelist_len[N_SIZE_CLASSES];
+/** The number of bytes in all of our freelists. */
+static size_t freelist_bytes = 0;
+/** Linked lists of unused memory area chunks, by size class.  Used to
+ * prevent us from spinning in malloc/free loops, including for the big
+ * chunks that we need for big documents. */
+static memarea_chunk_t *freelist[N_SIZE_CLASSES];
+
+/** Return the index of the smallest size class whose chunks hold at least
+ * <b>sz</b> bytes, or -1 if <b>sz</b> is bigger than any size class. */
+static INLINE int
+size_class_for(size_t sz)
+{
+  int i;
+  size_t class_size = CHUNK_SIZE;
+  for (i = 0; i < N_SIZE_CLASSES; ++i, class_size <<= 1) {
+    if (sz <= class_size)
+      return i;
+  }
+  return -1;
+}
 
-/** Helper: allocate a new memarea chunk of around <b>chunk_size</b> bytes. */
+/** Return the index of the size class whose chunks are exactly
+ * <b>chunk_size</b> bytes long, or -1 if there is none. */
+static INLINE int
+size_class_of(size_t chunk_size)
+{
+  int idx = size_class_for(chunk_size);
+  if (idx >= 0 && (((size_t)CHUNK_SIZE) << idx) == chunk_size)
+    return idx;
+  return -1;
+}
+
+/** Helper: allocate a new memarea chunk of <b>chunk_size</b> bytes, including
+ * its header.  If that's exactly the size of one of our size classes, try
+ * to reuse a chunk from that class's freelist first. */
 static memarea_chunk_t *
-alloc_chunk(size_t sz, int freelist_ok)
+alloc_chunk(size_t chunk_size)
 {
-  tor_assert(sz < SIZE_T_CEILING);
-  if (freelist && freelist_ok) {
-    memarea_chunk_t *res = freelist;
-    freelist = res->next_chunk;
+  memarea_chunk_t *res;
+  int idx = size_class_of(chunk_size);
+  tor_assert(chunk_size < SIZE_T_CEILING);
+  tor_assert(chunk_size > CHUNK_HEADER_SIZE + SENTINEL_LEN);
+  if (idx >= 0 && freelist[idx]) {
+    res = freelist[idx];
+    freelist[idx] = res->next_chunk;
     res->next_chunk = NULL;
-    --freelist_len;
+    --freelist_len[idx];
+    freelist_bytes -= res->chunk_size;
     CHECK_SENTINEL(res);
     return res;
-  } else {
-    size_t chunk_size = freelist_ok ? CHUNK_SIZE : sz;
-    memarea_chunk_t *res;
-    chunk_size += SENTINEL_LEN;
-    res = tor_malloc(chunk_size);
-    res->next_chunk = NULL;
-    res->mem_size = chunk_size - CHUNK_HEADER_SIZE - SENTINEL_LEN;
-    res->next_mem = res->U_MEM;
-    tor_assert(res->next_mem+res->mem_size+SENTINEL_LEN ==
-               ((char*)res)+chunk_size);
-    tor_assert(realign_pointer(res->next_mem) == res->next_mem);
-    SET_SENTINEL(res);
-    return res;
   }
+
+  res = tor_malloc(chunk_size);
+  res->next_chunk = NULL;
+  res->chunk_size = chunk_size;
+  res->mem_size = chunk_size - CHUNK_HEADER_SIZE - SENTINEL_LEN;
+  res->next_mem = res->U_MEM;
+  tor_assert(res->next_mem+res->mem_size+SENTINEL_LEN ==
+             ((char*)res)+chunk_size);
+  tor_assert(realign_pointer(res->next_mem) == res->next_mem);
+  SET_SENTINEL(res);
+  return res;
 }
 
 /** Release <b>chunk</b> from a memarea, either by adding it to the freelist
- * or by freeing it if the freelist is already too big. */
+ * for its size class or by freeing it if the freelists are already too
+ * big. */
 static void
 chunk_free_unchecked(memarea_chunk_t *chunk)
 {
+  int idx = size_class_of(chunk->chunk_size);
   CHECK_SENTINEL(chunk);
-  if (freelist_len < MAX_FREELIST_LEN) {
-    ++freelist_len;
-    chunk->next_chunk = freelist;
-    freelist = chunk;
+  if (idx >= 0 && freelist_len[idx] < MAX_FREELIST_LEN &&
+      freelist_bytes + chunk->chunk_size <= MAX_FREELIST_BYTES) {
+    ++freelist_len[idx];
+    freelist_bytes += chunk->chunk_size;
+    chunk->next_chunk = freelist[idx];
+    freelist[idx] = chunk;
     chunk->next_mem = chunk->U_MEM;
   } else {
     tor_free(chunk);
   }
 }
 
+/** Helper: set <b>allocated_out</b> and <b>used_out</b> to the number of
+ * bytes allocated and used in <b>area</b>, without walking its chunks. */
+static INLINE void
+memarea_get_totals(const memarea_t *area, size_t *allocated_out,
+                   size_t *used_out)
+{
+  const memarea_chunk_t *first = area->first;
+  *allocated_out = area->allocated;
+  *used_out = area->used_in_old_chunks + CHUNK_HEADER_SIZE +
+    (first->next_mem - first->U_MEM);
+}
+
+/** Helper: remember how much <b>area</b> has allocated and used, if that's
+ * the most it has had so far.  We call this whenever an area gets a new
+ * chunk or is about to be cleared. */
+static void
+memarea_note_peak(memarea_t *area)
+{
+  size_t allocated, used;
+  memarea_get_totals(area, &allocated, &used);
+  if (allocated > area->peak_allocated)
+    area->peak_allocated = allocated;
+  if (used > area->peak_used)
+    area->peak_used = used;
+}
+
 /** Allocate and return new memarea. */
 memarea_t *
 memarea_new(void)
 {
-  memarea_t *head = tor_malloc(sizeof(memarea_t));
-  head->first = alloc_chunk(CHUNK_SIZE, 1);
+  return memarea_new_sized(CHUNK_SIZE);
+}
+
+/** Allocate and return a new memarea that allocates memory in chunks of
+ * about <b>chunk_size</b> bytes.  Use this for areas that will hold lots of
+ * stuff, so that they need fewer chunks.  We round the size up to the
+ * nearest size class, so that we can reuse the chunks later. */
+memarea_t *
+memarea_new_sized(size_t chunk_size)
+{
+  memarea_t *head = tor_malloc_zero(sizeof(memarea_t));
+  int idx;
+  if (chunk_size > MAX_CLASS_CHUNK_SIZE)
+    chunk_size = MAX_CLASS_CHUNK_SIZE;
+  idx = size_class_for(chunk_size);
+  tor_assert(idx >= 0);
+  head->chunk_size = ((size_t)CHUNK_SIZE) << idx;
+  head->first = alloc_chunk(head->chunk_size);
+  head->allocated = CHUNK_HEADER_SIZE + head->first->mem_size;
+  memarea_note_peak(head);
   return head;
 }
 
@@ -187,6 +289,8 @@ void
 memarea_clear(memarea_t *area)
 {
   memarea_chunk_t *chunk, *next;
+  memarea_note_peak(area);
+
   if (area->first->next_chunk) {
     for (chunk = area->first->next_chunk; chunk; chunk = next) {
       next = chunk->next_chunk;
@@ -195,19 +299,25 @@ memarea_clear(memarea_t *area)
     area->first->next_chunk = NULL;
   }
   area->first->next_mem = area->first->U_MEM;
+  area->allocated = CHUNK_HEADER_SIZE + area->first->mem_size;
+  area->used_in_old_chunks = 0;
 }
 
-/** Remove all unused memarea chunks from the internal freelist. */
+/** Remove all unused memarea chunks from the internal freelists. */
 void
 memarea_clear_freelist(void)
 {
   memarea_chunk_t *chunk, *next;
-  freelist_len = 0;
-  for (chunk = freelist; chunk; chunk = next) {
-    next = chunk->next_chunk;
-    tor_free(chunk);
+  int i;
+  for (i = 0; i < N_SIZE_CLASSES; ++i) {
+    for (chunk = freelist[i]; chunk; chunk = next) {
+      next = chunk->next_chunk;
+      tor_free(chunk);
+    }
+    freelist[i] = NULL;
+    freelist_len[i] = 0;
   }
-  freelist = NULL;
+  freelist_bytes = 0;
 }
 
 /** Return true iff <b>p</b> is in a range that has been returned by an
@@ -232,25 +342,37 @@ memarea_alloc(memarea_t *area, size_t sz)
 {
   memarea_chunk_t *chunk = area->first;
   char *result;
+  int new_chunk_added = 0;
   tor_assert(chunk);
   CHECK_SENTINEL(chunk);
   tor_assert(sz < SIZE_T_CEILING);
   if (sz == 0)
     sz = 1;
   if (chunk->next_mem+sz > chunk->U_MEM+chunk->mem_size) {
-    if (sz+CHUNK_HEADER_SIZE >= CHUNK_SIZE) {
+    if (sz+CHUNK_HEADER_SIZE+SENTINEL_LEN > area->chunk_size) {
       /* This allocation is too big.  Stick it in a special chunk, and put
-       * that chunk second in the list. */
-      memarea_chunk_t *new_chunk = alloc_chunk(sz+CHUNK_HEADER_SIZE, 0);
+       * that chunk second in the list.  If it fits in a size class, use
+       * that, so that we can reuse the chunk for the next big allocation.
+       */
+      size_t chunk_size = sz+CHUNK_HEADER_SIZE+SENTINEL_LEN;
+      memarea_chunk_t *new_chunk;
+      int idx = size_class_for(chunk_size);
+      if (idx >= 0)
+        chunk_size = ((size_t)CHUNK_SIZE) << idx;
+      new_chunk = alloc_chunk(chunk_size);
       new_chunk->next_chunk = chunk->next_chunk;
       chunk->next_chunk = new_chunk;
       chunk = new_chunk;
     } else {
-      memarea_chunk_t *new_chunk = alloc_chunk(CHUNK_SIZE, 1);
+      memarea_chunk_t *new_chunk = alloc_chunk(area->chunk_size);
+      area->used_in_old_chunks +=
+        CHUNK_HEADER_SIZE + (chunk->next_mem - chunk->U_MEM);
       new_chunk->next_chunk = chunk;
       area->first = chunk = new_chunk;
     }
     tor_assert(chunk->mem_size >= sz);
+    area->allocated += CHUNK_HEADER_SIZE + chunk->mem_size;
+    new_chunk_added = 1;
   }
   result = chunk->next_mem;
   chunk->next_mem = chunk->next_mem + sz;
@@ -259,6 +381,14 @@ memarea_alloc(memarea_t *area, size_t sz)
   tor_assert(chunk->next_mem <= chunk->U_MEM+chunk->mem_size);
   */
   chunk->next_mem = realign_pointer(chunk->next_mem);
+  if (new_chunk_added) {
+    /* A too-big allocation's chunk never gets used again, so we can count
+     * it as old already. */
+    if (chunk != area->first)
+      area->used_in_old_chunks +=
+        CHUNK_HEADER_SIZE + (chunk->next_mem - chunk->U_MEM);
+    memarea_note_peak(area);
+  }
   return result;
 }
 
@@ -303,20 +433,25 @@ memarea_strndup(memarea_t *area, const char *s, size_t n)
 }
 
 /** Set <b>allocated_out</b> to the number of bytes allocated in <b>area</b>,
- * and <b>used_out</b> to the number of bytes currently used. */
+ * and <b>used_out</b> to the number of bytes currently used.  This is cheap:
+ * we keep running totals, so we don't need to walk the chunks. */
 void
 memarea_get_stats(memarea_t *area, size_t *allocated_out, size_t *used_out)
 {
-  size_t a = 0, u = 0;
-  memarea_chunk_t *chunk;
-  for (chunk = area->first; chunk; chunk = chunk->next_chunk) {
-    CHECK_SENTINEL(chunk);
-    a += CHUNK_HEADER_SIZE + chunk->mem_size;
-    tor_assert(chunk->next_mem >= chunk->U_MEM);
-    u += CHUNK_HEADER_SIZE + (chunk->next_mem - chunk->U_MEM);
-  }
-  *allocated_out = a;
-  *used_out = u;
+  memarea_get_totals(area, allocated_out, used_out);
+}
+
+/** Set <b>allocated_out</b> and <b>used_out</b> to the most bytes that
+ * <b>area</b> has ever had allocated and used at once: that is, the most
+ * that it has had since it was created, including right now. */
+void
+memarea_get_peak_stats(memarea_t *area, size_t *allocated_out,
+                       size_t *used_out)
+{
+  size_t a, u;
+  memarea_get_totals(area, &a, &u);
+  *allocated_out = MAX(a, area->peak_allocated);
+  *used_out = MAX(u, area->peak_used);
 }
 
 /** Assert that <b>area</b> is okay. */
@@ -324,6 +459,7 @@ void
 memarea_assert_ok(memarea_t *area)
 {
   memarea_chunk_t *chunk;
+  size_t a = 0, u = 0, total_a, total_u;
   tor_assert(area->first);
 
   for (chunk = area->first; chunk; chunk = chunk->next_chunk) {
@@ -331,6 +467,12 @@ memarea_assert_ok(memarea_t *area)
     tor_assert(chunk->next_mem >= chunk->U_MEM);
     tor_assert(chunk->next_mem <=
           (char*) realign_pointer(chunk->U_MEM+chunk->mem_size));
+    a += CHUNK_HEADER_SIZE + chunk->mem_size;
+    u += CHUNK_HEADER_SIZE + (chunk->next_mem - chunk->U_MEM);
   }
+  /* Our running totals should match the chunks. */
+  memarea_get_totals(area, &total_a, &total_u);
+  tor_assert(a == total_a);
+  tor_assert(u == total_u);
 }
 
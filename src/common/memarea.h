@@ -8,6 +8,7 @@
 typedef struct memarea_t memarea_t;
 
 memarea_t *memarea_new(void);
+memarea_t *memarea_new_sized(size_t chunk_size);
 void memarea_drop_all(memarea_t *area);
 void memarea_clear(memarea_t *area);
 int memarea_owns_ptr(const memarea_t *area, const void *ptr);
@@ -18,6 +19,8 @@ char *memarea_strdup(memarea_t *area, const char *s);
 char *memarea_strndup(memarea_t *area, const char *s, size_t n);
 void memarea_get_stats(memarea_t *area,
                        size_t *allocated_out, size_t *used_out);
+void memarea_get_peak_stats(memarea_t *area,
+                            size_t *allocated_out, size_t *used_out);
 void memarea_clear_freelist(void);
 void memarea_assert_ok(memarea_t *area);
 
@@ -0,0 +1,545 @@
+/* Copyright (c) 2007-2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/** \file mempool.c
+ * \brief Implementation for mp_pool_t, an allocator for large numbers of
+ * fixed-size objects that are allocated and freed individually.
+ *
+ * Items are carved out of large chunks.  Each chunk lives on exactly one of
+ * three lists in its pool: "empty" (no items handed out), "used" (some items
+ * handed out, some free), or "full" (every item handed out).  Allocation
+ * prefers used chunks, then empty chunks, and only allocates a fresh chunk
+ * when there is nothing else.  Every item is prefixed by a pointer to its
+ * chunk, so that mp_pool_release() doesn't need to be told which pool an
+ * item came from.
+ *
+ * Pools are not threadsafe: only use them from the main thread.
+ */
+
+#include "orconfig.h"
+#include <stdlib.h>
+#include <string.h>
+#include "mempool.h"
+#include "util.h"
+#include "compat.h"
+#include "torlog.h"
+
+/** If true, we poison items on release so that use-after-free bugs are more
+ * likely to show up. */
+#ifdef TOR_UNIT_TESTS
+#define MEMPOOL_POISON_FREED
+#endif
+
+/** Value that we use to fill freed items when MEMPOOL_POISON_FREED is set. */
+#define MEMPOOL_POISON_BYTE 0xAA
+
+/** A type with the strictest alignment requirement of anything we're likely
+ * to store in a pool item. */
+typedef union mp_align_t {
+  void *p;
+  uint64_t u64;
+  double d;
+} mp_align_t;
+/** Every item we hand out is aligned to a multiple of this many bytes. */
+#define ALIGNMENT (sizeof(mp_align_t))
+
+/** Smallest allowable number of items per chunk. */
+#define MIN_CHUNK_CAPACITY 8
+/** Largest chunk that we'll allocate by default. */
+#define MAX_CHUNK_BYTES (256*1024)
+
+typedef struct mp_chunk_t mp_chunk_t;
+typedef struct mp_allocated_t mp_allocated_t;
+
+/** Holds a single allocated item, allocated as part of a chunk. */
+struct mp_allocated_t {
+  /** The chunk that this item belongs to. */
+  mp_chunk_t *in_chunk;
+  union {
+    /** If this item is free, the next free item in the same chunk. */
+    mp_allocated_t *next_free;
+    /** If this item is not free, the actual memory contents of this item.
+     * (Not actual size.) */
+    char mem[1];
+    /** An extra element to the union to insure correct alignment. */
+    mp_align_t dummy_;
+  } u;
+};
+
+/** Number of bytes of overhead between an mp_allocated_t and its memory. */
+#define A2M_OFFSET (STRUCT_OFFSET(mp_allocated_t, u.mem))
+/** Given a pointer to an mp_allocated_t, return a pointer to its memory. */
+#define A2M(a) (&(a)->u.mem)
+/** Given a pointer to an item's memory, return its mp_allocated_t. */
+#define M2A(p) ( ((mp_allocated_t*) (((char*)(p)) - A2M_OFFSET)) )
+
+/** Magic value so that we can detect corrupt chunks. */
+#define MP_CHUNK_MAGIC 0x09870123
+
+/** A chunk of memory from which items are carved. */
+struct mp_chunk_t {
+  /** Must be MP_CHUNK_MAGIC if this chunk is valid.  (64 bits wide so that
+   * <b>mem</b> stays ALIGNMENT-aligned on 32-bit platforms too.) */
+  uint64_t magic;
+  mp_chunk_t *next; /**< The next free, used, or full chunk in sequence. */
+  mp_chunk_t *prev; /**< The previous free, used, or full chunk in sequence. */
+  mp_pool_t *pool; /**< The pool that this chunk is part of. */
+  /** First free item in the freelist for this chunk.  Note that this may be
+   * NULL even if this chunk is not at capacity: if so, the free memory at
+   * next_mem has not yet been carved into items. */
+  mp_allocated_t *first_free;
+  int n_allocated; /**< Number of currently allocated items in this chunk. */
+  int capacity; /**< Number of items that can be fit into this chunk. */
+  size_t mem_size; /**< Number of usable bytes in mem. */
+  char *next_mem; /**< Pointer into part of <b>mem</b> not yet carved up. */
+  char mem[FLEXIBLE_ARRAY_MEMBER]; /**< Storage for this chunk. */
+};
+
+/** Number of extra bytes needed beyond mem_size to allocate a chunk. */
+#define CHUNK_OVERHEAD STRUCT_OFFSET(mp_chunk_t, mem[0])
+
+/** A pool of fixed-size items. */
+struct mp_pool_t {
+  /** Human-readable name for this pool, for log messages. */
+  const char *name;
+  /** Doubly-linked list of chunks in which no items have been allocated.
+   * The front of the list is the most recently emptied chunk. */
+  mp_chunk_t *empty_chunks;
+  /** Doubly-linked list of chunks in which some items have been allocated.
+   * The front of the list is the chunk that we'll allocate from next. */
+  mp_chunk_t *used_chunks;
+  /** Doubly-linked list of chunks in which every item is allocated. */
+  mp_chunk_t *full_chunks;
+  /** Length of <b>empty_chunks</b>. */
+  int n_empty_chunks;
+  /** Total number of chunks in this pool. */
+  int n_chunks;
+  /** Size of each chunk, in items. */
+  int new_chunk_capacity;
+  /** Size to allocate for each item, including overhead and alignment
+   * padding. */
+  size_t item_alloc_size;
+  /** Number of items currently handed out from this pool. */
+  size_t n_allocated;
+  /** Largest value that n_allocated has ever had. */
+  size_t n_peak;
+};
+
+/** Helper: Allocate and return a new memory chunk for <b>pool</b>.  Does not
+ * link the chunk into any list. */
+static mp_chunk_t *
+mp_chunk_new(mp_pool_t *pool)
+{
+  size_t sz = pool->new_chunk_capacity * pool->item_alloc_size;
+  mp_chunk_t *chunk = tor_malloc_zero(CHUNK_OVERHEAD + sz);
+  chunk->magic = MP_CHUNK_MAGIC;
+  chunk->capacity = pool->new_chunk_capacity;
+  chunk->mem_size = sz;
+  chunk->next_mem = chunk->mem;
+  chunk->pool = pool;
+  ++pool->n_chunks;
+  return chunk;
+}
+
+/** Take a <b>chunk</b> that has just been allocated or removed from
+ * <b>pool</b>'s empty chunk list, and add it to the head of the used chunk
+ * list. */
+static INLINE void
+add_newly_used_chunk_to_used_list(mp_pool_t *pool, mp_chunk_t *chunk)
+{
+  chunk->next = pool->used_chunks;
+  chunk->prev = NULL;
+  if (chunk->next)
+    chunk->next->prev = chunk;
+  pool->used_chunks = chunk;
+}
+
+/** Return a newly allocated item from <b>pool</b>.  The item is
+ * uninitialized. */
+void *
+mp_pool_get(mp_pool_t *pool)
+{
+  mp_chunk_t *chunk;
+  mp_allocated_t *allocated;
+
+  if (PREDICT_LIKELY(pool->used_chunks != NULL)) {
+    /* Common case: there is some chunk that is neither full nor empty.  Use
+     * that one. (We can't use the full ones, obviously, and we should fill
+     * up the used ones before we start on any empty ones. */
+    chunk = pool->used_chunks;
+
+  } else if (pool->empty_chunks) {
+    /* We have no used chunks, but we have an empty chunk that we haven't
+     * freed yet: use that.  (We pull from the front of the list, which
+     * should get us the most recently emptied chunk.) */
+    chunk = pool->empty_chunks;
+
+    /* Remove the chunk from the empty list. */
+    pool->empty_chunks = chunk->next;
+    if (chunk->next)
+      chunk->next->prev = NULL;
+
+    /* Put the chunk on the 'used' list*/
+    add_newly_used_chunk_to_used_list(pool, chunk);
+
+    tor_assert(!chunk->prev);
+    --pool->n_empty_chunks;
+  } else {
+    /* We have no used or empty chunks: allocate a new chunk. */
+    chunk = mp_chunk_new(pool);
+
+    /* Add the new chunk to the used list. */
+    add_newly_used_chunk_to_used_list(pool, chunk);
+  }
+
+  tor_assert(chunk->n_allocated < chunk->capacity);
+
+  if (chunk->first_free) {
+    /* If there's anything on the chunk's freelist, unlink it and use it. */
+    allocated = chunk->first_free;
+    chunk->first_free = allocated->u.next_free;
+    allocated->u.next_free = NULL; /* For debugging; not really needed. */
+    tor_assert(allocated->in_chunk == chunk);
+  } else {
+    /* Otherwise, the chunk had better have some free space left on it. */
+    tor_assert(chunk->next_mem + pool->item_alloc_size <=
+               chunk->mem + chunk->mem_size);
+
+    /* Good, it did.  Let's carve off a bit of that free space, and use
+     * that. */
+    allocated = (void*)chunk->next_mem;
+    chunk->next_mem += pool->item_alloc_size;
+    allocated->in_chunk = chunk;
+    allocated->u.next_free = NULL; /* For debugging; not really needed. */
+  }
+
+  ++chunk->n_allocated;
+
+  if (PREDICT_UNLIKELY(chunk->n_allocated == chunk->capacity)) {
+    /* This chunk just became full. */
+    tor_assert(chunk == pool->used_chunks);
+    tor_assert(chunk->prev == NULL);
+
+    /* Take it off the used list. */
+    pool->used_chunks = chunk->next;
+    if (chunk->next)
+      chunk->next->prev = NULL;
+
+    /* Put it on the full list. */
+    chunk->next = pool->full_chunks;
+    if (chunk->next)
+      chunk->next->prev = chunk;
+    pool->full_chunks = chunk;
+  }
+
+  if (++pool->n_allocated > pool->n_peak)
+    pool->n_peak = pool->n_allocated;
+
+  /* And return the memory portion of the mp_allocated_t. */
+  return A2M(allocated);
+}
+
+/** Return an allocated memory item to its memory pool. */
+void
+mp_pool_release(void *item)
+{
+  mp_allocated_t *allocated = (void*) M2A(item);
+  mp_chunk_t *chunk = allocated->in_chunk;
+  mp_pool_t *pool;
+
+  tor_assert(chunk);
+  tor_assert(chunk->magic == MP_CHUNK_MAGIC);
+  tor_assert(chunk->n_allocated > 0);
+  pool = chunk->pool;
+
+#ifdef MEMPOOL_POISON_FREED
+  memset(A2M(allocated), MEMPOOL_POISON_BYTE,
+         pool->item_alloc_size - A2M_OFFSET);
+#endif
+
+  allocated->u.next_free = chunk->first_free;
+  chunk->first_free = allocated;
+
+  if (PREDICT_UNLIKELY(chunk->n_allocated == chunk->capacity)) {
+    /* This chunk was full and is about to be used. */
+    /* unlink from the full list  */
+    if (chunk->prev)
+      chunk->prev->next = chunk->next;
+    if (chunk->next)
+      chunk->next->prev = chunk->prev;
+    if (chunk == pool->full_chunks)
+      pool->full_chunks = chunk->next;
+
+    /* link to the used list. */
+    chunk->next = pool->used_chunks;
+    chunk->prev = NULL;
+    if (chunk->next)
+      chunk->next->prev = chunk;
+    pool->used_chunks = chunk;
+  } else if (PREDICT_UNLIKELY(chunk->n_allocated == 1)) {
+    /* This was used and is about to be empty. */
+
+    /* Unlink from the used list */
+    if (chunk->prev)
+      chunk->prev->next = chunk->next;
+    if (chunk->next)
+      chunk->next->prev = chunk->prev;
+    if (chunk == pool->used_chunks)
+      pool->used_chunks = chunk->next;
+
+    /* Link to the empty list */
+    chunk->next = pool->empty_chunks;
+    chunk->prev = NULL;
+    if (chunk->next)
+      chunk->next->prev = chunk;
+    pool->empty_chunks = chunk;
+
+    /* Reset the guts of this chunk to defragment it, in case it gets
+     * used again. */
+    chunk->first_free = NULL;
+    chunk->next_mem = chunk->mem;
+
+    ++pool->n_empty_chunks;
+  }
+
+  --chunk->n_allocated;
+  --pool->n_allocated;
+}
+
+/** Allocate a new memory pool to hold items of size <b>item_size</b>.  We'll
+ * try to fit about <b>chunk_capacity</b> items in each chunk; if
+ * <b>chunk_capacity</b> is 0, pick a chunk size of about 32KB.
+ * <b>name</b> is used in log messages, and must outlive the pool. */
+mp_pool_t *
+mp_pool_new(const char *name, size_t item_size, size_t chunk_capacity)
+{
+  mp_pool_t *pool;
+  size_t alloc_size;
+
+  tor_assert(item_size > 0);
+  pool = tor_malloc_zero(sizeof(mp_pool_t));
+  pool->name = name;
+
+  /* First, we figure out how much space to allow per item.  We'll want to
+   * use make sure we have enough for the overhead plus the item size. */
+  alloc_size = (size_t)(STRUCT_OFFSET(mp_allocated_t, u.mem) + item_size);
+  /* If the item_size is less than sizeof(next_free), we need to make
+   * the allocation bigger. */
+  if (alloc_size < sizeof(mp_allocated_t))
+    alloc_size = sizeof(mp_allocated_t);
+
+  /* If we're not an even multiple of ALIGNMENT, round up. */
+  if (alloc_size % ALIGNMENT) {
+    alloc_size = alloc_size + ALIGNMENT - (alloc_size % ALIGNMENT);
+  }
+  if (alloc_size < ALIGNMENT)
+    alloc_size = ALIGNMENT;
+  tor_assert((alloc_size % ALIGNMENT) == 0);
+  pool->item_alloc_size = alloc_size;
+
+  /* Now we figure out how many items fit in each chunk. */
+  if (chunk_capacity == 0)
+    chunk_capacity = (32*1024 - CHUNK_OVERHEAD) / alloc_size;
+  if (chunk_capacity > (MAX_CHUNK_BYTES - CHUNK_OVERHEAD) / alloc_size)
+    chunk_capacity = (MAX_CHUNK_BYTES - CHUNK_OVERHEAD) / alloc_size;
+  if (chunk_capacity < MIN_CHUNK_CAPACITY)
+    chunk_capacity = MIN_CHUNK_CAPACITY;
+
+  pool->new_chunk_capacity = (int)chunk_capacity;
+
+  return pool;
+}
+
+/** Helper: free all the chunks in the linked list starting at
+ * <b>chunk</b>. */
+static void
+destroy_chunks(mp_chunk_t *chunk)
+{
+  mp_chunk_t *next;
+  while (chunk) {
+    chunk->magic = 0xd3adb33f;
+    next = chunk->next;
+    tor_free(chunk);
+    chunk = next;
+  }
+}
+
+/** Helper: sort an array of mp_chunk_t* by address, lowest first. */
+static int
+mp_pool_sort_chunks_cmp(const void *_a, const void *_b)
+{
+  mp_chunk_t * const *a = _a;
+  mp_chunk_t * const *b = _b;
+  if (*a < *b)
+    return -1;
+  else if (*a > *b)
+    return 1;
+  else
+    return 0;
+}
+
+/** If there are more than <b>n_to_keep</b> empty chunks in <b>pool</b>,
+ * free the excess ones.  Chunks at lower addresses are kept in preference,
+ * to keep the pool's footprint compact.  If <b>n_to_keep</b> is negative,
+ * free all empty chunks. */
+void
+mp_pool_clean(mp_pool_t *pool, int n_to_keep)
+{
+  mp_chunk_t *chunk, **chunks;
+  int i, n;
+
+  if (n_to_keep < 0)
+    n_to_keep = 0;
+  if (pool->n_empty_chunks <= n_to_keep)
+    return;
+
+  n = pool->n_empty_chunks;
+  chunks = tor_calloc(n, sizeof(mp_chunk_t *));
+  for (i = 0, chunk = pool->empty_chunks; chunk; chunk = chunk->next)
+    chunks[i++] = chunk;
+  tor_assert(i == n);
+  qsort(chunks, n, sizeof(mp_chunk_t *), mp_pool_sort_chunks_cmp);
+
+  /* Relink the ones we keep, in address order. */
+  pool->empty_chunks = NULL;
+  for (i = n_to_keep - 1; i >= 0; --i) {
+    chunk = chunks[i];
+    chunk->prev = NULL;
+    chunk->next = pool->empty_chunks;
+    if (chunk->next)
+      chunk->next->prev = chunk;
+    pool->empty_chunks = chunk;
+  }
+  /* And free the rest. */
+  for (i = n_to_keep; i < n; ++i) {
+    chunks[i]->magic = 0xd3adb33f;
+    tor_free(chunks[i]);
+  }
+  pool->n_chunks -= n - n_to_keep;
+  pool->n_empty_chunks = n_to_keep;
+  tor_free(chunks);
+}
+
+/** Free all space held in <b>pool</b>.  This makes all pointers returned
+ * from mp_pool_get(<b>pool</b>) invalid. */
+void
+mp_pool_destroy(mp_pool_t *pool)
+{
+  destroy_chunks(pool->empty_chunks);
+  destroy_chunks(pool->used_chunks);
+  destroy_chunks(pool->full_chunks);
+  memset(pool, 0xe0, sizeof(mp_pool_t));
+  tor_free(pool);
+}
+
+/** Helper: make sure that a given chunk list is not corrupt. */
+static int
+assert_chunks_ok(mp_pool_t *pool, mp_chunk_t *chunk, int empty, int full)
+{
+  mp_allocated_t *allocated;
+  int n = 0;
+  if (chunk)
+    tor_assert(chunk->prev == NULL);
+
+  while (chunk) {
+    n++;
+    tor_assert(chunk->magic == MP_CHUNK_MAGIC);
+    tor_assert(chunk->pool == pool);
+    for (allocated = chunk->first_free; allocated;
+         allocated = allocated->u.next_free) {
+      tor_assert(allocated->in_chunk == chunk);
+    }
+    if (empty)
+      tor_assert(chunk->n_allocated == 0);
+    else if (full)
+      tor_assert(chunk->n_allocated == chunk->capacity);
+    else
+      tor_assert(chunk->n_allocated > 0 &&
+                 chunk->n_allocated < chunk->capacity);
+
+    tor_assert(chunk->capacity == pool->new_chunk_capacity);
+
+    tor_assert(chunk->mem_size ==
+               pool->new_chunk_capacity * pool->item_alloc_size);
+
+    tor_assert(chunk->next_mem >= chunk->mem &&
+               chunk->next_mem <= chunk->mem + chunk->mem_size);
+
+    if (chunk->next)
+      tor_assert(chunk->next->prev == chunk);
+
+    chunk = chunk->next;
+  }
+  return n;
+}
+
+/** Fail with an assertion if <b>pool</b> is not internally consistent. */
+void
+mp_pool_assert_ok(mp_pool_t *pool)
+{
+  int n_empty;
+  size_t n_alloc = 0;
+  mp_chunk_t *chunk;
+
+  n_empty = assert_chunks_ok(pool, pool->empty_chunks, 1, 0);
+  assert_chunks_ok(pool, pool->full_chunks, 0, 1);
+  assert_chunks_ok(pool, pool->used_chunks, 0, 0);
+
+  tor_assert(pool->n_empty_chunks == n_empty);
+
+  for (chunk = pool->used_chunks; chunk; chunk = chunk->next)
+    n_alloc += chunk->n_allocated;
+  for (chunk = pool->full_chunks; chunk; chunk = chunk->next)
+    n_alloc += chunk->n_allocated;
+  tor_assert(n_alloc == pool->n_allocated);
+  tor_assert(pool->n_allocated <= pool->n_peak);
+}
+
+/** Set *<b>n_allocated_out</b> to the number of items currently handed out
+ * from <b>pool</b>, *<b>n_peak_out</b> to the largest number ever handed out
+ * at once, *<b>n_chunks_out</b> to the number of chunks in the pool, and
+ * *<b>bytes_out</b> to the number of bytes the pool holds.  Any output
+ * pointer may be NULL. */
+void
+mp_pool_get_stats(const mp_pool_t *pool,
+                  size_t *n_allocated_out, size_t *n_peak_out,
+                  size_t *n_chunks_out, size_t *bytes_out)
+{
+  if (n_allocated_out)
+    *n_allocated_out = pool->n_allocated;
+  if (n_peak_out)
+    *n_peak_out = pool->n_peak;
+  if (n_chunks_out)
+    *n_chunks_out = pool->n_chunks;
+  if (bytes_out)
+    *bytes_out = pool->n_chunks *
+      (CHUNK_OVERHEAD + pool->new_chunk_capacity * pool->item_alloc_size);
+}
+
+/** Dump information about <b>pool</b>'s memory usage to the Tor log at level
+ * <b>severity</b>. */
+void
+mp_pool_log_status(mp_pool_t *pool, int severity)
+{
+  size_t bytes_allocated = 0;
+  size_t bytes_capacity = 0;
+
+  bytes_allocated = pool->n_allocated * pool->item_alloc_size;
+  mp_pool_get_stats(pool, NULL, NULL, NULL, &bytes_capacity);
+
+  tor_log(severity, LD_MM,
+      "Pool %s (%d-byte items): %lu/%lu items in use "
+      "(peak %lu); %d chunks (%d empty) of %d items each.",
+      pool->name, (int)pool->item_alloc_size,
+      (unsigned long)pool->n_allocated,
+      (unsigned long)(pool->n_chunks * pool->new_chunk_capacity),
+      (unsigned long)pool->n_peak,
+      pool->n_chunks, pool->n_empty_chunks, pool->new_chunk_capacity);
+  tor_log(severity, LD_MM,
+      "Pool %s: "U64_FORMAT" bytes in use out of "U64_FORMAT" allocated "
+      "(%.02f%% occupancy).",
+      pool->name,
+      U64_PRINTF_ARG(bytes_allocated), U64_PRINTF_ARG(bytes_capacity),
+      bytes_capacity ? (100.0*bytes_allocated/bytes_capacity) : 0.0);
+}
+
@@ -0,0 +1,30 @@
+/* Copyright (c) 2007-2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file mempool.h
+ * \brief Headers for mempool.c
+ **/
+
+#ifndef TOR_MEMPOOL_H
+#define TOR_MEMPOOL_H
+
+/** A memory pool is a context in which a large number of fixed-sized
+ * objects can be allocated efficiently.  See mempool.c for implementation
+ * details. */
+typedef struct mp_pool_t mp_pool_t;
+
+mp_pool_t *mp_pool_new(const char *name, size_t item_size,
+                       size_t chunk_capacity);
+void *mp_pool_get(mp_pool_t *pool);
+void mp_pool_release(void *item);
+void mp_pool_clean(mp_pool_t *pool, int n_to_keep);
+void mp_pool_destroy(mp_pool_t *pool);
+void mp_pool_assert_ok(mp_pool_t *pool);
+void mp_pool_get_stats(const mp_pool_t *pool,
+                       size_t *n_allocated_out, size_t *n_peak_out,
+                       size_t *n_chunks_out, size_t *bytes_out);
+void mp_pool_log_status(mp_pool_t *pool, int severity);
+
+#endif
+
@@ -139,6 +139,8 @@ int add_syslog_log(const log_severity_list_t *severity);
 #endif
 int add_callback_log(const log_severity_list_t *severity, log_callback cb);
 void logs_set_domain_logging(int enabled);
+int logs_set_async(int enabled, size_t buffer_size);
+uint64_t logs_get_n_async_dropped(void);
 int get_min_log_level(void);
 void switch_logs_debug(void);
 void logs_free_all(void);
@@ -69,10 +69,12 @@
 #include "compat_libevent.h"
 #endif
 
+#define TORTLS_PRIVATE
 #include "tortls.h"
 #include "util.h"
 #include "torlog.h"
 #include "container.h"
+#include "tor_queue.h"
 #include <string.h>
 
 /* Enable the "v2" TLS handshake.
@@ -503,6 +505,8 @@ tor_tls_free_all(void)
 {
   check_no_tls_errors();
 
+  tor_tls_session_cache_free_all();
+
   if (server_tls_context) {
     tor_tls_context_t *ctx = server_tls_context;
     server_tls_context = NULL;
@@ -1223,10 +1227,23 @@ tor_tls_context_new(crypto_pk_t *identity, unsigned int key_lifetime,
    * be few such servers by the time 0.2.4 is more stable.
    */
 #ifdef SSL_OP_NO_TICKET
-  if (! is_client) {
+  if (! is_client && ! (flags & TOR_TLS_CTX_USE_SESSION_TICKETS)) {
     SSL_CTX_set_options(result->ctx, SSL_OP_NO_TICKET);
   }
 #endif
+  /* Relays that reconnect to us may resume their sessions with a ticket,
+   * for a while.  The ticket keys live and die with this context, so a
+   * ticket never outlives the link certificate that it was issued
+   * under. */
+  if (flags & TOR_TLS_CTX_USE_SESSION_TICKETS)
+    SSL_CTX_set_timeout(result->ctx, TOR_TLS_SESSION_LIFETIME);
+#ifdef SSL_OP_ENABLE_KTLS
+  /* Once the handshake is done, hand the record layer to the kernel if we
+   * can.  OpenSSL quietly keeps doing the crypto itself if the kernel or
+   * the negotiated ciphersuite can't. */
+  if (flags & TOR_TLS_CTX_USE_KTLS)
+    SSL_CTX_set_options(result->ctx, SSL_OP_ENABLE_KTLS);
+#endif
 
   SSL_CTX_set_options(result->ctx, SSL_OP_SINGLE_DH_USE);
   SSL_CTX_set_options(result->ctx, SSL_OP_SINGLE_ECDH_USE);
@@ -1763,6 +1780,194 @@ tor_tls_new(int sock, int isServer)
   return result;
 }
 
+/** A TLS session that we can offer to resume the next time we connect to
+ * the same relay. */
+typedef struct tor_tls_session_ent_t {
+  /** Identity digest of the relay we negotiated this session with. */
+  char peer_id[DIGEST_LEN];
+  /** The session itself; we hold a reference to it. */
+  SSL_SESSION *session;
+  /** When we'll stop offering this session. */
+  time_t expires;
+  /** Links for the cache's list of sessions, oldest first. */
+  TOR_TAILQ_ENTRY(tor_tls_session_ent_t) next;
+} tor_tls_session_ent_t;
+
+/** Map from peer identity digest to tor_tls_session_ent_t. */
+static digestmap_t *tls_session_cache = NULL;
+/** Every entry in tls_session_cache, least recently saved first. */
+static TOR_TAILQ_HEAD(tor_tls_session_list_s, tor_tls_session_ent_t)
+  tls_session_list = TOR_TAILQ_HEAD_INITIALIZER(tls_session_list);
+/** Number of entries in tls_session_cache. */
+static int tls_session_cache_len = 0;
+
+/** Remove <b>ent</b> from the session cache and free it. */
+static void
+tor_tls_session_ent_remove(tor_tls_session_ent_t *ent)
+{
+  digestmap_remove(tls_session_cache, ent->peer_id);
+  TOR_TAILQ_REMOVE(&tls_session_list, ent, next);
+  --tls_session_cache_len;
+  SSL_SESSION_free(ent->session);
+  tor_free(ent);
+}
+
+/** Free every session in the session cache. */
+STATIC void
+tor_tls_session_cache_free_all(void)
+{
+  tor_tls_session_ent_t *ent;
+  while ((ent = TOR_TAILQ_FIRST(&tls_session_list)))
+    tor_tls_session_ent_remove(ent);
+  digestmap_free(tls_session_cache, NULL);
+  tls_session_cache = NULL;
+}
+
+/** Helper for tor_tls_resume_session(): if we have saved a session with
+ * the relay whose identity digest is <b>peer_id</b>, and it hasn't expired
+ * as of <b>now</b>, make <b>ssl</b> offer to resume it.  Return 1 if we
+ * did, 0 if we didn't. */
+STATIC int
+tor_tls_session_cache_offer(SSL *ssl, const char *peer_id, time_t now)
+{
+  tor_tls_session_ent_t *ent;
+
+  if (!tls_session_cache)
+    return 0;
+  ent = digestmap_get(tls_session_cache, peer_id);
+  if (!ent)
+    return 0;
+  if (ent->expires <= now) {
+    tor_tls_session_ent_remove(ent);
+    return 0;
+  }
+  if (!SSL_set_session(ssl, ent->session)) {
+    tls_log_errors(NULL, LOG_INFO, LD_HANDSHAKE, "offering a saved session");
+    tor_tls_session_ent_remove(ent);
+    return 0;
+  }
+  return 1;
+}
+
+/** Helper for tor_tls_save_session(): remember <b>session</b>, which we
+ * negotiated with the relay whose identity digest is <b>peer_id</b>, as of
+ * <b>now</b>.  Takes ownership of our reference to <b>session</b>.  If the
+ * cache is full, forget the session that we saved longest ago. */
+STATIC void
+tor_tls_session_cache_add(SSL_SESSION *session, const char *peer_id,
+                          time_t now)
+{
+  tor_tls_session_ent_t *ent;
+  time_t lifetime;
+
+#if OPENSSL_VERSION_NUMBER >= OPENSSL_V_SERIES(1,1,1)
+  if (!SSL_SESSION_is_resumable(session)) {
+    /* The relay didn't give us a ticket. */
+    SSL_SESSION_free(session);
+    return;
+  }
+#endif
+  lifetime = MIN(SSL_SESSION_get_timeout(session), TOR_TLS_SESSION_LIFETIME);
+
+  if (!tls_session_cache)
+    tls_session_cache = digestmap_new();
+  ent = digestmap_get(tls_session_cache, peer_id);
+  if (ent) {
+    SSL_SESSION_free(ent->session);
+    TOR_TAILQ_REMOVE(&tls_session_list, ent, next);
+  } else {
+    if (tls_session_cache_len >= TOR_TLS_SESSION_CACHE_MAX)
+      tor_tls_session_ent_remove(TOR_TAILQ_FIRST(&tls_session_list));
+    ent = tor_malloc_zero(sizeof(tor_tls_session_ent_t));
+    memcpy(ent->peer_id, peer_id, DIGEST_LEN);
+    digestmap_set(tls_session_cache, peer_id, ent);
+    ++tls_session_cache_len;
+  }
+  ent->session = session;
+  ent->expires = SSL_SESSION_get_time(session) + lifetime;
+  if (ent->expires > now + TOR_TLS_SESSION_LIFETIME)
+    ent->expires = now + TOR_TLS_SESSION_LIFETIME;
+  TOR_TAILQ_INSERT_TAIL(&tls_session_list, ent, next);
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the number of sessions in the session cache.  Only used in
+ * tests. */
+STATIC int
+tor_tls_session_cache_size(void)
+{
+  return tls_session_cache_len;
+}
+#endif
+
+/** If we have saved a session with the relay whose identity digest is
+ * <b>peer_id</b>, make the client-side <b>tls</b> offer to resume it.
+ * Return 1 if we did, 0 if we didn't. */
+int
+tor_tls_resume_session(tor_tls_t *tls, const char *peer_id)
+{
+  tor_assert(tls);
+  tor_assert(!tls->isServer);
+
+  return tor_tls_session_cache_offer(tls->ssl, peer_id, time(NULL));
+}
+
+/** Remember the session that the client-side <b>tls</b> negotiated with
+ * the relay whose identity digest is <b>peer_id</b>, so that we can
+ * resume it if we reconnect.  Only call this once the relay has proven
+ * that it holds <b>peer_id</b>. */
+void
+tor_tls_save_session(tor_tls_t *tls, const char *peer_id)
+{
+  SSL_SESSION *session;
+  tor_assert(tls);
+  tor_assert(!tls->isServer);
+
+  session = SSL_get1_session(tls->ssl);
+  if (session)
+    tor_tls_session_cache_add(session, peer_id, time(NULL));
+}
+
+/** Forget any session we've saved with the relay whose identity digest is
+ * <b>peer_id</b>. */
+void
+tor_tls_forget_session(const char *peer_id)
+{
+  tor_tls_session_ent_t *ent;
+  if (!tls_session_cache)
+    return;
+  ent = digestmap_get(tls_session_cache, peer_id);
+  if (ent)
+    tor_tls_session_ent_remove(ent);
+}
+
+/** Return true iff the handshake on <b>tls</b> resumed an earlier
+ * session. */
+int
+tor_tls_session_was_resumed(tor_tls_t *tls)
+{
+  tor_assert(tls);
+  return SSL_session_reused(tls->ssl) != 0;
+}
+
+/** Set *<b>send_out</b> and *<b>recv_out</b> to true iff the kernel is
+ * doing the record-layer crypto for the data we send and receive on
+ * <b>tls</b>, respectively.  Return 0 on success, or -1 if our OpenSSL
+ * can't use kernel TLS at all. */
+int
+tor_tls_get_ktls_offload(tor_tls_t *tls, int *send_out, int *recv_out)
+{
+  tor_assert(tls);
+  *send_out = *recv_out = 0;
+#ifdef SSL_OP_ENABLE_KTLS
+  *send_out = BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) ? 1 : 0;
+  *recv_out = BIO_get_ktls_recv(SSL_get_rbio(tls->ssl)) ? 1 : 0;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
 /** Make future log messages about <b>tls</b> display the address
  * <b>address</b>.
  */
@@ -1914,8 +2119,8 @@ static uint64_t total_bytes_written_by_tls = 0;
  * number of characters written.  On failure, returns TOR_TLS_ERROR,
  * TOR_TLS_WANTREAD, or TOR_TLS_WANTWRITE.
  */
-int
-tor_tls_write(tor_tls_t *tls, const char *cp, size_t n)
+MOCK_IMPL(int,
+tor_tls_write,(tor_tls_t *tls, const char *cp, size_t n))
 {
   int r, err;
   tor_assert(tls);
@@ -2398,8 +2603,8 @@ tor_tls_get_pending_bytes(tor_tls_t *tls)
 
 /** If <b>tls</b> requires that the next write be of a particular size,
  * return that size.  Otherwise, return 0. */
-size_t
-tor_tls_get_forced_write_size(tor_tls_t *tls)
+MOCK_IMPL(size_t,
+tor_tls_get_forced_write_size,(tor_tls_t *tls))
 {
   return tls->wantwrite_n;
 }
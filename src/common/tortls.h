@@ -59,6 +59,17 @@ void tor_tls_free_all(void);
 #define TOR_TLS_CTX_IS_PUBLIC_SERVER (1u<<0)
 #define TOR_TLS_CTX_USE_ECDHE_P256   (1u<<1)
 #define TOR_TLS_CTX_USE_ECDHE_P224   (1u<<2)
+#define TOR_TLS_CTX_USE_SESSION_TICKETS (1u<<3)
+#define TOR_TLS_CTX_USE_KTLS         (1u<<4)
+
+/** Most application data that fits in a single TLS record. */
+#define TOR_TLS_MAX_RECORD_PAYLOAD 16384
+
+/** Longest time for which we'll let a TLS session be resumed, in
+ * seconds. */
+#define TOR_TLS_SESSION_LIFETIME (60*60)
+/** Most TLS sessions that we'll remember in order to resume them. */
+#define TOR_TLS_SESSION_CACHE_MAX 8192
 
 int tor_tls_context_init(unsigned flags,
                          crypto_pk_t *client_identity,
@@ -66,6 +77,11 @@ int tor_tls_context_init(unsigned flags,
                          unsigned int key_lifetime);
 tor_tls_t *tor_tls_new(int sock, int is_server);
 void tor_tls_set_logged_address(tor_tls_t *tls, const char *address);
+int tor_tls_resume_session(tor_tls_t *tls, const char *peer_id);
+void tor_tls_save_session(tor_tls_t *tls, const char *peer_id);
+void tor_tls_forget_session(const char *peer_id);
+int tor_tls_session_was_resumed(tor_tls_t *tls);
+int tor_tls_get_ktls_offload(tor_tls_t *tls, int *send_out, int *recv_out);
 void tor_tls_set_renegotiate_callback(tor_tls_t *tls,
                                       void (*cb)(tor_tls_t *, void *arg),
                                       void *arg);
@@ -78,7 +94,7 @@ int tor_tls_check_lifetime(int severity,
                            tor_tls_t *tls, int past_tolerance,
                            int future_tolerance);
 MOCK_DECL(int, tor_tls_read, (tor_tls_t *tls, char *cp, size_t len));
-int tor_tls_write(tor_tls_t *tls, const char *cp, size_t n);
+MOCK_DECL(int, tor_tls_write, (tor_tls_t *tls, const char *cp, size_t n));
 int tor_tls_handshake(tor_tls_t *tls);
 int tor_tls_finish_handshake(tor_tls_t *tls);
 int tor_tls_renegotiate(tor_tls_t *tls);
@@ -87,7 +103,7 @@ void tor_tls_block_renegotiation(tor_tls_t *tls);
 void tor_tls_assert_renegotiation_unblocked(tor_tls_t *tls);
 int tor_tls_shutdown(tor_tls_t *tls);
 int tor_tls_get_pending_bytes(tor_tls_t *tls);
-size_t tor_tls_get_forced_write_size(tor_tls_t *tls);
+MOCK_DECL(size_t, tor_tls_get_forced_write_size, (tor_tls_t *tls));
 
 void tor_tls_get_n_raw_bytes(tor_tls_t *tls,
                              size_t *n_read, size_t *n_written);
@@ -142,5 +158,18 @@ const char *tor_tls_get_ciphersuite_name(tor_tls_t *tls);
 
 int evaluate_ecgroup_for_tls(const char *ecgroup);
 
+#ifdef TORTLS_PRIVATE
+struct ssl_st;
+struct ssl_session_st;
+STATIC int tor_tls_session_cache_offer(struct ssl_st *ssl,
+                                       const char *peer_id, time_t now);
+STATIC void tor_tls_session_cache_add(struct ssl_session_st *session,
+                                      const char *peer_id, time_t now);
+#ifdef TOR_UNIT_TESTS
+STATIC int tor_tls_session_cache_size(void);
+#endif
+STATIC void tor_tls_session_cache_free_all(void);
+#endif
+
 #endif
 
@@ -0,0 +1,390 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file trace.c
+ * \brief A low-overhead binary trace of hot-path events.
+ *
+ * Each thread that records an event gets its own ring of fixed-size
+ * tor_trace_record_t records, which only that thread writes to: recording
+ * an event takes no locks and makes no system calls beyond reading the
+ * clock.  Periodically (see tor_trace_flush()), the main thread copies new
+ * records from every ring into the trace file.  If a thread records events
+ * faster than we flush them, the oldest records get overwritten, and we
+ * write a TRACE_EV_LOST record saying how many.
+ *
+ * The flusher reads each ring while its owner may still be writing to it.
+ * Where the compiler gives us lock-free atomics, the owner publishes each
+ * record by storing the ring's head with release semantics, and the
+ * flusher reads the head with acquire semantics before it copies the
+ * records.  Before the owner starts overwriting a record, it says so in
+ * the ring's <b>claimed</b> counter; the flusher checks that counter after
+ * copying, and counts any record that the owner might have been
+ * overwriting in the meantime as lost.  Elsewhere, recording
+ * an event takes trace_mutex.  Use src/tools/tor-tracedump to read the
+ * files.
+ */
+
+#include "orconfig.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#include "compat.h"
+#include "util.h"
+#include "torlog.h"
+#include "trace.h"
+
+#if defined(__ATOMIC_ACQUIRE) && defined(__GCC_ATOMIC_LLONG_LOCK_FREE) && \
+  defined(__GCC_ATOMIC_INT_LOCK_FREE) && __GCC_ATOMIC_LLONG_LOCK_FREE == 2 && \
+  __GCC_ATOMIC_INT_LOCK_FREE == 2
+/** Defined if we can read and write ring heads and the ring count without
+ * locking. */
+#define TRACE_USE_ATOMICS
+#define TRACE_LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define TRACE_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define TRACE_FENCE_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define TRACE_FENCE_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#else
+/* Everything that these protect happens under trace_mutex instead. */
+#define TRACE_LOAD_ACQUIRE(p) (*(p))
+#define TRACE_STORE_RELEASE(p, v) (*(p) = (v))
+#define TRACE_FENCE_ACQUIRE() STMT_NIL
+#define TRACE_FENCE_RELEASE() STMT_NIL
+#endif
+
+/** How many threads can have rings?  Events from any other threads are not
+ * recorded. */
+#define MAX_TRACE_RINGS 64
+/** Smallest number of records we'll put in a ring. */
+#define MIN_TRACE_RING_RECORDS 1024
+
+/** A ring of trace records belonging to a single thread. */
+typedef struct tor_trace_ring_t {
+  unsigned long owner; /**< The thread that writes to this ring. */
+  uint16_t idx; /**< Position of this ring in trace_rings. */
+  uint64_t mask; /**< Number of records in the ring, minus one. */
+  /** Number of records ever written to this ring.  Only the owner writes
+   * this, with TRACE_STORE_RELEASE(); everyone else reads it with
+   * TRACE_LOAD_ACQUIRE(). */
+  uint64_t head;
+  /** Number of records that the owner has started to write: either head,
+   * or head + 1 while the owner is writing a record.  Only the owner
+   * writes this. */
+  uint64_t claimed;
+  /** Number of records that we have written to disk or given up on.  Only
+   * the flusher touches this. */
+  uint64_t tail;
+  tor_trace_record_t *records; /**< The ring itself. */
+} tor_trace_ring_t;
+
+int tor_trace_enabled_ = 0;
+
+/** Every thread's ring; the first n_trace_rings are in use. */
+static tor_trace_ring_t *trace_rings[MAX_TRACE_RINGS];
+/** Number of rings in trace_rings.  We only change this while holding
+ * trace_mutex, and only after storing the new ring in trace_rings; read it
+ * with TRACE_LOAD_ACQUIRE() when not holding trace_mutex. */
+static int n_trace_rings = 0;
+/** Number of records to put in each new ring. */
+static unsigned trace_ring_records = 0;
+/** File descriptor for the trace file, or -1 if we have none. */
+static int trace_fd = -1;
+/** Mutex protecting the set of rings and writes to the trace file. */
+static tor_mutex_t trace_mutex;
+/** True iff trace_mutex is initialized. */
+static int trace_mutex_initialized = 0;
+
+/** Names for each tor_trace_event_t, in order. */
+static const char *trace_event_names[] = {
+  "lost",
+  "cell_recv",
+  "cell_queue",
+  "cell_flush",
+  "channel_write_cell",
+  "cmux_xmit",
+  "onion_queue",
+  "onion_dequeue",
+  "cpuworker_assign",
+  "cpuworker_reply",
+  "buf_flush",
+  "buf_flush_tls",
+};
+
+/** Return a short name for the trace event <b>event</b>, or NULL if there
+ * is no such event. */
+const char *
+tor_trace_event_name(int event)
+{
+  if (event < 0 || event >= (int)ARRAY_LENGTH(trace_event_names))
+    return NULL;
+  return trace_event_names[event];
+}
+
+/** Return the current time in nanoseconds, from a monotonic clock if we
+ * have one. */
+static uint64_t
+trace_now(void)
+{
+  struct timeval tv;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return ((uint64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+  tor_gettimeofday(&tv);
+  return ((uint64_t)tv.tv_sec) * 1000000000 + ((uint64_t)tv.tv_usec) * 1000;
+}
+
+/** Return the ring for the current thread, creating it if we need to.
+ * Return NULL if we are out of rings. */
+static tor_trace_ring_t *
+trace_ring_for_thread(void)
+{
+  const unsigned long id = tor_get_thread_id();
+  tor_trace_ring_t *ring = NULL;
+  int i, n = TRACE_LOAD_ACQUIRE(&n_trace_rings);
+
+  /* Only this thread ever sets a ring's owner to our ID, and every ring
+   * below n is fully set up, so we can look for our ring without
+   * locking. */
+  for (i = 0; i < n; ++i) {
+    if (trace_rings[i]->owner == id)
+      return trace_rings[i];
+  }
+
+  tor_mutex_acquire(&trace_mutex);
+  if (n_trace_rings < MAX_TRACE_RINGS) {
+    ring = tor_malloc_zero(sizeof(tor_trace_ring_t));
+    ring->owner = id;
+    ring->idx = (uint16_t)n_trace_rings;
+    ring->mask = trace_ring_records - 1;
+    ring->records = tor_calloc(trace_ring_records,
+                               sizeof(tor_trace_record_t));
+    trace_rings[n_trace_rings] = ring;
+    TRACE_STORE_RELEASE(&n_trace_rings, n_trace_rings + 1);
+  }
+  tor_mutex_release(&trace_mutex);
+  return ring;
+}
+
+/** Record an <b>event</b> with arguments <b>a</b> and <b>b</b> in this
+ * thread's ring.  Use tor_trace() instead of calling this directly. */
+void
+tor_trace_event_(uint16_t event, uint64_t a, uint64_t b)
+{
+  tor_trace_ring_t *ring;
+  tor_trace_record_t *rec;
+  uint64_t head;
+#ifndef TRACE_USE_ATOMICS
+  tor_mutex_acquire(&trace_mutex);
+#endif
+  ring = trace_ring_for_thread();
+  if (PREDICT_UNLIKELY(!ring))
+    goto done;
+  /* We're the only writer, so we can read our own head plainly. */
+  head = ring->head;
+  /* Make sure nobody sees us overwrite a record before they see that we
+   * claimed it, so that the flusher can tell that it's gone. */
+  TRACE_STORE_RELEASE(&ring->claimed, head + 1);
+  TRACE_FENCE_RELEASE();
+  rec = &ring->records[head & ring->mask];
+  rec->timestamp = trace_now();
+  rec->event = event;
+  rec->thread = ring->idx;
+  rec->reserved = 0;
+  rec->a = a;
+  rec->b = b;
+  TRACE_STORE_RELEASE(&ring->head, head + 1);
+ done:
+#ifndef TRACE_USE_ATOMICS
+  tor_mutex_release(&trace_mutex);
+#endif
+  return;
+}
+
+/** Helper: write <b>n</b> records from <b>recs</b> to the trace file.  On
+ * failure, stop tracing. */
+static void
+trace_write_records(const tor_trace_record_t *recs, size_t n)
+{
+  if (trace_fd < 0 || n == 0)
+    return;
+  if (write_all(trace_fd, (const char *)recs, n * sizeof(*recs), 0) < 0) {
+    log_warn(LD_FS, "Couldn't write to trace file: %s. Stopping tracing.",
+             strerror(errno));
+    tor_trace_enabled_ = 0;
+    close(trace_fd);
+    trace_fd = -1;
+  }
+}
+
+/** Helper: write a TRACE_EV_LOST record saying that <b>ring</b> lost
+ * <b>n_lost</b> records. */
+static void
+trace_write_lost(const tor_trace_ring_t *ring, uint64_t n_lost)
+{
+  tor_trace_record_t rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.timestamp = trace_now();
+  rec.event = TRACE_EV_LOST;
+  rec.thread = ring->idx;
+  rec.a = n_lost;
+  trace_write_records(&rec, 1);
+}
+
+/** Write every record that has been added to <b>ring</b> since we last
+ * flushed it.  <b>tmp</b> must have room for the whole ring.  Caller must
+ * hold trace_mutex. */
+static void
+trace_flush_ring(tor_trace_ring_t *ring, tor_trace_record_t *tmp)
+{
+  const uint64_t capacity = ring->mask + 1;
+  uint64_t head = TRACE_LOAD_ACQUIRE(&ring->head), first_valid, i;
+  size_t n = 0;
+
+  if (head - ring->tail > capacity) {
+    trace_write_lost(ring, head - capacity - ring->tail);
+    ring->tail = head - capacity;
+  }
+  for (i = ring->tail; i < head; ++i)
+    tmp[n++] = ring->records[i & ring->mask];
+
+  /* If the owner wrapped around while we were copying, the oldest records
+   * we copied may be garbage, including one that the owner may be
+   * overwriting right now. */
+  TRACE_FENCE_ACQUIRE();
+  head = TRACE_LOAD_ACQUIRE(&ring->claimed);
+  first_valid = head > capacity ? head - capacity : 0;
+  if (first_valid > ring->tail) {
+    uint64_t n_bad = first_valid - ring->tail;
+    if (n_bad > n)
+      n_bad = n;
+    trace_write_lost(ring, n_bad);
+    trace_write_records(tmp + n_bad, n - (size_t)n_bad);
+  } else {
+    trace_write_records(tmp, n);
+  }
+  ring->tail += n;
+}
+
+/** Copy every new trace record from every thread's ring into the trace
+ * file.  Call this regularly from the main thread while tracing. */
+void
+tor_trace_flush(void)
+{
+  tor_trace_record_t *tmp = NULL;
+  size_t tmp_len = 0;
+  int i;
+
+  if (!tor_trace_enabled_ && trace_fd < 0)
+    return;
+
+  tor_mutex_acquire(&trace_mutex);
+  for (i = 0; i < n_trace_rings && trace_fd >= 0; ++i) {
+    tor_trace_ring_t *ring = trace_rings[i];
+    if (TRACE_LOAD_ACQUIRE(&ring->head) == ring->tail)
+      continue;
+    if (tmp_len < ring->mask + 1) {
+      tmp_len = (size_t)(ring->mask + 1);
+      tmp = tor_reallocarray(tmp, tmp_len, sizeof(tor_trace_record_t));
+    }
+    trace_flush_ring(ring, tmp);
+  }
+  tor_mutex_release(&trace_mutex);
+  tor_free(tmp);
+}
+
+/** Start recording trace events to <b>filename</b>, replacing its
+ * contents, with room for <b>n_records</b> unflushed records per thread.
+ * If we were already tracing, stop first.  Return 0 on success, -1 on
+ * failure. */
+int
+tor_trace_start(const char *filename, unsigned n_records)
+{
+  tor_trace_file_header_t hdr;
+  unsigned n = MIN_TRACE_RING_RECORDS;
+  int fd;
+
+  tor_assert(filename);
+  if (!trace_mutex_initialized) {
+    tor_mutex_init(&trace_mutex);
+    trace_mutex_initialized = 1;
+  }
+  tor_trace_stop();
+
+  fd = tor_open_cloexec(filename, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  if (fd < 0) {
+    log_warn(LD_FS, "Couldn't open trace file \"%s\": %s", filename,
+             strerror(errno));
+    return -1;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TOR_TRACE_FILE_MAGIC, sizeof(hdr.magic));
+  hdr.version = TOR_TRACE_FILE_VERSION;
+  hdr.record_size = sizeof(tor_trace_record_t);
+  if (write_all(fd, (const char *)&hdr, sizeof(hdr), 0) < 0) {
+    log_warn(LD_FS, "Couldn't write to trace file \"%s\": %s", filename,
+             strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  while (n < n_records && n < (1u<<30))
+    n <<= 1;
+
+  tor_mutex_acquire(&trace_mutex);
+  trace_fd = fd;
+  /* Rings that already exist keep their old size: another thread might be
+   * writing to one right now, so we can't replace it. */
+  trace_ring_records = n;
+  tor_mutex_release(&trace_mutex);
+  tor_trace_enabled_ = 1;
+  return 0;
+}
+
+/** Stop recording trace events, and write everything we've recorded so far
+ * to the trace file. */
+void
+tor_trace_stop(void)
+{
+  if (!trace_mutex_initialized)
+    return;
+  tor_trace_enabled_ = 0;
+  tor_trace_flush();
+  tor_mutex_acquire(&trace_mutex);
+  if (trace_fd >= 0) {
+    close(trace_fd);
+    trace_fd = -1;
+  }
+  tor_mutex_release(&trace_mutex);
+}
+
+/** Stop tracing and release all storage held by the tracing code.  Only
+ * call this when no other threads will record events. */
+void
+tor_trace_free_all(void)
+{
+  int i;
+  tor_trace_stop();
+  for (i = 0; i < n_trace_rings; ++i) {
+    tor_free(trace_rings[i]->records);
+    tor_free(trace_rings[i]);
+  }
+  n_trace_rings = 0;
+  if (trace_mutex_initialized) {
+    tor_mutex_uninit(&trace_mutex);
+    trace_mutex_initialized = 0;
+  }
+}
+
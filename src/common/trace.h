@@ -0,0 +1,98 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file trace.h
+ * \brief Headers for trace.c
+ **/
+
+#ifndef TOR_TRACE_H
+#define TOR_TRACE_H
+
+#include "torint.h"
+#include "compat.h"
+
+/** Identifiers for the events we can trace.  These numbers appear in trace
+ * files, so don't renumber them: only add new ones at the end. */
+typedef enum tor_trace_event_t {
+  /** We overwrote or lost some records.  A: number of records lost. */
+  TRACE_EV_LOST = 0,
+  /** A relay cell arrived on a circuit.  A: cell direction.  B: true iff the
+   * cell was recognized. */
+  TRACE_EV_CELL_RECV = 1,
+  /** A cell was added to a circuit's queue.  A: cell direction.  B: length
+   * of the queue afterwards. */
+  TRACE_EV_CELL_QUEUE = 2,
+  /** We moved cells from circuit queues onto a channel.  A: channel
+   * identifier.  B: number of cells. */
+  TRACE_EV_CELL_FLUSH = 3,
+  /** A cell was handed to a channel for writing.  A: channel identifier.
+   * B: bytes waiting in the channel's outgoing queue. */
+  TRACE_EV_CHANNEL_WRITE_CELL = 4,
+  /** A circuitmux sent cells from a circuit.  A: number of cells.  B: cells
+   * still queued on the circuitmux. */
+  TRACE_EV_CMUX_XMIT = 5,
+  /** An onionskin was queued for processing.  A: handshake type.  B: number
+   * of queued onionskins of that type. */
+  TRACE_EV_ONION_QUEUE = 6,
+  /** An onionskin was taken off the queue.  A: handshake type.  B: number of
+   * queued onionskins of that type. */
+  TRACE_EV_ONION_DEQUEUE = 7,
+  /** An onionskin was handed to a cpuworker.  A: handshake type.  B: number
+   * of jobs pending. */
+  TRACE_EV_CPUWORKER_ASSIGN = 8,
+  /** A cpuworker finished an onionskin.  A: handshake type.  B: usec the job
+   * took, or 0 if we weren't timing it. */
+  TRACE_EV_CPUWORKER_REPLY = 9,
+  /** We flushed a buffer to a socket.  A: bytes written.  B: bytes left. */
+  TRACE_EV_BUF_FLUSH = 10,
+  /** We flushed a buffer to a TLS connection.  A: bytes written.  B: bytes
+   * left. */
+  TRACE_EV_BUF_FLUSH_TLS = 11,
+  N_TRACE_EVENTS
+} tor_trace_event_t;
+
+/** One traced event, as stored in memory and in trace files. */
+typedef struct tor_trace_record_t {
+  uint64_t timestamp; /**< Nanoseconds, from an arbitrary monotonic clock. */
+  uint16_t event; /**< A tor_trace_event_t. */
+  uint16_t thread; /**< Which thread recorded the event. */
+  uint32_t reserved; /**< Zero. */
+  uint64_t a; /**< First event-specific argument. */
+  uint64_t b; /**< Second event-specific argument. */
+} tor_trace_record_t;
+
+/** A trace file begins with this header, followed by tor_trace_record_t
+ * records.  Everything is in the byte order of the host that wrote it. */
+typedef struct tor_trace_file_header_t {
+  char magic[8]; /**< TOR_TRACE_FILE_MAGIC. */
+  uint32_t version; /**< TOR_TRACE_FILE_VERSION. */
+  uint32_t record_size; /**< sizeof(tor_trace_record_t). */
+} tor_trace_file_header_t;
+
+/** Magic string at the start of every trace file. */
+#define TOR_TRACE_FILE_MAGIC "TORTRACE"
+/** Current trace file format version. */
+#define TOR_TRACE_FILE_VERSION 1
+
+/** True iff we are recording trace events.  Don't use this directly; use
+ * tor_trace(). */
+extern int tor_trace_enabled_;
+
+/** Record an <b>event</b> with arguments <b>a</b> and <b>b</b>, if tracing
+ * is enabled.  When it isn't, this costs one well-predicted branch. */
+#define tor_trace(event, a, b) STMT_BEGIN                               \
+    if (PREDICT_UNLIKELY(tor_trace_enabled_))                           \
+      tor_trace_event_((event), (uint64_t)(a), (uint64_t)(b));         \
+  STMT_END
+
+void tor_trace_event_(uint16_t event, uint64_t a, uint64_t b);
+
+int tor_trace_start(const char *filename, unsigned n_records);
+void tor_trace_flush(void);
+void tor_trace_stop(void);
+void tor_trace_free_all(void);
+const char *tor_trace_event_name(int event);
+
+#endif
+
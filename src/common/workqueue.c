@@ -134,8 +134,8 @@ workqueue_entry_free(workqueue_entry_t *ent)
  * This function will have no effect if the worker thread has already executed
  * or begun to execute the work item.  In that case, it will return NULL.
  */
-void *
-workqueue_entry_cancel(workqueue_entry_t *ent)
+MOCK_IMPL(void *,
+workqueue_entry_cancel,(workqueue_entry_t *ent))
 {
   int cancelled = 0;
   void *result = NULL;
@@ -32,7 +32,8 @@ int threadpool_queue_update(threadpool_t *pool,
                             int (*fn)(void *, void *),
                             void (*free_fn)(void *),
                             void *arg);
-void *workqueue_entry_cancel(workqueue_entry_t *pending_work);
+MOCK_DECL(void *, workqueue_entry_cancel,
+          (workqueue_entry_t *pending_work));
 threadpool_t *threadpool_new(int n_threads,
                              replyqueue_t *replyqueue,
                              void *(*new_thread_state_fn)(void*),
@@ -0,0 +1,547 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See license at end of ht.h. */
+
+/* An open-addressing variant of ht.h.
+ *
+ * The table is an array of cache-line-sized buckets.  Each bucket holds
+ * OAHT_BUCKET_N_SLOTS element pointers, and a single 64-bit word holding a
+ * one-byte tag for every slot.  A tag is either OAHT_TAG_EMPTY_,
+ * OAHT_TAG_DELETED_, or (for a full slot) 0x80 ORed with seven bits of the
+ * element's hash.  To look an element up, we compare its tag against all of
+ * a bucket's tags at once with a little word-at-a-time arithmetic, and only
+ * call the equality function on slots whose tags match.  Usually that means
+ * one cache line touched per lookup, rather than a chain of pointers.
+ *
+ * We probe buckets linearly; removing an element leaves a tombstone only
+ * when its bucket has no empty slot, since no probe could have continued
+ * past a bucket that has ever had an empty slot.
+ *
+ * The interface is the same as ht.h's: declare the table with OAHT_HEAD,
+ * the per-element field with OAHT_ENTRY, and generate the functions with
+ * OAHT_PROTOTYPE and OAHT_GENERATE2.  After that, the usual HT_FIND(),
+ * HT_INSERT(), HT_REMOVE(), HT_START(), HT_NEXT(), HT_NEXT_RMV(),
+ * HT_CLEAR(), HT_SIZE(), and HT_FOREACH() macros all work unchanged.  The
+ * only differences are that HT_MEM_USAGE must be replaced with
+ * OAHT_MEM_USAGE, and HT_FIND_OR_INSERT_/HT_FOI_INSERT_ with
+ * OAHT_FIND_OR_INSERT_/OAHT_FOI_INSERT_.
+ *
+ * As with ht.h, the pointers returned by HT_START and HT_NEXT remain valid
+ * across removals, but not across insertions.
+ */
+
+#ifndef OAHT_H_INCLUDED_
+#define OAHT_H_INCLUDED_
+
+#include "ht.h"
+
+/** How many element slots are in each bucket?  With 8-byte pointers, seven
+ * slots and the tag word fill exactly one 64-byte cache line. */
+#define OAHT_BUCKET_N_SLOTS 7
+/** Alignment to use for the bucket array. */
+#define OAHT_CACHE_LINE_ 64
+/** Smallest and largest number of buckets we'll use, as powers of two. */
+#define OAHT_MIN_LOG2_LENGTH_ 2
+#define OAHT_MAX_LOG2_LENGTH_ 26
+
+#define OAHT_HEAD(name, type)                                           \
+  struct name {                                                         \
+    /* The buckets of the hash table, aligned to a cache line. */       \
+    struct name##_oaht_bucket {                                         \
+      /* One tag byte per slot; the top byte is unused and always 0. */ \
+      uint64_t hthb_tags;                                               \
+      struct type *hthb_elts[OAHT_BUCKET_N_SLOTS];                      \
+    } *hth_table;                                                       \
+    /* The allocation holding hth_table. */                             \
+    void *hth_table_mem;                                                \
+    /* How many buckets are there?  Always a power of two. */           \
+    unsigned hth_table_length;                                          \
+    /* How many elements does the table contain? */                     \
+    unsigned hth_n_entries;                                             \
+    /* How many slots are full or hold tombstones? */                   \
+    unsigned hth_n_used;                                                \
+    /* How many used slots will we allow before rebuilding the table? */ \
+    unsigned hth_load_limit;                                            \
+    /* log2 of hth_table_length. */                                     \
+    int hth_log2_length;                                                \
+  }
+
+#define OAHT_INITIALIZER()                      \
+  { NULL, NULL, 0, 0, 0, 0, 0 }
+
+/* Open addressing never chains elements, so we only need to cache the
+ * hash. */
+#define OAHT_ENTRY(type)                        \
+  struct {                                      \
+    unsigned hte_hash;                          \
+  }
+
+/* Return memory usage for a hashtable (not counting the entries themselves) */
+#define OAHT_MEM_USAGE(head)                                            \
+  (sizeof(*head) + ((head)->hth_table_mem ?                             \
+     (head)->hth_table_length * sizeof(*(head)->hth_table) +            \
+       OAHT_CACHE_LINE_ : 0))
+
+#define OAHT_TAG_EMPTY_   0x00
+#define OAHT_TAG_DELETED_ 0x01
+/** Return the tag for a full slot holding an element with hash <b>h</b>. */
+#define OAHT_TAG_(h) ((uint8_t)(0x80 | ((h) & 0x7f)))
+
+/** Helper: the high bit of every byte that corresponds to a slot. */
+#define OAHT_HIGH_BITS_ U64_LITERAL(0x0080808080808080)
+/** Helper: the low seven bits of every byte. */
+#define OAHT_LOW_BITS_  U64_LITERAL(0x7f7f7f7f7f7f7f7f)
+/** Helper: <b>b</b> repeated in every slot's byte. */
+#define OAHT_REPEAT_(b) (U64_LITERAL(0x0001010101010101) * (uint8_t)(b))
+
+/** Return a word with the high bit set in each slot's byte of <b>tags</b>
+ * that is equal to <b>tag</b>, and all other bits clear.  (This is the exact
+ * form of the "does this word contain a zero byte" trick: it has no false
+ * positives.) */
+static INLINE uint64_t
+oaht_match_tag_(uint64_t tags, uint8_t tag)
+{
+  uint64_t x = tags ^ OAHT_REPEAT_(tag);
+  return ~(((x & OAHT_LOW_BITS_) + OAHT_LOW_BITS_) | x | OAHT_LOW_BITS_)
+    & OAHT_HIGH_BITS_;
+}
+/** As oaht_match_tag_(), but match slots that are full. */
+static INLINE uint64_t
+oaht_match_full_(uint64_t tags)
+{
+  return tags & OAHT_HIGH_BITS_;
+}
+/** As oaht_match_tag_(), but match slots that are empty or deleted. */
+static INLINE uint64_t
+oaht_match_free_(uint64_t tags)
+{
+  return ~tags & OAHT_HIGH_BITS_;
+}
+/** Given a nonzero match word, return the index of the first slot that
+ * matched. */
+static INLINE unsigned
+oaht_first_slot_(uint64_t match)
+{
+#if defined(__GNUC__) && __GNUC__ >= 4
+  return ((unsigned)__builtin_ctzll(match)) >> 3;
+#else
+  unsigned i = 0;
+  while (!(match & 0x80)) {
+    match >>= 8;
+    ++i;
+  }
+  return i;
+#endif
+}
+/** Return the number of the first bucket to probe for hash <b>h</b>.  We
+ * use Fibonacci hashing to pick a bucket from the high bits, so that weak
+ * hash functions don't cluster in a power-of-two table. */
+#define OAHT_BUCKET_NUM_(head, h)                                       \
+  ((unsigned)(((uint32_t)(h) * (uint32_t)2654435769u) >>                \
+              (32 - (head)->hth_log2_length)))
+/** Return the number of the bucket holding slot <b>p</b>. */
+#define OAHT_SLOT_BUCKET_(head, p)                                      \
+  ((unsigned)(((const char *)(p) - (const char *)(head)->hth_table) /   \
+              sizeof(*(head)->hth_table)))
+/** Return the position of slot <b>p</b> within bucket <b>b</b>. */
+#define OAHT_SLOT_IDX_(head, b, p)                                      \
+  ((unsigned)((p) - (head)->hth_table[(b)].hthb_elts))
+/** Set the tag for slot number <b>idx</b> in <b>tagword</b> to <b>tag</b>. */
+#define OAHT_SET_TAG_(tagword, idx, tag)                                \
+  do {                                                                  \
+    const unsigned oaht_shift_ = 8 * (idx);                             \
+    (tagword) = ((tagword) & ~(U64_LITERAL(0xff) << oaht_shift_)) |     \
+      (((uint64_t)(tag)) << oaht_shift_);                               \
+  } while (0)
+/** Return the tag for slot number <b>idx</b> in <b>tagword</b>. */
+#define OAHT_GET_TAG_(tagword, idx)                                     \
+  ((uint8_t)((tagword) >> (8 * (idx))))
+
+#define OAHT_PROTOTYPE(name, type, field, hashfn, eqfn)                 \
+  int name##_HT_GROW(struct name *ht, unsigned min_capacity);           \
+  void name##_HT_CLEAR(struct name *ht);                                \
+  int name##_HT_REP_IS_BAD_(const struct name *ht);                     \
+  static INLINE void                                                    \
+  name##_HT_INIT(struct name *head) {                                   \
+    head->hth_table = NULL;                                             \
+    head->hth_table_mem = NULL;                                         \
+    head->hth_table_length = 0;                                         \
+    head->hth_n_entries = 0;                                            \
+    head->hth_n_used = 0;                                               \
+    head->hth_load_limit = 0;                                           \
+    head->hth_log2_length = 0;                                          \
+  }                                                                     \
+  /* Helper: return a pointer to the slot in 'head' holding an element  \
+   * matching 'elm', or NULL if there is none.  The hash of 'elm' must  \
+   * already be set. */                                                 \
+  static INLINE struct type **                                          \
+  name##_OAHT_LOOKUP_P_(const struct name *head, struct type *elm)      \
+  {                                                                     \
+    const unsigned h = elm->field.hte_hash;                             \
+    const uint8_t tag = OAHT_TAG_(h);                                   \
+    const unsigned mask = head->hth_table_length - 1;                   \
+    unsigned b;                                                         \
+    if (!head->hth_table)                                               \
+      return NULL;                                                      \
+    b = OAHT_BUCKET_NUM_(head, h);                                      \
+    for (;;) {                                                          \
+      struct name##_oaht_bucket *bkt = &head->hth_table[b];             \
+      const uint64_t tags = bkt->hthb_tags;                             \
+      uint64_t m = oaht_match_tag_(tags, tag);                          \
+      while (m) {                                                       \
+        struct type **p = &bkt->hthb_elts[oaht_first_slot_(m)];         \
+        if (eqfn(*p, elm))                                              \
+          return p;                                                     \
+        m &= m - 1;                                                     \
+      }                                                                 \
+      if (oaht_match_tag_(tags, OAHT_TAG_EMPTY_))                       \
+        return NULL;                                                    \
+      b = (b + 1) & mask;                                               \
+    }                                                                   \
+  }                                                                     \
+  /* Helper: returns a pointer to the right location in the table       \
+   * 'head' to find or insert the element 'elm'.  The hash of 'elm'     \
+   * must already be set. */                                            \
+  static INLINE struct type **                                          \
+  name##_HT_FIND_P_(struct name *head, struct type *elm)                \
+  {                                                                     \
+    const unsigned h = elm->field.hte_hash;                             \
+    const uint8_t tag = OAHT_TAG_(h);                                   \
+    const unsigned mask = head->hth_table_length - 1;                   \
+    struct type **insert_at = NULL;                                     \
+    unsigned b;                                                         \
+    if (!head->hth_table)                                               \
+      return NULL;                                                      \
+    b = OAHT_BUCKET_NUM_(head, h);                                      \
+    for (;;) {                                                          \
+      struct name##_oaht_bucket *bkt = &head->hth_table[b];             \
+      const uint64_t tags = bkt->hthb_tags;                             \
+      uint64_t m = oaht_match_tag_(tags, tag);                          \
+      while (m) {                                                       \
+        struct type **p = &bkt->hthb_elts[oaht_first_slot_(m)];         \
+        if (eqfn(*p, elm))                                              \
+          return p;                                                     \
+        m &= m - 1;                                                     \
+      }                                                                 \
+      if (!insert_at && (m = oaht_match_free_(tags)))                   \
+        insert_at = &bkt->hthb_elts[oaht_first_slot_(m)];               \
+      if (oaht_match_tag_(tags, OAHT_TAG_EMPTY_))                       \
+        return insert_at;                                               \
+      b = (b + 1) & mask;                                               \
+    }                                                                   \
+  }                                                                     \
+  /* Helper: store 'elm' in the free slot 'p' of 'head'.  The hash of   \
+   * 'elm' must already be set. */                                      \
+  static INLINE void                                                    \
+  name##_OAHT_FILL_SLOT_(struct name *head, struct type **p,            \
+                         struct type *elm)                              \
+  {                                                                     \
+    const unsigned b = OAHT_SLOT_BUCKET_(head, p);                      \
+    const unsigned idx = OAHT_SLOT_IDX_(head, b, p);                    \
+    uint64_t *tags = &head->hth_table[b].hthb_tags;                     \
+    if (OAHT_GET_TAG_(*tags, idx) == OAHT_TAG_EMPTY_)                   \
+      ++head->hth_n_used;                                               \
+    OAHT_SET_TAG_(*tags, idx, OAHT_TAG_(elm->field.hte_hash));          \
+    *p = elm;                                                           \
+    ++head->hth_n_entries;                                              \
+  }                                                                     \
+  /* Helper: remove whatever element is in the full slot 'p' of 'head'. \
+   * We only need a tombstone if some probe might have continued past   \
+   * this bucket, which can only happen if it has no empty slot. */     \
+  static INLINE void                                                    \
+  name##_OAHT_CLEAR_SLOT_(struct name *head, struct type **p)           \
+  {                                                                     \
+    const unsigned b = OAHT_SLOT_BUCKET_(head, p);                      \
+    const unsigned idx = OAHT_SLOT_IDX_(head, b, p);                    \
+    uint64_t *tags = &head->hth_table[b].hthb_tags;                     \
+    if (oaht_match_tag_(*tags, OAHT_TAG_EMPTY_)) {                      \
+      OAHT_SET_TAG_(*tags, idx, OAHT_TAG_EMPTY_);                       \
+      --head->hth_n_used;                                               \
+    } else {                                                            \
+      OAHT_SET_TAG_(*tags, idx, OAHT_TAG_DELETED_);                     \
+    }                                                                   \
+    *p = NULL;                                                          \
+    --head->hth_n_entries;                                              \
+  }                                                                     \
+  /* Helper: return the first full slot in 'head' at or after slot      \
+   * 'idx' of bucket 'b', or NULL if there is none. */                  \
+  static INLINE struct type **                                          \
+  name##_OAHT_SCAN_(struct name *head, unsigned b, unsigned idx)        \
+  {                                                                     \
+    uint64_t m;                                                         \
+    if (b >= head->hth_table_length)                                    \
+      return NULL;                                                      \
+    m = oaht_match_full_(head->hth_table[b].hthb_tags) &                \
+      ~((U64_LITERAL(1) << (8 * idx)) - 1);                             \
+    while (!m) {                                                        \
+      if (++b >= head->hth_table_length)                                \
+        return NULL;                                                    \
+      m = oaht_match_full_(head->hth_table[b].hthb_tags);               \
+    }                                                                   \
+    return &head->hth_table[b].hthb_elts[oaht_first_slot_(m)];          \
+  }                                                                     \
+  /* Return a pointer to the element in the table 'head' matching 'elm', \
+   * or NULL if no such element exists */                               \
+  ATTR_UNUSED static INLINE struct type *                               \
+  name##_HT_FIND(const struct name *head, struct type *elm)             \
+  {                                                                     \
+    struct type **p;                                                    \
+    elm->field.hte_hash = hashfn(elm);                                  \
+    p = name##_OAHT_LOOKUP_P_(head, elm);                               \
+    return p ? *p : NULL;                                               \
+  }                                                                     \
+  /* Insert the element 'elm' into the table 'head'.  Do not call this  \
+   * function if the table might already contain a matching element. */ \
+  ATTR_UNUSED static INLINE void                                        \
+  name##_HT_INSERT(struct name *head, struct type *elm)                 \
+  {                                                                     \
+    unsigned b;                                                         \
+    uint64_t m;                                                         \
+    if (!head->hth_table || head->hth_n_used >= head->hth_load_limit)   \
+      name##_HT_GROW(head, head->hth_n_entries+1);                      \
+    elm->field.hte_hash = hashfn(elm);                                  \
+    b = OAHT_BUCKET_NUM_(head, elm->field.hte_hash);                    \
+    while (!(m = oaht_match_free_(head->hth_table[b].hthb_tags)))       \
+      b = (b + 1) & (head->hth_table_length - 1);                       \
+    name##_OAHT_FILL_SLOT_(head,                                        \
+                   &head->hth_table[b].hthb_elts[oaht_first_slot_(m)],  \
+                   elm);                                                \
+  }                                                                     \
+  /* Insert the element 'elm' into the table 'head'. If there already   \
+   * a matching element in the table, replace that element and return   \
+   * it. */                                                             \
+  ATTR_UNUSED static INLINE struct type *                               \
+  name##_HT_REPLACE(struct name *head, struct type *elm)                \
+  {                                                                     \
+    struct type **p, *r;                                                \
+    if (!head->hth_table || head->hth_n_used >= head->hth_load_limit)   \
+      name##_HT_GROW(head, head->hth_n_entries+1);                      \
+    elm->field.hte_hash = hashfn(elm);                                  \
+    p = name##_HT_FIND_P_(head, elm);                                   \
+    r = *p;                                                             \
+    if (r) {                                                            \
+      *p = elm;                                                         \
+      return (r == elm) ? NULL : r;                                     \
+    }                                                                   \
+    name##_OAHT_FILL_SLOT_(head, p, elm);                               \
+    return NULL;                                                        \
+  }                                                                     \
+  /* Remove any element matching 'elm' from the table 'head'.  If such  \
+   * an element is found, return it; otherwise return NULL. */          \
+  ATTR_UNUSED static INLINE struct type *                               \
+  name##_HT_REMOVE(struct name *head, struct type *elm)                 \
+  {                                                                     \
+    struct type **p, *r;                                                \
+    elm->field.hte_hash = hashfn(elm);                                  \
+    p = name##_OAHT_LOOKUP_P_(head, elm);                               \
+    if (!p)                                                             \
+      return NULL;                                                      \
+    r = *p;                                                             \
+    name##_OAHT_CLEAR_SLOT_(head, p);                                   \
+    return r;                                                           \
+  }                                                                     \
+  /* Invoke the function 'fn' on every element of the table 'head',     \
+   * using 'data' as its second argument.  If the function returns      \
+   * nonzero, remove the most recently examined element before invoking \
+   * the function again. */                                             \
+  ATTR_UNUSED static INLINE void                                        \
+  name##_HT_FOREACH_FN(struct name *head,                               \
+                       int (*fn)(struct type *, void *),                \
+                       void *data)                                      \
+  {                                                                     \
+    struct type **p;                                                    \
+    for (p = name##_OAHT_SCAN_(head, 0, 0); p != NULL; ) {              \
+      const unsigned b = OAHT_SLOT_BUCKET_(head, p);                    \
+      const unsigned idx = OAHT_SLOT_IDX_(head, b, p);                  \
+      if (fn(*p, data))                                                 \
+        name##_OAHT_CLEAR_SLOT_(head, p);                               \
+      p = name##_OAHT_SCAN_(head, b, idx + 1);                          \
+    }                                                                   \
+  }                                                                     \
+  /* Return a pointer to the first element in the table 'head', under   \
+   * an arbitrary order.  This order is stable under remove operations, \
+   * but not under others. If the table is empty, return NULL. */       \
+  ATTR_UNUSED static INLINE struct type **                              \
+  name##_HT_START(struct name *head)                                    \
+  {                                                                     \
+    return name##_OAHT_SCAN_(head, 0, 0);                               \
+  }                                                                     \
+  /* Return the next element in 'head' after 'elm', under the arbitrary \
+   * order used by HT_START.  If there are no more elements, return     \
+   * NULL.  If 'elm' is to be removed from the table, you must call     \
+   * this function for the next value before you remove it.             \
+   */                                                                   \
+  ATTR_UNUSED static INLINE struct type **                              \
+  name##_HT_NEXT(struct name *head, struct type **elm)                  \
+  {                                                                     \
+    const unsigned b = OAHT_SLOT_BUCKET_(head, elm);                    \
+    return name##_OAHT_SCAN_(head, b, OAHT_SLOT_IDX_(head, b, elm) + 1); \
+  }                                                                     \
+  ATTR_UNUSED static INLINE struct type **                              \
+  name##_HT_NEXT_RMV(struct name *head, struct type **elm)              \
+  {                                                                     \
+    const unsigned b = OAHT_SLOT_BUCKET_(head, elm);                    \
+    const unsigned idx = OAHT_SLOT_IDX_(head, b, elm);                  \
+    name##_OAHT_CLEAR_SLOT_(head, elm);                                 \
+    return name##_OAHT_SCAN_(head, b, idx + 1);                         \
+  }
+
+#define OAHT_GENERATE2(name, type, field, hashfn, eqfn, load,           \
+                       reallocarrayfn, freefn)                          \
+  /* Rebuild the table 'head' with enough room to hold at least twice   \
+   * 'size' elements, discarding any tombstones.  (This may shrink the  \
+   * table, if most of its used slots were tombstones.)  Return 0 on    \
+   * success, -1 on allocation failure. */                              \
+  int                                                                   \
+  name##_HT_GROW(struct name *head, unsigned size)                      \
+  {                                                                     \
+    int log2_len = OAHT_MIN_LOG2_LENGTH_;                               \
+    unsigned new_len, new_load_limit, b;                                \
+    void *new_mem;                                                      \
+    struct name##_oaht_bucket *new_table;                               \
+    for (;;) {                                                          \
+      new_len = 1u << log2_len;                                         \
+      new_load_limit =                                                  \
+        (unsigned)(load * new_len * OAHT_BUCKET_N_SLOTS);               \
+      if (new_load_limit / 2 >= size ||                                 \
+          log2_len == OAHT_MAX_LOG2_LENGTH_)                            \
+        break;                                                          \
+      ++log2_len;                                                       \
+    }                                                                   \
+    if (new_load_limit <= size)                                         \
+      return -1;                                                        \
+    new_mem = reallocarrayfn(NULL,                                      \
+                  new_len * sizeof(struct name##_oaht_bucket) +         \
+                  OAHT_CACHE_LINE_, 1);                                 \
+    if (!new_mem)                                                       \
+      return -1;                                                        \
+    new_table = (struct name##_oaht_bucket *)                           \
+      (((uintptr_t)new_mem + OAHT_CACHE_LINE_ - 1) &                    \
+       ~(uintptr_t)(OAHT_CACHE_LINE_ - 1));                             \
+    memset(new_table, 0, new_len * sizeof(struct name##_oaht_bucket));  \
+    for (b = 0; b < head->hth_table_length; ++b) {                      \
+      struct name##_oaht_bucket *old = &head->hth_table[b];             \
+      uint64_t m = oaht_match_full_(old->hthb_tags);                    \
+      while (m) {                                                       \
+        struct type *elm = old->hthb_elts[oaht_first_slot_(m)];         \
+        const unsigned h = elm->field.hte_hash;                         \
+        unsigned b2 = (unsigned)(((uint32_t)h * (uint32_t)2654435769u)  \
+                                 >> (32 - log2_len));                   \
+        uint64_t f;                                                     \
+        while (!(f = oaht_match_free_(new_table[b2].hthb_tags)))        \
+          b2 = (b2 + 1) & (new_len - 1);                                \
+        OAHT_SET_TAG_(new_table[b2].hthb_tags, oaht_first_slot_(f),     \
+                      OAHT_TAG_(h));                                    \
+        new_table[b2].hthb_elts[oaht_first_slot_(f)] = elm;             \
+        m &= m - 1;                                                     \
+      }                                                                 \
+    }                                                                   \
+    if (head->hth_table_mem)                                            \
+      freefn(head->hth_table_mem);                                      \
+    head->hth_table_mem = new_mem;                                      \
+    head->hth_table = new_table;                                        \
+    head->hth_table_length = new_len;                                   \
+    head->hth_log2_length = log2_len;                                   \
+    head->hth_load_limit = new_load_limit;                              \
+    head->hth_n_used = head->hth_n_entries;                             \
+    return 0;                                                           \
+  }                                                                     \
+  /* Free all storage held by 'head'.  Does not free 'head' itself, or  \
+   * individual elements. */                                            \
+  void                                                                  \
+  name##_HT_CLEAR(struct name *head)                                    \
+  {                                                                     \
+    if (head->hth_table_mem)                                            \
+      freefn(head->hth_table_mem);                                      \
+    name##_HT_INIT(head);                                               \
+  }                                                                     \
+  /* Debugging helper: return false iff the representation of 'head' is \
+   * internally consistent. */                                          \
+  int                                                                   \
+  name##_HT_REP_IS_BAD_(const struct name *head)                        \
+  {                                                                     \
+    unsigned n_full, n_deleted, b, idx;                                 \
+    if (!head->hth_table_length) {                                      \
+      if (!head->hth_table && !head->hth_table_mem &&                   \
+          !head->hth_n_entries && !head->hth_n_used &&                  \
+          !head->hth_load_limit)                                        \
+        return 0;                                                       \
+      else                                                              \
+        return 1;                                                       \
+    }                                                                   \
+    if (!head->hth_table || !head->hth_table_mem ||                     \
+        !head->hth_load_limit)                                          \
+      return 2;                                                         \
+    if (head->hth_n_used > head->hth_load_limit ||                      \
+        head->hth_n_entries > head->hth_n_used)                         \
+      return 3;                                                         \
+    if (head->hth_table_length != (1u << head->hth_log2_length))        \
+      return 4;                                                         \
+    if (head->hth_load_limit != (unsigned)(load *                       \
+               head->hth_table_length * OAHT_BUCKET_N_SLOTS))           \
+      return 5;                                                         \
+    if (((uintptr_t)head->hth_table) & (OAHT_CACHE_LINE_ - 1))          \
+      return 6;                                                         \
+    for (n_full = n_deleted = b = 0; b < head->hth_table_length; ++b) { \
+      const struct name##_oaht_bucket *bkt = &head->hth_table[b];       \
+      if (bkt->hthb_tags & ~U64_LITERAL(0x00ffffffffffffff))           \
+        return 1000 + b;                                                \
+      for (idx = 0; idx < OAHT_BUCKET_N_SLOTS; ++idx) {                 \
+        const uint8_t tag = OAHT_GET_TAG_(bkt->hthb_tags, idx);         \
+        struct type *elm = bkt->hthb_elts[idx];                         \
+        if (tag == OAHT_TAG_EMPTY_ || tag == OAHT_TAG_DELETED_) {       \
+          if (elm)                                                      \
+            return 10000 + b;                                           \
+          if (tag == OAHT_TAG_DELETED_)                                 \
+            ++n_deleted;                                                \
+          continue;                                                     \
+        }                                                               \
+        if (!elm || elm->field.hte_hash != hashfn(elm) ||               \
+            tag != OAHT_TAG_(elm->field.hte_hash))                      \
+          return 100000 + b;                                            \
+        if (name##_OAHT_LOOKUP_P_(head, elm) !=                         \
+            &bkt->hthb_elts[idx])                                       \
+          return 1000000 + b;                                           \
+        ++n_full;                                                       \
+      }                                                                 \
+    }                                                                   \
+    if (n_full != head->hth_n_entries)                                  \
+      return 7;                                                         \
+    if (n_full + n_deleted != head->hth_n_used)                         \
+      return 8;                                                         \
+    return 0;                                                           \
+  }
+
+/** As HT_FIND_OR_INSERT_, for a table declared with OAHT_HEAD. */
+#define OAHT_FIND_OR_INSERT_(name, field, hashfn, head, eltype, elm, var, \
+                             y, n)                                      \
+  {                                                                     \
+    struct name *var##_head_ = head;                                    \
+    struct eltype **var;                                                \
+    if (!var##_head_->hth_table ||                                      \
+        var##_head_->hth_n_used >= var##_head_->hth_load_limit)         \
+      name##_HT_GROW(var##_head_, var##_head_->hth_n_entries+1);        \
+    (elm)->field.hte_hash = hashfn(elm);                                \
+    var = name##_HT_FIND_P_(var##_head_, (elm));                        \
+    if (*var) {                                                         \
+      y;                                                                \
+    } else {                                                            \
+      n;                                                                \
+    }                                                                   \
+  }
+/** As HT_FOI_INSERT_, for a table declared with OAHT_HEAD. */
+#define OAHT_FOI_INSERT_(field, head, elm, newent, var)                 \
+  {                                                                     \
+    const unsigned var##_b_ = OAHT_SLOT_BUCKET_(head, var);             \
+    const unsigned var##_idx_ = OAHT_SLOT_IDX_(head, var##_b_, var);    \
+    uint64_t *var##_tags_ = &(head)->hth_table[var##_b_].hthb_tags;     \
+    if (OAHT_GET_TAG_(*var##_tags_, var##_idx_) == OAHT_TAG_EMPTY_)     \
+      ++((head)->hth_n_used);                                           \
+    OAHT_SET_TAG_(*var##_tags_, var##_idx_,                             \
+                  OAHT_TAG_((elm)->field.hte_hash));                    \
+    (newent)->field.hte_hash = (elm)->field.hte_hash;                   \
+    *var = newent;                                                      \
+    ++((head)->hth_n_entries);                                          \
+  }
+
+#endif
+
@@ -20,8 +20,10 @@
 #include "control.h"
 #include "reasons.h"
 #include "ext_orport.h"
+#include "metrics.h"
 #include "util.h"
 #include "torlog.h"
+#include "trace.h"
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -656,6 +658,39 @@ flush_chunk(tor_socket_t s, buf_t *buf, chunk_t *chunk, size_t sz,
   }
 }
 
+static INLINE void peek_from_buf(char *string, size_t string_len,
+                                 const buf_t *buf);
+
+/** Helper for flush_buf_tls(): try to write the <b>sz</b> bytes at
+ * <b>data</b>, which hold the first <b>sz</b> bytes of <b>buf</b>, to
+ * <b>tls</b>.  On success, remove the bytes written from <b>buf</b> and
+ * deduct them from *<b>buf_flushlen</b>.  Return the number of bytes
+ * written on success, and a TOR_TLS error code on failure or blocking.
+ */
+static INLINE int
+flush_data_tls(tor_tls_t *tls, buf_t *buf, const char *data,
+               size_t sz, size_t *buf_flushlen)
+{
+  int r;
+
+  r = tor_tls_write(tls, data, sz);
+  if (r < 0)
+    return r;
+  if (r > 0) {
+    metrics_add(METRICS_TLS_RECORDS_WRITTEN,
+                CEIL_DIV((size_t)r, TOR_TLS_MAX_RECORD_PAYLOAD));
+    metrics_add(METRICS_TLS_RECORD_BYTES_WRITTEN, r);
+  }
+  if (*buf_flushlen > (size_t)r)
+    *buf_flushlen -= r;
+  else
+    *buf_flushlen = 0;
+  buf_remove_from_front(buf, r);
+  log_debug(LD_NET,"flushed %d bytes, %d ready to flush, %d remain.",
+            r,(int)*buf_flushlen,(int)buf->datalen);
+  return r;
+}
+
 /** Helper for flush_buf_tls(): try to write <b>sz</b> bytes from chunk
  * <b>chunk</b> of buffer <b>buf</b> onto socket <b>s</b>.  (Tries to write
  * more if there is a forced pending write size.)  On success, deduct the
@@ -666,7 +701,6 @@ static INLINE int
 flush_chunk_tls(tor_tls_t *tls, buf_t *buf, chunk_t *chunk,
                 size_t sz, size_t *buf_flushlen)
 {
-  int r;
   size_t forced;
   char *data;
 
@@ -680,17 +714,27 @@ flush_chunk_tls(tor_tls_t *tls, buf_t *buf, chunk_t *chunk,
     data = NULL;
     tor_assert(sz == 0);
   }
-  r = tor_tls_write(tls, data, sz);
-  if (r < 0)
-    return r;
-  if (*buf_flushlen > (size_t)r)
-    *buf_flushlen -= r;
-  else
-    *buf_flushlen = 0;
-  buf_remove_from_front(buf, r);
-  log_debug(LD_NET,"flushed %d bytes, %d ready to flush, %d remain.",
-            r,(int)*buf_flushlen,(int)buf->datalen);
-  return r;
+  return flush_data_tls(tls, buf, data, sz, buf_flushlen);
+}
+
+/** Helper for flush_buf_tls(): copy the first <b>sz</b> bytes of
+ * <b>buf</b>, which span more than one chunk, and try to write them to
+ * <b>tls</b> as a single TLS record.  Return as flush_chunk_tls().
+ *
+ * If this blocks, OpenSSL wants the same bytes again next time; we copy
+ * them afresh from the front of <b>buf</b>, which is fine, since we set
+ * SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER.
+ */
+static INLINE int
+flush_record_tls(tor_tls_t *tls, buf_t *buf, size_t sz,
+                 size_t *buf_flushlen)
+{
+  static char record[TOR_TLS_MAX_RECORD_PAYLOAD];
+
+  tor_assert(sz <= sizeof(record));
+  tor_assert(sz <= buf->datalen);
+  peek_from_buf(record, sz, buf);
+  return flush_data_tls(tls, buf, record, sz, buf_flushlen);
 }
 
 /** Write data from <b>buf</b> to the socket <b>s</b>.  Write at most
@@ -731,15 +775,16 @@ flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen)
       break;
   }
   tor_assert(flushed < INT_MAX);
+  tor_trace(TRACE_EV_BUF_FLUSH, flushed, buf->datalen);
   return (int)flushed;
 }
 
 /** As flush_buf(), but writes data to a TLS connection.  Can write more than
  * <b>flushlen</b> bytes.
  */
-int
-flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
-              size_t *buf_flushlen)
+MOCK_IMPL(int,
+flush_buf_tls,(tor_tls_t *tls, buf_t *buf, size_t flushlen,
+               size_t *buf_flushlen))
 {
   int r;
   size_t flushed = 0;
@@ -755,17 +800,26 @@ flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
 
   check();
   do {
-    size_t flushlen0;
-    if (buf->head) {
-      if ((ssize_t)buf->head->datalen >= sz)
-        flushlen0 = sz;
-      else
-        flushlen0 = buf->head->datalen;
+    size_t flushlen0, record_len;
+    /* Cells often sit in several small chunks; copy up to a full record's
+     * worth of them together rather than writing one short record per
+     * chunk. */
+    record_len = MIN((size_t)sz, TOR_TLS_MAX_RECORD_PAYLOAD);
+    record_len = MAX(record_len, tor_tls_get_forced_write_size(tls));
+    if (buf->head && buf->head->datalen < record_len) {
+      r = flush_record_tls(tls, buf, record_len, buf_flushlen);
     } else {
-      flushlen0 = 0;
-    }
+      if (buf->head) {
+        if ((ssize_t)buf->head->datalen >= sz)
+          flushlen0 = sz;
+        else
+          flushlen0 = buf->head->datalen;
+      } else {
+        flushlen0 = 0;
+      }
 
-    r = flush_chunk_tls(tls, buf, buf->head, flushlen0, buf_flushlen);
+      r = flush_chunk_tls(tls, buf, buf->head, flushlen0, buf_flushlen);
+    }
     check();
     if (r < 0)
       return r;
@@ -775,6 +829,7 @@ flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
       break;
   } while (sz > 0);
   tor_assert(flushed < INT_MAX);
+  tor_trace(TRACE_EV_BUF_FLUSH_TLS, flushed, buf->datalen);
   return (int)flushed;
 }
 
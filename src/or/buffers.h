@@ -33,7 +33,8 @@ int read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
 int read_to_buf_tls(tor_tls_t *tls, size_t at_most, buf_t *buf);
 
 int flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen);
-int flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t sz, size_t *buf_flushlen);
+MOCK_DECL(int, flush_buf_tls, (tor_tls_t *tls, buf_t *buf, size_t sz,
+                                size_t *buf_flushlen));
 
 int write_to_buf(const char *string, size_t string_len, buf_t *buf);
 int write_to_buf_zlib(buf_t *buf, tor_zlib_state_t *state,
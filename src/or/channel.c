@@ -33,6 +33,7 @@
 #include "router.h"
 #include "routerlist.h"
 #include "scheduler.h"
+#include "trace.h"
 
 /* Global lists of channels */
 
@@ -1794,6 +1795,7 @@ channel_write_cell_queue_entry(channel_t *chan, cell_queue_entry_t *q)
      * used the stack.
      */
     tmp = cell_queue_entry_dup(q);
+    tmp->inserted_usec = cell_latency_timestamp();
     TOR_SIMPLEQ_INSERT_TAIL(&chan->outgoing_queue, tmp, next);
     /* Update global counters */
     ++n_channel_cells_queued;
@@ -1806,6 +1808,9 @@ channel_write_cell_queue_entry(channel_t *chan, cell_queue_entry_t *q)
     /* Try to process the queue? */
     if (CHANNEL_IS_OPEN(chan)) channel_flush_cells(chan);
   }
+
+  tor_trace(TRACE_EV_CHANNEL_WRITE_CELL, chan->global_identifier,
+            chan->bytes_in_queue);
 }
 
 /**
@@ -2386,6 +2391,9 @@ channel_flush_some_cells_from_outgoing_queue(channel_t *chan,
           channel_assert_counter_consistency();
           /* Update the channel's queue size too */
           chan->bytes_in_queue -= cell_size;
+          if (handed_off)
+            rep_hist_note_cell_latency(CELL_LATENCY_CHANNEL_QUEUE,
+                                       q->inserted_usec);
           /* Finally, free q */
           cell_queue_entry_free(q, handed_off);
           q = NULL;
@@ -376,6 +376,8 @@ struct cell_queue_entry_s {
       packed_cell_t *packed_cell;
     } packed;
   } u;
+  /** When this entry was queued, as returned by cell_latency_timestamp(). */
+  uint32_t inserted_usec;
 };
 
 /* Cell queue functions for benefit of test suite */
@@ -25,6 +25,7 @@
 #include "connection_or.h"
 #include "control.h"
 #include "link_handshake.h"
+#include "metrics.h"
 #include "relay.h"
 #include "rephist.h"
 #include "router.h"
@@ -805,6 +806,9 @@ channel_tls_write_packed_cell_method(channel_t *chan,
   if (tlschan->conn) {
     connection_write_to_buf(packed_cell->body, cell_network_size,
                             TO_CONN(tlschan->conn));
+    connection_or_note_cell_queued(tlschan->conn);
+    metrics_note_cell_sent(packed_cell_get_command(packed_cell,
+                                                   chan->wide_circ_ids));
 
     /* This is where the cell is finished; used to be done from relay.c */
     packed_cell_free(packed_cell);
@@ -1043,6 +1047,8 @@ channel_tls_handle_cell(cell_t *cell, or_connection_t *conn)
   if (conn->base_.marked_for_close)
     return;
 
+  metrics_note_cell_received(cell->command);
+
   /* Reject all but VERSIONS and NETINFO when handshaking. */
   /* (VERSIONS should actually be impossible; it's variable-length.) */
   if (handshaking && cell->command != CELL_VERSIONS &&
@@ -1150,6 +1156,8 @@ channel_tls_handle_var_cell(var_cell_t *var_cell, or_connection_t *conn)
   if (TO_CONN(conn)->marked_for_close)
     return;
 
+  metrics_note_cell_received(var_cell->command);
+
   switch (TO_CONN(conn)->state) {
     case OR_CONN_STATE_OR_HANDSHAKING_V2:
       if (var_cell->command != CELL_VERSIONS) {
@@ -1978,13 +1986,21 @@ channel_tls_process_auth_challenge_cell(var_cell_t *cell, channel_tls_t *chan)
   }
 
   if (use_type >= 0) {
+    int r;
     log_info(LD_OR,
              "Got an AUTH_CHALLENGE cell from %s:%d: Sending "
              "authentication",
              safe_str(chan->conn->base_.address),
              chan->conn->base_.port);
 
-    if (connection_or_send_authenticate_cell(chan->conn, use_type) < 0) {
+    r = connection_or_queue_authenticate_cell(chan->conn, use_type);
+    if (r > 0) {
+      /* The AUTHENTICATE and NETINFO cells go out once a worker thread has
+       * signed the former. */
+      goto done;
+    }
+    if (r < 0 ||
+        connection_or_send_authenticate_cell(chan->conn, use_type) < 0) {
       log_warn(LD_OR,
                "Couldn't send authenticate cell");
       connection_or_close_for_error(chan->conn, 0);
@@ -22,6 +22,7 @@
 #include "connection_or.h"
 #include "control.h"
 #include "main.h"
+#include "metrics.h"
 #include "networkstatus.h"
 #include "nodelist.h"
 #include "onion.h"
@@ -35,6 +36,8 @@
 #include "routerset.h"
 
 #include "ht.h"
+#include "oaht.h"
+#include "mempool.h"
 
 /********* START VARIABLES **********/
 
@@ -44,6 +47,14 @@ static smartlist_t *global_circuitlist = NULL;
 /** A list of all the circuits in CIRCUIT_STATE_CHAN_WAIT. */
 static smartlist_t *circuits_pending_chans = NULL;
 
+/** Pools from which we allocate origin_circuit_t, or_circuit_t, and
+ * crypt_path_t objects.  Circuits and hops are created and destroyed at a
+ * high rate on a busy relay, so we keep them in per-type pools rather than
+ * going to the general-purpose allocator each time. */
+static mp_pool_t *origin_circuit_pool = NULL;
+static mp_pool_t *or_circuit_pool = NULL;
+static mp_pool_t *crypt_path_pool = NULL;
+
 static void circuit_free_cpath_node(crypt_path_t *victim);
 static void cpath_ref_decref(crypt_path_reference_t *cpath_ref);
 //static void circuit_set_rend_token(or_circuit_t *circ, int is_rend_circ,
@@ -55,7 +66,7 @@ static void circuit_clear_rend_token(or_circuit_t *circ);
 /** A map from channel and circuit ID to circuit.  (Lookup performance is
  * very important here, since we need to do it every time a cell arrives.) */
 typedef struct chan_circid_circuit_map_t {
-  HT_ENTRY(chan_circid_circuit_map_t) node;
+  OAHT_ENTRY(chan_circid_circuit_map_t) node;
   channel_t *chan;
   circid_t circ_id;
   circuit_t *circuit;
@@ -89,14 +100,15 @@ chan_circid_entry_hash_(chan_circid_circuit_map_t *a)
   return (unsigned) siphash24g(array, sizeof(array));
 }
 
-/** Map from [chan,circid] to circuit. */
-static HT_HEAD(chan_circid_map, chan_circid_circuit_map_t)
-     chan_circid_map = HT_INITIALIZER();
-HT_PROTOTYPE(chan_circid_map, chan_circid_circuit_map_t, node,
-             chan_circid_entry_hash_, chan_circid_entries_eq_)
-HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
-             chan_circid_entry_hash_, chan_circid_entries_eq_, 0.6,
-             tor_reallocarray_, tor_free_)
+/** Map from [chan,circid] to circuit.  We use an open-addressing table
+ * here, since a lookup then usually touches a single cache line. */
+static OAHT_HEAD(chan_circid_map, chan_circid_circuit_map_t)
+     chan_circid_map = OAHT_INITIALIZER();
+OAHT_PROTOTYPE(chan_circid_map, chan_circid_circuit_map_t, node,
+               chan_circid_entry_hash_, chan_circid_entries_eq_)
+OAHT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
+               chan_circid_entry_hash_, chan_circid_entries_eq_, 0.75,
+               tor_reallocarray_, tor_free_)
 
 /** The most recently returned entry from circuit_get_by_circid_chan;
  * used to improve performance when many cells arrive in a row from the
@@ -701,7 +713,11 @@ origin_circuit_new(void)
    * controller */
   static uint32_t n_circuits_allocated = 1;
 
-  circ = tor_malloc_zero(sizeof(origin_circuit_t));
+  if (PREDICT_UNLIKELY(!origin_circuit_pool))
+    origin_circuit_pool = mp_pool_new("origin_circuit_t",
+                                      sizeof(origin_circuit_t), 0);
+  circ = mp_pool_get(origin_circuit_pool);
+  memset(circ, 0, sizeof(origin_circuit_t));
   circ->base_.magic = ORIGIN_CIRCUIT_MAGIC;
 
   circ->next_stream_id = crypto_rand_int(1<<16);
@@ -724,7 +740,10 @@ or_circuit_new(circid_t p_circ_id, channel_t *p_chan)
   /* CircIDs */
   or_circuit_t *circ;
 
-  circ = tor_malloc_zero(sizeof(or_circuit_t));
+  if (PREDICT_UNLIKELY(!or_circuit_pool))
+    or_circuit_pool = mp_pool_new("or_circuit_t", sizeof(or_circuit_t), 0);
+  circ = mp_pool_get(or_circuit_pool);
+  memset(circ, 0, sizeof(or_circuit_t));
   circ->base_.magic = OR_CIRCUIT_MAGIC;
 
   if (p_chan)
@@ -787,10 +806,7 @@ circuit_free(circuit_t *circ)
 
     should_free = (ocirc->workqueue_entry == NULL);
 
-    crypto_cipher_free(ocirc->p_crypto);
-    crypto_digest_free(ocirc->p_digest);
-    crypto_cipher_free(ocirc->n_crypto);
-    crypto_digest_free(ocirc->n_digest);
+    relay_crypto_clear(&ocirc->crypto);
 
     circuit_clear_rend_token(ocirc);
 
@@ -831,7 +847,7 @@ circuit_free(circuit_t *circ)
 
   if (should_free) {
     memwipe(mem, 0xAA, memlen); /* poison memory */
-    tor_free(mem);
+    mp_pool_release(mem);
   } else {
     /* If we made it here, this is an or_circuit_t that still has a pending
      * cpuworker request which we weren't able to cancel.  Instead, set up
@@ -843,6 +859,82 @@ circuit_free(circuit_t *circ)
   }
 }
 
+/** Release the memory held by <b>circ</b>, an or_circuit_t that
+ * circuit_free() left behind with DEAD_CIRCUIT_MAGIC because it still had a
+ * pending cpuworker request. */
+void
+or_circuit_free_dead(or_circuit_t *circ)
+{
+  tor_assert(circ->base_.magic == DEAD_CIRCUIT_MAGIC);
+  circ->base_.magic = 0;
+  mp_pool_release(circ);
+}
+
+/** Allocate and return a new, zeroed crypt_path_t with its magic number
+ * set.  Release it with circuit_free_cpath_node() or circuit_clear_cpath(). */
+crypt_path_t *
+crypt_path_new(void)
+{
+  crypt_path_t *cpath;
+  if (PREDICT_UNLIKELY(!crypt_path_pool))
+    crypt_path_pool = mp_pool_new("crypt_path_t", sizeof(crypt_path_t), 0);
+  cpath = mp_pool_get(crypt_path_pool);
+  memset(cpath, 0, sizeof(crypt_path_t));
+  cpath->magic = CRYPT_PATH_MAGIC;
+  return cpath;
+}
+
+/** Helper: log the occupancy of <b>pool</b> at <b>severity</b>, if it has
+ * been created. */
+static void
+circuit_pool_log_status(mp_pool_t *pool, int severity)
+{
+  if (pool)
+    mp_pool_log_status(pool, severity);
+}
+
+/** Log current statistics for the circuit and crypt_path pools at log level
+ * <b>severity</b>. */
+void
+dump_circuit_pool_usage(int severity)
+{
+  circuit_pool_log_status(origin_circuit_pool, severity);
+  circuit_pool_log_status(or_circuit_pool, severity);
+  circuit_pool_log_status(crypt_path_pool, severity);
+}
+
+/** Give back to the system any memory held by empty chunks in the circuit
+ * and crypt_path pools, keeping a few around to absorb bursts. */
+void
+circuit_pools_clean(void)
+{
+#define CIRCUIT_POOL_CHUNKS_TO_KEEP 2
+  if (origin_circuit_pool)
+    mp_pool_clean(origin_circuit_pool, CIRCUIT_POOL_CHUNKS_TO_KEEP);
+  if (or_circuit_pool)
+    mp_pool_clean(or_circuit_pool, CIRCUIT_POOL_CHUNKS_TO_KEEP);
+  if (crypt_path_pool)
+    mp_pool_clean(crypt_path_pool, CIRCUIT_POOL_CHUNKS_TO_KEEP);
+}
+
+/** Helper: free *<b>poolp</b> and set it to NULL if nothing is allocated from
+ * it any more.  Otherwise (for instance, if a dead circuit is still waiting
+ * on a cpuworker reply), just release its empty chunks. */
+static void
+circuit_pool_free(mp_pool_t **poolp)
+{
+  size_t n_allocated = 0;
+  if (!*poolp)
+    return;
+  mp_pool_get_stats(*poolp, &n_allocated, NULL, NULL, NULL);
+  if (n_allocated == 0) {
+    mp_pool_destroy(*poolp);
+    *poolp = NULL;
+  } else {
+    mp_pool_clean(*poolp, 0);
+  }
+}
+
 /** Deallocate the linked list circ-><b>cpath</b>, and remove the cpath from
  * <b>circ</b>. */
 void
@@ -908,6 +1000,10 @@ circuit_free_all(void)
     }
   }
   HT_CLEAR(chan_circid_map, &chan_circid_map);
+
+  circuit_pool_free(&origin_circuit_pool);
+  circuit_pool_free(&or_circuit_pool);
+  circuit_pool_free(&crypt_path_pool);
 }
 
 /** Deallocate space associated with the cpath node <b>victim</b>. */
@@ -917,16 +1013,13 @@ circuit_free_cpath_node(crypt_path_t *victim)
   if (!victim)
     return;
 
-  crypto_cipher_free(victim->f_crypto);
-  crypto_cipher_free(victim->b_crypto);
-  crypto_digest_free(victim->f_digest);
-  crypto_digest_free(victim->b_digest);
+  relay_crypto_clear(&victim->crypto);
   onion_handshake_state_release(&victim->handshake_state);
   crypto_dh_free(victim->rend_dh_handshake_state);
   extend_info_free(victim->extend_info);
 
   memwipe(victim, 0xBB, sizeof(crypt_path_t)); /* poison memory */
-  tor_free(victim);
+  mp_pool_release(victim);
 }
 
 /** Release a crypt_path_reference_t*, which may be NULL. */
@@ -2145,6 +2238,9 @@ circuits_handle_oom(size_t current_allocation)
 
  done_recovering_mem:
 
+  metrics_add(METRICS_OOM_CIRCUITS_KILLED, n_circuits_killed);
+  metrics_add(METRICS_OOM_BYTES_RECOVERED, mem_recovered);
+
   log_notice(LD_GENERAL, "Removed "U64_FORMAT" bytes by killing %d circuits; "
              "%d circuits remain alive. Also killed %d non-linked directory "
              "connections.",
@@ -2167,8 +2263,7 @@ assert_cpath_layer_ok(const crypt_path_t *cp)
   switch (cp->state)
     {
     case CPATH_STATE_OPEN:
-      tor_assert(cp->f_crypto);
-      tor_assert(cp->b_crypto);
+      tor_assert(cp->crypto.is_initialized);
       /* fall through */
     case CPATH_STATE_CLOSED:
       /*XXXX Assert that there's no handshake_state either. */
@@ -2257,10 +2352,7 @@ assert_circuit_ok(const circuit_t *c)
   if (c->state == CIRCUIT_STATE_OPEN) {
     tor_assert(!c->n_chan_create_cell);
     if (or_circ) {
-      tor_assert(or_circ->n_crypto);
-      tor_assert(or_circ->p_crypto);
-      tor_assert(or_circ->n_digest);
-      tor_assert(or_circ->p_digest);
+      tor_assert(or_circ->crypto.is_initialized);
     }
   }
   if (c->state == CIRCUIT_STATE_CHAN_WAIT && !c->marked_for_close) {
@@ -33,6 +33,10 @@ void circuit_close_all_marked(void);
 int32_t circuit_initial_package_window(void);
 origin_circuit_t *origin_circuit_new(void);
 or_circuit_t *or_circuit_new(circid_t p_circ_id, channel_t *p_chan);
+void or_circuit_free_dead(or_circuit_t *circ);
+crypt_path_t *crypt_path_new(void);
+void dump_circuit_pool_usage(int severity);
+void circuit_pools_clean(void);
 circuit_t *circuit_get_by_circid_channel(circid_t circ_id,
                                          channel_t *chan);
 circuit_t *
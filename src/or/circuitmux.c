@@ -11,6 +11,7 @@
 #include "circuitlist.h"
 #include "circuitmux.h"
 #include "relay.h"
+#include "trace.h"
 
 /*
  * Private typedefs for circuitmux.c
@@ -1549,6 +1550,7 @@ circuitmux_notify_xmit_cells(circuitmux_t *cmux, circuit_t *circ,
   if (hashent->muxinfo.cell_count == 0) becomes_inactive = 1;
   /* Adjust the mux cell counter */
   cmux->n_cells -= n_cells;
+  tor_trace(TRACE_EV_CMUX_XMIT, n_cells, cmux->n_cells);
 
   /* If we aren't making it inactive later, move it to the tail of the list */
   if (!becomes_inactive) {
@@ -72,6 +72,16 @@ get_circuit_build_timeout_ms(void)
   return circ_times.timeout_ms;
 }
 
+/** Return how long we expect a circuit to take to build, in milliseconds:
+ * the median of the build times we've recorded, or our build timeout if we
+ * haven't recorded any yet. */
+double
+get_circuit_build_median_ms(void)
+{
+  double median = circuit_build_times_median(&circ_times);
+  return median >= 0 ? median : circ_times.timeout_ms;
+}
+
 /**
  * This function decides if CBT learning should be disabled. It returns
  * true if one or more of the following four conditions are met:
@@ -612,6 +622,30 @@ circuit_build_times_max(const circuit_build_times_t *cbt)
   return max_build_time;
 }
 
+/**
+ * Return the median of the circuit build times in <b>cbt</b>, in
+ * milliseconds, or -1 if we haven't recorded any.
+ */
+double
+circuit_build_times_median(const circuit_build_times_t *cbt)
+{
+  build_time_t *times;
+  int i, n = 0;
+  double median = -1;
+
+  times = tor_calloc(CBT_NCIRCUITS_TO_OBSERVE, sizeof(build_time_t));
+  for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
+    if (cbt->circuit_build_times[i] == 0 /* 0 <-> uninitialized */
+            || cbt->circuit_build_times[i] == CBT_BUILD_ABANDONED)
+      continue;
+    times[n++] = cbt->circuit_build_times[i];
+  }
+  if (n)
+    median = median_uint32(times, n);
+  tor_free(times);
+  return median;
+}
+
 #if 0
 /** Return minimum circuit build time */
 build_time_t
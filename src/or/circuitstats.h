@@ -16,6 +16,7 @@ const circuit_build_times_t *get_circuit_build_times(void);
 circuit_build_times_t *get_circuit_build_times_mutable(void);
 double get_circuit_build_close_time_ms(void);
 double get_circuit_build_timeout_ms(void);
+double get_circuit_build_median_ms(void);
 
 int circuit_build_times_disabled(void);
 int circuit_build_times_enough_to_compute(const circuit_build_times_t *cbt);
@@ -39,6 +40,7 @@ void circuit_build_times_new_consensus_params(circuit_build_times_t *cbt,
                                               networkstatus_t *ns);
 double circuit_build_times_timeout_rate(const circuit_build_times_t *cbt);
 double circuit_build_times_close_rate(const circuit_build_times_t *cbt);
+double circuit_build_times_median(const circuit_build_times_t *cbt);
 
 void circuit_build_times_update_last_circ(circuit_build_times_t *cbt);
 
@@ -987,6 +987,10 @@ circuit_stream_is_being_handled(entry_connection_t *conn,
 /** Don't keep more than this many unused open circuits around. */
 #define MAX_UNUSED_OPEN_CIRCUITS 14
 
+/** Don't launch more than this many circuits for our hidden services in
+ * one call to circuit_predict_and_launch_new(). */
+#define MAX_HS_CIRCS_LAUNCHED_AT_ONCE 4
+
 /** Figure out how many circuits we have open that are clean. Make
  * sure it's enough for all the upcoming behaviors we predict we'll have.
  * But put an upper bound on the total number of circuits.
@@ -1049,17 +1053,28 @@ circuit_predict_and_launch_new(void)
   }
 
   /* Third, see if we need any more hidden service (server) circuits.
-   * HS servers only need an internal circuit. */
-  if (num_rend_services() && num_uptime_internal < 3
-      && router_have_consensus_path() != CONSENSUS_PATH_UNKNOWN) {
-    flags = (CIRCLAUNCH_NEED_CAPACITY | CIRCLAUNCH_NEED_UPTIME |
-             CIRCLAUNCH_IS_INTERNAL);
-    log_info(LD_CIRC,
-             "Have %d clean circs (%d internal), need another internal "
-             "circ for my hidden service.",
-             num, num_internal);
-    circuit_launch(CIRCUIT_PURPOSE_C_GENERAL, flags);
-    return;
+   * HS servers only need an internal circuit.  We keep enough of them
+   * around that most rendezvous circuits can be cannibalized from one, and
+   * need only the final extend; the busier our services are, the more that
+   * is. */
+  if (num_rend_services() &&
+      router_have_consensus_path() != CONSENSUS_PATH_UNKNOWN) {
+    const int wanted =
+      rep_hist_get_predicted_hs_circs(now, get_circuit_build_median_ms());
+    if (num_uptime_internal < wanted) {
+      int n_launch = MIN(wanted - num_uptime_internal,
+                         MAX_HS_CIRCS_LAUNCHED_AT_ONCE);
+      n_launch = MIN(n_launch, MAX_UNUSED_OPEN_CIRCUITS - num);
+      flags = (CIRCLAUNCH_NEED_CAPACITY | CIRCLAUNCH_NEED_UPTIME |
+               CIRCLAUNCH_IS_INTERNAL);
+      log_info(LD_CIRC,
+               "Have %d clean circs (%d uptime-internal), want %d for my "
+               "hidden services; launching %d more.",
+               num, num_uptime_internal, wanted, n_launch);
+      while (n_launch-- > 0)
+        circuit_launch(CIRCUIT_PURPOSE_C_GENERAL, flags);
+      return;
+    }
   }
 
   /* Fourth, see if we need any more hidden service (client) circuits.
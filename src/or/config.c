@@ -49,6 +49,7 @@
 #include "transports.h"
 #include "ext_orport.h"
 #include "torgzip.h"
+#include "trace.h"
 #ifdef _WIN32
 #include <shlobj.h>
 #endif
@@ -154,6 +155,7 @@ static config_var_t option_vars_[] = {
   V(AlternateDirAuthority,       LINELIST, NULL),
   OBSOLETE("AlternateHSAuthority"),
   V(AssumeReachable,             BOOL,     "0"),
+  V(AsyncLinkHandshakes,         BOOL,     "0"),
   OBSOLETE("AuthDirBadDir"),
   OBSOLETE("AuthDirBadDirCCs"),
   V(AuthDirBadExit,              LINELIST, NULL),
@@ -289,6 +291,7 @@ static config_var_t option_vars_[] = {
   VAR("HiddenServiceMaxStreams",LINELIST_S, RendConfigLines, NULL),
   VAR("HiddenServiceMaxStreamsCloseCircuit",LINELIST_S, RendConfigLines, NULL),
   VAR("HiddenServiceNumIntroductionPoints", LINELIST_S, RendConfigLines, NULL),
+  VAR("HiddenServiceInstanceDir", LINELIST_S, RendConfigLines, NULL),
   V(HiddenServiceStatistics,     BOOL,     "0"),
   V(HidServAuth,                 LINELIST, NULL),
   V(CloseHSClientCircuitsImmediatelyOnTimeout, BOOL, "0"),
@@ -307,10 +310,15 @@ static config_var_t option_vars_[] = {
   V(Socks5ProxyUsername,         STRING,   NULL),
   V(Socks5ProxyPassword,         STRING,   NULL),
   V(KeepalivePeriod,             INTERVAL, "5 minutes"),
+  V(KernelTLS,                   BOOL,     "0"),
   VAR("Log",                     LINELIST, Logs,             NULL),
+  V(LogAsynchronously,           BOOL,     "0"),
+  V(LogAsyncBufferSize,          MEMUNIT,  "256 KB"),
   V(LogMessageDomains,           BOOL,     "0"),
   V(LogTimeGranularity,          MSEC_INTERVAL, "1 second"),
   V(TruncateLogFile,             BOOL,     "0"),
+  V(TraceFile,                   FILENAME, NULL),
+  V(TraceRecordsPerThread,       UINT,     "65536"),
   V(LongLivedPorts,              CSV,
         "21,22,706,1863,5050,5190,5222,5223,6523,6667,6697,8300"),
   VAR("MapAddress",              LINELIST, AddressMap,           NULL),
@@ -320,6 +328,7 @@ static config_var_t option_vars_[] = {
   VAR("MaxMemInQueues",          MEMUNIT,   MaxMemInQueues_raw, "0"),
   OBSOLETE("MaxOnionsPending"),
   V(MaxOnionQueueDelay,          MSEC_INTERVAL, "1750 msec"),
+  VPORT(MetricsPort,                 LINELIST, NULL),
   V(MinMeasuredBWsForAuthToIgnoreAdvertised, INT, "500"),
   V(MyFamily,                    STRING,   NULL),
   V(NewCircuitPeriod,            INTERVAL, "30 seconds"),
@@ -385,6 +394,8 @@ static config_var_t option_vars_[] = {
   V(RejectPlaintextPorts,        CSV,      ""),
   V(RelayBandwidthBurst,         MEMUNIT,  "0"),
   V(RelayBandwidthRate,          MEMUNIT,  "0"),
+  V(RendClientCacheMaxMemory,    MEMUNIT,  "16 MB"),
+  V(RendDirCacheMaxMemory,       MEMUNIT,  "0"),
   V(RendPostPeriod,              INTERVAL, "1 hour"),
   V(RephistTrackTime,            INTERVAL, "24 hours"),
   V(RunAsDaemon,                 BOOL,     "0"),
@@ -418,6 +429,8 @@ static config_var_t option_vars_[] = {
   V(Tor2webMode,                 BOOL,     "0"),
   V(Tor2webRendezvousPoints,      ROUTERSET, NULL),
   V(TLSECGroup,                  STRING,   NULL),
+  V(TLSSessionResumption,        BOOL,     "0"),
+  V(TLSWriteCoalesceDelay,       MSEC_INTERVAL, "0 msec"),
   V(TrackHostExits,              CSV,      NULL),
   V(TrackHostExitsExpire,        INTERVAL, "30 minutes"),
   V(TransListenAddress,          LINELIST, NULL),
@@ -1347,6 +1360,13 @@ options_transition_requires_fresh_tls_context(const or_options_t *old_options,
   if (!opt_streq(old_options->TLSECGroup, new_options->TLSECGroup))
     return 1;
 
+  if (old_options->TLSSessionResumption !=
+      new_options->TLSSessionResumption)
+    return 1;
+
+  if (old_options->KernelTLS != new_options->KernelTLS)
+    return 1;
+
   return 0;
 }
 
@@ -1580,6 +1600,17 @@ options_act(const or_options_t *old_options)
                            (options->SchedulerMaxFlushCells__ > 0) ?
                            options->SchedulerMaxFlushCells__ : 1000);
 
+  /* Start, stop, or restart event tracing */
+  if (!old_options ||
+      !opt_streq(old_options->TraceFile, options->TraceFile) ||
+      old_options->TraceRecordsPerThread != options->TraceRecordsPerThread) {
+    if (options->TraceFile)
+      tor_trace_start(options->TraceFile,
+                      (unsigned)options->TraceRecordsPerThread);
+    else
+      tor_trace_stop();
+  }
+
   /* Set up accounting */
   if (accounting_parse_options(options, 0)<0) {
     log_warn(LD_CONFIG,"Error in accounting options");
@@ -4017,6 +4048,7 @@ options_transition_allowed(const or_options_t *old,
     SB_NOCHANGE_STR(DirPortFrontPage);
     SB_NOCHANGE_STR(CookieAuthFile);
     SB_NOCHANGE_STR(ExtORPortCookieAuthFile);
+    SB_NOCHANGE_STR(TraceFile);
 
 #undef SB_NOCHANGE_STR
 
@@ -4760,6 +4792,11 @@ addressmap_register_auto(const char *from, const char *to,
   return 0;
 }
 
+/** Lowest allowable value for LogAsyncBufferSize. */
+#define MIN_LOG_ASYNC_BUFFER_SIZE (4<<10)
+/** Highest allowable value for LogAsyncBufferSize. */
+#define MAX_LOG_ASYNC_BUFFER_SIZE (64<<20)
+
 /**
  * Initialize the logs based on the configuration file.
  */
@@ -4893,8 +4930,22 @@ options_init_logs(const or_options_t *old_options, or_options_t *options,
   }
   smartlist_free(elts);
 
-  if (ok && !validate_only)
+  if (options->LogAsyncBufferSize < MIN_LOG_ASYNC_BUFFER_SIZE ||
+      options->LogAsyncBufferSize > MAX_LOG_ASYNC_BUFFER_SIZE) {
+    log_warn(LD_CONFIG, "LogAsyncBufferSize must be between %d KB and "
+             "%d MB.", MIN_LOG_ASYNC_BUFFER_SIZE >> 10,
+             MAX_LOG_ASYNC_BUFFER_SIZE >> 20);
+    ok = 0;
+  }
+
+  if (ok && !validate_only) {
     logs_set_domain_logging(options->LogMessageDomains);
+    if (logs_set_async(options->LogAsynchronously,
+                       (size_t)options->LogAsyncBufferSize) < 0) {
+      log_warn(LD_CONFIG, "Couldn't start the asynchronous log writer; "
+               "logging synchronously instead.");
+    }
+  }
 
   return ok?0:-1;
 }
@@ -5705,6 +5756,26 @@ warn_nonlocal_ext_orports(const smartlist_t *ports, const char *portname)
   } SMARTLIST_FOREACH_END(port);
 }
 
+/** Warn for every metrics port in <b>ports</b> that is listening on a
+ * non-loopback address. */
+static void
+warn_nonlocal_metrics_ports(const smartlist_t *ports)
+{
+  SMARTLIST_FOREACH_BEGIN(ports, const port_cfg_t *, port) {
+    if (port->type != CONN_TYPE_METRICS_LISTENER)
+      continue;
+    if (port->is_unix_addr)
+      continue;
+    if (!tor_addr_is_loopback(&port->addr)) {
+      log_warn(LD_CONFIG, "You have a MetricsPort set to accept connections "
+               "from a non-local address '%s'. Anybody who can reach it can "
+               "watch your traffic statistics in detail. Maybe you should "
+               "just listen on 127.0.0.1?",
+               fmt_addrport(&port->addr, port->port));
+    }
+  } SMARTLIST_FOREACH_END(port);
+}
+
 /** Given a list of port_cfg_t in <b>ports</b>, warn any controller port there
  * is listening on any non-loopback address.  If <b>forbid_nonlocal</b> is
  * true, then emit a stronger warning and remove the port from the list.
@@ -5857,6 +5928,7 @@ parse_port_config(smartlist_t *out,
   int retval = -1;
   const unsigned is_control = (listener_type == CONN_TYPE_CONTROL_LISTENER);
   const unsigned is_ext_orport = (listener_type == CONN_TYPE_EXT_OR_LISTENER);
+  const unsigned is_metrics = (listener_type == CONN_TYPE_METRICS_LISTENER);
   const unsigned allow_no_stream_options = flags & CL_PORT_NO_STREAM_OPTIONS;
   const unsigned use_server_options = flags & CL_PORT_SERVER_OPTIONS;
   const unsigned warn_nonlocal = flags & CL_PORT_WARN_NONLOCAL;
@@ -5940,6 +6012,8 @@ parse_port_config(smartlist_t *out,
         warn_nonlocal_controller_ports(out, forbid_nonlocal);
       else if (is_ext_orport)
         warn_nonlocal_ext_orports(out, portname);
+      else if (is_metrics)
+        warn_nonlocal_metrics_ports(out);
       else
         warn_nonlocal_client_ports(out, portname, listener_type);
     }
@@ -6276,6 +6350,8 @@ parse_port_config(smartlist_t *out,
       warn_nonlocal_controller_ports(out, forbid_nonlocal);
     else if (is_ext_orport)
       warn_nonlocal_ext_orports(out, portname);
+    else if (is_metrics)
+      warn_nonlocal_metrics_ports(out);
     else
       warn_nonlocal_client_ports(out, portname, listener_type);
   }
@@ -6398,6 +6474,14 @@ parse_ports(or_options_t *options, int validate_only,
       goto err;
     }
   }
+  if (parse_port_config(ports,
+                        options->MetricsPort_lines, NULL,
+                        "Metrics", CONN_TYPE_METRICS_LISTENER,
+                        "127.0.0.1", 0,
+                        CL_PORT_NO_STREAM_OPTIONS|CL_PORT_WARN_NONLOCAL) < 0) {
+    *msg = tor_strdup("Invalid MetricsPort configuration");
+    goto err;
+  }
   if (! options->ClientOnly) {
     if (parse_port_config(ports,
                           options->ORPort_lines, options->ORListenAddress,
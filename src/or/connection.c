@@ -37,6 +37,7 @@
 #include "ext_orport.h"
 #include "geoip.h"
 #include "main.h"
+#include "metrics.h"
 #include "policies.h"
 #include "reasons.h"
 #include "relay.h"
@@ -72,8 +73,10 @@ static int connection_init_accepted_conn(connection_t *conn,
                           const listener_connection_t *listener);
 static int connection_handle_listener_read(connection_t *conn, int new_type);
 #ifndef USE_BUFFEREVENTS
-static int connection_bucket_should_increase(int bucket,
-                                             or_connection_t *conn);
+static void connection_or_buckets_refill_lazy(or_connection_t *or_conn,
+                                              const struct timeval *tvnow);
+static void connection_bw_blocked_list_add(connection_t *conn);
+static void connection_bw_blocked_list_remove(connection_t *conn);
 #endif
 static int connection_finished_flushing(connection_t *conn);
 static int connection_flushed_some(connection_t *conn);
@@ -106,6 +109,7 @@ static smartlist_t *outgoing_addrs = NULL;
 #define CASE_ANY_LISTENER_TYPE \
     case CONN_TYPE_OR_LISTENER: \
     case CONN_TYPE_EXT_OR_LISTENER: \
+    case CONN_TYPE_METRICS_LISTENER: \
     case CONN_TYPE_AP_LISTENER: \
     case CONN_TYPE_DIR_LISTENER: \
     case CONN_TYPE_CONTROL_LISTENER: \
@@ -138,6 +142,8 @@ conn_type_to_string(int type)
     case CONN_TYPE_CONTROL: return "Control";
     case CONN_TYPE_EXT_OR: return "Extended OR";
     case CONN_TYPE_EXT_OR_LISTENER: return "Extended OR listener";
+    case CONN_TYPE_METRICS: return "Metrics";
+    case CONN_TYPE_METRICS_LISTENER: return "Metrics listener";
     default:
       log_warn(LD_BUG, "unknown connection type %d", type);
       tor_snprintf(buf, sizeof(buf), "unknown [%d]", type);
@@ -223,6 +229,12 @@ conn_state_to_string(int type, int state)
           return "waiting for authentication (protocol v1)";
       }
       break;
+    case CONN_TYPE_METRICS:
+      switch (state) {
+        case METRICS_CONN_STATE_READING: return "reading request";
+        case METRICS_CONN_STATE_WRITING: return "writing";
+      }
+      break;
   }
 
   log_warn(LD_BUG, "unknown connection state %d (type %d)", state, type);
@@ -545,6 +557,7 @@ connection_free_(connection_t *conn)
 
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
+    connection_or_clear_held_write(or_conn);
     tor_tls_free(or_conn->tls);
     or_conn->tls = NULL;
     or_handshake_state_free(or_conn->handshake_state);
@@ -678,6 +691,9 @@ connection_free(connection_t *conn)
   if (conn->type == CONN_TYPE_CONTROL) {
     connection_control_closed(TO_CONTROL_CONN(conn));
   }
+#ifndef USE_BUFFEREVENTS
+  connection_bw_blocked_list_remove(conn);
+#endif
   connection_unregister_events(conn);
   connection_free_(conn);
 }
@@ -1612,6 +1628,9 @@ connection_init_accepted_conn(connection_t *conn,
     case CONN_TYPE_CONTROL:
       conn->state = CONTROL_CONN_STATE_NEEDAUTH;
       break;
+    case CONN_TYPE_METRICS:
+      conn->state = METRICS_CONN_STATE_READING;
+      break;
   }
   return 0;
 }
@@ -2627,8 +2646,12 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
 
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
-    if (conn->state == OR_CONN_STATE_OPEN)
+    if (conn->state == OR_CONN_STATE_OPEN) {
+      struct timeval tvnow;
+      tor_gettimeofday_cached_monotonic(&tvnow);
+      connection_or_buckets_refill_lazy(or_conn, &tvnow);
       conn_bucket = or_conn->read_bucket;
+    }
     base = get_cell_network_size(or_conn->wide_circ_ids);
   }
 
@@ -2663,10 +2686,14 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
     /* use the per-conn write limit if it's lower, but if it's less
      * than zero just use zero */
     or_connection_t *or_conn = TO_OR_CONN(conn);
-    if (conn->state == OR_CONN_STATE_OPEN)
+    if (conn->state == OR_CONN_STATE_OPEN) {
+      struct timeval tvnow;
+      tor_gettimeofday_cached_monotonic(&tvnow);
+      connection_or_buckets_refill_lazy(or_conn, &tvnow);
       if (or_conn->write_bucket < conn_bucket)
         conn_bucket = or_conn->write_bucket >= 0 ?
                         or_conn->write_bucket : 0;
+    }
     base = get_cell_network_size(or_conn->wide_circ_ids);
   }
 
@@ -2847,6 +2874,30 @@ connection_buckets_note_empty_ts(uint32_t *timestamp_var,
     *timestamp_var = msec_since_midnight(tvnow);
 }
 
+/** Stop reading on <b>conn</b> because some token bucket is empty, and
+ * remember to start reading again once the buckets have been refilled. */
+void
+connection_read_bw_exhausted(connection_t *conn)
+{
+#ifndef USE_BUFFEREVENTS
+  connection_bw_blocked_list_add(conn);
+#endif
+  conn->read_blocked_on_bw = 1;
+  connection_stop_reading(conn);
+}
+
+/** Stop writing on <b>conn</b> because some token bucket is empty, and
+ * remember to start writing again once the buckets have been refilled. */
+void
+connection_write_bw_exhausted(connection_t *conn)
+{
+#ifndef USE_BUFFEREVENTS
+  connection_bw_blocked_list_add(conn);
+#endif
+  conn->write_blocked_on_bw = 1;
+  connection_stop_writing(conn);
+}
+
 #ifndef USE_BUFFEREVENTS
 /** Last time at which the global or relay buckets were emptied in msec
  * since midnight. */
@@ -2855,6 +2906,35 @@ static uint32_t global_relayed_read_emptied = 0,
                 global_read_emptied = 0,
                 global_write_emptied = 0;
 
+/** List of every connection that has read_blocked_on_bw or
+ * write_blocked_on_bw set.  A connection is on this list exactly when one
+ * of those flags is set, so that refilling the token buckets only needs to
+ * visit the connections that are actually waiting for bandwidth. */
+static smartlist_t *blocked_on_bw_conns = NULL;
+
+/** Add <b>conn</b> to blocked_on_bw_conns, if it isn't there already.
+ * Call this <em>before</em> setting either of its blocked_on_bw flags. */
+static void
+connection_bw_blocked_list_add(connection_t *conn)
+{
+  if (conn->read_blocked_on_bw || conn->write_blocked_on_bw)
+    return; /* Already listed. */
+  if (!blocked_on_bw_conns)
+    blocked_on_bw_conns = smartlist_new();
+  smartlist_add(blocked_on_bw_conns, conn);
+}
+
+/** Remove <b>conn</b> from blocked_on_bw_conns, if it is there. */
+static void
+connection_bw_blocked_list_remove(connection_t *conn)
+{
+  if (!conn->read_blocked_on_bw && !conn->write_blocked_on_bw)
+    return;
+  if (blocked_on_bw_conns)
+    smartlist_remove(blocked_on_bw_conns, conn);
+  conn->read_blocked_on_bw = conn->write_blocked_on_bw = 0;
+}
+
 /** We just read <b>num_read</b> and wrote <b>num_written</b> bytes
  * onto <b>conn</b>. Decrement buckets appropriately. */
 static void
@@ -2936,8 +3016,7 @@ connection_consider_empty_read_buckets(connection_t *conn)
     return; /* all good, no need to stop it */
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
-  conn->read_blocked_on_bw = 1;
-  connection_stop_reading(conn);
+  connection_read_bw_exhausted(conn);
 }
 
 /** If we have exhausted our global buckets, or the buckets for conn,
@@ -2963,8 +3042,7 @@ connection_consider_empty_write_buckets(connection_t *conn)
     return; /* all good, no need to stop it */
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
-  conn->write_blocked_on_bw = 1;
-  connection_stop_writing(conn);
+  connection_write_bw_exhausted(conn);
 }
 
 /** Initialize the global read bucket to options-\>BandwidthBurst. */
@@ -3013,12 +3091,87 @@ connection_bucket_refill_helper(int *bucket, int rate, int burst,
   }
 }
 
-/** Time has passed; increment buckets appropriately. */
+/** Add tokens to the per-connection buckets of <b>or_conn</b> for the
+ * time that has passed between its last refill and <b>tvnow</b>.  We do
+ * this whenever we are about to look at those buckets, so that refilling
+ * doesn't require a walk over every OR connection on each tick. */
+static void
+connection_or_buckets_refill_lazy(or_connection_t *or_conn,
+                                  const struct timeval *tvnow)
+{
+  int burst = or_conn->bandwidthburst;
+  int prev_conn_read = or_conn->read_bucket;
+  int prev_conn_write = or_conn->write_bucket;
+  int milliseconds_elapsed;
+  long mdiff;
+
+  if (or_conn->bucket_last_refilled.tv_sec == 0 ||
+      or_conn->base_.state != OR_CONN_STATE_OPEN ||
+      (prev_conn_read >= burst && prev_conn_write >= burst)) {
+    /* Nothing to add: either this is the first time we've looked, only
+     * open connections play the rate limiting game, or both buckets are
+     * already full.  Just restart the clock. */
+    or_conn->bucket_last_refilled = *tvnow;
+    return;
+  }
+
+  mdiff = tv_mdiff(&or_conn->bucket_last_refilled, tvnow);
+  if (mdiff <= 0)
+    return;
+  if (mdiff > INT_MAX)
+    mdiff = INT_MAX;
+  milliseconds_elapsed = (int)mdiff;
+
+  /* Don't move the clock forward until at least one token has accrued:
+   * otherwise, a slow connection that we look at very often would never
+   * get refilled at all. */
+  if (((int64_t)or_conn->bandwidthrate) * milliseconds_elapsed < 1000)
+    return;
+
+  connection_bucket_refill_helper(&or_conn->read_bucket,
+                                  or_conn->bandwidthrate, burst,
+                                  milliseconds_elapsed,
+                                  "or_conn->read_bucket");
+  connection_bucket_refill_helper(&or_conn->write_bucket,
+                                  or_conn->bandwidthrate, burst,
+                                  milliseconds_elapsed,
+                                  "or_conn->write_bucket");
+  or_conn->bucket_last_refilled = *tvnow;
+
+  /* If buckets were empty before and have now been refilled, tell any
+   * interested controllers. */
+  if (get_options()->TestingEnableTbEmptyEvent) {
+    char *bucket;
+    uint32_t conn_read_empty_time, conn_write_empty_time;
+    struct timeval tv_wallclock;
+    tor_gettimeofday_cached(&tv_wallclock);
+    conn_read_empty_time = bucket_millis_empty(prev_conn_read,
+                           or_conn->read_emptied_time,
+                           or_conn->read_bucket,
+                           milliseconds_elapsed, &tv_wallclock);
+    conn_write_empty_time = bucket_millis_empty(prev_conn_write,
+                            or_conn->write_emptied_time,
+                            or_conn->write_bucket,
+                            milliseconds_elapsed, &tv_wallclock);
+    if (conn_read_empty_time || conn_write_empty_time) {
+      tor_asprintf(&bucket, "ORCONN ID="U64_FORMAT,
+                   U64_PRINTF_ARG(or_conn->base_.global_identifier));
+      control_event_tb_empty(bucket, conn_read_empty_time,
+                             conn_write_empty_time,
+                             milliseconds_elapsed);
+      tor_free(bucket);
+    }
+  }
+}
+
+/** Time has passed; increment the global buckets appropriately, and wake
+ * up any connection that was waiting for bandwidth and can now proceed.
+ * Per-connection buckets are refilled lazily; we only touch the ones
+ * belonging to connections that are blocked. */
 void
 connection_bucket_refill(int milliseconds_elapsed, time_t now)
 {
   const or_options_t *options = get_options();
-  smartlist_t *conns = get_connection_array();
   int bandwidthrate, bandwidthburst, relayrate, relayburst;
 
   int prev_global_read = global_read_bucket;
@@ -3026,6 +3179,7 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
   int prev_relay_read = global_relayed_read_bucket;
   int prev_relay_write = global_relayed_write_bucket;
   struct timeval tvnow; /*< Only used if TB_EMPTY events are enabled. */
+  struct timeval tv_refill;
 
   bandwidthrate = (int)options->BandwidthRate;
   bandwidthburst = (int)options->BandwidthBurst;
@@ -3087,52 +3241,15 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
                            relay_write_empty_time, milliseconds_elapsed);
   }
 
-  /* refill the per-connection buckets */
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (connection_speaks_cells(conn)) {
-      or_connection_t *or_conn = TO_OR_CONN(conn);
-      int orbandwidthrate = or_conn->bandwidthrate;
-      int orbandwidthburst = or_conn->bandwidthburst;
-
-      int prev_conn_read = or_conn->read_bucket;
-      int prev_conn_write = or_conn->write_bucket;
-
-      if (connection_bucket_should_increase(or_conn->read_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->read_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->read_bucket");
-      }
-      if (connection_bucket_should_increase(or_conn->write_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->write_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->write_bucket");
-      }
+  if (!blocked_on_bw_conns || smartlist_len(blocked_on_bw_conns) == 0)
+    return;
 
-      /* If buckets were empty before and have now been refilled, tell any
-       * interested controllers. */
-      if (get_options()->TestingEnableTbEmptyEvent) {
-        char *bucket;
-        uint32_t conn_read_empty_time, conn_write_empty_time;
-        tor_asprintf(&bucket, "ORCONN ID="U64_FORMAT,
-                     U64_PRINTF_ARG(or_conn->base_.global_identifier));
-        conn_read_empty_time = bucket_millis_empty(prev_conn_read,
-                               or_conn->read_emptied_time,
-                               or_conn->read_bucket,
-                               milliseconds_elapsed, &tvnow);
-        conn_write_empty_time = bucket_millis_empty(prev_conn_write,
-                                or_conn->write_emptied_time,
-                                or_conn->write_bucket,
-                                milliseconds_elapsed, &tvnow);
-        control_event_tb_empty(bucket, conn_read_empty_time,
-                               conn_write_empty_time,
-                               milliseconds_elapsed);
-        tor_free(bucket);
-      }
-    }
+  tor_gettimeofday_cached_monotonic(&tv_refill);
+
+  /* wake up the connections that were waiting for bandwidth */
+  SMARTLIST_FOREACH_BEGIN(blocked_on_bw_conns, connection_t *, conn) {
+    if (connection_speaks_cells(conn))
+      connection_or_buckets_refill_lazy(TO_OR_CONN(conn), &tv_refill);
 
     if (conn->read_blocked_on_bw == 1 /* marked to turn reading back on now */
         && global_read_bucket > 0 /* and we're allowed to read */
@@ -3160,23 +3277,10 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
       conn->write_blocked_on_bw = 0;
       connection_start_writing(conn);
     }
-  } SMARTLIST_FOREACH_END(conn);
-}
-
-/** Is the <b>bucket</b> for connection <b>conn</b> low enough that we
- * should add another pile of tokens to it?
- */
-static int
-connection_bucket_should_increase(int bucket, or_connection_t *conn)
-{
-  tor_assert(conn);
-
-  if (conn->base_.state != OR_CONN_STATE_OPEN)
-    return 0; /* only open connections play the rate limiting game */
-  if (bucket >= conn->bandwidthburst)
-    return 0;
 
-  return 1;
+    if (!conn->read_blocked_on_bw && !conn->write_blocked_on_bw)
+      SMARTLIST_DEL_CURRENT(blocked_on_bw_conns, conn);
+  } SMARTLIST_FOREACH_END(conn);
 }
 #else
 static void
@@ -3298,6 +3402,8 @@ connection_handle_read_impl(connection_t *conn)
       return connection_handle_listener_read(conn, CONN_TYPE_DIR);
     case CONN_TYPE_CONTROL_LISTENER:
       return connection_handle_listener_read(conn, CONN_TYPE_CONTROL);
+    case CONN_TYPE_METRICS_LISTENER:
+      return connection_handle_listener_read(conn, CONN_TYPE_METRICS);
     case CONN_TYPE_AP_DNS_LISTENER:
       /* This should never happen; eventdns.c handles the reads here. */
       tor_fragile_assert();
@@ -3937,6 +4043,11 @@ connection_handle_write_impl(connection_t *conn, int force)
     }
 
     /* else open, or closing */
+    if (!force && connection_or_should_hold_write(or_conn)) {
+      /* Wait for more cells, or for the coalescing delay to run out. */
+      connection_stop_writing(conn);
+      return 0;
+    }
     initial_size = buf_datalen(conn->outbuf);
     result = flush_buf_tls(or_conn->tls, conn->outbuf,
                            max_to_write, &conn->outbuf_flushlen);
@@ -3974,8 +4085,7 @@ connection_handle_write_impl(connection_t *conn, int force)
         /* Make sure to avoid a loop if the receive buckets are empty. */
         log_debug(LD_NET,"wanted read.");
         if (!connection_is_reading(conn)) {
-          connection_stop_writing(conn);
-          conn->write_blocked_on_bw = 1;
+          connection_write_bw_exhausted(conn);
           /* we'll start reading again when we get more tokens in our
            * read bucket; then we'll start writing again too.
            */
@@ -3999,6 +4109,8 @@ connection_handle_write_impl(connection_t *conn, int force)
      * the *_buf_tls functions, we should make them return ssize_t or size_t
      * or something. */
     result = (int)(initial_size-buf_datalen(conn->outbuf));
+    if (result > 0)
+      connection_or_note_flushed_bytes(or_conn, result);
   } else {
     CONN_LOG_PROTECT(conn,
              result = flush_buf(conn->s, conn->outbuf,
@@ -4195,18 +4307,23 @@ connection_write_to_buf_impl_,(const char *string, size_t len,
     return;
   }
 
+  if (zlib)
+    conn->outbuf_flushlen += buf_datalen(conn->outbuf) - old_datalen;
+  else
+    conn->outbuf_flushlen += len;
+
   /* If we receive optimistic data in the EXIT_CONN_STATE_RESOLVING
    * state, we don't want to try to write it right away, since
    * conn->write_event won't be set yet.  Otherwise, write data from
    * this conn as the socket is available. */
-  if (conn->write_event) {
+  if (conn->write_event &&
+      !(conn->type == CONN_TYPE_OR &&
+        connection_or_write_is_held(TO_OR_CONN(conn)))) {
+    /* (If we're holding back writes on an OR connection, don't wake it up
+     * until it has a whole TLS record to send.) */
     connection_start_writing(conn);
   }
-  if (zlib) {
-    conn->outbuf_flushlen += buf_datalen(conn->outbuf) - old_datalen;
-  } else {
-    conn->outbuf_flushlen += len;
-
+  if (!zlib) {
     /* Should we try flushing the outbuf now? */
     if (conn->in_flushed_some) {
       /* Don't flush the outbuf when the reason we're writing more stuff is
@@ -4396,7 +4513,8 @@ connection_is_listener(connection_t *conn)
       conn->type == CONN_TYPE_AP_DNS_LISTENER ||
       conn->type == CONN_TYPE_AP_NATD_LISTENER ||
       conn->type == CONN_TYPE_DIR_LISTENER ||
-      conn->type == CONN_TYPE_CONTROL_LISTENER)
+      conn->type == CONN_TYPE_CONTROL_LISTENER ||
+      conn->type == CONN_TYPE_METRICS_LISTENER)
     return 1;
   return 0;
 }
@@ -4582,6 +4700,8 @@ connection_process_inbuf(connection_t *conn, int package_partial)
       return connection_dir_process_inbuf(TO_DIR_CONN(conn));
     case CONN_TYPE_CONTROL:
       return connection_control_process_inbuf(TO_CONTROL_CONN(conn));
+    case CONN_TYPE_METRICS:
+      return connection_metrics_process_inbuf(conn);
     default:
       log_err(LD_BUG,"got unexpected conn type %d.", conn->type);
       tor_fragile_assert();
@@ -4641,6 +4761,8 @@ connection_finished_flushing(connection_t *conn)
       return connection_dir_finished_flushing(TO_DIR_CONN(conn));
     case CONN_TYPE_CONTROL:
       return connection_control_finished_flushing(TO_CONTROL_CONN(conn));
+    case CONN_TYPE_METRICS:
+      return connection_metrics_finished_flushing(conn);
     default:
       log_err(LD_BUG,"got unexpected conn type %d.", conn->type);
       tor_fragile_assert();
@@ -4696,6 +4818,8 @@ connection_reached_eof(connection_t *conn)
       return connection_dir_reached_eof(TO_DIR_CONN(conn));
     case CONN_TYPE_CONTROL:
       return connection_control_reached_eof(TO_CONTROL_CONN(conn));
+    case CONN_TYPE_METRICS:
+      return connection_metrics_reached_eof(conn);
     default:
       log_err(LD_BUG,"got unexpected conn type %d.", conn->type);
       tor_fragile_assert();
@@ -4903,6 +5027,10 @@ assert_connection_ok(connection_t *conn, time_t now)
       tor_assert(conn->state >= CONTROL_CONN_STATE_MIN_);
       tor_assert(conn->state <= CONTROL_CONN_STATE_MAX_);
       break;
+    case CONN_TYPE_METRICS:
+      tor_assert(conn->state >= METRICS_CONN_STATE_MIN_);
+      tor_assert(conn->state <= METRICS_CONN_STATE_MAX_);
+      break;
     default:
       tor_assert(0);
   }
@@ -5023,6 +5151,8 @@ connection_free_all(void)
   /* Clear out our list of broken connections */
   clear_broken_connection_map(0);
 
+  connection_or_free_held_writes();
+
   SMARTLIST_FOREACH(conns, connection_t *, conn, connection_free_(conn));
 
   if (outgoing_addrs) {
@@ -5037,6 +5167,9 @@ connection_free_all(void)
 #ifdef USE_BUFFEREVENTS
   if (global_rate_limit)
     bufferevent_rate_limit_group_free(global_rate_limit);
+#else
+  smartlist_free(blocked_on_bw_conns);
+  blocked_on_bw_conns = NULL;
 #endif
 }
 
@@ -22,15 +22,19 @@
 #include "circuitlist.h"
 #include "circuitstats.h"
 #include "command.h"
+#include "compat_libevent.h"
 #include "config.h"
 #include "connection.h"
+#define CONNECTION_OR_PRIVATE
 #include "connection_or.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "dirserv.h"
 #include "entrynodes.h"
 #include "geoip.h"
 #include "main.h"
 #include "link_handshake.h"
+#include "metrics.h"
 #include "networkstatus.h"
 #include "nodelist.h"
 #include "reasons.h"
@@ -40,6 +44,13 @@
 #include "routerlist.h"
 #include "ext_orport.h"
 #include "scheduler.h"
+#include "workqueue.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
 
 #ifdef USE_BUFFEREVENTS
 #include <event2/bufferevent_ssl.h>
@@ -577,6 +588,116 @@ connection_or_process_inbuf(or_connection_t *conn)
   return ret;
 }
 
+/** OR connections on which we're holding back writes; see
+ * connection_or_should_hold_write(). */
+static smartlist_t *held_write_conns = NULL;
+/** Event that fires TLSWriteCoalesceDelay after we start holding back
+ * writes, to let them all go. */
+static struct event *release_held_writes_ev = NULL;
+
+/** Return true iff <b>conn</b> has at least a whole TLS record's worth of
+ * data ready to flush, so that there's no point holding back its writes.
+ * connection_or_should_hold_write() and connection_or_write_is_held() must
+ * agree on this. */
+static INLINE int
+connection_or_has_full_record(const or_connection_t *conn)
+{
+  return conn->base_.outbuf_flushlen >= TOR_TLS_MAX_RECORD_PAYLOAD;
+}
+
+/** Callback for release_held_writes_ev: start writing again on every
+ * connection in held_write_conns, whatever it has queued. */
+STATIC void
+release_held_writes_cb(evutil_socket_t fd, short events, void *arg)
+{
+  smartlist_t *conns = held_write_conns;
+  (void)fd;
+  (void)events;
+  (void)arg;
+
+  held_write_conns = NULL;
+  if (!conns)
+    return;
+  SMARTLIST_FOREACH_BEGIN(conns, or_connection_t *, conn) {
+    conn->write_held = 0;
+    conn->write_released = 1;
+    connection_start_writing(TO_CONN(conn));
+  } SMARTLIST_FOREACH_END(conn);
+  smartlist_free(conns);
+}
+
+/** Return true iff we should put off flushing <b>conn</b>'s outbuf for now,
+ * so that we can send its cells in fuller TLS records.
+ *
+ * When TLSWriteCoalesceDelay is set, we hold back writes on an open
+ * connection until it has a whole record's worth of data queued, or until
+ * the delay runs out, whichever comes first.  The delay starts when we
+ * first hold back a write on any connection, so no write waits longer than
+ * that.
+ */
+int
+connection_or_should_hold_write(or_connection_t *conn)
+{
+  const or_options_t *options = get_options();
+
+  if (conn->write_released) {
+    conn->write_released = 0;
+    return 0;
+  }
+  if (!options->TLSWriteCoalesceDelay ||
+      conn->base_.state != OR_CONN_STATE_OPEN ||
+      conn->base_.marked_for_close ||
+      connection_or_has_full_record(conn) ||
+      tor_tls_get_forced_write_size(conn->tls))
+    return 0;
+  if (conn->write_held)
+    return 1;
+
+  if (!held_write_conns) {
+    struct timeval delay;
+    if (!release_held_writes_ev)
+      release_held_writes_ev = tor_event_new(tor_libevent_get_base(), -1, 0,
+                                             release_held_writes_cb, NULL);
+    held_write_conns = smartlist_new();
+    delay.tv_sec = options->TLSWriteCoalesceDelay / 1000;
+    delay.tv_usec = (options->TLSWriteCoalesceDelay % 1000) * 1000;
+    event_add(release_held_writes_ev, &delay);
+  }
+  smartlist_add(held_write_conns, conn);
+  conn->write_held = 1;
+  metrics_incr(METRICS_TLS_WRITES_HELD);
+  return 1;
+}
+
+/** Return true iff we're holding back writes on <b>conn</b>, and it still
+ * doesn't have a whole TLS record to send, so that we shouldn't wake it up
+ * for writing yet. */
+int
+connection_or_write_is_held(const or_connection_t *conn)
+{
+  return conn->write_held && !connection_or_has_full_record(conn);
+}
+
+/** Stop holding back writes on <b>conn</b>, which is about to be freed. */
+void
+connection_or_clear_held_write(or_connection_t *conn)
+{
+  if (conn->write_held && held_write_conns)
+    smartlist_remove(held_write_conns, conn);
+  conn->write_held = conn->write_released = 0;
+}
+
+/** Forget every connection that we're holding back writes on, and free the
+ * event that would release them. */
+void
+connection_or_free_held_writes(void)
+{
+  smartlist_free(held_write_conns);
+  held_write_conns = NULL;
+  tor_event_free(release_held_writes_ev);
+  release_held_writes_ev = NULL;
+}
+
 /** Called whenever we have flushed some data on an or_conn: add more data
  * from active circuits. */
 int
@@ -714,6 +835,10 @@ connection_or_about_to_close(or_connection_t *or_conn)
       rep_hist_note_connect_failed(or_conn->identity_digest, now);
       entry_guard_register_connect_status(or_conn->identity_digest,0,
                                           !options->HTTPSProxy, now);
+      if (or_conn->tls && tor_tls_session_was_resumed(or_conn->tls)) {
+        /* Don't try that session again: maybe it's what went wrong. */
+        tor_tls_forget_session(or_conn->identity_digest);
+      }
       if (conn->state >= OR_CONN_STATE_TLS_HANDSHAKING) {
         int reason = tls_error_to_orconn_end_reason(or_conn->tls_error);
         control_event_or_conn_status(or_conn, OR_CONN_EVENT_FAILED,
@@ -1336,6 +1461,18 @@ connection_or_close_for_error,(or_connection_t *orconn, int flush))
   }
 }
 
+/** Return true iff we should try to resume earlier TLS sessions when we
+ * reconnect to the relay at the other end of <b>conn</b>.  Only relays do
+ * this: their identities are public anyway, but a client that resumed a
+ * session would let the relay link its connections together. */
+static int
+connection_or_should_resume_tls(const or_connection_t *conn)
+{
+  const or_options_t *options = get_options();
+  return options->TLSSessionResumption && server_mode(options) &&
+    !tor_digest_is_zero(conn->identity_digest);
+}
+
 /** Begin the tls handshake with <b>conn</b>. <b>receiving</b> is 0 if
  * we initiated the connection, else it's 1.
  *
@@ -1373,6 +1510,8 @@ connection_tls_start_handshake,(or_connection_t *conn, int receiving))
   }
   tor_tls_set_logged_address(conn->tls, // XXX client and relay?
       escaped_safe_str(conn->base_.address));
+  if (!receiving && connection_or_should_resume_tls(conn))
+    tor_tls_resume_session(conn->tls, conn->identity_digest);
 
 #ifdef USE_BUFFEREVENTS
   if (connection_type_uses_bufferevent(TO_CONN(conn))) {
@@ -1440,6 +1579,34 @@ connection_or_tls_renegotiated_cb(tor_tls_t *tls, void *_conn)
   }
 }
 
+/** Called when the TLS handshake on <b>conn</b> is done and KernelTLS is
+ * set: note whether the kernel took over the record-layer crypto. */
+static void
+connection_or_note_ktls_offload(or_connection_t *conn)
+{
+  static int warned_unsupported = 0;
+  int send_offload, recv_offload;
+
+  if (tor_tls_get_ktls_offload(conn->tls, &send_offload, &recv_offload) < 0) {
+    if (!warned_unsupported) {
+      log_notice(LD_OR, "KernelTLS is set, but this version of OpenSSL "
+                 "can't hand TLS connections to the kernel. Doing the "
+                 "crypto ourselves.");
+      warned_unsupported = 1;
+    }
+    return;
+  }
+  if (send_offload)
+    metrics_incr(METRICS_TLS_KTLS_SEND);
+  if (recv_offload)
+    metrics_incr(METRICS_TLS_KTLS_RECV);
+  log_debug(LD_OR, "Kernel TLS on connection with %s:%u (%s): "
+            "send %s, receive %s.",
+            conn->base_.address, conn->base_.port,
+            tor_tls_get_ciphersuite_name(conn->tls),
+            send_offload ? "yes" : "no", recv_offload ? "yes" : "no");
+}
+
 /** Move forward with the tls handshake. If it finishes, hand
  * <b>conn</b> to connection_tls_finish_handshake().
  *
@@ -1465,8 +1632,17 @@ connection_tls_continue_handshake(or_connection_t *conn)
     CASE_TOR_TLS_ERROR_ANY:
     log_info(LD_OR,"tls error [%s]. breaking connection.",
              tor_tls_err_to_string(result));
+      metrics_incr(METRICS_TLS_HANDSHAKES_FAILED);
       return -1;
     case TOR_TLS_DONE:
+      if (conn->base_.state == OR_CONN_STATE_TLS_HANDSHAKING) {
+        metrics_incr(METRICS_TLS_HANDSHAKES_DONE);
+        metrics_incr(tor_tls_session_was_resumed(conn->tls) ?
+                     METRICS_TLS_HANDSHAKES_RESUMED :
+                     METRICS_TLS_HANDSHAKES_FULL);
+        if (get_options()->KernelTLS)
+          connection_or_note_ktls_offload(conn);
+      }
       if (! tor_tls_used_v1_handshake(conn->tls)) {
         if (!tor_tls_is_server(conn->tls)) {
           if (conn->base_.state == OR_CONN_STATE_TLS_HANDSHAKING) {
@@ -1878,6 +2054,13 @@ or_handshake_state_free(or_handshake_state_t *state)
 {
   if (!state)
     return;
+  if (state->auth_job) {
+    or_auth_job_t *job = state->auth_job;
+    if (job->workqueue_entry && workqueue_entry_cancel(job->workqueue_entry))
+      or_auth_job_free(job);
+    else
+      job->conn = NULL; /* or_auth_job_replyfn() will free it. */
+  }
   crypto_digest_free(state->digest_sent);
   crypto_digest_free(state->digest_received);
   tor_x509_cert_free(state->auth_cert);
@@ -1971,6 +2154,12 @@ or_handshake_state_record_var_cell(or_connection_t *conn,
 int
 connection_or_set_state_open(or_connection_t *conn)
 {
+  /* The relay has proven its identity by now, so it's safe to remember
+   * our session with it under that identity. */
+  if (conn->tls && !tor_tls_is_server(conn->tls) &&
+      connection_or_should_resume_tls(conn))
+    tor_tls_save_session(conn->tls, conn->identity_digest);
+
   connection_or_change_state(conn, OR_CONN_STATE_OPEN);
   control_event_or_conn_status(conn, OR_CONN_EVENT_CONNECTED, 0);
 
@@ -2002,6 +2191,9 @@ connection_or_write_cell_to_buf(const cell_t *cell, or_connection_t *conn)
 
   connection_write_to_buf(networkcell.body, cell_network_size, TO_CONN(conn));
 
+  connection_or_note_cell_queued(conn);
+  metrics_note_cell_sent(cell->command);
+
   /* Touch the channel's active timestamp if there is one */
   if (conn->chan)
     channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
@@ -2026,6 +2218,8 @@ connection_or_write_var_cell_to_buf,(const var_cell_t *cell,
   connection_write_to_buf(hdr, n, TO_CONN(conn));
   connection_write_to_buf((char*)cell->payload,
                           cell->payload_len, TO_CONN(conn));
+  connection_or_note_cell_queued(conn);
+  metrics_note_cell_sent(cell->command);
   if (conn->base_.state == OR_CONN_STATE_OR_HANDSHAKING_V3)
     or_handshake_state_record_var_cell(conn, conn->handshake_state, cell, 0);
 
@@ -2034,6 +2228,47 @@ connection_or_write_var_cell_to_buf,(const var_cell_t *cell,
     channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
 }
 
+/** Note that we just finished writing a cell onto <b>conn</b>'s outbuf, so
+ * that we can measure how long it waits there.  If we're already measuring
+ * OR_CONN_MAX_CELL_MARKS cells on this connection, don't measure this one:
+ * that keeps the cost per cell constant.
+ *
+ * Note that this doesn't give us an even sample.  When a burst of cells
+ * gets queued at once, we measure the first OR_CONN_MAX_CELL_MARKS of them
+ * and skip the rest, which wait behind them in the outbuf.  So the cells we
+ * skip are the ones likely to wait longest, and the latencies we report for
+ * busy connections are on the low side. */
+void
+connection_or_note_cell_queued(or_connection_t *conn)
+{
+  int idx;
+  if (!conn->base_.outbuf || conn->n_cell_marks == OR_CONN_MAX_CELL_MARKS)
+    return;
+  idx = (conn->cell_marks_head + conn->n_cell_marks) % OR_CONN_MAX_CELL_MARKS;
+  conn->cell_marks[idx].end =
+    conn->outbuf_bytes_flushed + buf_datalen(conn->base_.outbuf);
+  conn->cell_marks[idx].inserted_usec = cell_latency_timestamp();
+  ++conn->n_cell_marks;
+}
+
+/** Note that we just flushed <b>n</b> bytes from <b>conn</b>'s outbuf to
+ * TLS, and record the latency of any cells that are now completely
+ * flushed. */
+void
+connection_or_note_flushed_bytes(or_connection_t *conn, size_t n)
+{
+  conn->outbuf_bytes_flushed += n;
+  while (conn->n_cell_marks) {
+    const int head = conn->cell_marks_head;
+    if (conn->cell_marks[head].end > conn->outbuf_bytes_flushed)
+      break;
+    rep_hist_note_cell_latency(CELL_LATENCY_OUTBUF,
+                               conn->cell_marks[head].inserted_usec);
+    conn->cell_marks_head = (head + 1) % OR_CONN_MAX_CELL_MARKS;
+    --conn->n_cell_marks;
+  }
+}
+
 /** See whether there's a variable-length cell waiting on <b>or_conn</b>'s
  * inbuf.  Return values as for fetch_var_cell_from_buf(). */
 static int
@@ -2061,6 +2296,8 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
   var_cell_t *var_cell;
 
   while (1) {
+    if (conn->handshake_state && conn->handshake_state->auth_job)
+      return 0; /* or_auth_job_replyfn() will get back to us. */
     log_debug(LD_OR,
               TOR_SOCKET_T_FORMAT": starting, inbuf_datalen %d "
               "(%d pending in tls object).",
@@ -2477,6 +2714,26 @@ connection_or_compute_authenticate_cell_body(or_connection_t *conn,
   return result;
 }
 
+/** Return a new AUTHENTICATE cell of type AUTHTYPE_RSA_SHA256_TLSSECRET,
+ * with room for an authenticator signed by <b>pk</b>. */
+static var_cell_t *
+authenticate_cell_new(crypto_pk_t *pk)
+{
+  var_cell_t *cell;
+  size_t cell_maxlen;
+
+  cell_maxlen = 4 + /* overhead */
+    V3_AUTH_BODY_LEN + /* Authentication body */
+    crypto_pk_keysize(pk) + /* Max signature length */
+    16 /* add a few extra bytes just in case. */;
+
+  cell = var_cell_new(cell_maxlen);
+  cell->command = CELL_AUTHENTICATE;
+  set_uint16(cell->payload, htons(AUTHTYPE_RSA_SHA256_TLSSECRET));
+  /* skip over length ; we don't know that yet. */
+  return cell;
+}
+
 /** Send an AUTHENTICATE cell on the connection <b>conn</b>.  Return 0 on
  * success, -1 on failure */
 MOCK_IMPL(int,
@@ -2485,7 +2742,6 @@ connection_or_send_authenticate_cell,(or_connection_t *conn, int authtype))
   var_cell_t *cell;
   crypto_pk_t *pk = tor_tls_get_my_client_auth_key();
   int authlen;
-  size_t cell_maxlen;
   /* XXXX make sure we're actually supposed to send this! */
 
   if (!pk) {
@@ -2498,19 +2754,10 @@ connection_or_send_authenticate_cell,(or_connection_t *conn, int authtype))
     return -1;
   }
 
-  cell_maxlen = 4 + /* overhead */
-    V3_AUTH_BODY_LEN + /* Authentication body */
-    crypto_pk_keysize(pk) + /* Max signature length */
-    16 /* add a few extra bytes just in case. */;
-
-  cell = var_cell_new(cell_maxlen);
-  cell->command = CELL_AUTHENTICATE;
-  set_uint16(cell->payload, htons(AUTHTYPE_RSA_SHA256_TLSSECRET));
-  /* skip over length ; we don't know that yet. */
-
+  cell = authenticate_cell_new(pk);
   authlen = connection_or_compute_authenticate_cell_body(conn,
                                                          cell->payload+4,
-                                                         cell_maxlen-4,
+                                                         cell->payload_len-4,
                                                          pk,
                                                          0 /* not server */);
   if (authlen < 0) {
@@ -2528,3 +2775,153 @@ connection_or_send_authenticate_cell,(or_connection_t *conn, int authtype))
   return 0;
 }
 
+/** Return a new job to make an AUTHENTICATE cell for <b>conn</b>, signed
+ * with <b>pk</b>.  Everything but the signature is done by the time we
+ * return.  Return NULL on failure. */
+STATIC or_auth_job_t *
+or_auth_job_new(or_connection_t *conn, crypto_pk_t *pk)
+{
+  or_auth_job_t *job = tor_malloc_zero(sizeof(or_auth_job_t));
+
+  job->cell = authenticate_cell_new(pk);
+  job->body_len =
+    connection_or_compute_authenticate_cell_body(conn,
+                                                 job->cell->payload+4,
+                                                 job->cell->payload_len-4,
+                                                 NULL, 0 /* not server */);
+  if (job->body_len < 0) {
+    log_warn(LD_BUG, "Unable to compute authenticate cell!");
+    or_auth_job_free(job);
+    return NULL;
+  }
+  job->conn = conn;
+  job->signing_key = crypto_pk_copy_full(pk);
+  job->auth_len = -1;
+  return job;
+}
+
+/** Sign the authenticator in <b>job</b> and finish its cell.  Return 0 on
+ * success, or -1 on failure.
+ *
+ * This runs in a worker thread, so it may only touch <b>job</b>.
+ */
+STATIC int
+or_auth_job_sign(or_auth_job_t *job)
+{
+  var_cell_t *cell = job->cell;
+  char *body = (char*)cell->payload + 4;
+  char d[32];
+  int siglen;
+
+  crypto_digest256(d, body, job->body_len, DIGEST_SHA256);
+  siglen = crypto_pk_private_sign(job->signing_key,
+                                  body + job->body_len,
+                                  cell->payload_len - 4 - job->body_len,
+                                  d, 32);
+  if (siglen < 0) {
+    job->auth_len = -1;
+    return -1;
+  }
+
+  job->auth_len = job->body_len + siglen;
+  set_uint16(cell->payload+2, htons(job->auth_len));
+  cell->payload_len = job->auth_len + 4;
+  return 0;
+}
+
+/** Release all storage held by <b>job</b>. */
+STATIC void
+or_auth_job_free(or_auth_job_t *job)
+{
+  if (!job)
+    return;
+  crypto_pk_free(job->signing_key);
+  var_cell_free(job->cell);
+  memwipe(job, 0, sizeof(*job));
+  tor_free(job);
+}
+
+/** Worker thread callback: sign the AUTHENTICATE cell in a job. */
+STATIC int
+or_auth_job_threadfn(void *state, void *arg)
+{
+  (void)state;
+  or_auth_job_sign(arg);
+  return WQ_RPL_REPLY;
+}
+
+/** Main thread callback: send the AUTHENTICATE cell that a worker thread
+ * has signed, and the NETINFO cell that goes after it.  Then go back to
+ * reading cells from the connection. */
+STATIC void
+or_auth_job_replyfn(void *arg)
+{
+  or_auth_job_t *job = arg;
+  or_connection_t *conn = job->conn;
+
+  job->workqueue_entry = NULL;
+  if (!conn)
+    goto done; /* The connection went away. */
+  tor_assert(conn->handshake_state);
+  tor_assert(conn->handshake_state->auth_job == job);
+  conn->handshake_state->auth_job = NULL;
+  if (conn->base_.marked_for_close)
+    goto done;
+
+  if (job->auth_len < 0) {
+    log_warn(LD_OR, "Unable to sign AUTH1 data.");
+    connection_or_close_for_error(conn, 0);
+    goto done;
+  }
+  connection_or_write_var_cell_to_buf(job->cell, conn);
+  if (connection_or_send_netinfo(conn) < 0) {
+    log_warn(LD_OR, "Couldn't send netinfo cell");
+    connection_or_close_for_error(conn, 0);
+    goto done;
+  }
+
+  if (!conn->base_.read_blocked_on_bw)
+    connection_start_reading(TO_CONN(conn));
+  /* Handle anything that arrived before we stopped reading. */
+  connection_or_process_inbuf(conn);
+
+ done:
+  or_auth_job_free(job);
+}
+
+/** If AsyncLinkHandshakes is set and we have worker threads, start making
+ * an AUTHENTICATE cell of type <b>authtype</b> for <b>conn</b>, and leave
+ * the signature to a worker thread.  We stop reading from <b>conn</b> until
+ * the worker is done; then we send the AUTHENTICATE cell and our NETINFO
+ * cell.
+ *
+ * Return 1 if we queued the job, 0 if the caller should send the cell
+ * itself with connection_or_send_authenticate_cell(), or -1 on failure.
+ */
+int
+connection_or_queue_authenticate_cell(or_connection_t *conn, int authtype)
+{
+  crypto_pk_t *pk = tor_tls_get_my_client_auth_key();
+  or_auth_job_t *job;
+
+  if (!get_options()->AsyncLinkHandshakes ||
+      authtype != AUTHTYPE_RSA_SHA256_TLSSECRET || !pk)
+    return 0;
+  tor_assert(conn->handshake_state);
+  tor_assert(!conn->handshake_state->auth_job);
+
+  if (!(job = or_auth_job_new(conn, pk)))
+    return -1;
+  job->workqueue_entry = cpuworker_queue_work(or_auth_job_threadfn,
+                                              or_auth_job_replyfn, job);
+  if (!job->workqueue_entry) {
+    /* No worker threads; do it the slow way. */
+    or_auth_job_free(job);
+    return 0;
+  }
+
+  conn->handshake_state->auth_job = job;
+  connection_stop_reading(TO_CONN(conn));
+  return 1;
+}
+
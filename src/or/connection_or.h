@@ -26,6 +26,10 @@ int connection_or_reached_eof(or_connection_t *conn);
 int connection_or_process_inbuf(or_connection_t *conn);
 ssize_t connection_or_num_cells_writeable(or_connection_t *conn);
 int connection_or_flushed_some(or_connection_t *conn);
+int connection_or_should_hold_write(or_connection_t *conn);
+int connection_or_write_is_held(const or_connection_t *conn);
+void connection_or_clear_held_write(or_connection_t *conn);
+void connection_or_free_held_writes(void);
 int connection_or_finished_flushing(or_connection_t *conn);
 int connection_or_finished_connecting(or_connection_t *conn);
 void connection_or_about_to_close(or_connection_t *conn);
@@ -80,6 +84,8 @@ void connection_or_write_cell_to_buf(const cell_t *cell,
                                      or_connection_t *conn);
 MOCK_DECL(void,connection_or_write_var_cell_to_buf,(const var_cell_t *cell,
                                                    or_connection_t *conn));
+void connection_or_note_cell_queued(or_connection_t *conn);
+void connection_or_note_flushed_bytes(or_connection_t *conn, size_t n);
 int connection_or_send_versions(or_connection_t *conn, int v3_plus);
 MOCK_DECL(int,connection_or_send_netinfo,(or_connection_t *conn));
 int connection_or_send_certs_cell(or_connection_t *conn);
@@ -90,6 +96,8 @@ int connection_or_compute_authenticate_cell_body(or_connection_t *conn,
                                                  int server);
 MOCK_DECL(int,connection_or_send_authenticate_cell,
           (or_connection_t *conn, int type));
+int connection_or_queue_authenticate_cell(or_connection_t *conn,
+                                          int authtype);
 
 int is_or_protocol_version_known(uint16_t version);
 
@@ -102,5 +110,40 @@ void var_cell_free(var_cell_t *cell);
 /** DOCDOC */
 #define MIN_LINK_PROTO_FOR_WIDE_CIRC_IDS 4
 
+#ifdef CONNECTION_OR_PRIVATE
+/** An AUTHENTICATE cell whose expensive part (the signature) we make in a
+ * worker thread. */
+typedef struct or_auth_job_t {
+  /* Set in the main thread before the job is queued. */
+  /** The connection that we're authenticating on, or NULL if it has gone
+   * away while a worker thread was busy with this job. */
+  or_connection_t *conn;
+  /** A private copy of our link authentication key. */
+  crypto_pk_t *signing_key;
+  /** The cell we're building, with room for the signature.  Its body
+   * starts with the part of the authenticator that gets signed. */
+  var_cell_t *cell;
+  /** Length of the part of the authenticator that gets signed. */
+  int body_len;
+
+  /* Set by or_auth_job_sign(). */
+  /** Length of the whole authenticator, or -1 if we couldn't sign it. */
+  int auth_len;
+
+  /** The queued work if this job is in the threadpool, else NULL. */
+  struct workqueue_entry_s *workqueue_entry;
+} or_auth_job_t;
+
+STATIC or_auth_job_t *or_auth_job_new(or_connection_t *conn,
+                                      crypto_pk_t *pk);
+STATIC int or_auth_job_sign(or_auth_job_t *job);
+STATIC void or_auth_job_free(or_auth_job_t *job);
+STATIC int or_auth_job_threadfn(void *state, void *arg);
+STATIC void or_auth_job_replyfn(void *arg);
+
+STATIC void release_held_writes_cb(evutil_socket_t fd, short events,
+                                   void *arg);
+#endif
+
 #endif
 
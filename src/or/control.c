@@ -1548,6 +1548,8 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
                  U64_PRINTF_ARG(get_options()->MaxMemInQueues));
   } else if (!strcmp(question, "dir-usage")) {
     *answer = directory_dump_request_log();
+  } else if (!strcmp(question, "stats/cell-latency")) {
+    *answer = rep_hist_get_cell_latency_str();
   } else if (!strcmp(question, "fingerprint")) {
     crypto_pk_t *server_key;
     if (!server_mode(get_options())) {
@@ -1733,6 +1735,19 @@ getinfo_helper_dir(control_connection_t *control_conn,
     *answer = smartlist_join_strings(sl, "", 0, NULL);
     SMARTLIST_FOREACH(sl, char *, c, tor_free(c));
     smartlist_free(sl);
+  } else if (!strcmp(question, "hs/client/desc/cache-stats") ||
+             !strcmp(question, "hs/dir/desc/cache-stats")) {
+    const int as_dir = !strcmpstart(question, "hs/dir/");
+    rend_cache_stats_t stats;
+    rend_cache_get_stats(as_dir, &stats);
+    tor_asprintf(answer, "bytes=%lu max-bytes=%lu entries=%d hits="U64_FORMAT
+                 " misses="U64_FORMAT" evictions="U64_FORMAT,
+                 (unsigned long)stats.allocation,
+                 (unsigned long)rend_cache_get_max_allocation(as_dir),
+                 stats.n_entries,
+                 U64_PRINTF_ARG(stats.n_hits),
+                 U64_PRINTF_ARG(stats.n_misses),
+                 U64_PRINTF_ARG(stats.n_evictions));
   } else if (!strcmpstart(question, "hs/client/desc/id/")) {
     rend_cache_entry_t *e = NULL;
 
@@ -2303,6 +2318,10 @@ static const getinfo_item_t getinfo_items[] = {
   PREFIX("extra-info/digest/", dir, "Extra-info documents by digest."),
   PREFIX("hs/client/desc/id", dir,
          "Hidden Service descriptor in client's cache by onion."),
+  ITEM("hs/client/desc/cache-stats", dir,
+       "Size, hits, misses, and evictions of the client's descriptor cache."),
+  ITEM("hs/dir/desc/cache-stats", dir,
+       "Size, hits, misses, and evictions of the HSDir descriptor cache."),
   PREFIX("net/listeners/", listeners, "Bound addresses by type"),
   ITEM("ns/all", networkstatus,
        "Brief summary of router status (v2 directory format)"),
@@ -2358,6 +2377,8 @@ static const getinfo_item_t getinfo_items[] = {
   ITEM("process/descriptor-limit", misc, "File descriptor limit."),
   ITEM("limits/max-mem-in-queues", misc, "Actual limit on memory in queues"),
   ITEM("dir-usage", misc, "Breakdown of bytes transferred over DirPort."),
+  ITEM("stats/cell-latency", misc,
+       "How long cells have waited in each queue, in microseconds."),
   PREFIX("desc-annotations/id/", dir, "Router annotations by hexdigest."),
   PREFIX("dir/server/", dir,"Router descriptors as retrieved from a DirPort."),
   PREFIX("dir/status/", dir,
@@ -8,7 +8,9 @@
  * \brief Uses the workqueue/threadpool code to farm CPU-intensive activities
  * out to subprocesses.
  *
- * Right now, we only use this for processing onionskins.
+ * We use this for processing onionskins, and for other jobs (such as
+ * rebuilding the microdescriptor cache) that would otherwise stall the main
+ * thread; see cpuworker_queue_work().
  **/
 #include "or.h"
 #include "channel.h"
@@ -18,9 +20,11 @@
 #include "config.h"
 #include "cpuworker.h"
 #include "main.h"
+#include "metrics.h"
 #include "onion.h"
 #include "rephist.h"
 #include "router.h"
+#include "trace.h"
 #include "workqueue.h"
 
 #ifdef HAVE_EVENT2_EVENT_H
@@ -42,7 +46,9 @@ worker_state_new(void *arg)
   worker_state_t *ws;
   (void)arg;
   ws = tor_malloc_zero(sizeof(worker_state_t));
-  ws->onion_keys = server_onion_keys_new();
+  /* Without onion keys, we can still do work that doesn't need them. */
+  if (server_mode(get_options()))
+    ws->onion_keys = server_onion_keys_new();
   return ws;
 }
 static void
@@ -304,6 +310,7 @@ cpuworker_onion_handshake_replyfn(void *work_)
   cpuworker_job_t *job = work_;
   cpuworker_reply_t rpl;
   or_circuit_t *circ = NULL;
+  int64_t usec_roundtrip = 0;
 
   tor_assert(total_pending_tasks > 0);
   --total_pending_tasks;
@@ -318,7 +325,6 @@ cpuworker_onion_handshake_replyfn(void *work_)
     /* Time how long this request took. The handshake_type check should be
        needless, but let's leave it in to be safe. */
     struct timeval tv_end, tv_diff;
-    int64_t usec_roundtrip;
     tor_gettimeofday(&tv_end);
     timersub(&tv_end, &rpl.started_at, &tv_diff);
     usec_roundtrip = ((int64_t)tv_diff.tv_sec)*1000000 + tv_diff.tv_usec;
@@ -337,6 +343,9 @@ cpuworker_onion_handshake_replyfn(void *work_)
     }
   }
 
+  tor_trace(TRACE_EV_CPUWORKER_REPLY, rpl.handshake_type,
+            usec_roundtrip > 0 ? usec_roundtrip : 0);
+
   circ = job->circ;
 
   log_debug(LD_OR,
@@ -348,8 +357,7 @@ cpuworker_onion_handshake_replyfn(void *work_)
      * pending. Instead, it got left for us to free so that we wouldn't freak
      * out when the job->circ field wound up pointing to nothing. */
     log_debug(LD_OR, "Circuit died while reply was pending. Freeing memory.");
-    circ->base_.magic = 0;
-    tor_free(circ);
+    or_circuit_free_dead(circ);
     goto done_processing;
   }
 
@@ -362,6 +370,7 @@ cpuworker_onion_handshake_replyfn(void *work_)
   }
 
   if (rpl.success == 0) {
+    metrics_incr(METRICS_ONIONSKINS_FAILED);
     log_debug(LD_OR,
               "decoding onionskin failed. "
               "(Old key or bad software.) Closing.");
@@ -378,6 +387,7 @@ cpuworker_onion_handshake_replyfn(void *work_)
     goto done_processing;
   }
   log_debug(LD_OR,"onionskin_answer succeeded. Yay.");
+  metrics_incr(METRICS_ONIONSKINS_PROCESSED);
 
  done_processing:
   memwipe(&rpl, 0, sizeof(rpl));
@@ -412,12 +422,15 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
   rpl.handshake_type = cc->handshake_type;
   if (req.timed)
     tor_gettimeofday(&tv_start);
-  n = onion_skin_server_handshake(cc->handshake_type,
-                                  cc->onionskin, cc->handshake_len,
-                                  onion_keys,
-                                  cell_out->reply,
-                                  rpl.keys, CPATH_KEY_MATERIAL_LEN,
-                                  rpl.rend_auth_material);
+  if (onion_keys)
+    n = onion_skin_server_handshake(cc->handshake_type,
+                                    cc->onionskin, cc->handshake_len,
+                                    onion_keys,
+                                    cell_out->reply,
+                                    rpl.keys, CPATH_KEY_MATERIAL_LEN,
+                                    rpl.rend_auth_material);
+  else
+    n = -1; /* We aren't a server any more. */
   if (n < 0) {
     /* failure */
     log_debug(LD_OR,"onion_skin_server_handshake failed.");
@@ -530,6 +543,9 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
   memwipe(&req, 0, sizeof(req));
 
   ++total_pending_tasks;
+  tor_trace(TRACE_EV_CPUWORKER_ASSIGN,
+            job->u.request.create_cell.handshake_type,
+            total_pending_tasks);
   queue_entry = threadpool_queue_work(threadpool,
                                       cpuworker_onion_handshake_threadfn,
                                       cpuworker_onion_handshake_replyfn,
@@ -569,3 +585,18 @@ cpuworker_cancel_circ_handshake(or_circuit_t *circ)
   }
 }
 
+/** Queue <b>fn</b> to run on <b>arg</b> in one of the worker threads; once
+ * it is done, <b>reply_fn</b> will run on <b>arg</b> in the main thread.
+ * <b>fn</b> must not touch any state that the main thread might be using.
+ * Return the queued work on success, or NULL if we have no worker threads
+ * (as on a client) or we couldn't queue the work. */
+MOCK_IMPL(workqueue_entry_t *,
+cpuworker_queue_work,(int (*fn)(void *, void *),
+                      void (*reply_fn)(void *),
+                      void *arg))
+{
+  if (!threadpool)
+    return NULL;
+  return threadpool_queue_work(threadpool, fn, reply_fn, arg);
+}
+
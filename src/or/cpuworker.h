@@ -25,5 +25,9 @@ void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
+struct workqueue_entry_s;
+MOCK_DECL(struct workqueue_entry_s *, cpuworker_queue_work,
+          (int (*fn)(void *, void *), void (*reply_fn)(void *), void *arg));
+
 #endif
 
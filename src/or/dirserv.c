@@ -1854,6 +1854,9 @@ version_from_platform(const char *platform)
  *   NS_V3_VOTE - Output a complete V3 NS vote. If <b>vrs</b> is present,
  *        it contains additional information for the vote.
  *   NS_CONTROL_PORT - Output a NS document for the control port
+ *
+ * With NS_V3_CONSENSUS or NS_V3_CONSENSUS_MICRODESC, this function doesn't
+ * look at any global state, so it's safe to call from a worker thread.
  */
 char *
 routerstatus_format_entry(const routerstatus_t *rs, const char *version,
@@ -1866,11 +1869,15 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
   char published[ISO_TIME_LEN+1];
   char identity64[BASE64_DIGEST_LEN+1];
   char digest64[BASE64_DIGEST_LEN+1];
+  char ipaddr[INET_NTOA_BUF_LEN];
+  struct in_addr in;
   smartlist_t *chunks = smartlist_new();
 
   format_iso_time(published, rs->published_on);
   digest_to_base64(identity64, rs->identity_digest);
   digest_to_base64(digest64, rs->descriptor_digest);
+  in.s_addr = htonl(rs->addr);
+  tor_inet_ntoa(&in, ipaddr, sizeof(ipaddr));
 
   smartlist_add_asprintf(chunks,
                    "r %s %s %s%s%s %s %d %d\n",
@@ -1879,7 +1886,7 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
                    (format==NS_V3_CONSENSUS_MICRODESC)?"":digest64,
                    (format==NS_V3_CONSENSUS_MICRODESC)?"":" ",
                    published,
-                   fmt_addr32(rs->addr),
+                   ipaddr,
                    (int)rs->or_port,
                    (int)rs->dir_port);
 
@@ -1894,8 +1901,10 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
 
   /* Possible "a" line. At most one for now. */
   if (!tor_addr_is_null(&rs->ipv6_addr)) {
-    smartlist_add_asprintf(chunks, "a %s\n",
-                           fmt_addrport(&rs->ipv6_addr, rs->ipv6_orport));
+    char ipv6addr[TOR_ADDR_BUF_LEN];
+    tor_addr_to_str(ipv6addr, &rs->ipv6_addr, sizeof(ipv6addr), 1);
+    smartlist_add_asprintf(chunks, "a %s:%d\n",
+                           ipv6addr, (int)rs->ipv6_orport);
   }
 
   if (format == NS_V3_CONSENSUS)
@@ -0,0 +1,956 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file dirsnapshot.c
+ * \brief Save parsed directory documents in a binary form that we can load
+ * at startup without parsing or verifying them again.
+ *
+ * When we start, we reload our cached consensus and microdescriptors.
+ * Parsing them is most of the time that it takes us to become useful, and
+ * we already checked them the first time we loaded them.  So whenever we
+ * parse one of these files in full, we also write a "snapshot" file next to
+ * it, holding the parsed contents.
+ *
+ * Each snapshot starts with a header that names the format version, the
+ * SHA256 digest of the document it was made from, a digest of anything else
+ * that its contents depend on, and a digest of the snapshot itself.  When
+ * any of these don't match, or anything else is wrong with the snapshot, we
+ * ignore it and parse the original document as usual.
+ *
+ * A snapshot is only as trustworthy as the DataDirectory that it lives in;
+ * but so is everything else there.
+ **/
+
+#define DIRSNAPSHOT_PRIVATE
+#include "or.h"
+#include "dirsnapshot.h"
+#include "microdesc.h"
+#include "networkstatus.h"
+#include "policies.h"
+#include "routerlist.h"
+
+/** A growable buffer that we encode a snapshot body into. */
+typedef struct snap_out_t {
+  char *buf; /**< The encoded bytes. */
+  size_t len; /**< Number of bytes used in <b>buf</b>. */
+  size_t alloc; /**< Number of bytes allocated for <b>buf</b>. */
+} snap_out_t;
+
+/** A position in a snapshot body that we're decoding. */
+typedef struct snap_in_t {
+  const char *cp; /**< Next byte to decode. */
+  const char *end; /**< End of the body. */
+  /** True if we've tried to read past the end of the body, or found
+   * something malformed. */
+  int bad;
+} snap_in_t;
+
+/** Encoded length of a string or list that isn't there at all, as opposed
+ * to one that is empty. */
+#define SNAP_ABSENT 0xffffffffu
+
+/** Append the <b>n</b> bytes at <b>p</b> to <b>out</b>. */
+static void
+out_bytes(snap_out_t *out, const void *p, size_t n)
+{
+  if (out->len + n > out->alloc) {
+    while (out->len + n > out->alloc)
+      out->alloc = out->alloc ? out->alloc * 2 : 4096;
+    out->buf = tor_realloc(out->buf, out->alloc);
+  }
+  memcpy(out->buf + out->len, p, n);
+  out->len += n;
+}
+
+/** Append <b>v</b> to <b>out</b>. */
+static void
+out_u8(snap_out_t *out, uint8_t v)
+{
+  out_bytes(out, &v, 1);
+}
+
+/** Append <b>v</b> to <b>out</b>, in network order. */
+static void
+out_u16(snap_out_t *out, uint16_t v)
+{
+  char b[2];
+  set_uint16(b, htons(v));
+  out_bytes(out, b, 2);
+}
+
+/** Append <b>v</b> to <b>out</b>, in network order. */
+static void
+out_u32(snap_out_t *out, uint32_t v)
+{
+  char b[4];
+  set_uint32(b, htonl(v));
+  out_bytes(out, b, 4);
+}
+
+/** Append <b>v</b> to <b>out</b>, in network order. */
+static void
+out_u64(snap_out_t *out, uint64_t v)
+{
+  out_u32(out, (uint32_t)(v >> 32));
+  out_u32(out, (uint32_t)v);
+}
+
+/** Append the <b>len</b>-byte string <b>s</b> to <b>out</b>, preceded by
+ * its length.  If <b>s</b> is NULL, record that it's absent. */
+static void
+out_mem(snap_out_t *out, const char *s, size_t len)
+{
+  if (!s) {
+    out_u32(out, SNAP_ABSENT);
+    return;
+  }
+  tor_assert(len < SNAP_ABSENT);
+  out_u32(out, (uint32_t)len);
+  out_bytes(out, s, len);
+}
+
+/** Append the NUL-terminated string <b>s</b>, or NULL, to <b>out</b>. */
+static void
+out_string(snap_out_t *out, const char *s)
+{
+  out_mem(out, s, s ? strlen(s) : 0);
+}
+
+/** Append the list of strings <b>sl</b>, or NULL, to <b>out</b>. */
+static void
+out_strlist(snap_out_t *out, const smartlist_t *sl)
+{
+  if (!sl) {
+    out_u32(out, SNAP_ABSENT);
+    return;
+  }
+  out_u32(out, smartlist_len(sl));
+  SMARTLIST_FOREACH(sl, const char *, s, out_string(out, s));
+}
+
+/** Append <b>addr</b> and <b>port</b> to <b>out</b>, if <b>addr</b> is an
+ * IPv6 address; otherwise record that there is no address. */
+static void
+out_ipv6(snap_out_t *out, const tor_addr_t *addr, uint16_t port)
+{
+  if (tor_addr_family(addr) != AF_INET6) {
+    out_u8(out, 0);
+    return;
+  }
+  out_u8(out, 1);
+  out_bytes(out, tor_addr_to_in6_addr8(addr), 16);
+  out_u16(out, port);
+}
+
+/** Consume <b>n</b> bytes from <b>in</b> and return a pointer to them, or
+ * return NULL and mark <b>in</b> as bad if there aren't enough. */
+static const char *
+in_bytes(snap_in_t *in, size_t n)
+{
+  const char *p = in->cp;
+  if (in->bad || (size_t)(in->end - in->cp) < n) {
+    in->bad = 1;
+    return NULL;
+  }
+  in->cp += n;
+  return p;
+}
+
+/** Consume <b>n</b> bytes from <b>in</b> into <b>out</b>.  On failure,
+ * zero <b>out</b>. */
+static void
+in_copy(snap_in_t *in, void *out, size_t n)
+{
+  const char *p = in_bytes(in, n);
+  if (p)
+    memcpy(out, p, n);
+  else
+    memset(out, 0, n);
+}
+
+/** Consume and return a byte from <b>in</b>. */
+static uint8_t
+in_u8(snap_in_t *in)
+{
+  const char *p = in_bytes(in, 1);
+  return p ? (uint8_t)*p : 0;
+}
+
+/** Consume and return a 16-bit value from <b>in</b>. */
+static uint16_t
+in_u16(snap_in_t *in)
+{
+  const char *p = in_bytes(in, 2);
+  return p ? ntohs(get_uint16(p)) : 0;
+}
+
+/** Consume and return a 32-bit value from <b>in</b>. */
+static uint32_t
+in_u32(snap_in_t *in)
+{
+  const char *p = in_bytes(in, 4);
+  return p ? ntohl(get_uint32(p)) : 0;
+}
+
+/** Consume and return a 64-bit value from <b>in</b>. */
+static uint64_t
+in_u64(snap_in_t *in)
+{
+  uint64_t hi = in_u32(in);
+  return (hi << 32) | in_u32(in);
+}
+
+/** Consume a count of items from <b>in</b>, each of which takes at least one
+ * byte.  Return SNAP_ABSENT if the items are absent, and mark <b>in</b> as
+ * bad if there can't be that many. */
+static uint32_t
+in_count(snap_in_t *in)
+{
+  uint32_t n = in_u32(in);
+  if (n != SNAP_ABSENT && n > (size_t)(in->end - in->cp))
+    in->bad = 1;
+  return in->bad ? 0 : n;
+}
+
+/** Consume a string from <b>in</b>, and return a newly allocated
+ * NUL-terminated copy of it, or NULL if it was absent.  If
+ * <b>len_out</b> is provided, set it to the length of the string. */
+static char *
+in_mem(snap_in_t *in, size_t *len_out)
+{
+  uint32_t len = in_u32(in);
+  const char *p;
+  if (len_out)
+    *len_out = 0;
+  if (in->bad || len == SNAP_ABSENT)
+    return NULL;
+  if (!(p = in_bytes(in, len)))
+    return NULL;
+  if (len_out)
+    *len_out = len;
+  return tor_memdup_nulterm(p, len);
+}
+
+/** Consume a string from <b>in</b>, as in_mem(). */
+static char *
+in_string(snap_in_t *in)
+{
+  return in_mem(in, NULL);
+}
+
+/** Consume a list of strings from <b>in</b> and return it, or NULL if it
+ * was absent. */
+static smartlist_t *
+in_strlist(snap_in_t *in)
+{
+  smartlist_t *sl;
+  uint32_t i, n = in_count(in);
+  if (n == SNAP_ABSENT || in->bad)
+    return NULL;
+  sl = smartlist_new();
+  for (i = 0; i < n && !in->bad; ++i) {
+    char *s = in_string(in);
+    if (s)
+      smartlist_add(sl, s);
+  }
+  return sl;
+}
+
+/** Consume an IPv6 address and port from <b>in</b> into <b>addr</b> and
+ * <b>port</b>. */
+static void
+in_ipv6(snap_in_t *in, tor_addr_t *addr, uint16_t *port)
+{
+  const char *p;
+  tor_addr_make_unspec(addr);
+  *port = 0;
+  if (!in_u8(in))
+    return;
+  if ((p = in_bytes(in, 16)))
+    tor_addr_from_ipv6_bytes(addr, p);
+  *port = in_u16(in);
+}
+
+/* Bits for the flags of an encoded routerstatus_t. */
+#define RS_IS_AUTHORITY                (1u<<0)
+#define RS_IS_EXIT                     (1u<<1)
+#define RS_IS_STABLE                   (1u<<2)
+#define RS_IS_FAST                     (1u<<3)
+#define RS_IS_FLAGGED_RUNNING          (1u<<4)
+#define RS_IS_NAMED                    (1u<<5)
+#define RS_IS_UNNAMED                  (1u<<6)
+#define RS_IS_VALID                    (1u<<7)
+#define RS_IS_POSSIBLE_GUARD           (1u<<8)
+#define RS_IS_BAD_EXIT                 (1u<<9)
+#define RS_IS_HS_DIR                   (1u<<10)
+#define RS_VERSION_KNOWN               (1u<<11)
+#define RS_VERSION_SUPPORTS_EXTEND2    (1u<<12)
+#define RS_HAS_BANDWIDTH               (1u<<13)
+#define RS_HAS_EXITSUMMARY             (1u<<14)
+#define RS_BW_IS_UNMEASURED            (1u<<15)
+#define RS_HAS_GUARDFRACTION           (1u<<16)
+
+/** Append the consensus entry <b>rs</b> to <b>out</b>. */
+static void
+encode_routerstatus(snap_out_t *out, const routerstatus_t *rs)
+{
+  uint32_t flags =
+    (rs->is_authority ? RS_IS_AUTHORITY : 0) |
+    (rs->is_exit ? RS_IS_EXIT : 0) |
+    (rs->is_stable ? RS_IS_STABLE : 0) |
+    (rs->is_fast ? RS_IS_FAST : 0) |
+    (rs->is_flagged_running ? RS_IS_FLAGGED_RUNNING : 0) |
+    (rs->is_named ? RS_IS_NAMED : 0) |
+    (rs->is_unnamed ? RS_IS_UNNAMED : 0) |
+    (rs->is_valid ? RS_IS_VALID : 0) |
+    (rs->is_possible_guard ? RS_IS_POSSIBLE_GUARD : 0) |
+    (rs->is_bad_exit ? RS_IS_BAD_EXIT : 0) |
+    (rs->is_hs_dir ? RS_IS_HS_DIR : 0) |
+    (rs->version_known ? RS_VERSION_KNOWN : 0) |
+    (rs->version_supports_extend2_cells ? RS_VERSION_SUPPORTS_EXTEND2 : 0) |
+    (rs->has_bandwidth ? RS_HAS_BANDWIDTH : 0) |
+    (rs->has_exitsummary ? RS_HAS_EXITSUMMARY : 0) |
+    (rs->bw_is_unmeasured ? RS_BW_IS_UNMEASURED : 0) |
+    (rs->has_guardfraction ? RS_HAS_GUARDFRACTION : 0);
+
+  out_u64(out, (uint64_t)rs->published_on);
+  out_string(out, rs->nickname);
+  out_bytes(out, rs->identity_digest, DIGEST_LEN);
+  out_bytes(out, rs->descriptor_digest, DIGEST256_LEN);
+  out_u32(out, rs->addr);
+  out_u16(out, rs->or_port);
+  out_u16(out, rs->dir_port);
+  out_ipv6(out, &rs->ipv6_addr, rs->ipv6_orport);
+  out_u32(out, flags);
+  out_u32(out, rs->bandwidth_kb);
+  out_u32(out, rs->guardfraction_percentage);
+  out_string(out, rs->exitsummary);
+}
+
+/** Decode and return a consensus entry from <b>in</b>, or return NULL on
+ * failure. */
+static routerstatus_t *
+decode_routerstatus(snap_in_t *in)
+{
+  routerstatus_t *rs = tor_malloc_zero(sizeof(routerstatus_t));
+  char *nickname;
+  uint32_t flags;
+
+  rs->published_on = (time_t)in_u64(in);
+  nickname = in_string(in);
+  if (!nickname || strlen(nickname) > MAX_NICKNAME_LEN)
+    in->bad = 1;
+  else
+    strlcpy(rs->nickname, nickname, sizeof(rs->nickname));
+  tor_free(nickname);
+  in_copy(in, rs->identity_digest, DIGEST_LEN);
+  in_copy(in, rs->descriptor_digest, DIGEST256_LEN);
+  rs->addr = in_u32(in);
+  rs->or_port = in_u16(in);
+  rs->dir_port = in_u16(in);
+  in_ipv6(in, &rs->ipv6_addr, &rs->ipv6_orport);
+  flags = in_u32(in);
+  rs->is_authority = !!(flags & RS_IS_AUTHORITY);
+  rs->is_exit = !!(flags & RS_IS_EXIT);
+  rs->is_stable = !!(flags & RS_IS_STABLE);
+  rs->is_fast = !!(flags & RS_IS_FAST);
+  rs->is_flagged_running = !!(flags & RS_IS_FLAGGED_RUNNING);
+  rs->is_named = !!(flags & RS_IS_NAMED);
+  rs->is_unnamed = !!(flags & RS_IS_UNNAMED);
+  rs->is_valid = !!(flags & RS_IS_VALID);
+  rs->is_possible_guard = !!(flags & RS_IS_POSSIBLE_GUARD);
+  rs->is_bad_exit = !!(flags & RS_IS_BAD_EXIT);
+  rs->is_hs_dir = !!(flags & RS_IS_HS_DIR);
+  rs->version_known = !!(flags & RS_VERSION_KNOWN);
+  rs->version_supports_extend2_cells =
+    !!(flags & RS_VERSION_SUPPORTS_EXTEND2);
+  rs->has_bandwidth = !!(flags & RS_HAS_BANDWIDTH);
+  rs->has_exitsummary = !!(flags & RS_HAS_EXITSUMMARY);
+  rs->bw_is_unmeasured = !!(flags & RS_BW_IS_UNMEASURED);
+  rs->has_guardfraction = !!(flags & RS_HAS_GUARDFRACTION);
+  rs->bandwidth_kb = in_u32(in);
+  rs->guardfraction_percentage = in_u32(in);
+  rs->exitsummary = in_string(in);
+
+  if (in->bad) {
+    routerstatus_free(rs);
+    return NULL;
+  }
+  return rs;
+}
+
+/** Encode the consensus <b>ns</b>, and return a newly allocated buffer
+ * holding the encoding.  Set *<b>len_out</b> to its length. */
+STATIC char *
+dirsnapshot_encode_consensus(const networkstatus_t *ns, size_t *len_out)
+{
+  snap_out_t out;
+  memset(&out, 0, sizeof(out));
+  tor_assert(ns->type == NS_TYPE_CONSENSUS);
+
+  out_u8(&out, (uint8_t)ns->flavor);
+  out_u8(&out, ns->has_measured_bws);
+  out_u64(&out, (uint64_t)ns->valid_after);
+  out_u64(&out, (uint64_t)ns->fresh_until);
+  out_u64(&out, (uint64_t)ns->valid_until);
+  out_u32(&out, (uint32_t)ns->consensus_method);
+  out_u32(&out, (uint32_t)ns->vote_seconds);
+  out_u32(&out, (uint32_t)ns->dist_seconds);
+  out_string(&out, ns->client_versions);
+  out_string(&out, ns->server_versions);
+  out_strlist(&out, ns->package_lines);
+  out_strlist(&out, ns->known_flags);
+  out_strlist(&out, ns->net_params);
+  out_strlist(&out, ns->weight_params);
+  out_bytes(&out, &ns->digests.d, sizeof(ns->digests.d));
+
+  out_u32(&out, smartlist_len(ns->voters));
+  SMARTLIST_FOREACH_BEGIN(ns->voters, const networkstatus_voter_info_t *,
+                          voter) {
+    out_bytes(&out, voter->identity_digest, DIGEST_LEN);
+    out_string(&out, voter->nickname);
+    out_bytes(&out, voter->legacy_id_digest, DIGEST_LEN);
+    out_string(&out, voter->address);
+    out_u32(&out, voter->addr);
+    out_u16(&out, voter->dir_port);
+    out_u16(&out, voter->or_port);
+    out_string(&out, voter->contact);
+    out_bytes(&out, voter->vote_digest, DIGEST_LEN);
+    out_u32(&out, smartlist_len(voter->sigs));
+    SMARTLIST_FOREACH_BEGIN(voter->sigs, const document_signature_t *, sig) {
+      out_bytes(&out, sig->identity_digest, DIGEST_LEN);
+      out_bytes(&out, sig->signing_key_digest, DIGEST_LEN);
+      out_u8(&out, (uint8_t)sig->alg);
+      out_mem(&out, sig->signature, sig->signature_len);
+      out_u8(&out, sig->good_signature | (sig->bad_signature << 1));
+    } SMARTLIST_FOREACH_END(sig);
+  } SMARTLIST_FOREACH_END(voter);
+
+  out_u32(&out, smartlist_len(ns->routerstatus_list));
+  SMARTLIST_FOREACH(ns->routerstatus_list, const routerstatus_t *, rs,
+                    encode_routerstatus(&out, rs));
+
+  *len_out = out.len;
+  return out.buf;
+}
+
+/** Decode and return a consensus from the <b>len</b>-byte encoding at
+ * <b>body</b>.  Return NULL if the encoding is malformed. */
+STATIC networkstatus_t *
+dirsnapshot_decode_consensus(const char *body, size_t len)
+{
+  snap_in_t in;
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  uint32_t i, j, n_voters, n_sigs, n_rs;
+  uint8_t flavor;
+
+  in.cp = body;
+  in.end = body + len;
+  in.bad = 0;
+
+  ns->type = NS_TYPE_CONSENSUS;
+  flavor = in_u8(&in);
+  if (flavor >= N_CONSENSUS_FLAVORS)
+    in.bad = 1;
+  ns->flavor = flavor;
+  ns->has_measured_bws = !!in_u8(&in);
+  ns->valid_after = (time_t)in_u64(&in);
+  ns->fresh_until = (time_t)in_u64(&in);
+  ns->valid_until = (time_t)in_u64(&in);
+  ns->consensus_method = (int)in_u32(&in);
+  ns->vote_seconds = (int)in_u32(&in);
+  ns->dist_seconds = (int)in_u32(&in);
+  ns->client_versions = in_string(&in);
+  ns->server_versions = in_string(&in);
+  ns->package_lines = in_strlist(&in);
+  ns->known_flags = in_strlist(&in);
+  ns->net_params = in_strlist(&in);
+  ns->weight_params = in_strlist(&in);
+  in_copy(&in, &ns->digests.d, sizeof(ns->digests.d));
+  if (!ns->known_flags)
+    in.bad = 1;
+
+  ns->voters = smartlist_new();
+  n_voters = in_count(&in);
+  if (n_voters == SNAP_ABSENT)
+    in.bad = 1;
+  for (i = 0; i < n_voters && !in.bad; ++i) {
+    networkstatus_voter_info_t *voter =
+      tor_malloc_zero(sizeof(networkstatus_voter_info_t));
+    smartlist_add(ns->voters, voter);
+    voter->sigs = smartlist_new();
+    in_copy(&in, voter->identity_digest, DIGEST_LEN);
+    voter->nickname = in_string(&in);
+    in_copy(&in, voter->legacy_id_digest, DIGEST_LEN);
+    voter->address = in_string(&in);
+    voter->addr = in_u32(&in);
+    voter->dir_port = in_u16(&in);
+    voter->or_port = in_u16(&in);
+    voter->contact = in_string(&in);
+    in_copy(&in, voter->vote_digest, DIGEST_LEN);
+    if (!voter->nickname || !voter->address)
+      in.bad = 1;
+    n_sigs = in_count(&in);
+    if (n_sigs == SNAP_ABSENT)
+      in.bad = 1;
+    for (j = 0; j < n_sigs && !in.bad; ++j) {
+      document_signature_t *sig =
+        tor_malloc_zero(sizeof(document_signature_t));
+      size_t sig_len;
+      uint8_t alg, status;
+      smartlist_add(voter->sigs, sig);
+      in_copy(&in, sig->identity_digest, DIGEST_LEN);
+      in_copy(&in, sig->signing_key_digest, DIGEST_LEN);
+      alg = in_u8(&in);
+      if (alg >= N_DIGEST_ALGORITHMS)
+        in.bad = 1;
+      sig->alg = alg;
+      sig->signature = in_mem(&in, &sig_len);
+      sig->signature_len = (int)sig_len;
+      status = in_u8(&in);
+      sig->good_signature = !!(status & 1);
+      sig->bad_signature = !!(status & 2);
+    }
+  }
+
+  ns->routerstatus_list = smartlist_new();
+  n_rs = in_count(&in);
+  if (n_rs == SNAP_ABSENT)
+    in.bad = 1;
+  for (i = 0; i < n_rs && !in.bad; ++i) {
+    routerstatus_t *rs = decode_routerstatus(&in);
+    if (rs)
+      smartlist_add(ns->routerstatus_list, rs);
+  }
+
+  if (in.bad || in.cp != in.end) {
+    networkstatus_vote_free(ns);
+    return NULL;
+  }
+  return ns;
+}
+
+/** Encode the microdescriptors in <b>mds</b>, all of which must be stored
+ * in the microdescriptor cache file, and return a newly allocated buffer
+ * holding the encoding.  Set *<b>len_out</b> to its length.  Return NULL
+ * if we can't encode one of them. */
+STATIC char *
+dirsnapshot_encode_microdescs(const smartlist_t *mds, size_t *len_out)
+{
+  snap_out_t out;
+  char key[1024];
+  memset(&out, 0, sizeof(out));
+
+  out_u32(&out, smartlist_len(mds));
+  SMARTLIST_FOREACH_BEGIN(mds, const microdesc_t *, md) {
+    char *policy;
+    int key_len;
+    tor_assert(md->saved_location == SAVED_IN_CACHE);
+    key_len = crypto_pk_asn1_encode(md->onion_pkey, key, sizeof(key));
+    if (key_len < 0) {
+      tor_free(out.buf);
+      return NULL;
+    }
+    out_bytes(&out, md->digest, DIGEST256_LEN);
+    out_u64(&out, (uint64_t)md->off);
+    out_u32(&out, (uint32_t)md->bodylen);
+    out_u64(&out, (uint64_t)md->last_listed);
+    out_mem(&out, key, key_len);
+    out_mem(&out, (const char *)md->onion_curve25519_pkey,
+            sizeof(curve25519_public_key_t));
+    out_mem(&out, (const char *)md->ed25519_identity_pkey,
+            sizeof(ed25519_public_key_t));
+    out_ipv6(&out, &md->ipv6_addr, md->ipv6_orport);
+    out_strlist(&out, md->family);
+    policy = md->exit_policy ? write_short_policy(md->exit_policy) : NULL;
+    out_string(&out, policy);
+    tor_free(policy);
+    policy = md->ipv6_exit_policy ?
+      write_short_policy(md->ipv6_exit_policy) : NULL;
+    out_string(&out, policy);
+    tor_free(policy);
+  } SMARTLIST_FOREACH_END(md);
+
+  *len_out = out.len;
+  return out.buf;
+}
+
+/** Consume a fixed-size key of <b>len</b> bytes from <b>in</b>, and return
+ * a newly allocated copy of it, or NULL if it was absent. */
+static void *
+in_fixed_key(snap_in_t *in, size_t len)
+{
+  size_t got;
+  char *k = in_mem(in, &got);
+  if (k && got != len) {
+    in->bad = 1;
+    tor_free(k);
+  }
+  return k;
+}
+
+/** Decode and return a list of microdescriptors from the <b>len</b>-byte
+ * encoding at <b>body</b>.  Their bodies point into the
+ * <b>cache_len</b>-byte microdescriptor cache file at <b>cache</b>.  Return
+ * NULL if the encoding is malformed. */
+STATIC smartlist_t *
+dirsnapshot_decode_microdescs(const char *body, size_t len,
+                              const char *cache, size_t cache_len)
+{
+  snap_in_t in;
+  smartlist_t *mds = smartlist_new();
+  uint32_t i, n;
+
+  in.cp = body;
+  in.end = body + len;
+  in.bad = 0;
+
+  n = in_count(&in);
+  if (n == SNAP_ABSENT)
+    in.bad = 1;
+  for (i = 0; i < n && !in.bad; ++i) {
+    microdesc_t *md = tor_malloc_zero(sizeof(microdesc_t));
+    uint64_t off;
+    size_t key_len;
+    char *key, *policy;
+    smartlist_add(mds, md);
+
+    md->saved_location = SAVED_IN_CACHE;
+    in_copy(&in, md->digest, DIGEST256_LEN);
+    off = in_u64(&in);
+    md->bodylen = in_u32(&in);
+    if (off > cache_len || md->bodylen > cache_len - off) {
+      in.bad = 1;
+      break;
+    }
+    md->off = (off_t)off;
+    md->body = (char *)cache + off;
+    md->last_listed = (time_t)in_u64(&in);
+
+    key = in_mem(&in, &key_len);
+    if (key)
+      md->onion_pkey = crypto_pk_asn1_decode(key, key_len);
+    tor_free(key);
+    if (!md->onion_pkey)
+      in.bad = 1;
+    md->onion_curve25519_pkey =
+      in_fixed_key(&in, sizeof(curve25519_public_key_t));
+    md->ed25519_identity_pkey =
+      in_fixed_key(&in, sizeof(ed25519_public_key_t));
+    in_ipv6(&in, &md->ipv6_addr, &md->ipv6_orport);
+    md->family = in_strlist(&in);
+    if ((policy = in_string(&in)))
+      md->exit_policy = parse_short_policy(policy);
+    tor_free(policy);
+    if ((policy = in_string(&in)))
+      md->ipv6_exit_policy = parse_short_policy(policy);
+    tor_free(policy);
+  }
+
+  if (in.bad || in.cp != in.end) {
+    SMARTLIST_FOREACH(mds, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(mds);
+    return NULL;
+  }
+  return mds;
+}
+
+/** Write a snapshot of type <b>type</b> to <b>fname</b>, holding the
+ * <b>body_len</b>-byte <b>body</b>.  <b>source_digest</b> is the SHA256
+ * digest of the document that the snapshot replaces; <b>context_digest</b>
+ * is a digest of anything else that must not change for the snapshot to
+ * stay valid.  If <b>usable_until</b> is nonzero, the snapshot will not be
+ * used after that time.  Return 0 on success, -1 on failure. */
+STATIC int
+dirsnapshot_write_file(const char *fname, uint32_t type,
+                       const char *source_digest, const char *context_digest,
+                       time_t usable_until,
+                       const char *body, size_t body_len)
+{
+  char header[DIRSNAPSHOT_HEADER_LEN];
+  char *cp = header;
+  smartlist_t *chunks = smartlist_new();
+  sized_chunk_t c_header, c_body;
+  int r;
+
+  memcpy(cp, DIRSNAPSHOT_MAGIC, DIRSNAPSHOT_MAGIC_LEN);
+  cp += DIRSNAPSHOT_MAGIC_LEN;
+  set_uint32(cp, htonl(DIRSNAPSHOT_VERSION));
+  cp += 4;
+  set_uint32(cp, htonl(type));
+  cp += 4;
+  memcpy(cp, source_digest, DIGEST256_LEN);
+  cp += DIGEST256_LEN;
+  memcpy(cp, context_digest, DIGEST256_LEN);
+  cp += DIGEST256_LEN;
+  set_uint32(cp, htonl((uint32_t)((uint64_t)usable_until >> 32)));
+  set_uint32(cp+4, htonl((uint32_t)usable_until));
+  cp += 8;
+  set_uint32(cp, htonl((uint32_t)((uint64_t)body_len >> 32)));
+  set_uint32(cp+4, htonl((uint32_t)body_len));
+  cp += 8;
+  crypto_digest256(cp, body, body_len, DIGEST_SHA256);
+  cp += DIGEST256_LEN;
+  tor_assert(cp == header + sizeof(header));
+
+  c_header.bytes = header;
+  c_header.len = sizeof(header);
+  c_body.bytes = body;
+  c_body.len = body_len;
+  smartlist_add(chunks, &c_header);
+  smartlist_add(chunks, &c_body);
+  r = write_chunks_to_file(fname, chunks, 1, 0);
+  smartlist_free(chunks);
+  return r;
+}
+
+/** Map the snapshot in <b>fname</b>, and check that it is a current
+ * snapshot of type <b>type</b>, made from the document whose SHA256 digest
+ * is <b>source_digest</b> in the context <b>context_digest</b>, and that
+ * its body is intact.  If so, set *<b>body_out</b> and
+ * *<b>body_len_out</b> to its body, and return the mapping.  Otherwise
+ * return NULL. */
+STATIC tor_mmap_t *
+dirsnapshot_open_file(const char *fname, uint32_t type,
+                      const char *source_digest, const char *context_digest,
+                      time_t now,
+                      const char **body_out, size_t *body_len_out)
+{
+  tor_mmap_t *mm;
+  const char *cp, *why;
+  char digest[DIGEST256_LEN];
+  uint64_t usable_until, body_len;
+
+  if (!(mm = tor_mmap_file(fname)))
+    return NULL;
+
+  cp = mm->data;
+  if (mm->size < DIRSNAPSHOT_HEADER_LEN ||
+      fast_memneq(cp, DIRSNAPSHOT_MAGIC, DIRSNAPSHOT_MAGIC_LEN)) {
+    why = "it isn't a snapshot";
+    goto stale;
+  }
+  cp += DIRSNAPSHOT_MAGIC_LEN;
+  if (ntohl(get_uint32(cp)) != DIRSNAPSHOT_VERSION) {
+    why = "it has an unrecognized version";
+    goto stale;
+  }
+  cp += 4;
+  if (ntohl(get_uint32(cp)) != type) {
+    why = "it has the wrong type";
+    goto stale;
+  }
+  cp += 4;
+  if (tor_memneq(cp, source_digest, DIGEST256_LEN)) {
+    why = "the document it was made from has changed";
+    goto stale;
+  }
+  cp += DIGEST256_LEN;
+  if (tor_memneq(cp, context_digest, DIGEST256_LEN)) {
+    why = "our configuration has changed";
+    goto stale;
+  }
+  cp += DIGEST256_LEN;
+  usable_until = ((uint64_t)ntohl(get_uint32(cp)) << 32) |
+    ntohl(get_uint32(cp+4));
+  cp += 8;
+  if (usable_until && (uint64_t)now > usable_until) {
+    why = "it is too old";
+    goto stale;
+  }
+  body_len = ((uint64_t)ntohl(get_uint32(cp)) << 32) |
+    ntohl(get_uint32(cp+4));
+  cp += 8;
+  if (body_len != mm->size - DIRSNAPSHOT_HEADER_LEN) {
+    why = "it is truncated";
+    goto stale;
+  }
+  crypto_digest256(digest, mm->data + DIRSNAPSHOT_HEADER_LEN,
+                   (size_t)body_len, DIGEST_SHA256);
+  if (tor_memneq(cp, digest, DIGEST256_LEN)) {
+    why = "it is corrupt";
+    goto stale;
+  }
+
+  *body_out = mm->data + DIRSNAPSHOT_HEADER_LEN;
+  *body_len_out = (size_t)body_len;
+  return mm;
+
+ stale:
+  log_info(LD_DIR, "Not using the snapshot in \"%s\": %s.", fname, why);
+  tor_munmap_file(mm);
+  return NULL;
+}
+
+/** Set <b>out</b> to a digest of the v3 directory authorities that we
+ * trust.  A consensus that we verified with one set of authorities
+ * shouldn't be trusted without checking it again when they change. */
+static void
+get_authorities_digest(char *out)
+{
+  smartlist_t *ids = smartlist_new();
+  crypto_digest_t *d = crypto_digest256_new(DIGEST_SHA256);
+
+  SMARTLIST_FOREACH(router_get_trusted_dir_servers(), dir_server_t *, ds,
+                    if (ds->type & V3_DIRINFO)
+                      smartlist_add(ids, ds->v3_identity_digest));
+  smartlist_sort_digests(ids);
+  SMARTLIST_FOREACH(ids, const char *, id,
+                    crypto_digest_add_bytes(d, id, DIGEST_LEN));
+  crypto_digest_get_digest(d, out, DIGEST256_LEN);
+  crypto_digest_free(d);
+  smartlist_free(ids);
+}
+
+/** Try to load the consensus <b>consensus</b> of flavor <b>flav</b> from
+ * the snapshot in <b>fname</b>.  Return it on success; its signatures
+ * were checked when we saved it.  Return NULL if there is no usable
+ * snapshot of <b>consensus</b>. */
+networkstatus_t *
+dirsnapshot_load_consensus(const char *fname, const char *consensus,
+                           consensus_flavor_t flav)
+{
+  char source_digest[DIGEST256_LEN], context_digest[DIGEST256_LEN];
+  const char *body;
+  size_t body_len;
+  tor_mmap_t *mm;
+  networkstatus_t *ns;
+
+  crypto_digest256(source_digest, consensus, strlen(consensus),
+                   DIGEST_SHA256);
+  get_authorities_digest(context_digest);
+  mm = dirsnapshot_open_file(fname, DIRSNAPSHOT_TYPE_CONSENSUS,
+                             source_digest, context_digest, time(NULL),
+                             &body, &body_len);
+  if (!mm)
+    return NULL;
+
+  ns = dirsnapshot_decode_consensus(body, body_len);
+  tor_munmap_file(mm);
+  if (ns && ns->flavor != flav) {
+    networkstatus_vote_free(ns);
+    ns = NULL;
+  }
+  if (!ns) {
+    log_warn(LD_DIR, "Couldn't decode the snapshot in \"%s\". I'll parse "
+             "the consensus instead.", fname);
+    return NULL;
+  }
+  log_info(LD_DIR, "Loaded a %s consensus with %d entries from \"%s\".",
+           networkstatus_get_flavor_name(flav),
+           smartlist_len(ns->routerstatus_list), fname);
+  return ns;
+}
+
+/** Save a snapshot of <b>ns</b>, which we parsed from <b>consensus</b> and
+ * whose signatures we have checked, to <b>fname</b>. */
+void
+dirsnapshot_save_consensus(const char *fname, const networkstatus_t *ns,
+                           const char *consensus)
+{
+  char source_digest[DIGEST256_LEN], context_digest[DIGEST256_LEN];
+  time_t usable_until = 0;
+  char *body;
+  size_t body_len;
+
+  /* Don't trust the snapshot after any of the certificates that we used to
+   * check it expire. */
+  SMARTLIST_FOREACH_BEGIN(ns->voters, networkstatus_voter_info_t *, voter) {
+    SMARTLIST_FOREACH_BEGIN(voter->sigs, document_signature_t *, sig) {
+      authority_cert_t *cert;
+      if (!sig->good_signature)
+        continue;
+      cert = authority_cert_get_by_digests(sig->identity_digest,
+                                           sig->signing_key_digest);
+      if (cert && (!usable_until || cert->expires < usable_until))
+        usable_until = cert->expires;
+    } SMARTLIST_FOREACH_END(sig);
+  } SMARTLIST_FOREACH_END(voter);
+  if (!usable_until) {
+    log_info(LD_DIR, "Not saving a snapshot of a consensus that we haven't "
+             "checked.");
+    return;
+  }
+
+  crypto_digest256(source_digest, consensus, strlen(consensus),
+                   DIGEST_SHA256);
+  get_authorities_digest(context_digest);
+  body = dirsnapshot_encode_consensus(ns, &body_len);
+  if (dirsnapshot_write_file(fname, DIRSNAPSHOT_TYPE_CONSENSUS,
+                             source_digest, context_digest, usable_until,
+                             body, body_len) < 0) {
+    log_info(LD_FS, "Couldn't write a consensus snapshot to \"%s\".", fname);
+  }
+  tor_free(body);
+}
+
+/** Try to load the microdescriptors in the cache file whose contents are
+ * <b>cache_content</b> from the snapshot in <b>fname</b>.  Return a newly
+ * allocated list of them on success, or NULL if there is no usable
+ * snapshot of <b>cache_content</b>. */
+smartlist_t *
+dirsnapshot_load_microdescs(const char *fname,
+                            const tor_mmap_t *cache_content)
+{
+  char source_digest[DIGEST256_LEN], context_digest[DIGEST256_LEN];
+  const char *body;
+  size_t body_len;
+  tor_mmap_t *mm;
+  smartlist_t *mds;
+
+  crypto_digest256(source_digest, cache_content->data, cache_content->size,
+                   DIGEST_SHA256);
+  memset(context_digest, 0, sizeof(context_digest));
+  mm = dirsnapshot_open_file(fname, DIRSNAPSHOT_TYPE_MICRODESCS,
+                             source_digest, context_digest, time(NULL),
+                             &body, &body_len);
+  if (!mm)
+    return NULL;
+
+  mds = dirsnapshot_decode_microdescs(body, body_len, cache_content->data,
+                                      cache_content->size);
+  tor_munmap_file(mm);
+  if (!mds) {
+    log_warn(LD_DIR, "Couldn't decode the snapshot in \"%s\". I'll parse "
+             "the microdescriptor cache instead.", fname);
+    return NULL;
+  }
+  log_info(LD_DIR, "Loaded %d microdescriptors from \"%s\".",
+           smartlist_len(mds), fname);
+  return mds;
+}
+
+/** Save a snapshot of <b>mds</b>, which are all the microdescriptors in the
+ * cache file whose contents are <b>cache_content</b>, to <b>fname</b>.  If
+ * <b>cache_digest</b> is provided, it is the SHA256 digest of
+ * <b>cache_content</b>, and we don't need to compute it again. */
+void
+dirsnapshot_save_microdescs(const char *fname, const smartlist_t *mds,
+                            const tor_mmap_t *cache_content,
+                            const char *cache_digest)
+{
+  char source_digest[DIGEST256_LEN], context_digest[DIGEST256_LEN];
+  char *body;
+  size_t body_len;
+
+  body = dirsnapshot_encode_microdescs(mds, &body_len);
+  if (!body) {
+    log_info(LD_DIR, "Couldn't encode a microdescriptor snapshot.");
+    return;
+  }
+  if (cache_digest)
+    memcpy(source_digest, cache_digest, DIGEST256_LEN);
+  else
+    crypto_digest256(source_digest, cache_content->data, cache_content->size,
+                     DIGEST_SHA256);
+  memset(context_digest, 0, sizeof(context_digest));
+  if (dirsnapshot_write_file(fname, DIRSNAPSHOT_TYPE_MICRODESCS,
+                             source_digest, context_digest, 0,
+                             body, body_len) < 0) {
+    log_info(LD_FS, "Couldn't write a microdescriptor snapshot to \"%s\".",
+             fname);
+  }
+  tor_free(body);
+}
+
@@ -0,0 +1,67 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file dirsnapshot.h
+ * \brief Header file for dirsnapshot.c.
+ **/
+
+#ifndef TOR_DIRSNAPSHOT_H
+#define TOR_DIRSNAPSHOT_H
+
+#include "testsupport.h"
+
+networkstatus_t *dirsnapshot_load_consensus(const char *fname,
+                                            const char *consensus,
+                                            consensus_flavor_t flav);
+void dirsnapshot_save_consensus(const char *fname, const networkstatus_t *ns,
+                                const char *consensus);
+smartlist_t *dirsnapshot_load_microdescs(const char *fname,
+                                         const tor_mmap_t *cache_content);
+void dirsnapshot_save_microdescs(const char *fname, const smartlist_t *mds,
+                                 const tor_mmap_t *cache_content,
+                                 const char *cache_digest);
+
+#ifdef DIRSNAPSHOT_PRIVATE
+/** Magic string that starts every snapshot file. */
+#define DIRSNAPSHOT_MAGIC "TorSnap\n"
+/** Length of DIRSNAPSHOT_MAGIC. */
+#define DIRSNAPSHOT_MAGIC_LEN 8
+/** Version of the snapshot format.  Bump this whenever the encoding of a
+ * snapshot changes, or when we start deriving something new from the
+ * documents that a snapshot replaces. */
+#define DIRSNAPSHOT_VERSION 1
+/** Size of the header at the start of every snapshot file. */
+#define DIRSNAPSHOT_HEADER_LEN \
+  (DIRSNAPSHOT_MAGIC_LEN + 4 + 4 + DIGEST256_LEN*3 + 8 + 8)
+
+/** Snapshot type: a parsed, verified consensus. */
+#define DIRSNAPSHOT_TYPE_CONSENSUS 1
+/** Snapshot type: the parsed contents of the microdescriptor cache file. */
+#define DIRSNAPSHOT_TYPE_MICRODESCS 2
+
+STATIC int dirsnapshot_write_file(const char *fname, uint32_t type,
+                                  const char *source_digest,
+                                  const char *context_digest,
+                                  time_t usable_until,
+                                  const char *body, size_t body_len);
+STATIC tor_mmap_t *dirsnapshot_open_file(const char *fname, uint32_t type,
+                                         const char *source_digest,
+                                         const char *context_digest,
+                                         time_t now,
+                                         const char **body_out,
+                                         size_t *body_len_out);
+STATIC char *dirsnapshot_encode_consensus(const networkstatus_t *ns,
+                                          size_t *len_out);
+STATIC networkstatus_t *dirsnapshot_decode_consensus(const char *body,
+                                                     size_t len);
+STATIC char *dirsnapshot_encode_microdescs(const smartlist_t *mds,
+                                           size_t *len_out);
+STATIC smartlist_t *dirsnapshot_decode_microdescs(const char *body,
+                                                  size_t len,
+                                                  const char *cache,
+                                                  size_t cache_len);
+#endif
+
+#endif
+
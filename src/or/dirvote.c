@@ -6,6 +6,7 @@
 #define DIRVOTE_PRIVATE
 #include "or.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "dircollate.h"
 #include "directory.h"
 #include "dirserv.h"
@@ -19,6 +20,7 @@
 #include "routerparse.h"
 #include "entrynodes.h" /* needed for guardfraction methods */
 #include "torcert.h"
+#include "workqueue.h"
 
 /**
  * \file dirvote.c
@@ -466,10 +468,12 @@ compute_routerstatus_consensus(smartlist_t *votes, int consensus_method,
     most_alt_orport = smartlist_get_most_frequent(alt_orports,
                                                   compare_orports_);
     if (most_alt_orport) {
+      /* Not fmt_addrport(): we might be in a worker thread. */
+      char addrbuf[TOR_ADDR_BUF_LEN];
+      tor_addr_to_str(addrbuf, &most_alt_orport->addr, sizeof(addrbuf), 1);
       memcpy(best_alt_orport_out, most_alt_orport, sizeof(tor_addr_port_t));
-      log_debug(LD_DIR, "\"a\" line winner for %s is %s",
-                most->status.nickname,
-                fmt_addrport(&most_alt_orport->addr, most_alt_orport->port));
+      log_debug(LD_DIR, "\"a\" line winner for %s is %s:%u",
+                most->status.nickname, addrbuf, most_alt_orport->port);
     }
 
     SMARTLIST_FOREACH(alt_orports, tor_addr_port_t *, ap, tor_free(ap));
@@ -1108,22 +1112,548 @@ update_total_bandwidth_weights(const routerstatus_t *rs,
   }
 }
 
-/** Given a list of vote networkstatus_t in <b>votes</b>, our public
- * authority <b>identity_key</b>, our private authority <b>signing_key</b>,
- * and the number of <b>total_authorities</b> that we believe exist in our
- * voting quorum, generate the text of a new v3 consensus vote, and return the
- * value in a newly allocated string.
+/** Everything that the consensus entry for a router depends on, apart from
+ * the votes about that router.  Once networkstatus_compute_consensus_impl()
+ * has built it, nothing changes it, so several threads can share it. */
+typedef struct consensus_router_ctx_t {
+  /** The votes we're computing a consensus from. */
+  const smartlist_t *votes;
+  /** The names of all the flags that any vote knows about, sorted. */
+  const smartlist_t *flags;
+  /** The number of authorities that we believe exist. */
+  int total_authorities;
+  /** The consensus method we're using. */
+  int consensus_method;
+  /** The flavor of consensus we're generating. */
+  consensus_flavor_t flavor;
+  /** The format to use for the "r" lines of the consensus. */
+  routerstatus_format_type_t rs_format;
+  /** n_voter_flags[j] is the number of flags that votes[j] knows about. */
+  const int *n_voter_flags;
+  /** n_flag_voters[f] is the number of votes that care about flags[f]. */
+  const int *n_flag_voters;
+  /** flag_map[j][b] is the index in flags of votes[j]->known_flags[b]. */
+  int **flag_map;
+  /** named_flag[j] is the index of the flag "Named" for votes[j], or -1. */
+  const int *named_flag;
+  /** Map from lowercase nickname to the identity digest that it's bound to,
+   * or to a special value for conflicting or unknown names. */
+  strmap_t *name_to_id_map;
+  /** The number of votes that include bandwidth measurements. */
+  int n_authorities_measuring_bandwidth;
+  /** The largest bandwidth we allow an unmeasured router to have. */
+  uint32_t max_unmeasured_bw_kb;
+  /** The collator that lists the votes for each router. */
+  dircollator_t *collator;
+} consensus_router_ctx_t;
+
+struct consensus_range_join_t;
+
+/** A range of routers whose consensus entries one thread computes, and the
+ * results of computing them. */
+typedef struct consensus_router_range_t {
+  /** The state shared by every range of this consensus. */
+  const consensus_router_ctx_t *ctx;
+  /** The first router in this range, as an index into the collator. */
+  int lo;
+  /** One past the last router in this range. */
+  int hi;
+  /** The text of the consensus entries for this range. */
+  smartlist_t *chunks;
+  /** The totals for the bandwidth weights of the routers in this range. */
+  int64_t G, M, E, D, T;
+  /** If this range is being computed in a thread of its own, the state that
+   * tells the thread that started it when it's done. */
+  struct consensus_range_join_t *join;
+} consensus_router_range_t;
+
+/** Compute the consensus entries for the routers in <b>range</b>, from
+ * range->lo (inclusive) to range->hi (exclusive) in the collator's order,
+ * and add their text to range->chunks and their bandwidths to range->G
+ * through range->T.  This only reads range->ctx, so the ranges of one
+ * consensus can be computed in parallel. */
+static void
+consensus_compute_router_range(consensus_router_range_t *range)
+{
+  const consensus_router_ctx_t *ctx = range->ctx;
+  const smartlist_t *votes = ctx->votes;
+  const smartlist_t *flags = ctx->flags;
+  const int total_authorities = ctx->total_authorities;
+  const int consensus_method = ctx->consensus_method;
+  const consensus_flavor_t flavor = ctx->flavor;
+  const routerstatus_format_type_t rs_format = ctx->rs_format;
+  const int *n_voter_flags = ctx->n_voter_flags;
+  const int *n_flag_voters = ctx->n_flag_voters;
+  int * const *flag_map = ctx->flag_map;
+  const int *named_flag = ctx->named_flag;
+  strmap_t *name_to_id_map = ctx->name_to_id_map;
+  const int n_authorities_measuring_bandwidth =
+    ctx->n_authorities_measuring_bandwidth;
+  const uint32_t max_unmeasured_bw_kb = ctx->max_unmeasured_bw_kb;
+  dircollator_t *collator = ctx->collator;
+  smartlist_t *chunks = range->chunks;
+  int *flag_counts; /* The number of voters that list flag[j] for the
+                     * currently considered router. */
+  int i;
+  smartlist_t *matching_descs = smartlist_new();
+  smartlist_t *chosen_flags = smartlist_new();
+  smartlist_t *versions = smartlist_new();
+  smartlist_t *exitsummaries = smartlist_new();
+  uint32_t *bandwidths_kb = tor_calloc(smartlist_len(votes),
+                                       sizeof(uint32_t));
+  uint32_t *measured_bws_kb = tor_calloc(smartlist_len(votes),
+                                         sizeof(uint32_t));
+  uint32_t *measured_guardfraction = tor_calloc(smartlist_len(votes),
+                                                sizeof(uint32_t));
+  int num_bandwidths;
+  int num_mbws;
+  int num_guardfraction_inputs;
+
+  flag_counts = tor_calloc(smartlist_len(flags), sizeof(int));
+  for (i = range->lo; i < range->hi; ++i) {
+    vote_routerstatus_t **vrs_lst =
+      dircollator_get_votes_for_router(collator, i);
+
+    vote_routerstatus_t *rs;
+    routerstatus_t rs_out;
+    const char *current_rsa_id = NULL;
+    const char *chosen_version;
+    const char *chosen_name = NULL;
+    int exitsummary_disagreement = 0;
+    int is_named = 0, is_unnamed = 0, is_running = 0;
+    int is_guard = 0, is_exit = 0, is_bad_exit = 0;
+    int naming_conflict = 0;
+    int n_listing = 0;
+    char microdesc_digest[DIGEST256_LEN];
+    tor_addr_port_t alt_orport = {TOR_ADDR_NULL, 0};
+
+    memset(flag_counts, 0, sizeof(int)*smartlist_len(flags));
+    smartlist_clear(matching_descs);
+    smartlist_clear(chosen_flags);
+    smartlist_clear(versions);
+    num_bandwidths = 0;
+    num_mbws = 0;
+    num_guardfraction_inputs = 0;
+
+    /* Okay, go through all the entries for this digest. */
+    for (int voter_idx = 0; voter_idx < smartlist_len(votes); ++voter_idx) {
+      if (vrs_lst[voter_idx] == NULL)
+        continue; /* This voter had nothing to say about this entry. */
+      rs = vrs_lst[voter_idx];
+      ++n_listing;
+
+      current_rsa_id = rs->status.identity_digest;
+
+      smartlist_add(matching_descs, rs);
+      if (rs->version && rs->version[0])
+        smartlist_add(versions, rs->version);
+
+      /* Tally up all the flags. */
+      for (int flag = 0; flag < n_voter_flags[voter_idx]; ++flag) {
+        if (rs->flags & (U64_LITERAL(1) << flag))
+          ++flag_counts[flag_map[voter_idx][flag]];
+      }
+      if (named_flag[voter_idx] >= 0 &&
+          (rs->flags & (U64_LITERAL(1) << named_flag[voter_idx]))) {
+        if (chosen_name && strcmp(chosen_name, rs->status.nickname)) {
+          log_notice(LD_DIR, "Conflict on naming for router: %s vs %s",
+                     chosen_name, rs->status.nickname);
+          naming_conflict = 1;
+        }
+        chosen_name = rs->status.nickname;
+      }
+
+      /* Count guardfraction votes and note down the values. */
+      if (rs->status.has_guardfraction) {
+        measured_guardfraction[num_guardfraction_inputs++] =
+          rs->status.guardfraction_percentage;
+      }
+
+      /* count bandwidths */
+      if (rs->has_measured_bw)
+        measured_bws_kb[num_mbws++] = rs->measured_bw_kb;
+
+      if (rs->status.has_bandwidth)
+        bandwidths_kb[num_bandwidths++] = rs->status.bandwidth_kb;
+    }
+
+    /* We don't include this router at all unless more than half of
+     * the authorities we believe in list it. */
+    if (n_listing <= total_authorities/2)
+      continue;
+
+    /* The clangalyzer can't figure out that this will never be NULL
+     * if n_listing is at least 1 */
+    tor_assert(current_rsa_id);
+
+    /* Figure out the most popular opinion of what the most recent
+     * routerinfo and its contents are. */
+    memset(microdesc_digest, 0, sizeof(microdesc_digest));
+    rs = compute_routerstatus_consensus(matching_descs, consensus_method,
+                                        microdesc_digest, &alt_orport);
+    /* Copy bits of that into rs_out. */
+    memset(&rs_out, 0, sizeof(rs_out));
+    tor_assert(fast_memeq(current_rsa_id,
+                          rs->status.identity_digest,DIGEST_LEN));
+    memcpy(rs_out.identity_digest, current_rsa_id, DIGEST_LEN);
+    memcpy(rs_out.descriptor_digest, rs->status.descriptor_digest,
+           DIGEST_LEN);
+    rs_out.addr = rs->status.addr;
+    rs_out.published_on = rs->status.published_on;
+    rs_out.dir_port = rs->status.dir_port;
+    rs_out.or_port = rs->status.or_port;
+    if (consensus_method >= MIN_METHOD_FOR_A_LINES) {
+      tor_addr_copy(&rs_out.ipv6_addr, &alt_orport.addr);
+      rs_out.ipv6_orport = alt_orport.port;
+    }
+    rs_out.has_bandwidth = 0;
+    rs_out.has_exitsummary = 0;
+
+    if (chosen_name && !naming_conflict) {
+      strlcpy(rs_out.nickname, chosen_name, sizeof(rs_out.nickname));
+    } else {
+      strlcpy(rs_out.nickname, rs->status.nickname, sizeof(rs_out.nickname));
+    }
+
+    {
+      const char *d = strmap_get_lc(name_to_id_map, rs_out.nickname);
+      if (!d) {
+        is_named = is_unnamed = 0;
+      } else if (fast_memeq(d, current_rsa_id, DIGEST_LEN)) {
+        is_named = 1; is_unnamed = 0;
+      } else {
+        is_named = 0; is_unnamed = 1;
+      }
+    }
+
+    /* Set the flags. */
+    smartlist_add(chosen_flags, (char*)"s"); /* for the start of the line. */
+    SMARTLIST_FOREACH_BEGIN(flags, const char *, fl) {
+      if (!strcmp(fl, "Named")) {
+        if (is_named)
+          smartlist_add(chosen_flags, (char*)fl);
+      } else if (!strcmp(fl, "Unnamed")) {
+        if (is_unnamed)
+          smartlist_add(chosen_flags, (char*)fl);
+      } else {
+        if (flag_counts[fl_sl_idx] > n_flag_voters[fl_sl_idx]/2) {
+          smartlist_add(chosen_flags, (char*)fl);
+          if (!strcmp(fl, "Exit"))
+            is_exit = 1;
+          else if (!strcmp(fl, "Guard"))
+            is_guard = 1;
+          else if (!strcmp(fl, "Running"))
+            is_running = 1;
+          else if (!strcmp(fl, "BadExit"))
+            is_bad_exit = 1;
+        }
+      }
+    } SMARTLIST_FOREACH_END(fl);
+
+    /* Starting with consensus method 4 we do not list servers
+     * that are not running in a consensus.  See Proposal 138 */
+    if (!is_running)
+      continue;
+
+    /* Pick the version. */
+    if (smartlist_len(versions)) {
+      sort_version_list(versions, 0);
+      chosen_version = get_most_frequent_member(versions);
+    } else {
+      chosen_version = NULL;
+    }
+
+    /* If it's a guard and we have enough guardfraction votes,
+       calculate its consensus guardfraction value. */
+    if (is_guard && num_guardfraction_inputs > 2 &&
+        consensus_method >= MIN_METHOD_FOR_GUARDFRACTION) {
+      rs_out.has_guardfraction = 1;
+      rs_out.guardfraction_percentage = median_uint32(measured_guardfraction,
+                                                   num_guardfraction_inputs);
+      /* final value should be an integer percentage! */
+      tor_assert(rs_out.guardfraction_percentage <= 100);
+    }
+
+    /* Pick a bandwidth */
+    if (num_mbws > 2) {
+      rs_out.has_bandwidth = 1;
+      rs_out.bw_is_unmeasured = 0;
+      rs_out.bandwidth_kb = median_uint32(measured_bws_kb, num_mbws);
+    } else if (num_bandwidths > 0) {
+      rs_out.has_bandwidth = 1;
+      rs_out.bw_is_unmeasured = 1;
+      rs_out.bandwidth_kb = median_uint32(bandwidths_kb, num_bandwidths);
+      if (consensus_method >= MIN_METHOD_TO_CLIP_UNMEASURED_BW &&
+          n_authorities_measuring_bandwidth > 2) {
+        /* Cap non-measured bandwidths. */
+        if (rs_out.bandwidth_kb > max_unmeasured_bw_kb) {
+          rs_out.bandwidth_kb = max_unmeasured_bw_kb;
+        }
+      }
+    }
+
+    /* Fix bug 2203: Do not count BadExit nodes as Exits for bw weights */
+    is_exit = is_exit && !is_bad_exit;
+
+    /* Update total bandwidth weights with the bandwidths of this router. */
+    {
+      update_total_bandwidth_weights(&rs_out,
+                                     is_exit, is_guard,
+                                     &range->G, &range->M, &range->E,
+                                     &range->D, &range->T);
+    }
+
+    /* Ok, we already picked a descriptor digest we want to list
+     * previously.  Now we want to use the exit policy summary from
+     * that descriptor.  If everybody plays nice all the voters who
+     * listed that descriptor will have the same summary.  If not then
+     * something is fishy and we'll use the most common one (breaking
+     * ties in favor of lexicographically larger one (only because it
+     * lets me reuse more existing code)).
+     *
+     * The other case that can happen is that no authority that voted
+     * for that descriptor has an exit policy summary.  That's
+     * probably quite unlikely but can happen.  In that case we use
+     * the policy that was most often listed in votes, again breaking
+     * ties like in the previous case.
+     */
+    {
+      /* Okay, go through all the votes for this router.  We prepared
+       * that list previously */
+      const char *chosen_exitsummary = NULL;
+      smartlist_clear(exitsummaries);
+      SMARTLIST_FOREACH_BEGIN(matching_descs, vote_routerstatus_t *, vsr) {
+        /* Check if the vote where this status comes from had the
+         * proper descriptor */
+        tor_assert(fast_memeq(rs_out.identity_digest,
+                           vsr->status.identity_digest,
+                           DIGEST_LEN));
+        if (vsr->status.has_exitsummary &&
+             fast_memeq(rs_out.descriptor_digest,
+                     vsr->status.descriptor_digest,
+                     DIGEST_LEN)) {
+          tor_assert(vsr->status.exitsummary);
+          smartlist_add(exitsummaries, vsr->status.exitsummary);
+          if (!chosen_exitsummary) {
+            chosen_exitsummary = vsr->status.exitsummary;
+          } else if (strcmp(chosen_exitsummary, vsr->status.exitsummary)) {
+            /* Great.  There's disagreement among the voters.  That
+             * really shouldn't be */
+            exitsummary_disagreement = 1;
+          }
+        }
+      } SMARTLIST_FOREACH_END(vsr);
+
+      if (exitsummary_disagreement) {
+        char id[HEX_DIGEST_LEN+1];
+        char dd[HEX_DIGEST_LEN+1];
+        base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
+        base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
+        log_warn(LD_DIR, "The voters disagreed on the exit policy summary "
+                 " for router %s with descriptor %s.  This really shouldn't"
+                 " have happened.", id, dd);
+
+        smartlist_sort_strings(exitsummaries);
+        chosen_exitsummary = get_most_frequent_member(exitsummaries);
+      } else if (!chosen_exitsummary) {
+        char id[HEX_DIGEST_LEN+1];
+        char dd[HEX_DIGEST_LEN+1];
+        base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
+        base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
+        log_warn(LD_DIR, "Not one of the voters that made us select"
+                 "descriptor %s for router %s had an exit policy"
+                 "summary", dd, id);
+
+        /* Ok, none of those voting for the digest we chose had an
+         * exit policy for us.  Well, that kinda sucks.
+         */
+        smartlist_clear(exitsummaries);
+        SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
+          if (vsr->status.has_exitsummary)
+            smartlist_add(exitsummaries, vsr->status.exitsummary);
+        });
+        smartlist_sort_strings(exitsummaries);
+        chosen_exitsummary = get_most_frequent_member(exitsummaries);
+
+        if (!chosen_exitsummary)
+          log_warn(LD_DIR, "Wow, not one of the voters had an exit "
+                   "policy summary for %s.  Wow.", id);
+      }
+
+      if (chosen_exitsummary) {
+        rs_out.has_exitsummary = 1;
+        /* yea, discards the const */
+        rs_out.exitsummary = (char *)chosen_exitsummary;
+      }
+    }
+
+    if (flavor == FLAV_MICRODESC &&
+        tor_digest256_is_zero(microdesc_digest)) {
+      /* With no microdescriptor digest, we omit the entry entirely. */
+      continue;
+    }
+
+    {
+      char *buf;
+      /* Okay!! Now we can write the descriptor... */
+      /*     First line goes into "buf". */
+      buf = routerstatus_format_entry(&rs_out, NULL, rs_format, NULL);
+      if (buf)
+        smartlist_add(chunks, buf);
+    }
+    /*     Now an m line, if applicable. */
+    if (flavor == FLAV_MICRODESC &&
+        !tor_digest256_is_zero(microdesc_digest)) {
+      char m[BASE64_DIGEST256_LEN+1];
+      digest256_to_base64(m, microdesc_digest);
+      smartlist_add_asprintf(chunks, "m %s\n", m);
+    }
+    /*     Next line is all flags.  The "\n" is missing. */
+    smartlist_add(chunks,
+                  smartlist_join_strings(chosen_flags, " ", 0, NULL));
+    /*     Now the version line. */
+    if (chosen_version) {
+      smartlist_add(chunks, tor_strdup("\nv "));
+      smartlist_add(chunks, tor_strdup(chosen_version));
+    }
+    smartlist_add(chunks, tor_strdup("\n"));
+    /*     Now the weight line. */
+    if (rs_out.has_bandwidth) {
+      char *guardfraction_str = NULL;
+      int unmeasured = rs_out.bw_is_unmeasured &&
+        consensus_method >= MIN_METHOD_TO_CLIP_UNMEASURED_BW;
+
+      /* If we have guardfraction info, include it in the 'w' line. */
+      if (rs_out.has_guardfraction) {
+        tor_asprintf(&guardfraction_str,
+                     " GuardFraction=%u", rs_out.guardfraction_percentage);
+      }
+      smartlist_add_asprintf(chunks, "w Bandwidth=%d%s%s\n",
+                             rs_out.bandwidth_kb,
+                             unmeasured?" Unmeasured=1":"",
+                             guardfraction_str ? guardfraction_str : "");
+
+      tor_free(guardfraction_str);
+    }
+
+    /*     Now the exitpolicy summary line. */
+    if (rs_out.has_exitsummary && flavor == FLAV_NS) {
+      smartlist_add_asprintf(chunks, "p %s\n", rs_out.exitsummary);
+    }
+
+    /* And the loop is over and we move on to the next router */
+  }
+
+  tor_free(flag_counts);
+  smartlist_free(matching_descs);
+  smartlist_free(chosen_flags);
+  smartlist_free(versions);
+  smartlist_free(exitsummaries);
+  tor_free(bandwidths_kb);
+  tor_free(measured_bws_kb);
+  tor_free(measured_guardfraction);
+}
+
+/** The state that consensus_compute_router_ranges() uses to wait for the
+ * threads that it starts. */
+typedef struct consensus_range_join_t {
+  /** Protects n_running. */
+  tor_mutex_t lock;
+  /** Signalled whenever a thread finishes its range. */
+  tor_cond_t cond;
+  /** The number of threads that haven't finished yet. */
+  int n_running;
+} consensus_range_join_t;
+
+/** Thread main function: compute the consensus entries for <b>arg</b>, a
+ * consensus_router_range_t, and tell the thread that's waiting for it. */
+static void
+consensus_router_range_thread_main(void *arg)
+{
+  consensus_router_range_t *range = arg;
+  consensus_range_join_t *join = range->join;
+
+  consensus_compute_router_range(range);
+
+  tor_mutex_acquire(&join->lock);
+  --join->n_running;
+  tor_cond_signal_all(&join->cond);
+  tor_mutex_release(&join->lock);
+  spawn_exit();
+}
+
+/** Compute the consensus entries for each of the <b>n_ranges</b> ranges in
+ * <b>ranges</b>.  Start a thread for every range but the first, do the
+ * first one ourself, and then wait until all the others are done. */
+static void
+consensus_compute_router_ranges(consensus_router_range_t *ranges,
+                                int n_ranges)
+{
+  /* This can live on our stack, since we don't return until every thread
+   * that uses it is done with it. */
+  consensus_range_join_t join;
+  int i;
+
+  if (n_ranges <= 1) {
+    if (n_ranges == 1)
+      consensus_compute_router_range(&ranges[0]);
+    return;
+  }
+
+  tor_mutex_init_for_cond(&join.lock);
+  tor_cond_init(&join.cond);
+  join.n_running = 0;
+
+  for (i = 1; i < n_ranges; ++i) {
+    ranges[i].join = &join;
+    tor_mutex_acquire(&join.lock);
+    ++join.n_running;
+    tor_mutex_release(&join.lock);
+    if (spawn_func(consensus_router_range_thread_main, &ranges[i]) < 0) {
+      log_warn(LD_GENERAL, "Couldn't start a thread to compute part of the "
+               "consensus. Doing it in this thread instead.");
+      tor_mutex_acquire(&join.lock);
+      --join.n_running;
+      tor_mutex_release(&join.lock);
+      ranges[i].join = NULL;
+      consensus_compute_router_range(&ranges[i]);
+    }
+  }
+
+  consensus_compute_router_range(&ranges[0]);
+
+  tor_mutex_acquire(&join.lock);
+  while (join.n_running > 0) {
+    if (tor_cond_wait(&join.cond, &join.lock, NULL) < 0)
+      log_warn(LD_BUG, "Failed to wait for consensus threads.");
+  }
+  tor_mutex_release(&join.lock);
+
+  tor_cond_uninit(&join.cond);
+  tor_mutex_uninit(&join.lock);
+}
+
+/** As networkstatus_compute_consensus(), but split the work on the router
+ * entries among up to <b>n_threads</b> threads.  Use the voting intervals
+ * for a testing network iff <b>testing_tor_network</b> is set.  If
+ * <b>check_result</b> is set, make sure that we can parse the consensus
+ * that we generated.
  *
- * Note: this function DOES NOT check whether the votes are from
- * recognized authorities.   (dirvote_add_vote does that.) */
-char *
-networkstatus_compute_consensus(smartlist_t *votes,
-                                int total_authorities,
-                                crypto_pk_t *identity_key,
-                                crypto_pk_t *signing_key,
-                                const char *legacy_id_key_digest,
-                                crypto_pk_t *legacy_signing_key,
-                                consensus_flavor_t flavor)
+ * Unless <b>check_result</b> is set, this function doesn't look at our
+ * options or at any other global state, so it's safe to call it from a
+ * worker thread, as long as nobody changes or frees the votes or the keys
+ * while it runs.  It sorts <b>votes</b>, though. */
+static char *
+networkstatus_compute_consensus_impl(smartlist_t *votes,
+                                     int total_authorities,
+                                     crypto_pk_t *identity_key,
+                                     crypto_pk_t *signing_key,
+                                     const char *legacy_id_key_digest,
+                                     crypto_pk_t *legacy_signing_key,
+                                     consensus_flavor_t flavor,
+                                     int testing_tor_network,
+                                     int n_threads,
+                                     int check_result)
 {
   smartlist_t *chunks;
   char *result = NULL;
@@ -1212,10 +1742,10 @@ networkstatus_compute_consensus(smartlist_t *votes,
     dist_seconds = median_int(distsec_list, n_votes);
 
     tor_assert(valid_after +
-               (get_options()->TestingTorNetwork ?
+               (testing_tor_network ?
                 MIN_VOTE_INTERVAL_TESTING : MIN_VOTE_INTERVAL) <= fresh_until);
     tor_assert(fresh_until +
-               (get_options()->TestingTorNetwork ?
+               (testing_tor_network ?
                 MIN_VOTE_INTERVAL_TESTING : MIN_VOTE_INTERVAL) <= valid_until);
     tor_assert(vote_seconds >= MIN_VOTE_SECONDS);
     tor_assert(dist_seconds >= MIN_DIST_SECONDS);
@@ -1314,17 +1844,22 @@ networkstatus_compute_consensus(smartlist_t *votes,
     SMARTLIST_FOREACH_BEGIN(dir_sources, const dir_src_ent_t *, e) {
       char fingerprint[HEX_DIGEST_LEN+1];
       char votedigest[HEX_DIGEST_LEN+1];
+      char addrbuf[INET_NTOA_BUF_LEN];
+      struct in_addr in;
       networkstatus_t *v = e->v;
       networkstatus_voter_info_t *voter = get_voter(v);
 
       base16_encode(fingerprint, sizeof(fingerprint), e->digest, DIGEST_LEN);
       base16_encode(votedigest, sizeof(votedigest), voter->vote_digest,
                     DIGEST_LEN);
+      /* Not fmt_addr32(): we might be in a worker thread. */
+      in.s_addr = htonl(voter->addr);
+      tor_inet_ntoa(&in, addrbuf, sizeof(addrbuf));
 
       smartlist_add_asprintf(chunks,
                    "dir-source %s%s %s %s %s %d %d\n",
                    voter->nickname, e->is_legacy ? "-legacy" : "",
-                   fingerprint, voter->address, fmt_addr32(voter->addr),
+                   fingerprint, voter->address, addrbuf,
                    voter->dir_port,
                    voter->or_port);
       if (! e->is_legacy) {
@@ -1355,8 +1890,11 @@ networkstatus_compute_consensus(smartlist_t *votes,
         max_unmeasured_bw_kb = (uint32_t)
           tor_parse_ulong(eq+1, 10, 1, UINT32_MAX, &ok, NULL);
         if (!ok) {
+          /* Not escaped(): we might be in a worker thread. */
+          char *esc = esc_for_log(max_unmeasured_param);
           log_warn(LD_DIR, "Bad element '%s' in max unmeasured bw param",
-                   escaped(max_unmeasured_param));
+                   esc);
+          tor_free(esc);
           max_unmeasured_bw_kb = DEFAULT_MAX_UNMEASURED_BW_KB;
         }
       }
@@ -1367,22 +1905,7 @@ networkstatus_compute_consensus(smartlist_t *votes,
   {
     int *index; /* index[j] is the current index into votes[j]. */
     int *size; /* size[j] is the number of routerstatuses in votes[j]. */
-    int *flag_counts; /* The number of voters that list flag[j] for the
-                       * currently considered router. */
     int i;
-    smartlist_t *matching_descs = smartlist_new();
-    smartlist_t *chosen_flags = smartlist_new();
-    smartlist_t *versions = smartlist_new();
-    smartlist_t *exitsummaries = smartlist_new();
-    uint32_t *bandwidths_kb = tor_calloc(smartlist_len(votes),
-                                         sizeof(uint32_t));
-    uint32_t *measured_bws_kb = tor_calloc(smartlist_len(votes),
-                                           sizeof(uint32_t));
-    uint32_t *measured_guardfraction = tor_calloc(smartlist_len(votes),
-                                                  sizeof(uint32_t));
-    int num_bandwidths;
-    int num_mbws;
-    int num_guardfraction_inputs;
 
     int *n_voter_flags; /* n_voter_flags[j] is the number of flags that
                          * votes[j] knows about. */
@@ -1505,340 +2028,58 @@ networkstatus_compute_consensus(smartlist_t *votes,
 
     dircollator_collate(collator, consensus_method);
 
-    /* Now go through all the votes */
-    flag_counts = tor_calloc(smartlist_len(flags), sizeof(int));
-    const int num_routers = dircollator_n_routers(collator);
-    for (i = 0; i < num_routers; ++i) {
-      vote_routerstatus_t **vrs_lst =
-        dircollator_get_votes_for_router(collator, i);
-
-      vote_routerstatus_t *rs;
-      routerstatus_t rs_out;
-      const char *current_rsa_id = NULL;
-      const char *chosen_version;
-      const char *chosen_name = NULL;
-      int exitsummary_disagreement = 0;
-      int is_named = 0, is_unnamed = 0, is_running = 0;
-      int is_guard = 0, is_exit = 0, is_bad_exit = 0;
-      int naming_conflict = 0;
-      int n_listing = 0;
-      char microdesc_digest[DIGEST256_LEN];
-      tor_addr_port_t alt_orport = {TOR_ADDR_NULL, 0};
-
-      memset(flag_counts, 0, sizeof(int)*smartlist_len(flags));
-      smartlist_clear(matching_descs);
-      smartlist_clear(chosen_flags);
-      smartlist_clear(versions);
-      num_bandwidths = 0;
-      num_mbws = 0;
-      num_guardfraction_inputs = 0;
-
-      /* Okay, go through all the entries for this digest. */
-      for (int voter_idx = 0; voter_idx < smartlist_len(votes); ++voter_idx) {
-        if (vrs_lst[voter_idx] == NULL)
-          continue; /* This voter had nothing to say about this entry. */
-        rs = vrs_lst[voter_idx];
-        ++n_listing;
-
-        current_rsa_id = rs->status.identity_digest;
-
-        smartlist_add(matching_descs, rs);
-        if (rs->version && rs->version[0])
-          smartlist_add(versions, rs->version);
-
-        /* Tally up all the flags. */
-        for (int flag = 0; flag < n_voter_flags[voter_idx]; ++flag) {
-          if (rs->flags & (U64_LITERAL(1) << flag))
-            ++flag_counts[flag_map[voter_idx][flag]];
-        }
-        if (named_flag[voter_idx] >= 0 &&
-            (rs->flags & (U64_LITERAL(1) << named_flag[voter_idx]))) {
-          if (chosen_name && strcmp(chosen_name, rs->status.nickname)) {
-            log_notice(LD_DIR, "Conflict on naming for router: %s vs %s",
-                       chosen_name, rs->status.nickname);
-            naming_conflict = 1;
-          }
-          chosen_name = rs->status.nickname;
-        }
-
-        /* Count guardfraction votes and note down the values. */
-        if (rs->status.has_guardfraction) {
-          measured_guardfraction[num_guardfraction_inputs++] =
-            rs->status.guardfraction_percentage;
-        }
-
-        /* count bandwidths */
-        if (rs->has_measured_bw)
-          measured_bws_kb[num_mbws++] = rs->measured_bw_kb;
-
-        if (rs->status.has_bandwidth)
-          bandwidths_kb[num_bandwidths++] = rs->status.bandwidth_kb;
-      }
-
-      /* We don't include this router at all unless more than half of
-       * the authorities we believe in list it. */
-      if (n_listing <= total_authorities/2)
-        continue;
-
-      /* The clangalyzer can't figure out that this will never be NULL
-       * if n_listing is at least 1 */
-      tor_assert(current_rsa_id);
-
-      /* Figure out the most popular opinion of what the most recent
-       * routerinfo and its contents are. */
-      memset(microdesc_digest, 0, sizeof(microdesc_digest));
-      rs = compute_routerstatus_consensus(matching_descs, consensus_method,
-                                          microdesc_digest, &alt_orport);
-      /* Copy bits of that into rs_out. */
-      memset(&rs_out, 0, sizeof(rs_out));
-      tor_assert(fast_memeq(current_rsa_id,
-                            rs->status.identity_digest,DIGEST_LEN));
-      memcpy(rs_out.identity_digest, current_rsa_id, DIGEST_LEN);
-      memcpy(rs_out.descriptor_digest, rs->status.descriptor_digest,
-             DIGEST_LEN);
-      rs_out.addr = rs->status.addr;
-      rs_out.published_on = rs->status.published_on;
-      rs_out.dir_port = rs->status.dir_port;
-      rs_out.or_port = rs->status.or_port;
-      if (consensus_method >= MIN_METHOD_FOR_A_LINES) {
-        tor_addr_copy(&rs_out.ipv6_addr, &alt_orport.addr);
-        rs_out.ipv6_orport = alt_orport.port;
-      }
-      rs_out.has_bandwidth = 0;
-      rs_out.has_exitsummary = 0;
-
-      if (chosen_name && !naming_conflict) {
-        strlcpy(rs_out.nickname, chosen_name, sizeof(rs_out.nickname));
-      } else {
-        strlcpy(rs_out.nickname, rs->status.nickname, sizeof(rs_out.nickname));
-      }
-
-      {
-        const char *d = strmap_get_lc(name_to_id_map, rs_out.nickname);
-        if (!d) {
-          is_named = is_unnamed = 0;
-        } else if (fast_memeq(d, current_rsa_id, DIGEST_LEN)) {
-          is_named = 1; is_unnamed = 0;
-        } else {
-          is_named = 0; is_unnamed = 1;
-        }
-      }
-
-      /* Set the flags. */
-      smartlist_add(chosen_flags, (char*)"s"); /* for the start of the line. */
-      SMARTLIST_FOREACH_BEGIN(flags, const char *, fl) {
-        if (!strcmp(fl, "Named")) {
-          if (is_named)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else if (!strcmp(fl, "Unnamed")) {
-          if (is_unnamed)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else {
-          if (flag_counts[fl_sl_idx] > n_flag_voters[fl_sl_idx]/2) {
-            smartlist_add(chosen_flags, (char*)fl);
-            if (!strcmp(fl, "Exit"))
-              is_exit = 1;
-            else if (!strcmp(fl, "Guard"))
-              is_guard = 1;
-            else if (!strcmp(fl, "Running"))
-              is_running = 1;
-            else if (!strcmp(fl, "BadExit"))
-              is_bad_exit = 1;
-          }
-        }
-      } SMARTLIST_FOREACH_END(fl);
-
-      /* Starting with consensus method 4 we do not list servers
-       * that are not running in a consensus.  See Proposal 138 */
-      if (!is_running)
-        continue;
-
-      /* Pick the version. */
-      if (smartlist_len(versions)) {
-        sort_version_list(versions, 0);
-        chosen_version = get_most_frequent_member(versions);
-      } else {
-        chosen_version = NULL;
-      }
-
-      /* If it's a guard and we have enough guardfraction votes,
-         calculate its consensus guardfraction value. */
-      if (is_guard && num_guardfraction_inputs > 2 &&
-          consensus_method >= MIN_METHOD_FOR_GUARDFRACTION) {
-        rs_out.has_guardfraction = 1;
-        rs_out.guardfraction_percentage = median_uint32(measured_guardfraction,
-                                                     num_guardfraction_inputs);
-        /* final value should be an integer percentage! */
-        tor_assert(rs_out.guardfraction_percentage <= 100);
-      }
-
-      /* Pick a bandwidth */
-      if (num_mbws > 2) {
-        rs_out.has_bandwidth = 1;
-        rs_out.bw_is_unmeasured = 0;
-        rs_out.bandwidth_kb = median_uint32(measured_bws_kb, num_mbws);
-      } else if (num_bandwidths > 0) {
-        rs_out.has_bandwidth = 1;
-        rs_out.bw_is_unmeasured = 1;
-        rs_out.bandwidth_kb = median_uint32(bandwidths_kb, num_bandwidths);
-        if (consensus_method >= MIN_METHOD_TO_CLIP_UNMEASURED_BW &&
-            n_authorities_measuring_bandwidth > 2) {
-          /* Cap non-measured bandwidths. */
-          if (rs_out.bandwidth_kb > max_unmeasured_bw_kb) {
-            rs_out.bandwidth_kb = max_unmeasured_bw_kb;
-          }
-        }
-      }
-
-      /* Fix bug 2203: Do not count BadExit nodes as Exits for bw weights */
-      is_exit = is_exit && !is_bad_exit;
-
-      /* Update total bandwidth weights with the bandwidths of this router. */
-      {
-        update_total_bandwidth_weights(&rs_out,
-                                       is_exit, is_guard,
-                                       &G, &M, &E, &D, &T);
-      }
-
-      /* Ok, we already picked a descriptor digest we want to list
-       * previously.  Now we want to use the exit policy summary from
-       * that descriptor.  If everybody plays nice all the voters who
-       * listed that descriptor will have the same summary.  If not then
-       * something is fishy and we'll use the most common one (breaking
-       * ties in favor of lexicographically larger one (only because it
-       * lets me reuse more existing code)).
-       *
-       * The other case that can happen is that no authority that voted
-       * for that descriptor has an exit policy summary.  That's
-       * probably quite unlikely but can happen.  In that case we use
-       * the policy that was most often listed in votes, again breaking
-       * ties like in the previous case.
-       */
-      {
-        /* Okay, go through all the votes for this router.  We prepared
-         * that list previously */
-        const char *chosen_exitsummary = NULL;
-        smartlist_clear(exitsummaries);
-        SMARTLIST_FOREACH_BEGIN(matching_descs, vote_routerstatus_t *, vsr) {
-          /* Check if the vote where this status comes from had the
-           * proper descriptor */
-          tor_assert(fast_memeq(rs_out.identity_digest,
-                             vsr->status.identity_digest,
-                             DIGEST_LEN));
-          if (vsr->status.has_exitsummary &&
-               fast_memeq(rs_out.descriptor_digest,
-                       vsr->status.descriptor_digest,
-                       DIGEST_LEN)) {
-            tor_assert(vsr->status.exitsummary);
-            smartlist_add(exitsummaries, vsr->status.exitsummary);
-            if (!chosen_exitsummary) {
-              chosen_exitsummary = vsr->status.exitsummary;
-            } else if (strcmp(chosen_exitsummary, vsr->status.exitsummary)) {
-              /* Great.  There's disagreement among the voters.  That
-               * really shouldn't be */
-              exitsummary_disagreement = 1;
-            }
-          }
-        } SMARTLIST_FOREACH_END(vsr);
-
-        if (exitsummary_disagreement) {
-          char id[HEX_DIGEST_LEN+1];
-          char dd[HEX_DIGEST_LEN+1];
-          base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
-          base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
-          log_warn(LD_DIR, "The voters disagreed on the exit policy summary "
-                   " for router %s with descriptor %s.  This really shouldn't"
-                   " have happened.", id, dd);
-
-          smartlist_sort_strings(exitsummaries);
-          chosen_exitsummary = get_most_frequent_member(exitsummaries);
-        } else if (!chosen_exitsummary) {
-          char id[HEX_DIGEST_LEN+1];
-          char dd[HEX_DIGEST_LEN+1];
-          base16_encode(id, sizeof(dd), rs_out.identity_digest, DIGEST_LEN);
-          base16_encode(dd, sizeof(dd), rs_out.descriptor_digest, DIGEST_LEN);
-          log_warn(LD_DIR, "Not one of the voters that made us select"
-                   "descriptor %s for router %s had an exit policy"
-                   "summary", dd, id);
-
-          /* Ok, none of those voting for the digest we chose had an
-           * exit policy for us.  Well, that kinda sucks.
-           */
-          smartlist_clear(exitsummaries);
-          SMARTLIST_FOREACH(matching_descs, vote_routerstatus_t *, vsr, {
-            if (vsr->status.has_exitsummary)
-              smartlist_add(exitsummaries, vsr->status.exitsummary);
-          });
-          smartlist_sort_strings(exitsummaries);
-          chosen_exitsummary = get_most_frequent_member(exitsummaries);
-
-          if (!chosen_exitsummary)
-            log_warn(LD_DIR, "Wow, not one of the voters had an exit "
-                     "policy summary for %s.  Wow.", id);
-        }
-
-        if (chosen_exitsummary) {
-          rs_out.has_exitsummary = 1;
-          /* yea, discards the const */
-          rs_out.exitsummary = (char *)chosen_exitsummary;
-        }
-      }
-
-      if (flavor == FLAV_MICRODESC &&
-          tor_digest256_is_zero(microdesc_digest)) {
-        /* With no microdescriptor digest, we omit the entry entirely. */
-        continue;
-      }
-
-      {
-        char *buf;
-        /* Okay!! Now we can write the descriptor... */
-        /*     First line goes into "buf". */
-        buf = routerstatus_format_entry(&rs_out, NULL, rs_format, NULL);
-        if (buf)
-          smartlist_add(chunks, buf);
-      }
-      /*     Now an m line, if applicable. */
-      if (flavor == FLAV_MICRODESC &&
-          !tor_digest256_is_zero(microdesc_digest)) {
-        char m[BASE64_DIGEST256_LEN+1];
-        digest256_to_base64(m, microdesc_digest);
-        smartlist_add_asprintf(chunks, "m %s\n", m);
-      }
-      /*     Next line is all flags.  The "\n" is missing. */
-      smartlist_add(chunks,
-                    smartlist_join_strings(chosen_flags, " ", 0, NULL));
-      /*     Now the version line. */
-      if (chosen_version) {
-        smartlist_add(chunks, tor_strdup("\nv "));
-        smartlist_add(chunks, tor_strdup(chosen_version));
+    /* Now go through all the votes.  The collator lists the routers in
+     * order of identity digest, so we split them into ranges of digests,
+     * compute each range on its own thread, and put the ranges back
+     * together in order: the result is the same as if we had done them all
+     * here. */
+    {
+      consensus_router_ctx_t ctx;
+      consensus_router_range_t *ranges;
+      const int num_routers = dircollator_n_routers(collator);
+      int n_ranges = n_threads;
+      if (n_ranges > num_routers)
+        n_ranges = num_routers;
+      if (n_ranges < 1)
+        n_ranges = 1;
+
+      memset(&ctx, 0, sizeof(ctx));
+      ctx.votes = votes;
+      ctx.flags = flags;
+      ctx.total_authorities = total_authorities;
+      ctx.consensus_method = consensus_method;
+      ctx.flavor = flavor;
+      ctx.rs_format = rs_format;
+      ctx.n_voter_flags = n_voter_flags;
+      ctx.n_flag_voters = n_flag_voters;
+      ctx.flag_map = flag_map;
+      ctx.named_flag = named_flag;
+      ctx.name_to_id_map = name_to_id_map;
+      ctx.n_authorities_measuring_bandwidth =
+        n_authorities_measuring_bandwidth;
+      ctx.max_unmeasured_bw_kb = max_unmeasured_bw_kb;
+      ctx.collator = collator;
+
+      ranges = tor_calloc(n_ranges, sizeof(consensus_router_range_t));
+      for (i = 0; i < n_ranges; ++i) {
+        ranges[i].ctx = &ctx;
+        ranges[i].lo = (int)(((int64_t)num_routers * i) / n_ranges);
+        ranges[i].hi = (int)(((int64_t)num_routers * (i+1)) / n_ranges);
+        ranges[i].chunks = smartlist_new();
       }
-      smartlist_add(chunks, tor_strdup("\n"));
-      /*     Now the weight line. */
-      if (rs_out.has_bandwidth) {
-        char *guardfraction_str = NULL;
-        int unmeasured = rs_out.bw_is_unmeasured &&
-          consensus_method >= MIN_METHOD_TO_CLIP_UNMEASURED_BW;
-
-        /* If we have guardfraction info, include it in the 'w' line. */
-        if (rs_out.has_guardfraction) {
-          tor_asprintf(&guardfraction_str,
-                       " GuardFraction=%u", rs_out.guardfraction_percentage);
-        }
-        smartlist_add_asprintf(chunks, "w Bandwidth=%d%s%s\n",
-                               rs_out.bandwidth_kb,
-                               unmeasured?" Unmeasured=1":"",
-                               guardfraction_str ? guardfraction_str : "");
 
-        tor_free(guardfraction_str);
-      }
+      consensus_compute_router_ranges(ranges, n_ranges);
 
-      /*     Now the exitpolicy summary line. */
-      if (rs_out.has_exitsummary && flavor == FLAV_NS) {
-        smartlist_add_asprintf(chunks, "p %s\n", rs_out.exitsummary);
+      for (i = 0; i < n_ranges; ++i) {
+        smartlist_add_all(chunks, ranges[i].chunks);
+        smartlist_free(ranges[i].chunks);
+        G += ranges[i].G;
+        M += ranges[i].M;
+        E += ranges[i].E;
+        D += ranges[i].D;
+        T += ranges[i].T;
       }
-
-      /* And the loop is over and we move on to the next router */
+      tor_free(ranges);
     }
 
     tor_free(index);
@@ -1848,17 +2089,9 @@ networkstatus_compute_consensus(smartlist_t *votes,
     for (i = 0; i < smartlist_len(votes); ++i)
       tor_free(flag_map[i]);
     tor_free(flag_map);
-    tor_free(flag_counts);
     tor_free(named_flag);
     tor_free(unnamed_flag);
     strmap_free(name_to_id_map, NULL);
-    smartlist_free(matching_descs);
-    smartlist_free(chosen_flags);
-    smartlist_free(versions);
-    smartlist_free(exitsummaries);
-    tor_free(bandwidths_kb);
-    tor_free(measured_bws_kb);
-    tor_free(measured_guardfraction);
   }
 
   /* Mark the directory footer region */
@@ -1885,14 +2118,12 @@ networkstatus_compute_consensus(smartlist_t *votes,
       if (eq) {
         weight_scale = tor_parse_long(eq+1, 10, 1, INT32_MAX, &ok,
                                          NULL);
-        if (!ok) {
-          log_warn(LD_DIR, "Bad element '%s' in bw weight param",
-              escaped(bw_weight_param));
-          weight_scale = BW_WEIGHT_SCALE;
-        }
-      } else {
-        log_warn(LD_DIR, "Bad element '%s' in bw weight param",
-            escaped(bw_weight_param));
+      }
+      if (!ok) {
+        /* Not escaped(): we might be in a worker thread. */
+        char *esc = esc_for_log(bw_weight_param);
+        log_warn(LD_DIR, "Bad element '%s' in bw weight param", esc);
+        tor_free(esc);
         weight_scale = BW_WEIGHT_SCALE;
       }
     }
@@ -1965,7 +2196,7 @@ networkstatus_compute_consensus(smartlist_t *votes,
 
   result = smartlist_join_strings(chunks, "", 0, NULL);
 
-  {
+  if (check_result) {
     networkstatus_t *c;
     if (!(c = networkstatus_parse_vote_from_string(result, NULL,
                                                    NS_TYPE_CONSENSUS))) {
@@ -1995,6 +2226,51 @@ networkstatus_compute_consensus(smartlist_t *votes,
   return result;
 }
 
+/** Given a list of vote networkstatus_t in <b>votes</b>, our public
+ * authority <b>identity_key</b>, our private authority <b>signing_key</b>,
+ * and the number of <b>total_authorities</b> that we believe exist in our
+ * voting quorum, generate the text of a new v3 consensus vote, and return the
+ * value in a newly allocated string.
+ *
+ * Note: this function DOES NOT check whether the votes are from
+ * recognized authorities.   (dirvote_add_vote does that.) */
+char *
+networkstatus_compute_consensus(smartlist_t *votes,
+                                int total_authorities,
+                                crypto_pk_t *identity_key,
+                                crypto_pk_t *signing_key,
+                                const char *legacy_id_key_digest,
+                                crypto_pk_t *legacy_signing_key,
+                                consensus_flavor_t flavor)
+{
+  return networkstatus_compute_consensus_threaded(votes, total_authorities,
+                                                  identity_key, signing_key,
+                                                  legacy_id_key_digest,
+                                                  legacy_signing_key,
+                                                  flavor, 1);
+}
+
+/** As networkstatus_compute_consensus(), but split the work of computing
+ * the router entries among up to <b>n_threads</b> threads.  The result is
+ * the same no matter how many threads we use. */
+char *
+networkstatus_compute_consensus_threaded(smartlist_t *votes,
+                                         int total_authorities,
+                                         crypto_pk_t *identity_key,
+                                         crypto_pk_t *signing_key,
+                                         const char *legacy_id_key_digest,
+                                         crypto_pk_t *legacy_signing_key,
+                                         consensus_flavor_t flavor,
+                                         int n_threads)
+{
+  return networkstatus_compute_consensus_impl(votes, total_authorities,
+                                              identity_key, signing_key,
+                                              legacy_id_key_digest,
+                                              legacy_signing_key, flavor,
+                                              get_options()->TestingTorNetwork,
+                                              n_threads, 1);
+}
+
 /** Given a list of networkstatus_t for each vote, return a newly allocated
  * string containing the "package" lines for the vote. */
 STATIC char *
@@ -2635,6 +2911,98 @@ static char *pending_consensus_signatures = NULL;
  * before we have generated the consensus on our own. */
 static smartlist_t *pending_consensus_signature_list = NULL;
 
+struct consensus_job_t;
+
+/** The part of a consensus_job_t that computes one flavor. */
+typedef struct consensus_flavor_job_t {
+  /** The job that this is part of. */
+  struct consensus_job_t *job;
+  /** The flavor to compute. */
+  consensus_flavor_t flavor;
+  /** Our own copy of the list of votes, since computing a consensus sorts
+   * it. */
+  smartlist_t *votes;
+  /** The consensus that we computed, or NULL if we couldn't. */
+  char *body;
+} consensus_flavor_job_t;
+
+/** A computation of every flavor of consensus from the pending votes.
+ * dirvote_compute_consensuses() sets one up in the main thread;
+ * consensus_job_threadfn() computes each flavor, in a worker thread if we
+ * have any; and consensus_job_finish() takes the results back in the main
+ * thread once every flavor is done. */
+typedef struct consensus_job_t {
+  /** The votes that we're computing the consensus from.  They still belong
+   * to pending_vote_list or previous_vote_list, but we don't free them there
+   * while the job is running: see dirvote_free_vote(). */
+  smartlist_t *votes;
+  /** Votes that we would have freed already if the job didn't need them. */
+  smartlist_t *retired_votes;
+  /** The number of authorities that we believe in. */
+  int n_voters;
+  /** Our authority identity key. */
+  crypto_pk_t *identity_key;
+  /** Our authority signing key. */
+  crypto_pk_t *signing_key;
+  /** Our legacy signing key, if we sign with one. */
+  crypto_pk_t *legacy_signing_key;
+  /** The digest of our legacy identity key, if have_legacy_id is set. */
+  char legacy_id_digest[DIGEST_LEN];
+  /** True iff legacy_id_digest is set. */
+  unsigned int have_legacy_id : 1;
+  /** The value of the TestingTorNetwork option when we started. */
+  unsigned int testing_tor_network : 1;
+  /** True iff we threw the pending votes away while the job was running,
+   * so that its result is no longer any use. */
+  unsigned int cancelled : 1;
+  /** True iff dirvote_free_all() let go of this job while workers were
+   * still busy with it, so that nothing is waiting for it any more. */
+  unsigned int detached : 1;
+  /** How many threads each flavor may use for the router entries. */
+  int n_threads;
+  /** The flavors that we're computing. */
+  consensus_flavor_job_t flavors[N_CONSENSUS_FLAVORS];
+  /** The number of flavors that aren't done yet. */
+  int n_flavors_running;
+} consensus_job_t;
+
+/** The consensus computation that's in progress, if any. */
+static consensus_job_t *consensus_job = NULL;
+
+/** Release all storage held by <b>job</b>, including any votes that we held
+ * on to for it. */
+static void
+consensus_job_free(consensus_job_t *job)
+{
+  int flav;
+  if (!job)
+    return;
+  for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
+    smartlist_free(job->flavors[flav].votes);
+    tor_free(job->flavors[flav].body);
+  }
+  SMARTLIST_FOREACH(job->retired_votes, networkstatus_t *, v,
+                    networkstatus_vote_free(v));
+  smartlist_free(job->retired_votes);
+  smartlist_free(job->votes);
+  crypto_pk_free(job->identity_key);
+  crypto_pk_free(job->signing_key);
+  crypto_pk_free(job->legacy_signing_key);
+  tor_free(job);
+}
+
+/** Free <b>vote</b>, which we're removing from pending_vote_list or
+ * previous_vote_list.  If a consensus computation is still using it, leave
+ * it for the computation to free once it's done. */
+static void
+dirvote_free_vote(networkstatus_t *vote)
+{
+  if (consensus_job && vote && smartlist_contains(consensus_job->votes, vote))
+    smartlist_add(consensus_job->retired_votes, vote);
+  else
+    networkstatus_vote_free(vote);
+}
+
 /** Generate a networkstatus vote and post it to all the v3 authorities.
  * (V3 Authority only) */
 static int
@@ -2774,7 +3142,7 @@ dirvote_clear_votes(int all_votes)
   SMARTLIST_FOREACH(previous_vote_list, pending_vote_t *, v, {
       cached_dir_decref(v->vote_body);
       v->vote_body = NULL;
-      networkstatus_vote_free(v->vote);
+      dirvote_free_vote(v->vote);
       tor_free(v);
     });
   smartlist_clear(previous_vote_list);
@@ -2784,7 +3152,7 @@ dirvote_clear_votes(int all_votes)
     SMARTLIST_FOREACH(pending_vote_list, pending_vote_t *, v, {
         cached_dir_decref(v->vote_body);
         v->vote_body = NULL;
-        networkstatus_vote_free(v->vote);
+        dirvote_free_vote(v->vote);
         tor_free(v);
       });
   } else {
@@ -2800,6 +3168,11 @@ dirvote_clear_votes(int all_votes)
   }
   tor_free(pending_consensus_signatures);
   dirvote_clear_pending_consensuses();
+
+  /* If we're still computing a consensus from these votes, it's too late
+   * for it to be any use. */
+  if (consensus_job)
+    consensus_job->cancelled = 1;
 }
 
 /** Return a newly allocated string containing the hex-encoded v3 authority
@@ -2920,7 +3293,7 @@ dirvote_add_vote(const char *vote_body, const char **msg_out, int *status_out)
           log_notice(LD_DIR, "Replacing an older pending vote from this "
                      "directory (%s)", vi->address);
           cached_dir_decref(v->vote_body);
-          networkstatus_vote_free(v->vote);
+          dirvote_free_vote(v->vote);
           v->vote_body = new_cached_dir(tor_strndup(vote_body,
                                                     end_of_vote-vote_body),
                                         vote->published);
@@ -2985,124 +3358,86 @@ dirvote_add_vote(const char *vote_body, const char **msg_out, int *status_out)
   return any_failed ? NULL : pending_vote;
 }
 
-/** Try to compute a v3 networkstatus consensus from the currently pending
- * votes.  Return 0 on success, -1 on failure.  Store the consensus in
- * pending_consensus: it won't be ready to be published until we have
- * everybody else's signatures collected too. (V3 Authority only) */
+/** Compute the flavor of consensus that <b>arg</b>, a
+ * consensus_flavor_job_t, asks for.  This only touches the job, so it can
+ * run in a worker thread. */
 static int
-dirvote_compute_consensuses(void)
+consensus_job_threadfn(void *state_, void *arg)
 {
-  /* Have we got enough votes to try? */
-  int n_votes, n_voters, n_vote_running = 0;
-  smartlist_t *votes = NULL, *votestrings = NULL;
-  char *consensus_body = NULL, *signatures = NULL, *votefile;
-  networkstatus_t *consensus = NULL;
-  authority_cert_t *my_cert;
-  pending_consensus_t pending[N_CONSENSUS_FLAVORS];
-  int flav;
-
-  memset(pending, 0, sizeof(pending));
+  consensus_flavor_job_t *fj = arg;
+  consensus_job_t *job = fj->job;
+  (void) state_;
+
+  fj->body = networkstatus_compute_consensus_impl(
+        fj->votes, job->n_voters,
+        job->identity_key, job->signing_key,
+        job->have_legacy_id ? job->legacy_id_digest : NULL,
+        job->legacy_signing_key,
+        fj->flavor, job->testing_tor_network, job->n_threads,
+        0 /* we check the result in consensus_job_finish() */);
+
+  return WQ_RPL_REPLY;
+}
 
-  if (!pending_vote_list)
-    pending_vote_list = smartlist_new();
+/** Back in the main thread, take the consensuses that <b>job</b> computed,
+ * and make them our pending consensuses: collect our signatures on them,
+ * and send those to the other authorities.  Free <b>job</b>.  Return 0 on
+ * success, -1 on failure. */
+static int
+consensus_job_finish(consensus_job_t *job)
+{
+  char *signatures = NULL;
+  pending_consensus_t pending[N_CONSENSUS_FLAVORS];
+  int flav, n_generated = 0;
 
-  n_voters = get_n_authorities(V3_DIRINFO);
-  n_votes = smartlist_len(pending_vote_list);
-  if (n_votes <= n_voters/2) {
-    log_warn(LD_DIR, "We don't have enough votes to generate a consensus: "
-             "%d of %d", n_votes, n_voters/2+1);
-    goto err;
-  }
-  tor_assert(pending_vote_list);
-  SMARTLIST_FOREACH(pending_vote_list, pending_vote_t *, v, {
-    if (smartlist_contains_string(v->vote->known_flags, "Running"))
-      n_vote_running++;
-  });
-  if (!n_vote_running) {
-    /* See task 1066. */
-    log_warn(LD_DIR, "Nobody has voted on the Running flag. Generating "
-                     "and publishing a consensus without Running nodes "
-                     "would make many clients stop working. Not "
-                     "generating a consensus!");
-    goto err;
+  if (job->detached) {
+    /* We've freed everything that the result would have gone into. */
+    consensus_job_free(job);
+    return -1;
   }
+  tor_assert(job == consensus_job);
+  consensus_job = NULL;
+  memset(pending, 0, sizeof(pending));
 
-  if (!(my_cert = get_my_v3_authority_cert())) {
-    log_warn(LD_DIR, "Can't generate consensus without a certificate.");
+  if (job->cancelled) {
+    log_notice(LD_DIR, "Discarding the consensus we computed: the votes it "
+               "came from are out of date.");
     goto err;
   }
 
-  votes = smartlist_new();
-  votestrings = smartlist_new();
-  SMARTLIST_FOREACH(pending_vote_list, pending_vote_t *, v,
-    {
-      sized_chunk_t *c = tor_malloc(sizeof(sized_chunk_t));
-      c->bytes = v->vote_body->dir;
-      c->len = v->vote_body->dir_len;
-      smartlist_add(votestrings, c); /* collect strings to write to disk */
-
-      smartlist_add(votes, v->vote); /* collect votes to compute consensus */
-    });
-
-  votefile = get_datadir_fname("v3-status-votes");
-  write_chunks_to_file(votefile, votestrings, 0, 0);
-  tor_free(votefile);
-  SMARTLIST_FOREACH(votestrings, sized_chunk_t *, c, tor_free(c));
-  smartlist_free(votestrings);
+  for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
+    const char *flavor_name = networkstatus_get_flavor_name(flav);
+    char *consensus_body = job->flavors[flav].body;
+    networkstatus_t *consensus;
 
-  {
-    char legacy_dbuf[DIGEST_LEN];
-    crypto_pk_t *legacy_sign=NULL;
-    char *legacy_id_digest = NULL;
-    int n_generated = 0;
-    if (get_options()->V3AuthUseLegacyKey) {
-      authority_cert_t *cert = get_my_v3_legacy_cert();
-      legacy_sign = get_my_v3_legacy_signing_key();
-      if (cert) {
-        if (crypto_pk_get_digest(cert->identity_key, legacy_dbuf)) {
-          log_warn(LD_BUG,
-                   "Unable to compute digest of legacy v3 identity key");
-        } else {
-          legacy_id_digest = legacy_dbuf;
-        }
-      }
+    if (!consensus_body) {
+      log_warn(LD_DIR, "Couldn't generate a %s consensus at all!",
+               flavor_name);
+      continue;
     }
+    consensus = networkstatus_parse_vote_from_string(consensus_body, NULL,
+                                                     NS_TYPE_CONSENSUS);
+    if (!consensus) {
+      log_warn(LD_DIR, "Couldn't parse %s consensus we generated!",
+               flavor_name);
+      continue;
+    }
+    // Verify balancing parameters
+    if (consensus->weight_params)
+      networkstatus_verify_bw_weights(consensus,
+                                      consensus->consensus_method);
 
-    for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
-      const char *flavor_name = networkstatus_get_flavor_name(flav);
-      consensus_body = networkstatus_compute_consensus(
-        votes, n_voters,
-        my_cert->identity_key,
-        get_my_v3_authority_signing_key(), legacy_id_digest, legacy_sign,
-        flav);
-
-      if (!consensus_body) {
-        log_warn(LD_DIR, "Couldn't generate a %s consensus at all!",
-                 flavor_name);
-        continue;
-      }
-      consensus = networkstatus_parse_vote_from_string(consensus_body, NULL,
-                                                       NS_TYPE_CONSENSUS);
-      if (!consensus) {
-        log_warn(LD_DIR, "Couldn't parse %s consensus we generated!",
-                 flavor_name);
-        tor_free(consensus_body);
-        continue;
-      }
-
-      /* 'Check' our own signature, to mark it valid. */
-      networkstatus_check_consensus_signature(consensus, -1);
+    /* 'Check' our own signature, to mark it valid. */
+    networkstatus_check_consensus_signature(consensus, -1);
 
-      pending[flav].body = consensus_body;
-      pending[flav].consensus = consensus;
-      n_generated++;
-      consensus_body = NULL;
-      consensus = NULL;
-    }
-    if (!n_generated) {
-      log_warn(LD_DIR, "Couldn't generate any consensus flavors at all.");
-      goto err;
-    }
+    pending[flav].body = consensus_body;
+    pending[flav].consensus = consensus;
+    job->flavors[flav].body = NULL;
+    n_generated++;
+  }
+  if (!n_generated) {
+    log_warn(LD_DIR, "Couldn't generate any consensus flavors at all.");
+    goto err;
   }
 
   signatures = get_detached_signatures_from_pending_consensuses(
@@ -3150,17 +3485,162 @@ dirvote_compute_consensuses(void)
                                strlen(pending_consensus_signatures), 0);
   log_notice(LD_DIR, "Signature(s) posted.");
 
-  smartlist_free(votes);
+  consensus_job_free(job);
   return 0;
  err:
-  smartlist_free(votes);
-  tor_free(consensus_body);
-  tor_free(signatures);
-  networkstatus_vote_free(consensus);
-
+  for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
+    tor_free(pending[flav].body);
+    networkstatus_vote_free(pending[flav].consensus);
+  }
+  consensus_job_free(job);
   return -1;
 }
 
+/** Note that the flavor of consensus in <b>fj</b> is done.  If it was the
+ * last one, finish its job, and return what consensus_job_finish() returns;
+ * otherwise return 0. */
+static int
+consensus_flavor_job_done(consensus_flavor_job_t *fj)
+{
+  consensus_job_t *job = fj->job;
+
+  tor_assert(job->n_flavors_running > 0);
+  if (--job->n_flavors_running == 0)
+    return consensus_job_finish(job);
+  return 0;
+}
+
+/** Main-thread callback: a worker is done computing the flavor of consensus
+ * in <b>arg</b>, a consensus_flavor_job_t.  If it was the last one, finish
+ * the job. */
+static void
+consensus_job_replyfn(void *arg)
+{
+  consensus_flavor_job_done(arg);
+}
+
+/** Try to compute a v3 networkstatus consensus from the currently pending
+ * votes.  Return 0 on success, -1 on failure.  Store the consensus in
+ * pending_consensus: it won't be ready to be published until we have
+ * everybody else's signatures collected too. (V3 Authority only)
+ *
+ * If we have worker threads, we compute each flavor in a worker, and only
+ * store the consensus once they're all done.  In that case, a return value
+ * of 0 only means that we've started. */
+static int
+dirvote_compute_consensuses(void)
+{
+  /* Have we got enough votes to try? */
+  int n_votes, n_voters, n_vote_running = 0;
+  smartlist_t *votestrings = NULL;
+  char *votefile;
+  authority_cert_t *my_cert;
+  const or_options_t *options = get_options();
+  consensus_job_t *job;
+  int flav, r = 0;
+
+  if (!pending_vote_list)
+    pending_vote_list = smartlist_new();
+
+  if (consensus_job) {
+    log_warn(LD_DIR, "Not computing a consensus: we're still working on the "
+             "last one.");
+    return -1;
+  }
+
+  n_voters = get_n_authorities(V3_DIRINFO);
+  n_votes = smartlist_len(pending_vote_list);
+  if (n_votes <= n_voters/2) {
+    log_warn(LD_DIR, "We don't have enough votes to generate a consensus: "
+             "%d of %d", n_votes, n_voters/2+1);
+    return -1;
+  }
+  tor_assert(pending_vote_list);
+  SMARTLIST_FOREACH(pending_vote_list, pending_vote_t *, v, {
+    if (smartlist_contains_string(v->vote->known_flags, "Running"))
+      n_vote_running++;
+  });
+  if (!n_vote_running) {
+    /* See task 1066. */
+    log_warn(LD_DIR, "Nobody has voted on the Running flag. Generating "
+                     "and publishing a consensus without Running nodes "
+                     "would make many clients stop working. Not "
+                     "generating a consensus!");
+    return -1;
+  }
+
+  if (!(my_cert = get_my_v3_authority_cert())) {
+    log_warn(LD_DIR, "Can't generate consensus without a certificate.");
+    return -1;
+  }
+
+  job = tor_malloc_zero(sizeof(consensus_job_t));
+  job->votes = smartlist_new();
+  job->retired_votes = smartlist_new();
+  votestrings = smartlist_new();
+  SMARTLIST_FOREACH(pending_vote_list, pending_vote_t *, v,
+    {
+      sized_chunk_t *c = tor_malloc(sizeof(sized_chunk_t));
+      c->bytes = v->vote_body->dir;
+      c->len = v->vote_body->dir_len;
+      smartlist_add(votestrings, c); /* collect strings to write to disk */
+
+      smartlist_add(job->votes, v->vote); /* collect votes to compute
+                                           * consensus */
+    });
+
+  votefile = get_datadir_fname("v3-status-votes");
+  write_chunks_to_file(votefile, votestrings, 0, 0);
+  tor_free(votefile);
+  SMARTLIST_FOREACH(votestrings, sized_chunk_t *, c, tor_free(c));
+  smartlist_free(votestrings);
+
+  /* The job holds its own references to the keys, in case we replace them
+   * while it's running. */
+  job->n_voters = n_voters;
+  job->identity_key = crypto_pk_dup_key(my_cert->identity_key);
+  job->signing_key = crypto_pk_dup_key(get_my_v3_authority_signing_key());
+  if (options->V3AuthUseLegacyKey) {
+    authority_cert_t *cert = get_my_v3_legacy_cert();
+    crypto_pk_t *legacy_sign = get_my_v3_legacy_signing_key();
+    if (legacy_sign)
+      job->legacy_signing_key = crypto_pk_dup_key(legacy_sign);
+    if (cert) {
+      if (crypto_pk_get_digest(cert->identity_key, job->legacy_id_digest)) {
+        log_warn(LD_BUG,
+                 "Unable to compute digest of legacy v3 identity key");
+      } else {
+        job->have_legacy_id = 1;
+      }
+    }
+  }
+  job->testing_tor_network = options->TestingTorNetwork ? 1 : 0;
+  job->n_threads = get_num_cpus(options);
+
+  for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
+    job->flavors[flav].job = job;
+    job->flavors[flav].flavor = flav;
+    job->flavors[flav].votes = smartlist_new();
+    smartlist_add_all(job->flavors[flav].votes, job->votes);
+  }
+  job->n_flavors_running = N_CONSENSUS_FLAVORS;
+  consensus_job = job;
+
+  for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
+    consensus_flavor_job_t *fj = &job->flavors[flav];
+    if (!cpuworker_queue_work(consensus_job_threadfn, consensus_job_replyfn,
+                              fj)) {
+      /* No worker threads: do it here.  If this was the last flavor, this
+       * finishes the job too. */
+      consensus_job_threadfn(NULL, fj);
+      r = consensus_flavor_job_done(fj);
+    }
+  }
+  /* If we did every flavor here, we're done already; otherwise we'll finish
+   * once the workers reply. */
+  return r;
+}
+
 /** Helper: we just got the <b>detached_signatures_body</b> sent to us as
  * signatures on the currently pending consensus.  Add them to <b>pc</b>
  * as appropriate.  Return the number of signatures added. (?) */
@@ -3366,6 +3846,14 @@ dirvote_free_all(void)
     smartlist_free(pending_consensus_signature_list);
     pending_consensus_signature_list = NULL;
   }
+
+  if (consensus_job) {
+    /* Workers may still be computing from the votes that we just handed
+     * over to the job, so we leave it for them to free once they're
+     * done. */
+    consensus_job->detached = 1;
+    consensus_job = NULL;
+  }
 }
 
 /* ====
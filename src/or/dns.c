@@ -20,6 +20,7 @@
 #include "control.h"
 #include "dns.h"
 #include "main.h"
+#include "metrics.h"
 #include "policies.h"
 #include "relay.h"
 #include "router.h"
@@ -902,6 +903,7 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
                   "cached answer for %s",
                   exitconn->base_.s,
                   escaped_safe_str(resolve->address));
+        metrics_incr(METRICS_DNS_CACHE_HITS);
 
         *resolve_out = resolve;
 
@@ -914,6 +916,7 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
   }
   tor_assert(!resolve);
   /* not there, need to add it */
+  metrics_incr(METRICS_DNS_CACHE_MISSES);
   resolve = tor_malloc_zero(sizeof(cached_resolve_t));
   resolve->magic = CACHED_RESOLVE_MAGIC;
   resolve->state = CACHE_STATE_PENDING;
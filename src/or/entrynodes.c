@@ -712,6 +712,36 @@ entry_guards_compute_status(const or_options_t *options, time_t now)
   digestmap_free(reasons, NULL);
 }
 
+/** The nodelist has just switched to a new consensus, and the nodes whose
+ * identity digests are keys in <b>changed</b> were added, dropped, or
+ * listed differently.  Update the status of the entry guards among them
+ * right away, without waiting to look at every guard in
+ * entry_guards_compute_status(). */
+void
+entry_guards_note_nodes_changed(const digestmap_t *changed, time_t now)
+{
+  const or_options_t *options = get_options();
+  int n_changed = 0;
+
+  if (! entry_guards || digestmap_isempty(changed))
+    return;
+
+  SMARTLIST_FOREACH_BEGIN(entry_guards, entry_guard_t *, entry) {
+    const char *reason = NULL;
+    if (! digestmap_get(changed, entry->identity))
+      continue;
+    if (entry_guard_set_status(entry, node_get_by_id(entry->identity), now,
+                               options, &reason))
+      ++n_changed;
+  } SMARTLIST_FOREACH_END(entry);
+
+  if (n_changed) {
+    log_info(LD_CIRC, "The new consensus changed the status of %d entry "
+             "guard%s.", n_changed, n_changed == 1 ? "" : "s");
+    entry_guards_changed();
+  }
+}
+
 /** Called when a connection to an OR with the identity digest <b>digest</b>
  * is established (<b>succeeded</b>==1) or has failed (<b>succeeded</b>==0).
  * If the OR is an entry, change that entry's up/down status.
@@ -112,6 +112,7 @@ STATIC int entry_is_time_to_retry(const entry_guard_t *e, time_t now);
 void remove_all_entry_guards(void);
 
 void entry_guards_compute_status(const or_options_t *options, time_t now);
+void entry_guards_note_nodes_changed(const digestmap_t *changed, time_t now);
 int entry_guard_register_connect_status(const char *digest, int succeeded,
                                         int mark_relay_status, time_t now);
 void entry_nodes_should_be_added(void);
@@ -66,6 +66,7 @@
 #endif
 #include "memarea.h"
 #include "sandbox.h"
+#include "trace.h"
 
 #ifdef HAVE_EVENT2_EVENT_H
 #include <event2/event.h>
@@ -932,10 +933,8 @@ conn_close_if_marked(int i)
          * busy Libevent loops where we keep ending up here and returning
          * 0 until we are no longer blocked on bandwidth.
          */
-        if (connection_is_writing(conn)) {
-          conn->write_blocked_on_bw = 1;
-          connection_stop_writing(conn);
-        }
+        if (connection_is_writing(conn))
+          connection_write_bw_exhausted(conn);
         if (connection_is_reading(conn)) {
           /* XXXX024 We should make this code unreachable; if a connection is
            * marked for close and flushing, there is no point in reading to it
@@ -955,8 +954,7 @@ conn_close_if_marked(int i)
             tor_free(m);
           }
 #endif
-          conn->read_blocked_on_bw = 1;
-          connection_stop_reading(conn);
+          connection_read_bw_exhausted(conn);
         }
       }
       return 0;
@@ -1484,7 +1482,8 @@ run_scheduled_events(time_t now)
     rep_history_clean(now - options->RephistTrackTime);
     rend_cache_clean(now);
     rend_cache_clean_v2_descs_as_dir(now, 0);
-    microdesc_cache_rebuild(NULL, 0);
+    microdesc_cache_rebuild_in_background(NULL, 0);
+    circuit_pools_clean();
 #define CLEAN_CACHES_INTERVAL (30*60)
     time_to.clean_caches = now + CLEAN_CACHES_INTERVAL;
   }
@@ -1715,6 +1714,8 @@ second_elapsed_callback(periodic_timer_t *timer, void *arg)
   now = time(NULL);
   update_approx_time(now);
 
+  tor_trace_flush();
+
   /* the second has rolled over. check more stuff. */
   seconds_elapsed = current_second ? (int)(now - current_second) : 0;
 #ifdef USE_BUFFEREVENTS
@@ -2337,6 +2338,7 @@ dumpmemusage(int severity)
       U64_PRINTF_ARG(rephist_total_alloc), rephist_total_num);
   dump_routerlist_mem_usage(severity);
   dump_cell_pool_usage(severity);
+  dump_circuit_pool_usage(severity);
   dump_dns_mem_usage(severity);
   tor_log_mallinfo(severity);
 }
@@ -2733,6 +2735,7 @@ tor_free_all(int postfork)
   connection_free_all();
   scheduler_free_all();
   memarea_clear_freelist();
+  tor_trace_free_all();
   nodelist_free_all();
   microdesc_free_all();
   ext_orport_free_all();
@@ -0,0 +1,334 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file metrics.c
+ * \brief Keep counters of what this Tor is doing, and serve them on the
+ * MetricsPort in the Prometheus text exposition format.
+ *
+ * Event counters live in flat arrays that the hot paths bump with one
+ * increment each (see metrics.h).  They are only touched from the main
+ * thread, so they need no locks.  Everything that we can cheaply compute
+ * from existing state, such as queue lengths and memory use, we compute
+ * when somebody asks.
+ **/
+
+#include "or.h"
+#include "buffers.h"
+#include "circuitlist.h"
+#include "command.h"
+#include "connection.h"
+#include "main.h"
+#include "metrics.h"
+#include "onion.h"
+#include "relay.h"
+#include "rendservice.h"
+#include "routerparse.h"
+
+uint64_t metrics_counters_[N_METRICS_COUNTERS];
+uint64_t metrics_cells_received_[256];
+uint64_t metrics_cells_sent_[256];
+
+/** Largest HTTP request header we'll accept on a metrics connection. */
+#define MAX_METRICS_REQUEST_SIZE 8192
+
+/** Helper: add the HELP and TYPE lines for a metric called <b>name</b> of
+ * type <b>type</b> to <b>out</b>. */
+static void
+add_metric_header(smartlist_t *out, const char *name, const char *type,
+                  const char *help)
+{
+  smartlist_add_asprintf(out, "# HELP %s %s\n# TYPE %s %s\n",
+                         name, help, name, type);
+}
+
+/** Helper: add a metric called <b>name</b> with a single unlabeled
+ * <b>value</b> to <b>out</b>. */
+static void
+add_metric(smartlist_t *out, const char *name, const char *type,
+           const char *help, uint64_t value)
+{
+  add_metric_header(out, name, type, help);
+  smartlist_add_asprintf(out, "%s "U64_FORMAT"\n",
+                         name, U64_PRINTF_ARG(value));
+}
+
+/** Helper: add a sample of the metric <b>name</b> with one label to
+ * <b>out</b>. */
+static void
+add_metric_labeled(smartlist_t *out, const char *name, const char *label,
+                   const char *label_value, uint64_t value)
+{
+  smartlist_add_asprintf(out, "%s{%s=\"%s\"} "U64_FORMAT"\n",
+                         name, label, label_value, U64_PRINTF_ARG(value));
+}
+
+/** Helper: add the counts in <b>cells</b>, indexed by cell command, to
+ * <b>out</b> as the metric <b>name</b>.  Commands that we don't recognize
+ * are lumped together. */
+static void
+add_cell_counts(smartlist_t *out, const char *name, const char *help,
+                const uint64_t *cells)
+{
+  uint64_t unrecognized = 0;
+  int i;
+  add_metric_header(out, name, "counter", help);
+  for (i = 0; i < 256; ++i) {
+    const char *command = cell_command_to_string((uint8_t)i);
+    if (!strcmp(command, "unrecognized"))
+      unrecognized += cells[i];
+    else if (cells[i])
+      add_metric_labeled(out, name, "command", command, cells[i]);
+  }
+  if (unrecognized)
+    add_metric_labeled(out, name, "command", "unrecognized", unrecognized);
+}
+
+/** Return a newly allocated string holding all of our metrics, in the
+ * Prometheus text format. */
+char *
+metrics_format(void)
+{
+  smartlist_t *out = smartlist_new();
+  int circs_by_state[CIRCUIT_STATE_OPEN+1];
+  int conns_by_type[CONN_TYPE_MAX_+1];
+  char *result;
+  int i;
+
+  add_metric(out, "tor_uptime_seconds", "gauge",
+             "How long this Tor has been running.", get_uptime());
+  add_metric(out, "tor_traffic_read_bytes_total", "counter",
+             "Bytes read from the network.", get_bytes_read());
+  add_metric(out, "tor_traffic_written_bytes_total", "counter",
+             "Bytes written to the network.", get_bytes_written());
+
+  add_cell_counts(out, "tor_cells_received_total",
+                  "Cells received on channels, by command.",
+                  metrics_cells_received_);
+  add_cell_counts(out, "tor_cells_sent_total",
+                  "Cells written to channels, by command.",
+                  metrics_cells_sent_);
+
+  add_metric_header(out, "tor_onionskins_total", "counter",
+                    "Circuit-creation handshakes, by outcome.");
+  add_metric_labeled(out, "tor_onionskins_total", "result", "processed",
+                     metrics_counters_[METRICS_ONIONSKINS_PROCESSED]);
+  add_metric_labeled(out, "tor_onionskins_total", "result", "failed",
+                     metrics_counters_[METRICS_ONIONSKINS_FAILED]);
+  add_metric_labeled(out, "tor_onionskins_total", "result", "dropped",
+                     metrics_counters_[METRICS_ONIONSKINS_DROPPED]);
+  add_metric_header(out, "tor_onionskins_pending", "gauge",
+                    "Circuit-creation handshakes waiting for a cpuworker.");
+  add_metric_labeled(out, "tor_onionskins_pending", "type", "tap",
+                     onion_num_pending(ONION_HANDSHAKE_TYPE_TAP));
+  add_metric_labeled(out, "tor_onionskins_pending", "type", "ntor",
+                     onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+  memset(circs_by_state, 0, sizeof(circs_by_state));
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
+    if (!circ->marked_for_close && circ->state <= CIRCUIT_STATE_OPEN)
+      ++circs_by_state[circ->state];
+  } SMARTLIST_FOREACH_END(circ);
+  add_metric_header(out, "tor_circuits", "gauge", "Circuits, by state.");
+  for (i = 0; i <= CIRCUIT_STATE_OPEN; ++i)
+    add_metric_labeled(out, "tor_circuits", "state",
+                       circuit_state_to_string(i), circs_by_state[i]);
+
+  memset(conns_by_type, 0, sizeof(conns_by_type));
+  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+    if (!conn->marked_for_close && conn->type <= CONN_TYPE_MAX_)
+      ++conns_by_type[conn->type];
+  } SMARTLIST_FOREACH_END(conn);
+  add_metric_header(out, "tor_connections", "gauge", "Connections, by type.");
+  for (i = CONN_TYPE_MIN_; i <= CONN_TYPE_MAX_; ++i) {
+    if (conns_by_type[i])
+      add_metric_labeled(out, "tor_connections", "type",
+                         conn_type_to_string(i), conns_by_type[i]);
+  }
+
+  add_metric(out, "tor_oom_circuits_killed_total", "counter",
+             "Circuits killed because we were low on memory.",
+             metrics_counters_[METRICS_OOM_CIRCUITS_KILLED]);
+  add_metric(out, "tor_oom_bytes_recovered_total", "counter",
+             "Bytes freed because we were low on memory.",
+             metrics_counters_[METRICS_OOM_BYTES_RECOVERED]);
+  add_metric(out, "tor_buffer_bytes", "gauge",
+             "Bytes allocated for connection buffers.",
+             buf_get_total_allocation());
+  add_metric(out, "tor_cell_queue_bytes", "gauge",
+             "Bytes allocated for cells on circuit queues.",
+             cell_queues_get_total_allocation());
+
+  add_metric_header(out, "tor_dns_cache_total", "counter",
+                    "Exit DNS resolves, by whether they hit the cache.");
+  add_metric_labeled(out, "tor_dns_cache_total", "result", "hit",
+                     metrics_counters_[METRICS_DNS_CACHE_HITS]);
+  add_metric_labeled(out, "tor_dns_cache_total", "result", "miss",
+                     metrics_counters_[METRICS_DNS_CACHE_MISSES]);
+
+  add_metric_header(out, "tor_tls_handshakes_total", "counter",
+                    "TLS handshakes with other relays, by outcome.");
+  add_metric_labeled(out, "tor_tls_handshakes_total", "result", "done",
+                     metrics_counters_[METRICS_TLS_HANDSHAKES_DONE]);
+  add_metric_labeled(out, "tor_tls_handshakes_total", "result", "failed",
+                     metrics_counters_[METRICS_TLS_HANDSHAKES_FAILED]);
+  add_metric_header(out, "tor_tls_handshakes_by_kind_total", "counter",
+                    "Finished TLS handshakes, by whether they resumed an "
+                    "earlier session.");
+  add_metric_labeled(out, "tor_tls_handshakes_by_kind_total", "kind", "full",
+                     metrics_counters_[METRICS_TLS_HANDSHAKES_FULL]);
+  add_metric_labeled(out, "tor_tls_handshakes_by_kind_total", "kind",
+                     "resumed",
+                     metrics_counters_[METRICS_TLS_HANDSHAKES_RESUMED]);
+  add_metric_header(out, "tor_tls_ktls_offloads_total", "counter",
+                    "TLS connections on which the kernel took over the "
+                    "record-layer crypto, by direction.");
+  add_metric_labeled(out, "tor_tls_ktls_offloads_total", "direction", "send",
+                     metrics_counters_[METRICS_TLS_KTLS_SEND]);
+  add_metric_labeled(out, "tor_tls_ktls_offloads_total", "direction", "recv",
+                     metrics_counters_[METRICS_TLS_KTLS_RECV]);
+  add_metric(out, "tor_tls_records_written_total", "counter",
+             "TLS records written on OR connections.",
+             metrics_counters_[METRICS_TLS_RECORDS_WRITTEN]);
+  add_metric(out, "tor_tls_record_bytes_written_total", "counter",
+             "Bytes of data in the TLS records written on OR connections.",
+             metrics_counters_[METRICS_TLS_RECORD_BYTES_WRITTEN]);
+  add_metric(out, "tor_tls_record_average_bytes", "gauge",
+             "Average amount of data per TLS record written on OR "
+             "connections.",
+             metrics_counters_[METRICS_TLS_RECORDS_WRITTEN] ?
+             metrics_counters_[METRICS_TLS_RECORD_BYTES_WRITTEN] /
+             metrics_counters_[METRICS_TLS_RECORDS_WRITTEN] : 0);
+  add_metric(out, "tor_tls_writes_held_total", "counter",
+             "Times we held back a write on an OR connection to fill a "
+             "TLS record.",
+             metrics_counters_[METRICS_TLS_WRITES_HELD]);
+
+  add_metric_header(out, "tor_introduce2_total", "counter",
+                    "INTRODUCE2 cells for our onion services, by outcome.");
+  add_metric_labeled(out, "tor_introduce2_total", "result", "processed",
+                     metrics_counters_[METRICS_INTRODUCE2_PROCESSED]);
+  add_metric_labeled(out, "tor_introduce2_total", "result", "failed",
+                     metrics_counters_[METRICS_INTRODUCE2_FAILED]);
+  add_metric_labeled(out, "tor_introduce2_total", "result", "dropped",
+                     metrics_counters_[METRICS_INTRODUCE2_DROPPED]);
+  add_metric(out, "tor_introduce2_pending", "gauge",
+             "INTRODUCE2 cells waiting for a worker thread.",
+             rend_service_num_pending_intros());
+
+  add_metric_header(out, "tor_dirparse_objects_total", "counter",
+                    "Directory objects parsed, by type.");
+  for (i = 0; i < N_ROUTERPARSE_AREA_TYPES; ++i) {
+    routerparse_area_stats_t st;
+    routerparse_get_area_stats_by_type(i, &st);
+    add_metric_labeled(out, "tor_dirparse_objects_total", "type",
+                       routerparse_area_type_to_string(i), st.n_parsed);
+  }
+  add_metric_header(out, "tor_dirparse_area_peak_bytes", "gauge",
+                    "Most memory used to parse one directory object, "
+                    "by type.");
+  for (i = 0; i < N_ROUTERPARSE_AREA_TYPES; ++i) {
+    routerparse_area_stats_t st;
+    routerparse_get_area_stats_by_type(i, &st);
+    add_metric_labeled(out, "tor_dirparse_area_peak_bytes", "type",
+                       routerparse_area_type_to_string(i), st.peak_used);
+  }
+
+  result = smartlist_join_strings(out, "", 0, NULL);
+  SMARTLIST_FOREACH(out, char *, cp, tor_free(cp));
+  smartlist_free(out);
+  return result;
+}
+
+/** Reset every event counter to zero. */
+void
+metrics_reset_counters(void)
+{
+  memset(metrics_counters_, 0, sizeof(metrics_counters_));
+  memset(metrics_cells_received_, 0, sizeof(metrics_cells_received_));
+  memset(metrics_cells_sent_, 0, sizeof(metrics_cells_sent_));
+}
+
+/** Write an HTTP/1.0 response with status <b>status</b> and the body
+ * <b>body</b> to <b>conn</b>, and get ready to close it once it's sent. */
+static void
+metrics_write_response(connection_t *conn, int status, const char *reason,
+                       const char *body)
+{
+  char *hdr = NULL;
+  const size_t body_len = strlen(body);
+  tor_asprintf(&hdr, "HTTP/1.0 %d %s\r\n"
+               "Content-Type: text/plain; version=0.0.4\r\n"
+               "Content-Length: %lu\r\n\r\n",
+               status, reason, (unsigned long)body_len);
+  connection_write_to_buf(hdr, strlen(hdr), conn);
+  connection_write_to_buf(body, body_len, conn);
+  conn->state = METRICS_CONN_STATE_WRITING;
+  /* We only answer one request per connection. */
+  connection_stop_reading(conn);
+  tor_free(hdr);
+}
+
+/** Called when <b>conn</b>, a metrics connection, has new data on its
+ * inbuf.  Once we have a whole HTTP request, answer it.  Return 0 on
+ * success, -1 if the connection should be closed. */
+int
+connection_metrics_process_inbuf(connection_t *conn)
+{
+  char *headers = NULL;
+  tor_assert(conn->type == CONN_TYPE_METRICS);
+
+  if (conn->state != METRICS_CONN_STATE_READING)
+    return 0; /* We already answered. */
+
+  /* We don't want a body, but we tolerate (and ignore) a small one. */
+  switch (connection_fetch_from_buf_http(conn, &headers,
+                                         MAX_METRICS_REQUEST_SIZE,
+                                         NULL, NULL,
+                                         MAX_METRICS_REQUEST_SIZE, 0)) {
+    case -1:
+      log_info(LD_NET, "Metrics request from %s was too long. Closing.",
+               conn->address);
+      return -1;
+    case 0:
+      return 0; /* We need more data. */
+  }
+
+  if (strcmpstart(headers, "GET ")) {
+    metrics_write_response(conn, 405, "Method Not Allowed",
+                           "Only GET is supported.\n");
+  } else if (strcmpstart(headers, "GET /metrics ") &&
+             strcmpstart(headers, "GET /metrics\r")) {
+    metrics_write_response(conn, 404, "Not Found",
+                           "Try /metrics.\n");
+  } else {
+    char *body = metrics_format();
+    metrics_write_response(conn, 200, "OK", body);
+    tor_free(body);
+  }
+  tor_free(headers);
+  return 0;
+}
+
+/** Called when <b>conn</b>, a metrics connection, has sent everything on
+ * its outbuf. */
+int
+connection_metrics_finished_flushing(connection_t *conn)
+{
+  tor_assert(conn->type == CONN_TYPE_METRICS);
+  if (conn->state == METRICS_CONN_STATE_WRITING)
+    connection_mark_for_close(conn);
+  return 0;
+}
+
+/** Called when <b>conn</b>, a metrics connection, has gotten its socket
+ * closed. */
+int
+connection_metrics_reached_eof(connection_t *conn)
+{
+  tor_assert(conn->type == CONN_TYPE_METRICS);
+  log_info(LD_NET, "Metrics connection reached EOF. Closing.");
+  connection_mark_for_close(conn);
+  return 0;
+}
+
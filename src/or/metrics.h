@@ -0,0 +1,89 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file metrics.h
+ * \brief Header file for metrics.c.
+ **/
+
+#ifndef TOR_METRICS_H
+#define TOR_METRICS_H
+
+#include "testsupport.h"
+
+/** Event counters that we export on the MetricsPort.  Counters that are
+ * cheaper to compute on demand (queue lengths, memory use, circuits by
+ * state) aren't here; see metrics_format(). */
+typedef enum metrics_counter_t {
+  /** Onionskins that a cpuworker answered successfully. */
+  METRICS_ONIONSKINS_PROCESSED = 0,
+  /** Onionskins that a cpuworker couldn't decode. */
+  METRICS_ONIONSKINS_FAILED,
+  /** Onionskins we dropped because our queues were full or too slow. */
+  METRICS_ONIONSKINS_DROPPED,
+  /** Circuits killed by the out-of-memory handler. */
+  METRICS_OOM_CIRCUITS_KILLED,
+  /** Bytes freed by the out-of-memory handler. */
+  METRICS_OOM_BYTES_RECOVERED,
+  /** Exit resolves that we answered from the DNS cache. */
+  METRICS_DNS_CACHE_HITS,
+  /** Exit resolves that we had to launch. */
+  METRICS_DNS_CACHE_MISSES,
+  /** TLS handshakes that finished. */
+  METRICS_TLS_HANDSHAKES_DONE,
+  /** TLS handshakes that failed. */
+  METRICS_TLS_HANDSHAKES_FAILED,
+  /** TLS handshakes that finished with a full key exchange. */
+  METRICS_TLS_HANDSHAKES_FULL,
+  /** TLS handshakes that finished by resuming an earlier session. */
+  METRICS_TLS_HANDSHAKES_RESUMED,
+  /** TLS connections where the kernel encrypts the data we send. */
+  METRICS_TLS_KTLS_SEND,
+  /** TLS connections where the kernel decrypts the data we receive. */
+  METRICS_TLS_KTLS_RECV,
+  /** TLS records that we wrote on OR connections. */
+  METRICS_TLS_RECORDS_WRITTEN,
+  /** Bytes of cell data in the TLS records that we wrote. */
+  METRICS_TLS_RECORD_BYTES_WRITTEN,
+  /** Times that we held back a write on an OR connection to fill a record. */
+  METRICS_TLS_WRITES_HELD,
+  /** INTRODUCE2 cells that we handled and launched a rendezvous for. */
+  METRICS_INTRODUCE2_PROCESSED,
+  /** INTRODUCE2 cells that we couldn't decrypt, parse, or act on. */
+  METRICS_INTRODUCE2_FAILED,
+  /** INTRODUCE2 cells we dropped because our worker threads were busy. */
+  METRICS_INTRODUCE2_DROPPED,
+  N_METRICS_COUNTERS
+} metrics_counter_t;
+
+/* Only the main thread updates these, so plain increments are safe.  Use
+ * the macros below rather than touching them directly. */
+extern uint64_t metrics_counters_[N_METRICS_COUNTERS];
+extern uint64_t metrics_cells_received_[256];
+extern uint64_t metrics_cells_sent_[256];
+
+/** Add <b>n</b> to the metrics counter <b>counter</b>. */
+#define metrics_add(counter, n) STMT_BEGIN                 \
+    metrics_counters_[(counter)] += (uint64_t)(n);          \
+  STMT_END
+/** Add one to the metrics counter <b>counter</b>. */
+#define metrics_incr(counter) metrics_add((counter), 1)
+/** Count a cell with command <b>command</b> that we received on a
+ * channel. */
+#define metrics_note_cell_received(command) STMT_BEGIN     \
+    ++metrics_cells_received_[(uint8_t)(command)];          \
+  STMT_END
+/** Count a cell with command <b>command</b> that we wrote to a channel. */
+#define metrics_note_cell_sent(command) STMT_BEGIN         \
+    ++metrics_cells_sent_[(uint8_t)(command)];              \
+  STMT_END
+
+char *metrics_format(void);
+void metrics_reset_counters(void);
+
+int connection_metrics_process_inbuf(connection_t *conn);
+int connection_metrics_finished_flushing(connection_t *conn);
+int connection_metrics_reached_eof(connection_t *conn);
+
+#endif
+
@@ -4,8 +4,10 @@
 #include "or.h"
 #include "circuitbuild.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
+#include "dirsnapshot.h"
 #include "entrynodes.h"
 #include "microdesc.h"
 #include "networkstatus.h"
@@ -14,11 +16,70 @@
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "workqueue.h"
+
+/** A microdescriptor that a rebuild is writing to the new cache file. */
+typedef struct md_rebuild_entry_t {
+  /** The microdescriptor's digest, so we can find it again when we're
+   * done. */
+  char digest[DIGEST256_LEN];
+  /** When the microdescriptor was last listed. */
+  time_t last_listed;
+  /** The body of the microdescriptor.  If <b>body_is_copy</b> is false, it
+   * points into the old cache file. */
+  char *body;
+  /** Number of bytes in <b>body</b>. */
+  size_t bodylen;
+  /** True iff we allocated <b>body</b> ourselves. */
+  unsigned int body_is_copy : 1;
+  /** Offset of the body in the new cache file. */
+  off_t off;
+} md_rebuild_entry_t;
+
+/** A rebuild of a microdescriptor cache file.  The main thread notes which
+ * microdescriptors to keep in md_rebuild_job_new(); md_rebuild_threadfn()
+ * writes them out, possibly in a worker thread, without touching the cache;
+ * and md_rebuild_job_finish() switches the cache over to the new file back
+ * in the main thread. */
+typedef struct md_rebuild_job_t {
+  /** The cache we're rebuilding, or NULL if it was cleared while we were
+   * working. */
+  microdesc_cache_t *cache;
+  /** The contents of the old cache file.  We must not unmap them while the
+   * new file is being written. */
+  tor_mmap_t *old_content;
+  /** The new cache file. */
+  open_file_t *open_file;
+  /** File descriptor for the new cache file. */
+  int fd;
+  /** The microdescriptors to write. */
+  md_rebuild_entry_t *entries;
+  /** Number of elements in <b>entries</b>. */
+  int n_entries;
+  /** Bytes in the old cache file and the sealed journal. */
+  size_t orig_size;
+  /** Value of the cache's bytes_dropped when we started. */
+  size_t bytes_dropped;
+
+  /** Number of bytes written to the new cache file. */
+  size_t new_size;
+  /** SHA256 digest of the new cache file. */
+  char digest[DIGEST256_LEN];
+  /** True iff we couldn't write the new cache file. */
+  unsigned int failed : 1;
+  /** If <b>failed</b>, the errno for the failure. */
+  int failed_errno;
+} md_rebuild_job_t;
 
 /** A data structure to hold a bunch of cached microdescriptors.  There are
  * two active files in the cache: a "cache file" that we mmap, and a "journal
  * file" that we append to.  Periodically, we rebuild the cache file to hold
- * only the microdescriptors that we want to keep */
+ * only the microdescriptors that we want to keep.
+ *
+ * When we start a rebuild, we seal the journal: we move it aside, and start
+ * a new one for the microdescriptors that arrive while the rebuild is
+ * running.  Once the new cache file is in place, we can throw the sealed
+ * journal away. */
 struct microdesc_cache_t {
   /** Map from sha256-digest to microdesc_t for every microdesc_t in the
    * cache. */
@@ -28,10 +89,19 @@ struct microdesc_cache_t {
   char *cache_fname;
   /** Name of the journal file. */
   char *journal_fname;
+  /** Name of the sealed journal file, which holds the journal entries that
+   * the current (or last unfinished) rebuild is folding into the cache
+   * file. */
+  char *sealed_journal_fname;
+  /** Name of the file that holds a snapshot of the parsed contents of the
+   * cache file. */
+  char *snapshot_fname;
   /** Mmap'd contents of the cache file, or NULL if there is none. */
   tor_mmap_t *cache_content;
   /** Number of bytes used in the journal file. */
   size_t journal_len;
+  /** Number of bytes used in the sealed journal file. */
+  size_t sealed_journal_len;
   /** Number of bytes in descriptors removed as too old. */
   size_t bytes_dropped;
 
@@ -39,6 +109,9 @@ struct microdesc_cache_t {
   uint64_t total_len_seen;
   /** Total number of microdescriptors we have added to this cache */
   unsigned n_seen;
+
+  /** The rebuild of this cache that is in progress, if any. */
+  md_rebuild_job_t *rebuild_job;
 };
 
 /** Helper: computes a hash of <b>md</b> to place it in a hash table. */
@@ -61,6 +134,25 @@ HT_GENERATE2(microdesc_map, microdesc_t, node,
              microdesc_hash_, microdesc_eq_, 0.6,
              tor_reallocarray_, tor_free_)
 
+/** Longest annotation that format_md_annotation() will generate. */
+#define MD_ANNOTATION_MAXLEN (ISO_TIME_LEN+32)
+
+/** Write the annotations for a microdescriptor last listed at
+ * <b>last_listed</b> into the MD_ANNOTATION_MAXLEN-byte buffer
+ * <b>out</b>. */
+static void
+format_md_annotation(char *out, time_t last_listed)
+{
+  /* XXXX drops unknown annotations. */
+  if (last_listed) {
+    char buf[ISO_TIME_LEN+1];
+    format_iso_time(buf, last_listed);
+    tor_snprintf(out, MD_ANNOTATION_MAXLEN, "@last-listed %s\n", buf);
+  } else {
+    out[0] = '\0';
+  }
+}
+
 /** Write the body of <b>md</b> into <b>f</b>, with appropriate annotations.
  * On success, return the total number of bytes written, and set
  * *<b>annotation_len_out</b> to the number of bytes written as
@@ -70,16 +162,13 @@ dump_microdescriptor(int fd, microdesc_t *md, size_t *annotation_len_out)
 {
   ssize_t r = 0;
   ssize_t written;
+  char annotation[MD_ANNOTATION_MAXLEN];
   if (md->body == NULL) {
     *annotation_len_out = 0;
     return 0;
   }
-  /* XXXX drops unknown annotations. */
-  if (md->last_listed) {
-    char buf[ISO_TIME_LEN+1];
-    char annotation[ISO_TIME_LEN+32];
-    format_iso_time(buf, md->last_listed);
-    tor_snprintf(annotation, sizeof(annotation), "@last-listed %s\n", buf);
+  format_md_annotation(annotation, md->last_listed);
+  if (annotation[0]) {
     if (write_all(fd, annotation, strlen(annotation), 0) < 0) {
       log_warn(LD_DIR,
                "Couldn't write microdescriptor annotation: %s",
@@ -118,6 +207,9 @@ get_microdesc_cache(void)
     HT_INIT(microdesc_map, &cache->map);
     cache->cache_fname = get_datadir_fname("cached-microdescs");
     cache->journal_fname = get_datadir_fname("cached-microdescs.new");
+    cache->sealed_journal_fname =
+      get_datadir_fname("cached-microdescs.sealed");
+    cache->snapshot_fname = get_datadir_fname("cached-microdescs.snapshot");
     microdesc_cache_reload(cache);
     the_microdesc_cache = cache;
   }
@@ -325,6 +417,13 @@ microdesc_cache_clear(microdesc_cache_t *cache)
     microdesc_free(md);
   }
   HT_CLEAR(microdesc_map, &cache->map);
+  if (cache->rebuild_job) {
+    /* A worker may still be reading from the old cache file, so we leave
+     * it for the rebuild to unmap once it's done. */
+    cache->rebuild_job->cache = NULL;
+    cache->rebuild_job = NULL;
+    cache->cache_content = NULL;
+  }
   if (cache->cache_content) {
     int res = tor_munmap_file(cache->cache_content);
     if (res != 0) {
@@ -338,6 +437,35 @@ microdesc_cache_clear(microdesc_cache_t *cache)
   cache->total_len_seen = 0;
   cache->n_seen = 0;
   cache->bytes_dropped = 0;
+  cache->sealed_journal_len = 0;
+}
+
+/** Add every microdescriptor in the journal file <b>fname</b> to
+ * <b>cache</b>.  Set *<b>len_out</b> to the size of the file, or to 0 if
+ * there is none.  Return the number of microdescriptors we added. */
+static int
+microdesc_cache_load_journal(microdesc_cache_t *cache, const char *fname,
+                             size_t *len_out)
+{
+  struct stat st;
+  char *journal_content;
+  smartlist_t *added;
+  int n = 0;
+
+  *len_out = 0;
+  journal_content = read_file_to_str(fname, RFTS_IGNORE_MISSING, &st);
+  if (journal_content) {
+    *len_out = (size_t) st.st_size;
+    added = microdescs_add_to_cache(cache, journal_content,
+                                    journal_content+st.st_size,
+                                    SAVED_IN_JOURNAL, 0, -1, NULL);
+    if (added) {
+      n = smartlist_len(added);
+      smartlist_free(added);
+    }
+    tor_free(journal_content);
+  }
+  return n;
 }
 
 /** Reload the contents of <b>cache</b> from disk.  If it is empty, load it
@@ -345,8 +473,6 @@ microdesc_cache_clear(microdesc_cache_t *cache)
 int
 microdesc_cache_reload(microdesc_cache_t *cache)
 {
-  struct stat st;
-  char *journal_content;
   smartlist_t *added;
   tor_mmap_t *mm;
   int total = 0;
@@ -355,31 +481,33 @@ microdesc_cache_reload(microdesc_cache_t *cache)
 
   mm = cache->cache_content = tor_mmap_file(cache->cache_fname);
   if (mm) {
-    added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
-                                    SAVED_IN_CACHE, 0, -1, NULL);
-    if (added) {
-      total += smartlist_len(added);
-      smartlist_free(added);
+    /* If we have a snapshot of the cache file, we needn't parse it. */
+    smartlist_t *mds = dirsnapshot_load_microdescs(cache->snapshot_fname, mm);
+    if (mds) {
+      added = microdescs_add_list_to_cache(cache, mds, SAVED_IN_CACHE, 0);
+      smartlist_free(mds);
+    } else {
+      added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
+                                      SAVED_IN_CACHE, 0, -1, NULL);
+      if (added)
+        dirsnapshot_save_microdescs(cache->snapshot_fname, added, mm, NULL);
     }
-  }
-
-  journal_content = read_file_to_str(cache->journal_fname,
-                                     RFTS_IGNORE_MISSING, &st);
-  if (journal_content) {
-    cache->journal_len = (size_t) st.st_size;
-    added = microdescs_add_to_cache(cache, journal_content,
-                                    journal_content+st.st_size,
-                                    SAVED_IN_JOURNAL, 0, -1, NULL);
     if (added) {
       total += smartlist_len(added);
       smartlist_free(added);
     }
-    tor_free(journal_content);
   }
+
+  /* If we stopped in the middle of a rebuild, the sealed journal holds
+   * whatever it didn't get to put in the cache file. */
+  total += microdesc_cache_load_journal(cache, cache->sealed_journal_fname,
+                                        &cache->sealed_journal_len);
+  total += microdesc_cache_load_journal(cache, cache->journal_fname,
+                                        &cache->journal_len);
   log_info(LD_DIR, "Reloaded microdescriptor cache. Found %d descriptors.",
            total);
 
-  microdesc_cache_rebuild(cache, 0 /* don't force */);
+  microdesc_cache_rebuild_in_background(cache, 0 /* don't force */);
 
   return 0;
 }
@@ -490,7 +618,7 @@ should_rebuild_md_cache(microdesc_cache_t *cache)
 {
     const size_t old_len =
       cache->cache_content ? cache->cache_content->size : 0;
-    const size_t journal_len = cache->journal_len;
+    const size_t journal_len = cache->journal_len + cache->sealed_journal_len;
     const size_t dropped = cache->bytes_dropped;
 
     if (journal_len < 16384)
@@ -523,77 +651,203 @@ microdesc_wipe_body(microdesc_t *md)
   md->no_save = 1;
 }
 
-/** Regenerate the main cache file for <b>cache</b>, clear the journal file,
- * and update every microdesc_t in the cache with pointers to its new
- * location.  If <b>force</b> is true, do this unconditionally.  If
- * <b>force</b> is false, do it only if we expect to save space on disk. */
-int
-microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
+/** Move everything in the journal of <b>cache</b> into the sealed journal,
+ * and start a new, empty journal.  Return 0 on success, -1 on failure. */
+static int
+microdesc_cache_seal_journal(microdesc_cache_t *cache)
 {
-  open_file_t *open_file;
-  int fd = -1, res;
-  microdesc_t **mdp;
-  smartlist_t *wrote;
-  ssize_t size;
-  off_t off = 0, off_real;
-  int orig_size, new_size;
+  if (cache->journal_len == 0)
+    return 0;
 
-  if (cache == NULL) {
-    cache = the_microdesc_cache;
-    if (cache == NULL)
-      return 0;
+  if (cache->sealed_journal_len == 0) {
+    if (replace_file(cache->journal_fname, cache->sealed_journal_fname) < 0) {
+      log_warn(LD_FS, "Couldn't rename \"%s\" to \"%s\": %s",
+               cache->journal_fname, cache->sealed_journal_fname,
+               strerror(errno));
+      return -1;
+    }
+  } else {
+    /* An earlier rebuild didn't finish; add on to what it left. */
+    struct stat st;
+    char *journal_content;
+    int r;
+    journal_content = read_file_to_str(cache->journal_fname, RFTS_BIN, &st);
+    if (!journal_content)
+      return -1;
+    r = append_bytes_to_file(cache->sealed_journal_fname, journal_content,
+                             (size_t)st.st_size, 1);
+    tor_free(journal_content);
+    if (r < 0)
+      return -1;
   }
 
-  /* Remove dead descriptors */
-  microdesc_cache_clean(cache, 0/*cutoff*/, 0/*force*/);
+  cache->sealed_journal_len += cache->journal_len;
+  cache->journal_len = 0;
+  write_str_to_file(cache->journal_fname, "", 1);
+  return 0;
+}
 
-  if (!force && !should_rebuild_md_cache(cache))
-    return 0;
+/** How many bytes of a new cache file do we write between calls to
+ * tor_fsync()?  Flushing as we go keeps us from piling up tens of megabytes
+ * of dirty pages for the kernel to write out all at once. */
+#define MD_CACHE_FSYNC_INTERVAL (4*1024*1024)
 
-  log_info(LD_DIR, "Rebuilding the microdescriptor cache...");
+/** Seal the journal of <b>cache</b>, start writing a new cache file, and
+ * return a new md_rebuild_job_t to write every microdescriptor we want to
+ * keep into it.  Return NULL on failure. */
+static md_rebuild_job_t *
+md_rebuild_job_new(microdesc_cache_t *cache)
+{
+  md_rebuild_job_t *job;
+  open_file_t *open_file;
+  microdesc_t **mdp;
+  int fd;
 
-  orig_size = (int)(cache->cache_content ? cache->cache_content->size : 0);
-  orig_size += (int)cache->journal_len;
+  tor_assert(!cache->rebuild_job);
+
+  if (microdesc_cache_seal_journal(cache) < 0)
+    return NULL;
 
   fd = start_writing_to_file(cache->cache_fname,
                              OPEN_FLAGS_REPLACE|O_BINARY,
                              0600, &open_file);
   if (fd < 0)
-    return -1;
-
-  wrote = smartlist_new();
+    return NULL;
+
+  job = tor_malloc_zero(sizeof(md_rebuild_job_t));
+  job->cache = cache;
+  job->old_content = cache->cache_content;
+  job->open_file = open_file;
+  job->fd = fd;
+  job->orig_size = cache->cache_content ? cache->cache_content->size : 0;
+  job->orig_size += cache->sealed_journal_len;
+  job->bytes_dropped = cache->bytes_dropped;
+  job->entries = tor_calloc(MAX(HT_SIZE(&cache->map), 1),
+                            sizeof(md_rebuild_entry_t));
 
   HT_FOREACH(mdp, microdesc_map, &cache->map) {
     microdesc_t *md = *mdp;
-    size_t annotation_len;
+    md_rebuild_entry_t *ent;
     if (md->no_save || !md->body)
       continue;
+    ent = &job->entries[job->n_entries++];
+    memcpy(ent->digest, md->digest, DIGEST256_LEN);
+    ent->last_listed = md->last_listed;
+    ent->bodylen = md->bodylen;
+    if (md->saved_location == SAVED_IN_CACHE) {
+      ent->body = md->body;
+    } else {
+      /* The main thread may free this body while we're writing it. */
+      ent->body = tor_memdup(md->body, md->bodylen);
+      ent->body_is_copy = 1;
+    }
+  }
 
-    size = dump_microdescriptor(fd, md, &annotation_len);
-    if (size < 0) {
-      microdesc_wipe_body(md);
+  cache->rebuild_job = job;
+  return job;
+}
 
-      /* rewind, in case it was a partial write. */
-      tor_fd_setpos(fd, off);
-      continue;
-    }
-    tor_assert(((size_t)size) == annotation_len + md->bodylen);
-    md->off = off + annotation_len;
-    off += size;
-    off_real = tor_fd_getpos(fd);
-    if (off_real != off) {
-      log_warn(LD_BUG, "Discontinuity in position in microdescriptor cache."
-               "By my count, I'm at "I64_FORMAT
-               ", but I should be at "I64_FORMAT,
-               I64_PRINTF_ARG(off), I64_PRINTF_ARG(off_real));
-      if (off_real >= 0)
-        off = off_real;
-    }
-    if (md->saved_location != SAVED_IN_CACHE) {
-      tor_free(md->body);
-      md->saved_location = SAVED_IN_CACHE;
+/** Helper for md_rebuild_threadfn: write <b>len</b> bytes from <b>s</b> to
+ * the new cache file for <b>job</b>, and add them to <b>digest</b>.  Return
+ * 0 on success, -1 on failure. */
+static int
+md_rebuild_write(md_rebuild_job_t *job, crypto_digest_t *digest,
+                 const char *s, size_t len)
+{
+  if (write_all(job->fd, s, len, 0) != (ssize_t)len)
+    return -1;
+  crypto_digest_add_bytes(digest, s, len);
+  job->new_size += len;
+  return 0;
+}
+
+/** Write the new cache file for <b>job_</b>, an md_rebuild_job_t.  This
+ * function only touches the job, so it can run in a worker thread. */
+static int
+md_rebuild_threadfn(void *state_, void *job_)
+{
+  md_rebuild_job_t *job = job_;
+  crypto_digest_t *digest = crypto_digest256_new(DIGEST_SHA256);
+  size_t last_sync = 0;
+  int i;
+  (void) state_;
+
+  for (i = 0; i < job->n_entries; ++i) {
+    md_rebuild_entry_t *ent = &job->entries[i];
+    char annotation[MD_ANNOTATION_MAXLEN];
+    format_md_annotation(annotation, ent->last_listed);
+    if (md_rebuild_write(job, digest, annotation, strlen(annotation)) < 0)
+      goto err;
+    ent->off = job->new_size;
+    if (md_rebuild_write(job, digest, ent->body, ent->bodylen) < 0)
+      goto err;
+    if (job->new_size - last_sync >= MD_CACHE_FSYNC_INTERVAL) {
+      if (tor_fsync(job->fd) < 0)
+        goto err;
+      last_sync = job->new_size;
     }
-    smartlist_add(wrote, md);
+  }
+  /* Make sure the new file is on disk before it replaces the old one. */
+  if (tor_fsync(job->fd) < 0)
+    goto err;
+
+  crypto_digest_get_digest(digest, job->digest, DIGEST256_LEN);
+  crypto_digest_free(digest);
+  return WQ_RPL_REPLY;
+
+ err:
+  job->failed = 1;
+  job->failed_errno = errno;
+  crypto_digest_free(digest);
+  return WQ_RPL_REPLY;
+}
+
+/** Release all storage held by <b>job</b>, and unmap its old cache file
+ * contents if it's the last one who wants them. */
+static void
+md_rebuild_job_free(md_rebuild_job_t *job)
+{
+  int i;
+  for (i = 0; i < job->n_entries; ++i) {
+    if (job->entries[i].body_is_copy)
+      tor_free(job->entries[i].body);
+  }
+  tor_free(job->entries);
+  if (!job->cache && job->old_content) {
+    if (tor_munmap_file(job->old_content) != 0)
+      log_warn(LD_FS, "Failed to unmap old microdescriptor cache.");
+  }
+  tor_free(job);
+}
+
+/** Now that the new cache file for <b>job</b> is written, put it in place
+ * of the old one, and point every microdescriptor that we wrote into it.
+ * Free <b>job</b>.  Return 0 on success, -1 on failure. */
+static int
+md_rebuild_job_finish(md_rebuild_job_t *job)
+{
+  microdesc_cache_t *cache = job->cache;
+  microdesc_t **mdp;
+  smartlist_t *wrote = NULL;
+  int i, res, r = -1;
+  size_t new_size;
+
+  if (!cache) {
+    /* The cache was cleared while we were working: nobody wants this. */
+    abort_writing_to_file(job->open_file);
+    goto done;
+  }
+  tor_assert(cache->rebuild_job == job);
+  tor_assert(cache->cache_content == job->old_content);
+  cache->rebuild_job = NULL;
+
+  if (job->failed) {
+    /* The old cache file and the sealed journal are still fine; we'll try
+     * again later. */
+    log_warn(LD_DIR, "Error writing rebuilt microdescriptor cache: %s",
+             strerror(job->failed_errno));
+    abort_writing_to_file(job->open_file);
+    goto done;
   }
 
   /* We must do this unmap _before_ we call finish_writing_to_file(), or
@@ -607,31 +861,33 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
     cache->cache_content = NULL;
   }
 
-  if (finish_writing_to_file(open_file) < 0) {
+  if (finish_writing_to_file(job->open_file) < 0) {
     log_warn(LD_DIR, "Error rebuilding microdescriptor cache: %s",
              strerror(errno));
-    /* Okay. Let's prevent from making things worse elsewhere. */
-    cache->cache_content = NULL;
-    HT_FOREACH(mdp, microdesc_map, &cache->map) {
-      microdesc_t *md = *mdp;
-      if (md->saved_location == SAVED_IN_CACHE) {
-        microdesc_wipe_body(md);
-      }
-    }
-    smartlist_free(wrote);
-    return -1;
+    goto wipe_cached_bodies;
   }
 
   cache->cache_content = tor_mmap_file(cache->cache_fname);
 
-  if (!cache->cache_content && smartlist_len(wrote)) {
+  if (!cache->cache_content && job->n_entries) {
     log_err(LD_DIR, "Couldn't map file that we just wrote to %s!",
             cache->cache_fname);
-    smartlist_free(wrote);
-    return -1;
+    goto wipe_cached_bodies;
   }
-  SMARTLIST_FOREACH_BEGIN(wrote, microdesc_t *, md) {
-    tor_assert(md->saved_location == SAVED_IN_CACHE);
+
+  wrote = smartlist_new();
+  for (i = 0; i < job->n_entries; ++i) {
+    const md_rebuild_entry_t *ent = &job->entries[i];
+    microdesc_t *md = microdesc_cache_lookup_by_digest256(cache, ent->digest);
+    if (!md || md->no_save) {
+      /* We dropped this one while we were working. */
+      continue;
+    }
+    if (md->saved_location != SAVED_IN_CACHE) {
+      tor_free(md->body);
+      md->saved_location = SAVED_IN_CACHE;
+    }
+    md->off = ent->off;
     md->body = (char*)cache->cache_content->data + md->off;
     if (PREDICT_UNLIKELY(
              md->bodylen < 9 || fast_memneq(md->body, "onion-key", 9) != 0)) {
@@ -648,20 +904,126 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
       tor_free(bad_str);
       tor_assert(fast_memeq(md->body, "onion-key", 9));
     }
-  } SMARTLIST_FOREACH_END(md);
+    smartlist_add(wrote, md);
+  }
 
+  if (cache->cache_content)
+    dirsnapshot_save_microdescs(cache->snapshot_fname, wrote,
+                                cache->cache_content, job->digest);
   smartlist_free(wrote);
 
-  write_str_to_file(cache->journal_fname, "", 1);
-  cache->journal_len = 0;
-  cache->bytes_dropped = 0;
-
-  new_size = cache->cache_content ? (int)cache->cache_content->size : 0;
+  /* Everything from the sealed journal is in the cache file now.  Anything
+   * that arrived while we were working is still in the journal. */
+  if (unlink(cache->sealed_journal_fname) < 0 && errno != ENOENT) {
+    log_warn(LD_FS, "Couldn't remove \"%s\": %s",
+             cache->sealed_journal_fname, strerror(errno));
+  }
+  cache->sealed_journal_len = 0;
+  /* Whatever we dropped before we started isn't in the new file. */
+  if (cache->bytes_dropped >= job->bytes_dropped)
+    cache->bytes_dropped -= job->bytes_dropped;
+  else
+    cache->bytes_dropped = 0;
+
+  new_size = cache->cache_content ? cache->cache_content->size : 0;
   log_info(LD_DIR, "Done rebuilding microdesc cache. "
            "Saved %d bytes; %d still used.",
-           orig_size-new_size, new_size);
+           (int)job->orig_size-(int)new_size, (int)new_size);
+  r = 0;
+  goto done;
 
-  return 0;
+ wipe_cached_bodies:
+  /* Okay. Let's prevent from making things worse elsewhere. */
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    if (md->saved_location == SAVED_IN_CACHE) {
+      microdesc_wipe_body(md);
+    }
+  }
+
+ done:
+  md_rebuild_job_free(job);
+  return r;
+}
+
+/** Main-thread callback: a worker is done writing the cache file for
+ * <b>job_</b>. */
+static void
+md_rebuild_replyfn(void *job_)
+{
+  md_rebuild_job_finish(job_);
+}
+
+/** Helper: decide whether to rebuild <b>cache</b> (or the default cache, if
+ * <b>cache</b> is NULL), as for microdesc_cache_rebuild().  Return 0 if
+ * there's nothing to do, -1 if we couldn't start the rebuild, and 1 if we
+ * started it, setting *<b>job_out</b> to the job that will finish it. */
+static int
+microdesc_cache_start_rebuild(microdesc_cache_t *cache, int force,
+                              md_rebuild_job_t **job_out)
+{
+  *job_out = NULL;
+  if (cache == NULL) {
+    cache = the_microdesc_cache;
+    if (cache == NULL)
+      return 0;
+  }
+
+  if (cache->rebuild_job) {
+    log_info(LD_DIR, "Not rebuilding the microdescriptor cache: we're "
+             "already doing that.");
+    return 0;
+  }
+
+  /* Remove dead descriptors */
+  microdesc_cache_clean(cache, 0/*cutoff*/, 0/*force*/);
+
+  if (!force && !should_rebuild_md_cache(cache))
+    return 0;
+
+  log_info(LD_DIR, "Rebuilding the microdescriptor cache...");
+  *job_out = md_rebuild_job_new(cache);
+  return *job_out ? 1 : -1;
+}
+
+/** Regenerate the main cache file for <b>cache</b>, clear the journal file,
+ * and update every microdesc_t in the cache with pointers to its new
+ * location.  If <b>force</b> is true, do this unconditionally.  If
+ * <b>force</b> is false, do it only if we expect to save space on disk. */
+int
+microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
+{
+  md_rebuild_job_t *job;
+  int r = microdesc_cache_start_rebuild(cache, force, &job);
+  if (r <= 0)
+    return r;
+
+  md_rebuild_threadfn(NULL, job);
+  return md_rebuild_job_finish(job);
+}
+
+/** As microdesc_cache_rebuild(), but write the new cache file in a worker
+ * thread if we have any, so that rebuilding a large cache doesn't stall the
+ * main thread. */
+void
+microdesc_cache_rebuild_in_background(microdesc_cache_t *cache, int force)
+{
+  md_rebuild_job_t *job;
+  if (microdesc_cache_start_rebuild(cache, force, &job) <= 0)
+    return;
+
+  if (!cpuworker_queue_work(md_rebuild_threadfn, md_rebuild_replyfn, job)) {
+    md_rebuild_threadfn(NULL, job);
+    md_rebuild_job_finish(job);
+  }
+}
+
+/** Return true iff a rebuild of <b>cache</b> is running in the
+ * background. */
+int
+microdesc_cache_rebuild_in_progress(const microdesc_cache_t *cache)
+{
+  return cache && cache->rebuild_job != NULL;
 }
 
 /** Make sure that the reference count of every microdescriptor in cache is
@@ -760,6 +1122,8 @@ microdesc_free_all(void)
     microdesc_cache_clear(the_microdesc_cache);
     tor_free(the_microdesc_cache->cache_fname);
     tor_free(the_microdesc_cache->journal_fname);
+    tor_free(the_microdesc_cache->sealed_journal_fname);
+    tor_free(the_microdesc_cache->snapshot_fname);
     tor_free(the_microdesc_cache);
   }
 }
@@ -22,6 +22,7 @@
 #include "control.h"
 #include "directory.h"
 #include "dirserv.h"
+#include "dirsnapshot.h"
 #include "dirvote.h"
 #include "entrynodes.h"
 #include "main.h"
@@ -124,6 +125,20 @@ networkstatus_reset_download_failures(void)
     download_status_reset(&consensus_dl_status[i]);
 }
 
+/** Return a newly allocated name for the file that holds a snapshot of our
+ * cached consensus of flavor <b>flav</b>, or NULL if we don't keep
+ * snapshots of that flavor. */
+static char *
+networkstatus_get_snapshot_fname(int flav)
+{
+  if (flav == FLAV_NS)
+    return get_datadir_fname("cached-consensus.snapshot");
+  else if (flav == FLAV_MICRODESC)
+    return get_datadir_fname("cached-microdesc-consensus.snapshot");
+  else
+    return NULL;
+}
+
 /** Read every cached v3 consensus networkstatus from the disk. */
 int
 router_reload_consensus_networkstatus(void)
@@ -1004,8 +1019,8 @@ consensus_is_waiting_for_certs(void)
 
 /** Return the most recent consensus that we have downloaded, or NULL if we
  * don't have one. */
-networkstatus_t *
-networkstatus_get_latest_consensus(void)
+MOCK_IMPL(networkstatus_t *,
+networkstatus_get_latest_consensus,(void))
 {
   return current_consensus;
 }
@@ -1059,15 +1074,18 @@ networkstatus_get_reasonably_live_consensus(time_t now, int flavor)
 
 /** Given two router status entries for the same router identity, return 1 if
  * if the contents have changed between them. Otherwise, return 0. */
-static int
+int
 routerstatus_has_changed(const routerstatus_t *a, const routerstatus_t *b)
 {
   tor_assert(tor_memeq(a->identity_digest, b->identity_digest, DIGEST_LEN));
 
   return strcmp(a->nickname, b->nickname) ||
-         fast_memneq(a->descriptor_digest, b->descriptor_digest, DIGEST_LEN) ||
+         fast_memneq(a->descriptor_digest, b->descriptor_digest,
+                     DIGEST256_LEN) ||
          a->addr != b->addr ||
          a->or_port != b->or_port ||
+         !tor_addr_eq(&a->ipv6_addr, &b->ipv6_addr) ||
+         a->ipv6_orport != b->ipv6_orport ||
          a->dir_port != b->dir_port ||
          a->is_authority != b->is_authority ||
          a->is_exit != b->is_exit ||
@@ -1083,43 +1101,6 @@ routerstatus_has_changed(const routerstatus_t *a, const routerstatus_t *b)
          a->version_known != b->version_known;
 }
 
-/** Notify controllers of any router status entries that changed between
- * <b>old_c</b> and <b>new_c</b>. */
-static void
-notify_control_networkstatus_changed(const networkstatus_t *old_c,
-                                     const networkstatus_t *new_c)
-{
-  smartlist_t *changed;
-  if (old_c == new_c)
-    return;
-
-  /* tell the controller exactly which relays are still listed, as well
-   * as what they're listed as */
-  control_event_newconsensus(new_c);
-
-  if (!control_event_is_interesting(EVENT_NS))
-    return;
-
-  if (!old_c) {
-    control_event_networkstatus_changed(new_c->routerstatus_list);
-    return;
-  }
-  changed = smartlist_new();
-
-  SMARTLIST_FOREACH_JOIN(
-                     old_c->routerstatus_list, const routerstatus_t *, rs_old,
-                     new_c->routerstatus_list, const routerstatus_t *, rs_new,
-                     tor_memcmp(rs_old->identity_digest,
-                            rs_new->identity_digest, DIGEST_LEN),
-                     smartlist_add(changed, (void*) rs_new)) {
-    if (routerstatus_has_changed(rs_old, rs_new))
-      smartlist_add(changed, (void*)rs_new);
-  } SMARTLIST_FOREACH_JOIN_END(rs_old, rs_new);
-
-  control_event_networkstatus_changed(changed);
-  smartlist_free(changed);
-}
-
 /** Copy all the ancillary information (like router download status and so on)
  * from <b>old_c</b> to <b>new_c</b>. */
 static void
@@ -1174,6 +1155,7 @@ networkstatus_set_current_consensus(const char *consensus,
   time_t now = time(NULL);
   const or_options_t *options = get_options();
   char *unverified_fname = NULL, *consensus_fname = NULL;
+  char *snapshot_fname = NULL;
   int flav = networkstatus_parse_flavor_name(flavor);
   const unsigned from_cache = flags & NSSET_FROM_CACHE;
   const unsigned was_waiting_for_certs = flags & NSSET_WAS_WAITING_FOR_CERTS;
@@ -1184,6 +1166,8 @@ networkstatus_set_current_consensus(const char *consensus,
   consensus_waiting_for_certs_t *waiting = NULL;
   time_t current_valid_after = 0;
   int free_consensus = 1; /* Free 'c' at the end of the function */
+  networkstatus_t *old_consensus = NULL; /* Replaced by 'c'; free at end. */
+  int from_snapshot = 0;
   int old_ewma_enabled;
 
   if (flav < 0) {
@@ -1192,8 +1176,18 @@ networkstatus_set_current_consensus(const char *consensus,
     return -2;
   }
 
+  /* If we're reloading a consensus that we checked before, we may have a
+   * snapshot of it that's faster to load than parsing it again. */
+  if (from_cache && !was_waiting_for_certs &&
+      (snapshot_fname = networkstatus_get_snapshot_fname(flav))) {
+    c = dirsnapshot_load_consensus(snapshot_fname, consensus, flav);
+    from_snapshot = (c != NULL);
+  }
+
   /* Make sure it's parseable. */
-  c = networkstatus_parse_vote_from_string(consensus, NULL, NS_TYPE_CONSENSUS);
+  if (!c)
+    c = networkstatus_parse_vote_from_string(consensus, NULL,
+                                             NS_TYPE_CONSENSUS);
   if (!c) {
     log_warn(LD_DIR, "Unable to parse networkstatus consensus");
     result = -2;
@@ -1267,8 +1261,10 @@ networkstatus_set_current_consensus(const char *consensus,
     goto done;
   }
 
-  /* Make sure it's signed enough. */
-  if ((r=networkstatus_check_consensus_signature(c, 1))<0) {
+  /* Make sure it's signed enough.  (If it came from a snapshot, we checked
+   * that before we saved the snapshot.) */
+  r = from_snapshot ? 1 : networkstatus_check_consensus_signature(c, 1);
+  if (r < 0) {
     if (r == -1) {
       /* Okay, so it _might_ be signed enough if we get more certificates. */
       if (!was_waiting_for_certs) {
@@ -1330,15 +1326,20 @@ networkstatus_set_current_consensus(const char *consensus,
     authority_certs_fetch_missing(c, now);
 
   if (flav == usable_consensus_flavor()) {
-    notify_control_networkstatus_changed(current_consensus, c);
+    /* tell the controller exactly which relays are still listed, as well
+     * as what they're listed as.  nodelist_set_consensus() will tell it
+     * which ones changed. */
+    control_event_newconsensus(c);
   }
+  /* The nodes still point into the old consensus, and we want to see what
+   * changed since then, so we don't free it till we're done below. */
   if (flav == FLAV_NS) {
     if (current_ns_consensus) {
       networkstatus_copy_old_consensus_info(c, current_ns_consensus);
-      networkstatus_vote_free(current_ns_consensus);
+      old_consensus = current_ns_consensus;
       /* Defensive programming : we should set current_consensus very soon,
        * but we're about to call some stuff in the meantime, and leaving this
-       * dangling pointer around has proven to be trouble. */
+       * pointer around has proven to be trouble. */
       current_ns_consensus = NULL;
     }
     current_ns_consensus = c;
@@ -1346,7 +1347,7 @@ networkstatus_set_current_consensus(const char *consensus,
   } else if (flav == FLAV_MICRODESC) {
     if (current_md_consensus) {
       networkstatus_copy_old_consensus_info(c, current_md_consensus);
-      networkstatus_vote_free(current_md_consensus);
+      old_consensus = current_md_consensus;
       /* more defensive programming */
       current_md_consensus = NULL;
     }
@@ -1384,7 +1385,7 @@ networkstatus_set_current_consensus(const char *consensus,
     /* XXXXNM Microdescs: needs a non-ns variant. ???? NM*/
     update_consensus_networkstatus_fetch_time(now);
 
-    nodelist_set_consensus(current_consensus);
+    nodelist_set_consensus(current_consensus, old_consensus);
 
     dirvote_recalculate_timing(options, now);
     routerstatus_list_update_named_server_map();
@@ -1419,6 +1420,11 @@ networkstatus_set_current_consensus(const char *consensus,
   if (!from_cache) {
     write_str_to_file(consensus_fname, consensus, 0);
   }
+  if (!from_snapshot) {
+    tor_free(snapshot_fname);
+    if ((snapshot_fname = networkstatus_get_snapshot_fname(flav)))
+      dirsnapshot_save_consensus(snapshot_fname, c, consensus);
+  }
 
 /** If a consensus appears more than this many seconds before its declared
  * valid-after time, declare that our clock is skewed. */
@@ -1444,8 +1450,10 @@ networkstatus_set_current_consensus(const char *consensus,
  done:
   if (free_consensus)
     networkstatus_vote_free(c);
+  networkstatus_vote_free(old_consensus);
   tor_free(consensus_fname);
   tor_free(unverified_fname);
+  tor_free(snapshot_fname);
   return result;
 }
 
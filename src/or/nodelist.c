@@ -9,6 +9,7 @@
 #include "config.h"
 #include "control.h"
 #include "dirserv.h"
+#include "entrynodes.h"
 #include "geoip.h"
 #include "main.h"
 #include "microdesc.h"
@@ -55,6 +56,15 @@ typedef struct nodelist_t {
   /* Hash table to map from node ID digest to node. */
   HT_HEAD(nodelist_map, node_t) nodes_by_id;
 
+  /* True iff the nodes' routerstatus entries come from a consensus. */
+  unsigned int have_consensus : 1;
+  /* The values of the options that nodelist_set_consensus() looked at when
+   * it last set the nodes' routerstatus entries. */
+  unsigned int consensus_authdir : 1;
+  unsigned int consensus_client_ipv6 : 1;
+  /* SHA1 digest of the consensus that the nodes' routerstatus entries
+   * come from, if have_consensus is set. */
+  char consensus_digest[DIGEST_LEN];
 } nodelist_t;
 
 static INLINE unsigned int
@@ -214,80 +224,229 @@ nodelist_add_microdesc(microdesc_t *md)
   return node;
 }
 
-/** Tell the nodelist that the current usable consensus is <b>ns</b>.
- * This makes the nodelist change all of the routerstatus entries for
- * the nodes, drop nodes that no longer have enough info to get used,
- * and grab microdescriptors into nodes as appropriate.
+/** Helper for nodelist_set_consensus: copy the flags that the consensus
+ * gives us for <b>node</b> out of its routerstatus <b>rs</b>.  We do this
+ * for every entry in every new consensus, changed or not, since other code
+ * (like router_set_status()) may have overridden them in the meantime. */
+static void
+node_set_flags_from_routerstatus(node_t *node, const routerstatus_t *rs,
+                                 int client_ipv6)
+{
+  node->is_valid = rs->is_valid;
+  node->is_running = rs->is_flagged_running;
+  node->is_fast = rs->is_fast;
+  node->is_stable = rs->is_stable;
+  node->is_possible_guard = rs->is_possible_guard;
+  node->is_exit = rs->is_exit;
+  node->is_bad_exit = rs->is_bad_exit;
+  node->is_hs_dir = rs->is_hs_dir;
+  node->ipv6_preferred = 0;
+  if (client_ipv6 &&
+      (tor_addr_is_null(&rs->ipv6_addr) == 0 ||
+       (node->md && tor_addr_is_null(&node->md->ipv6_addr) == 0)))
+    node->ipv6_preferred = 1;
+}
+
+/** Helper for nodelist_set_consensus: point <b>node</b> at its new
+ * routerstatus <b>rs</b> from a consensus of flavor <b>flav</b>, and
+ * recompute everything that we derive from it.  If <b>authdir</b>, leave
+ * the flags alone: we set those ourselves. */
+static void
+node_set_routerstatus(node_t *node, routerstatus_t *rs,
+                      consensus_flavor_t flav, int authdir, int client_ipv6)
+{
+  node->rs = rs;
+  if (flav == FLAV_MICRODESC) {
+    if (node->md == NULL ||
+        tor_memneq(node->md->digest,rs->descriptor_digest,DIGEST256_LEN)) {
+      if (node->md)
+        node->md->held_by_nodes--;
+      node->md = microdesc_cache_lookup_by_digest256(NULL,
+                                                     rs->descriptor_digest);
+      if (node->md)
+        node->md->held_by_nodes++;
+    }
+  }
+
+  node_set_country(node);
+
+  /* If we're not an authdir, believe others. */
+  if (!authdir)
+    node_set_flags_from_routerstatus(node, rs, client_ipv6);
+}
+
+/** Helper for nodelist_set_consensus: <b>node</b> no longer has a
+ * routerstatus.  Clear the flags we took from it, so we can skip it, maybe,
+ * or drop it entirely if we have nothing else to go on. */
+static void
+node_clear_routerstatus(node_t *node, int authdir)
+{
+  node->rs = NULL;
+  if (node->md) {
+    /* An md is only useful if there is an rs. */
+    node->md->held_by_nodes--;
+    node->md = NULL;
+  }
+  if (!node->ri) {
+    nodelist_drop_node(node, 1);
+    node_free(node);
+    return;
+  }
+  if (!authdir && node->ri->purpose == ROUTER_PURPOSE_GENERAL) {
+    /* Clear all flags. */
+    node->is_valid = node->is_running = node->is_hs_dir =
+      node->is_fast = node->is_stable =
+      node->is_possible_guard = node->is_exit =
+      node->is_bad_exit = node->ipv6_preferred = 0;
+  }
+}
+
+/** Tell the nodelist that the current usable consensus is <b>ns</b>, and
+ * that it replaces <b>old_ns</b> (which may be NULL, but must not have been
+ * freed yet).  This makes the nodelist change all of the routerstatus
+ * entries for the nodes, drop nodes that no longer have enough info to get
+ * used, and grab microdescriptors into nodes as appropriate.
+ *
+ * If the nodes are currently built from <b>old_ns</b>, we only touch the
+ * nodes whose entries were added, removed, or changed between the two
+ * consensuses.  Otherwise we rebuild every node.  Either way, we tell the
+ * entry guard code and any controller that wants NS events about exactly
+ * the nodes that changed.
  */
 void
-nodelist_set_consensus(networkstatus_t *ns)
+nodelist_set_consensus(networkstatus_t *ns, const networkstatus_t *old_ns)
 {
   const or_options_t *options = get_options();
   int authdir = authdir_mode_v3(options);
-  int client = !server_mode(options);
+  int client_ipv6 = !server_mode(options) &&
+    options->ClientPreferIPv6ORPort == 1;
+  const consensus_flavor_t flav = ns->flavor;
+  int incremental;
+  smartlist_t *changed_rs;
+  digestmap_t *changed_ids;
 
   init_nodelist();
-  if (ns->flavor == FLAV_MICRODESC)
+  if (flav == FLAV_MICRODESC)
     (void) get_microdesc_cache(); /* Make sure it exists first. */
 
-  SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
-                    node->rs = NULL);
-
-  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
-    node_t *node = node_get_or_create(rs->identity_digest);
-    node->rs = rs;
-    if (ns->flavor == FLAV_MICRODESC) {
-      if (node->md == NULL ||
-          tor_memneq(node->md->digest,rs->descriptor_digest,DIGEST256_LEN)) {
-        if (node->md)
-          node->md->held_by_nodes--;
-        node->md = microdesc_cache_lookup_by_digest256(NULL,
-                                                       rs->descriptor_digest);
-        if (node->md)
-          node->md->held_by_nodes++;
-      }
-    }
+  /* We can only patch up the nodes if their routerstatus pointers all point
+   * into old_ns, and nothing else that we derive them from has changed. */
+  incremental = old_ns && old_ns != ns && old_ns->flavor == ns->flavor &&
+    the_nodelist->have_consensus &&
+    tor_memeq(the_nodelist->consensus_digest,
+              old_ns->digests.d[DIGEST_SHA1], DIGEST_LEN) &&
+    the_nodelist->consensus_authdir == authdir &&
+    the_nodelist->consensus_client_ipv6 == client_ipv6;
 
-    node_set_country(node);
-
-    /* If we're not an authdir, believe others. */
-    if (!authdir) {
-      node->is_valid = rs->is_valid;
-      node->is_running = rs->is_flagged_running;
-      node->is_fast = rs->is_fast;
-      node->is_stable = rs->is_stable;
-      node->is_possible_guard = rs->is_possible_guard;
-      node->is_exit = rs->is_exit;
-      node->is_bad_exit = rs->is_bad_exit;
-      node->is_hs_dir = rs->is_hs_dir;
-      node->ipv6_preferred = 0;
-      if (client && options->ClientPreferIPv6ORPort == 1 &&
-          (tor_addr_is_null(&rs->ipv6_addr) == 0 ||
-           (node->md && tor_addr_is_null(&node->md->ipv6_addr) == 0)))
-        node->ipv6_preferred = 1;
-    }
+  if (!incremental) {
+    SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
+                      node->rs = NULL);
 
-  } SMARTLIST_FOREACH_END(rs);
+    SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
+      node_t *node = node_get_or_create(rs->identity_digest);
+      node_set_routerstatus(node, rs, flav, authdir, client_ipv6);
+    } SMARTLIST_FOREACH_END(rs);
 
-  nodelist_purge();
+    nodelist_purge();
 
-  if (! authdir) {
     SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
-      /* We have no routerstatus for this router. Clear flags so we can skip
-       * it, maybe.*/
       if (!node->rs) {
         tor_assert(node->ri); /* if it had only an md, or nothing, purge
                                * would have removed it. */
-        if (node->ri->purpose == ROUTER_PURPOSE_GENERAL) {
-          /* Clear all flags. */
-          node->is_valid = node->is_running = node->is_hs_dir =
-            node->is_fast = node->is_stable =
-            node->is_possible_guard = node->is_exit =
-            node->is_bad_exit = node->ipv6_preferred = 0;
-        }
+        node_clear_routerstatus(node, authdir);
       }
     } SMARTLIST_FOREACH_END(node);
   }
+
+  /* Now find out which entries changed, and if we're updating
+   * incrementally, apply those changes. */
+  changed_rs = smartlist_new();
+  changed_ids = digestmap_new();
+  if (!old_ns || old_ns == ns) {
+    SMARTLIST_FOREACH(ns->routerstatus_list, routerstatus_t *, rs,
+                      smartlist_add(changed_rs, rs));
+  } else {
+    /* Both lists are sorted by identity digest, so walk them together. */
+    const smartlist_t *old_list = old_ns->routerstatus_list;
+    const smartlist_t *new_list = ns->routerstatus_list;
+    const int n_old = smartlist_len(old_list);
+    const int n_new = smartlist_len(new_list);
+    int i_old = 0, i_new = 0;
+    while (i_old < n_old || i_new < n_new) {
+      routerstatus_t *rs_old = i_old < n_old ?
+        smartlist_get(old_list, i_old) : NULL;
+      routerstatus_t *rs_new = i_new < n_new ?
+        smartlist_get(new_list, i_new) : NULL;
+      int cmp;
+      if (rs_old && rs_new)
+        cmp = tor_memcmp(rs_old->identity_digest, rs_new->identity_digest,
+                         DIGEST_LEN);
+      else
+        cmp = rs_old ? -1 : 1;
+      if (cmp < 0)
+        rs_new = NULL;
+      else if (cmp > 0)
+        rs_old = NULL;
+      if (rs_old)
+        ++i_old;
+      if (rs_new)
+        ++i_new;
+
+      if (!rs_new) {
+        /* Only in the old consensus: the node has been dropped. */
+        if (incremental) {
+          node_t *node = node_get_mutable_by_id(rs_old->identity_digest);
+          if (node && node->rs == rs_old)
+            node_clear_routerstatus(node, authdir);
+        }
+        digestmap_set(changed_ids, rs_old->identity_digest, rs_old);
+      } else if (!rs_old || routerstatus_has_changed(rs_old, rs_new)) {
+        /* A new node, or one whose entry changed. */
+        if (incremental) {
+          node_t *node = node_get_or_create(rs_new->identity_digest);
+          node_set_routerstatus(node, rs_new, flav, authdir, client_ipv6);
+        }
+        smartlist_add(changed_rs, rs_new);
+        digestmap_set(changed_ids, rs_new->identity_digest, rs_new);
+      } else if (incremental) {
+        /* Nothing changed; move the node to its new entry, and put back
+         * any flags that we overrode since the last consensus. */
+        node_t *node = node_get_mutable_by_id(rs_new->identity_digest);
+        if (!node || node->rs != rs_old) {
+          /* Somebody else changed the node; be safe. */
+          node = node_get_or_create(rs_new->identity_digest);
+          node_set_routerstatus(node, rs_new, flav, authdir, client_ipv6);
+        } else {
+          node->rs = rs_new;
+          if (flav == FLAV_MICRODESC && !node->md &&
+              (node->md = microdesc_cache_lookup_by_digest256(NULL,
+                                              rs_new->descriptor_digest)))
+            node->md->held_by_nodes++;
+          if (!authdir)
+            node_set_flags_from_routerstatus(node, rs_new, client_ipv6);
+        }
+      }
+    }
+  }
+
+  the_nodelist->have_consensus = 1;
+  memcpy(the_nodelist->consensus_digest, ns->digests.d[DIGEST_SHA1],
+         DIGEST_LEN);
+  the_nodelist->consensus_authdir = authdir;
+  the_nodelist->consensus_client_ipv6 = client_ipv6;
+
+  log_info(LD_DIR, "Nodelist %s for new consensus: %d of %d entries "
+           "were added or changed.",
+           incremental ? "updated" : "rebuilt",
+           smartlist_len(changed_rs), smartlist_len(ns->routerstatus_list));
+
+  if (old_ns && old_ns != ns)
+    entry_guards_note_nodes_changed(changed_ids, approx_time());
+  if (control_event_is_interesting(EVENT_NS))
+    control_event_networkstatus_changed(changed_rs);
+
+  smartlist_free(changed_rs);
+  digestmap_free(changed_ids, NULL);
 }
 
 /** Helper: return true iff a node has a usable amount of information*/
@@ -14,6 +14,7 @@
 #include "circuitlist.h"
 #include "config.h"
 #include "cpuworker.h"
+#include "metrics.h"
 #include "networkstatus.h"
 #include "onion.h"
 #include "onion_fast.h"
@@ -22,6 +23,7 @@
 #include "relay.h"
 #include "rephist.h"
 #include "router.h"
+#include "trace.h"
 
 /** Type for a linked list of circuits that are waiting for a free CPU worker
  * to process a waiting onion handshake. */
@@ -156,6 +158,7 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
       tor_free(m);
     }
     tor_free(tmp);
+    metrics_incr(METRICS_ONIONSKINS_DROPPED);
     return -1;
   }
 
@@ -167,6 +170,8 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 
   circ->onionqueue_entry = tmp;
   TOR_TAILQ_INSERT_TAIL(&ol_list[onionskin->handshake_type], tmp, next);
+  tor_trace(TRACE_EV_ONION_QUEUE, onionskin->handshake_type,
+            ol_entries[onionskin->handshake_type]);
 
   /* cull elderly requests. */
   while (1) {
@@ -179,6 +184,7 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
     onion_queue_entry_remove(head);
     log_info(LD_CIRC,
              "Circuit create request is too old; canceling due to overload.");
+    metrics_incr(METRICS_ONIONSKINS_DROPPED);
     circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
   }
   return 0;
@@ -265,6 +271,8 @@ onion_next_task(create_cell_t **onionskin_out)
     head->handshake_type == ONION_HANDSHAKE_TYPE_NTOR ? "ntor" : "tap",
     ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
     ol_entries[ONION_HANDSHAKE_TYPE_TAP]);
+  tor_trace(TRACE_EV_ONION_DEQUEUE, head->handshake_type,
+            ol_entries[head->handshake_type]);
 
   *onionskin_out = head->onionskin;
   head->onionskin = NULL; /* prevent free. */
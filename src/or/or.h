@@ -228,8 +228,12 @@ typedef enum {
 #define CONN_TYPE_EXT_OR 16
 /** Type for sockets listening for Extended ORPort connections. */
 #define CONN_TYPE_EXT_OR_LISTENER 17
+/** Type for sockets listening for requests for our metrics. */
+#define CONN_TYPE_METRICS_LISTENER 18
+/** Type for HTTP connections asking for our metrics. */
+#define CONN_TYPE_METRICS 19
 
-#define CONN_TYPE_MAX_ 17
+#define CONN_TYPE_MAX_ 19
 /* !!!! If _CONN_TYPE_MAX is ever over 31, we must grow the type field in
  * connection_t. */
 
@@ -384,6 +388,13 @@ typedef enum {
 #define CONTROL_CONN_STATE_NEEDAUTH 2
 #define CONTROL_CONN_STATE_MAX_ 2
 
+#define METRICS_CONN_STATE_MIN_ 1
+/** State for a metrics connection: waiting for an HTTP request. */
+#define METRICS_CONN_STATE_READING 1
+/** State for a metrics connection: sending the response, then closing. */
+#define METRICS_CONN_STATE_WRITING 2
+#define METRICS_CONN_STATE_MAX_ 2
+
 #define DIR_PURPOSE_MIN_ 4
 /** A connection to a directory server: set after a v2 rendezvous
  * descriptor is downloaded. */
@@ -825,6 +836,16 @@ typedef struct rend_data_t {
  * simultaneous attempts to connect to the same rendezvous point. */
 #define REND_REPLAY_TIME_INTERVAL (5 * 60)
 
+/** Most DH public keys from INTRODUCE2 cells that a service will remember
+ * at once.  Past this, it forgets the oldest ones before
+ * REND_REPLAY_TIME_INTERVAL is up, rather than growing without bound when
+ * it's flooded with introductions. */
+#define REND_REPLAY_MAX_ENTRIES (1<<20)
+
+/** Highest chance we'll accept that a new DH public key looks like one
+ * we've already seen, when choosing how much of each to remember. */
+#define REND_REPLAY_MAX_FALSE_POSITIVE_RATE 1e-3
+
 /** Used to indicate which way a cell is going on a circuit. */
 typedef enum {
   CELL_DIRECTION_IN=1, /**< The cell is moving towards the origin. */
@@ -1118,6 +1139,8 @@ typedef struct packed_cell_t {
   char body[CELL_MAX_NETWORK_SIZE]; /**< Cell as packed for network. */
   uint32_t inserted_time; /**< Time (in milliseconds since epoch, with high
                            * bits truncated) when this cell was inserted. */
+  uint32_t inserted_usec; /**< When this cell was inserted, as returned by
+                           * cell_latency_timestamp(). */
 } packed_cell_t;
 
 /** A queue of cells on a circuit, waiting to be added to the
@@ -1431,6 +1454,11 @@ typedef struct or_handshake_state_t {
   /** A self-signed identity certificate */
   tor_x509_cert_t *id_cert;
   /**@}*/
+
+  /** If a worker thread is signing our AUTHENTICATE cell, the job that it's
+   * working on.  We don't process any more cells on this connection until
+   * the job is done. */
+  struct or_auth_job_t *auth_job;
 } or_handshake_state_t;
 
 /** Length of Extended ORPort connection identifier. */
@@ -1448,6 +1476,10 @@ typedef struct or_handshake_state_t {
  * drops below this size. */
 #define OR_CONN_LOWWATER (16*1024)
 
+/** How many cells in each OR connection's outbuf do we measure the latency
+ * of at once? */
+#define OR_CONN_MAX_CELL_MARKS 16
+
 /** Subtype of connection_t for an "OR connection" -- that is, one that speaks
  * cells over TLS. */
 typedef struct or_connection_t {
@@ -1503,6 +1535,13 @@ typedef struct or_connection_t {
   /** True iff this connection has had its bootstrap failure logged with
    * control_event_bootstrap_problem. */
   unsigned int have_noted_bootstrap_problem:1;
+  /** True iff we're holding back writes on this connection until it has a
+   * full TLS record's worth of data or TLSWriteCoalesceDelay runs out. */
+  unsigned int write_held:1;
+  /** True iff TLSWriteCoalesceDelay ran out while we were holding back
+   * writes on this connection, so the next write should go out whatever
+   * its size. */
+  unsigned int write_released:1;
 
   uint16_t link_proto; /**< What protocol version are we using? 0 for
                         * "none negotiated yet." */
@@ -1519,10 +1558,14 @@ typedef struct or_connection_t {
   int bandwidthrate; /**< Bytes/s added to the bucket. (OPEN ORs only.) */
   int bandwidthburst; /**< Max bucket size for this conn. (OPEN ORs only.) */
 #ifndef USE_BUFFEREVENTS
-  int read_bucket; /**< When this hits 0, stop receiving. Every second we
-                    * add 'bandwidthrate' to this, capping it at
+  int read_bucket; /**< When this hits 0, stop receiving. We add
+                    * 'bandwidthrate' per second to this, capping it at
                     * bandwidthburst. (OPEN ORs only) */
   int write_bucket; /**< When this hits 0, stop writing. Like read_bucket. */
+  /** When did we last add tokens to read_bucket and write_bucket?  The
+   * per-connection buckets are refilled lazily from this timestamp whenever
+   * we look at them, rather than on every refill tick. */
+  struct timeval bucket_last_refilled;
 #else
   /** A rate-limiting configuration object to determine how this connection
    * set its read- and write- limits. */
@@ -1544,6 +1587,22 @@ typedef struct or_connection_t {
    * bytes TLS actually sent - used for overhead estimation for scheduling.
    */
   uint64_t bytes_xmitted, bytes_xmitted_by_tls;
+
+  /** Total number of bytes we have ever flushed from this connection's
+   * outbuf to TLS. */
+  uint64_t outbuf_bytes_flushed;
+  /** A ring of cells in our outbuf whose latency we're measuring: when
+   * outbuf_bytes_flushed reaches a mark's <b>end</b>, the cell has been
+   * handed to TLS.  We only track a sample of the cells in the outbuf;
+   * see connection_or_note_cell_queued(). */
+  struct {
+    uint64_t end; /**< Value of outbuf_bytes_flushed after the cell. */
+    uint32_t inserted_usec; /**< When the cell went into the outbuf. */
+  } cell_marks[OR_CONN_MAX_CELL_MARKS];
+  /** Index of the oldest mark in cell_marks. */
+  uint8_t cell_marks_head;
+  /** Number of marks in cell_marks. */
+  uint8_t n_cell_marks;
 } or_connection_t;
 
 /** Subtype of connection_t for an "edge connection" -- that is, an entry (ap)
@@ -2642,23 +2701,32 @@ typedef struct {
   } u;
 } onion_handshake_state_t;
 
+/** The relay cell crypto state for one hop of a circuit: an AES-CTR stream
+ * and a running SHA1 digest in each direction.  "Forward" means away from
+ * the circuit's origin; "backward" means toward it.  Everything is held by
+ * value, so that setting up a hop needs no allocations of its own and the
+ * state that the per-cell path touches is laid out together. */
+typedef struct relay_crypto_t {
+  /** Digest state for cells heading away from the origin. */
+  crypto_digest_storage_t f_digest;
+  /** Encryption key and counter for cells heading away from the origin. */
+  crypto_cipher_storage_t f_crypto;
+  /** Digest state for cells heading toward the origin. */
+  crypto_digest_storage_t b_digest;
+  /** Encryption key and counter for cells heading toward the origin. */
+  crypto_cipher_storage_t b_crypto;
+  /** True iff the digests and ciphers above have been set up. */
+  unsigned int is_initialized : 1;
+} relay_crypto_t;
+
 /** Holds accounting information for a single step in the layered encryption
  * performed by a circuit.  Used only at the client edge of a circuit. */
 typedef struct crypt_path_t {
   uint32_t magic;
 
-  /* crypto environments */
-  /** Encryption key and counter for cells heading towards the OR at this
-   * step. */
-  crypto_cipher_t *f_crypto;
-  /** Encryption key and counter for cells heading back from the OR at this
-   * step. */
-  crypto_cipher_t *b_crypto;
-
-  /** Digest state for cells heading towards the OR at this step. */
-  crypto_digest_t *f_digest; /* for integrity checking */
-  /** Digest state for cells heading away from the OR at this step. */
-  crypto_digest_t *b_digest;
+  /** Ciphers and digests for cells heading towards the OR at this step
+   * (forward) and back from it (backward). */
+  relay_crypto_t crypto;
 
   /** Current state of the handshake as performed with the OR at this
    * step. */
@@ -3185,21 +3253,10 @@ typedef struct or_circuit_t {
   /** Linked list of Exit streams associated with this circuit that are
    * still being resolved. */
   edge_connection_t *resolving_streams;
-  /** The cipher used by intermediate hops for cells heading toward the
-   * OP. */
-  crypto_cipher_t *p_crypto;
-  /** The cipher used by intermediate hops for cells heading away from
-   * the OP. */
-  crypto_cipher_t *n_crypto;
-
-  /** The integrity-checking digest used by intermediate hops, for
-   * cells packaged here and heading towards the OP.
-   */
-  crypto_digest_t *p_digest;
-  /** The integrity-checking digest used by intermediate hops, for
-   * cells packaged at the OP and arriving here.
-   */
-  crypto_digest_t *n_digest;
+  /** The ciphers and integrity-checking digests used by intermediate hops.
+   * The forward half handles cells packaged at the OP and arriving here; the
+   * backward half handles cells packaged here and heading towards the OP. */
+  relay_crypto_t crypto;
 
   /** Points to spliced circuit if purpose is REND_ESTABLISHED, and circuit
    * is not marked for close. */
@@ -3415,8 +3472,16 @@ typedef struct {
 
   int LogMessageDomains; /**< Boolean: Should we log the domain(s) in which
                           * each log message occurs? */
+  int LogAsynchronously; /**< Boolean: Should a separate thread write our
+                          * file and syslog logs? */
+  uint64_t LogAsyncBufferSize; /**< Bytes of log messages that each thread
+                                * may queue for the log writer thread. */
   int TruncateLogFile; /**< Boolean: Should we truncate the log file
                             before we start writing? */
+  char *TraceFile; /**< Where to write binary event traces, or NULL for
+                    * no tracing. */
+  int TraceRecordsPerThread; /**< How many trace records can each thread
+                              * hold before we write them out? */
 
   char *DebugLogFile; /**< Where to send verbose log messages. */
   char *DataDirectory; /**< OR only: where to store long-term data. */
@@ -3510,6 +3575,8 @@ typedef struct {
                                * connections. */
   config_line_t *ControlSocket; /**< List of Unix Domain Sockets to listen on
                                  * for control connections. */
+  /** Ports to listen on for requests for our metrics. */
+  config_line_t *MetricsPort_lines;
 
   int ControlSocketsGroupWritable; /**< Boolean: Are control sockets g+rw? */
   int SocksSocketsGroupWritable; /**< Boolean: Are SOCKS sockets g+rw? */
@@ -3665,6 +3732,12 @@ typedef struct {
   smartlist_t *AutomapHostsSuffixes;
   int RendPostPeriod; /**< How often do we post each rendezvous service
                        * descriptor? Remember to publish them independently. */
+  /** Most bytes of hidden service descriptors to keep in the client cache;
+   * 0 for no limit. */
+  uint64_t RendClientCacheMaxMemory;
+  /** Most bytes of hidden service descriptors to keep in the HSDir cache;
+   * 0 for a tenth of MaxMemInQueues. */
+  uint64_t RendDirCacheMaxMemory;
   int KeepalivePeriod; /**< How often do we send padding cells to keep
                         * connections alive? */
   int SocksTimeout; /**< How long do we let a socks connection wait
@@ -4245,6 +4318,22 @@ typedef struct {
 
   char *TLSECGroup; /**< One of "P256", "P224", or nil for auto */
 
+  /** Should we let other relays resume their TLS sessions with us, and
+   * resume ours with them? */
+  int TLSSessionResumption;
+
+  /** Should we let the kernel do the TLS record-layer crypto on our OR
+   * connections, where it can? */
+  int KernelTLS;
+
+  /** How long may we hold back a write on an OR connection, in msec, in
+   * the hope of filling a whole TLS record?  0 means never. */
+  int TLSWriteCoalesceDelay;
+
+  /** Should we sign the AUTHENTICATE cells for our link handshakes in a
+   * worker thread? */
+  int AsyncLinkHandshakes;
+
   /** Autobool: should we use the ntor handshake if we can? */
   int UseNTorHandshake;
 
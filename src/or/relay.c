@@ -34,10 +34,12 @@
 #include "relay.h"
 #include "rendcache.h"
 #include "rendcommon.h"
+#include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
 #include "scheduler.h"
+#include "trace.h"
 
 static edge_connection_t *relay_lookup_conn(circuit_t *circ, cell_t *cell,
                                             cell_direction_t cell_direction,
@@ -83,43 +85,44 @@ uint64_t stats_n_relay_cells_delivered = 0;
 /** Used to tell which stream to read from first on a circuit. */
 static tor_weak_rng_t stream_choice_rng = TOR_WEAK_RNG_INIT;
 
+/** Offset of the 'recognized' field within a packed relay header. */
+#define RELAY_RECOGNIZED_OFFSET 1
+/** Offset of the 'integrity' field within a packed relay header. */
+#define RELAY_INTEGRITY_OFFSET 5
+
 /** Update digest from the payload of cell. Assign integrity part to
  * cell.
  */
 static void
 relay_set_digest(crypto_digest_t *digest, cell_t *cell)
 {
-  char integrity[4];
-  relay_header_t rh;
-
   crypto_digest_add_bytes(digest, (char*)cell->payload, CELL_PAYLOAD_SIZE);
-  crypto_digest_get_digest(digest, integrity, 4);
-//  log_fn(LOG_DEBUG,"Putting digest of %u %u %u %u into relay cell.",
-//    integrity[0], integrity[1], integrity[2], integrity[3]);
-  relay_header_unpack(&rh, cell->payload);
-  memcpy(rh.integrity, integrity, 4);
-  relay_header_pack(cell->payload, &rh);
+  crypto_digest_get_digest(digest,
+                           (char*)cell->payload + RELAY_INTEGRITY_OFFSET, 4);
 }
 
 /** Does the digest for this circuit indicate that this cell is for us?
  *
- * Update digest from the payload of cell (with the integrity part set
- * to 0). If the integrity part is valid, return 1, else restore digest
- * and cell to their original state and return 0.
+ * If the cell's 'recognized' field is nonzero, it can't be for us: return 0
+ * without touching the digest.  Otherwise, update digest from the payload
+ * of cell (with the integrity part set to 0). If the integrity part is
+ * valid, return 1, else restore digest and cell to their original state and
+ * return 0.
  */
 static int
 relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
 {
   uint32_t received_integrity, calculated_integrity;
-  relay_header_t rh;
-  crypto_digest_t *backup_digest=NULL;
+  crypto_digest_checkpoint_t backup_digest;
+  uint8_t *integrity = cell->payload + RELAY_INTEGRITY_OFFSET;
 
-  backup_digest = crypto_digest_dup(digest);
+  if (get_uint16(cell->payload + RELAY_RECOGNIZED_OFFSET) != 0)
+    return 0;
 
-  relay_header_unpack(&rh, cell->payload);
-  memcpy(&received_integrity, rh.integrity, 4);
-  memset(rh.integrity, 0, 4);
-  relay_header_pack(cell->payload, &rh);
+  crypto_digest_checkpoint(&backup_digest, digest);
+
+  memcpy(&received_integrity, integrity, 4);
+  memset(integrity, 0, 4);
 
 //  log_fn(LOG_DEBUG,"Reading digest of %u %u %u %u from relay cell.",
 //    received_integrity[0], received_integrity[1],
@@ -132,17 +135,72 @@ relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
 //    log_fn(LOG_INFO,"Recognized=0 but bad digest. Not recognizing.");
 // (%d vs %d).", received_integrity, calculated_integrity);
     /* restore digest to its old form */
-    crypto_digest_assign(digest, backup_digest);
+    crypto_digest_restore(digest, &backup_digest);
     /* restore the relay header */
-    memcpy(rh.integrity, &received_integrity, 4);
-    relay_header_pack(cell->payload, &rh);
-    crypto_digest_free(backup_digest);
+    memcpy(integrity, &received_integrity, 4);
     return 0;
   }
-  crypto_digest_free(backup_digest);
   return 1;
 }
 
+/** Initialize the ciphers and digests in <b>crypto</b> from the key
+ * material in <b>key_data</b>.  key_data must contain CPATH_KEY_MATERIAL_LEN
+ * bytes, which are used as follows:
+ *   - 20 to initialize f_digest
+ *   - 20 to initialize b_digest
+ *   - 16 to key f_crypto
+ *   - 16 to key b_crypto
+ *
+ * (If <b>reverse</b> is true, then f_XX and b_XX are swapped.)
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int
+relay_crypto_init(relay_crypto_t *crypto, const char *key_data, int reverse)
+{
+  crypto_digest_storage_t *f_digest, *b_digest;
+  crypto_cipher_storage_t *f_crypto, *b_crypto;
+
+  tor_assert(crypto);
+  tor_assert(key_data);
+  tor_assert(!crypto->is_initialized);
+
+  if (reverse) {
+    f_digest = &crypto->b_digest;
+    b_digest = &crypto->f_digest;
+    f_crypto = &crypto->b_crypto;
+    b_crypto = &crypto->f_crypto;
+  } else {
+    f_digest = &crypto->f_digest;
+    b_digest = &crypto->b_digest;
+    f_crypto = &crypto->f_crypto;
+    b_crypto = &crypto->b_crypto;
+  }
+
+  crypto_digest_add_bytes(crypto_digest_init_in(f_digest),
+                          key_data, DIGEST_LEN);
+  crypto_digest_add_bytes(crypto_digest_init_in(b_digest),
+                          key_data+DIGEST_LEN, DIGEST_LEN);
+  crypto_cipher_init_in(f_crypto, key_data+(2*DIGEST_LEN));
+  crypto_cipher_init_in(b_crypto, key_data+(2*DIGEST_LEN)+CIPHER_KEY_LEN);
+
+  crypto->is_initialized = 1;
+  return 0;
+}
+
+/** Release all the state held in <b>crypto</b>, if any, and wipe it. */
+void
+relay_crypto_clear(relay_crypto_t *crypto)
+{
+  if (!crypto->is_initialized)
+    return;
+  crypto_cipher_clear(CRYPTO_CIPHER_IN(&crypto->f_crypto));
+  crypto_cipher_clear(CRYPTO_CIPHER_IN(&crypto->b_crypto));
+  crypto_digest_clear(CRYPTO_DIGEST_IN(&crypto->f_digest));
+  crypto_digest_clear(CRYPTO_DIGEST_IN(&crypto->b_digest));
+  memwipe(crypto, 0, sizeof(relay_crypto_t));
+}
+
 /** Apply <b>cipher</b> to CELL_PAYLOAD_SIZE bytes of <b>in</b>
  * (in place).
  *
@@ -198,6 +256,8 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
     return -END_CIRC_REASON_INTERNAL;
   }
 
+  tor_trace(TRACE_EV_CELL_RECV, cell_direction, recognized);
+
   if (recognized) {
     edge_connection_t *conn = NULL;
 
@@ -312,8 +372,6 @@ int
 relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
             crypt_path_t **layer_hint, char *recognized)
 {
-  relay_header_t rh;
-
   tor_assert(circ);
   tor_assert(cell);
   tor_assert(recognized);
@@ -333,17 +391,18 @@ relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
       do { /* Remember: cpath is in forward order, that is, first hop first. */
         tor_assert(thishop);
 
-        if (relay_crypt_one_payload(thishop->b_crypto, cell->payload, 0) < 0)
+        if (relay_crypt_one_payload(
+                              CRYPTO_CIPHER_IN(&thishop->crypto.b_crypto),
+                              cell->payload, 0) < 0)
           return -1;
 
-        relay_header_unpack(&rh, cell->payload);
-        if (rh.recognized == 0) {
-          /* it's possibly recognized. have to check digest to be sure. */
-          if (relay_digest_matches(thishop->b_digest, cell)) {
-            *recognized = 1;
-            *layer_hint = thishop;
-            return 0;
-          }
+        /* If it's possibly recognized, we have to check the digest to be
+         * sure. */
+        if (relay_digest_matches(CRYPTO_DIGEST_IN(&thishop->crypto.b_digest),
+                                 cell)) {
+          *recognized = 1;
+          *layer_hint = thishop;
+          return 0;
         }
 
         thishop = thishop->next;
@@ -352,7 +411,8 @@ relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
              "Incoming cell at client not recognized. Closing.");
       return -1;
     } else { /* we're in the middle. Just one crypt. */
-      if (relay_crypt_one_payload(TO_OR_CIRCUIT(circ)->p_crypto,
+      or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+      if (relay_crypt_one_payload(CRYPTO_CIPHER_IN(&or_circ->crypto.b_crypto),
                                   cell->payload, 1) < 0)
         return -1;
 //      log_fn(LOG_DEBUG,"Skipping recognized check, because we're not "
@@ -360,18 +420,18 @@ relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
     }
   } else /* cell_direction == CELL_DIRECTION_OUT */ {
     /* we're in the middle. Just one crypt. */
+    or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
 
-    if (relay_crypt_one_payload(TO_OR_CIRCUIT(circ)->n_crypto,
+    if (relay_crypt_one_payload(CRYPTO_CIPHER_IN(&or_circ->crypto.f_crypto),
                                 cell->payload, 0) < 0)
       return -1;
 
-    relay_header_unpack(&rh, cell->payload);
-    if (rh.recognized == 0) {
-      /* it's possibly recognized. have to check digest to be sure. */
-      if (relay_digest_matches(TO_OR_CIRCUIT(circ)->n_digest, cell)) {
-        *recognized = 1;
-        return 0;
-      }
+    /* If it's possibly recognized, we have to check the digest to be
+     * sure. */
+    if (relay_digest_matches(CRYPTO_DIGEST_IN(&or_circ->crypto.f_digest),
+                             cell)) {
+      *recognized = 1;
+      return 0;
     }
   }
   return 0;
@@ -403,7 +463,7 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
       return 0; /* just drop it */
     }
 
-    relay_set_digest(layer_hint->f_digest, cell);
+    relay_set_digest(CRYPTO_DIGEST_IN(&layer_hint->crypto.f_digest), cell);
 
     thishop = layer_hint;
     /* moving from farthest to nearest hop */
@@ -411,7 +471,8 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
       tor_assert(thishop);
       /* XXXX RD This is a bug, right? */
       log_debug(LD_OR,"crypting a layer of the relay cell.");
-      if (relay_crypt_one_payload(thishop->f_crypto, cell->payload, 1) < 0) {
+      if (relay_crypt_one_payload(CRYPTO_CIPHER_IN(&thishop->crypto.f_crypto),
+                                  cell->payload, 1) < 0) {
         return -1;
       }
 
@@ -429,8 +490,9 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
     }
     or_circ = TO_OR_CIRCUIT(circ);
     chan = or_circ->p_chan;
-    relay_set_digest(or_circ->p_digest, cell);
-    if (relay_crypt_one_payload(or_circ->p_crypto, cell->payload, 1) < 0)
+    relay_set_digest(CRYPTO_DIGEST_IN(&or_circ->crypto.b_digest), cell);
+    if (relay_crypt_one_payload(CRYPTO_CIPHER_IN(&or_circ->crypto.b_crypto),
+                                cell->payload, 1) < 0)
       return -1;
   }
   ++stats_n_relay_cells_relayed;
@@ -2328,6 +2390,7 @@ cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
   tor_gettimeofday_cached_monotonic(&now);
 
   copy->inserted_time = (uint32_t)tv_to_msec(&now);
+  copy->inserted_usec = cell_latency_timestamp();
 
   cell_queue_append(queue, copy);
 }
@@ -2374,8 +2437,9 @@ packed_cell_mem_cost(void)
   return sizeof(packed_cell_t);
 }
 
-/** DOCDOC */
-STATIC size_t
+/** Return the number of bytes currently allocated for cells on circuit
+ * queues. */
+size_t
 cell_queues_get_total_allocation(void)
 {
   return total_cells_allocated * packed_cell_mem_cost();
@@ -2406,9 +2470,7 @@ cell_queues_check_size(void)
       if (rend_cache_total > get_options()->MaxMemInQueues / 5) {
         const size_t bytes_to_remove =
           rend_cache_total - (size_t)(get_options()->MaxMemInQueues / 10);
-        rend_cache_clean_v2_descs_as_dir(time(NULL), bytes_to_remove);
-        alloc -= rend_cache_total;
-        alloc += rend_cache_get_total_allocation();
+        alloc -= rend_cache_handle_oom(time(NULL), bytes_to_remove);
       }
       circuits_handle_oom(alloc);
       return 1;
@@ -2545,7 +2607,7 @@ set_streams_blocked_on_circ(circuit_t *circ, channel_t *chan,
 }
 
 /** Extract the command from a packed cell. */
-static uint8_t
+uint8_t
 packed_cell_get_command(const packed_cell_t *cell, int wide_circ_ids)
 {
   if (wide_circ_ids) {
@@ -2623,6 +2685,8 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
      * has more than one.
      */
     cell = cell_queue_pop(queue);
+    rep_hist_note_cell_latency(CELL_LATENCY_CIRCUIT_QUEUE,
+                               cell->inserted_usec);
 
     /* Calculate the exact time that this cell has spent in the queue. */
     if (get_options()->CellStatistics ||
@@ -2694,6 +2758,8 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
   /* Okay, we're done sending now */
   assert_cmux_ok_paranoid(chan);
 
+  tor_trace(TRACE_EV_CELL_FLUSH, chan->global_identifier, n_flushed);
+
   return n_flushed;
 }
 
@@ -2823,6 +2889,7 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
 
   cell_queue_append_packed_copy(circ, queue, exitward, cell,
                                 chan->wide_circ_ids, 1);
+  tor_trace(TRACE_EV_CELL_QUEUE, direction, queue->n);
 
   if (PREDICT_UNLIKELY(cell_queues_check_size())) {
     /* We ran the OOM handler */
@@ -44,6 +44,7 @@ extern uint64_t stats_n_data_bytes_received;
 
 void dump_cell_pool_usage(int severity);
 size_t packed_cell_mem_cost(void);
+size_t cell_queues_get_total_allocation(void);
 
 int have_been_under_memory_pressure(void);
 
@@ -77,9 +78,13 @@ void circuit_clear_cell_queue(circuit_t *circ, channel_t *chan);
 
 void stream_choice_seed_weak_rng(void);
 
+int relay_crypto_init(relay_crypto_t *crypto, const char *key_data,
+                      int reverse);
+void relay_crypto_clear(relay_crypto_t *crypto);
 int relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
                 crypt_path_t **layer_hint, char *recognized);
 
+uint8_t packed_cell_get_command(const packed_cell_t *cell, int wide_circ_ids);
 circid_t packed_cell_get_circid(const packed_cell_t *cell, int wide_circ_ids);
 
 #ifdef RELAY_PRIVATE
@@ -99,7 +104,6 @@ STATIC int connection_edge_process_resolved_cell(edge_connection_t *conn,
                                                  const relay_header_t *rh);
 STATIC packed_cell_t *packed_cell_new(void);
 STATIC packed_cell_t *cell_queue_pop(cell_queue_t *queue);
-STATIC size_t cell_queues_get_total_allocation(void);
 STATIC int cell_queues_check_size(void);
 #endif
 
@@ -6,6 +6,7 @@
  * \brief Hidden service desriptor cache.
  **/
 
+#define RENDCACHE_PRIVATE
 #include "rendcache.h"
 
 #include "config.h"
@@ -22,9 +23,16 @@ static strmap_t *rend_cache = NULL;
  * directories. */
 static digestmap_t *rend_cache_v2_dir = NULL;
 
-/** DOCDOC */
+/** Total bytes attributed to both descriptor caches. */
 static size_t rend_cache_total_allocation = 0;
 
+/** Counters for the client cache (index 0) and the HSDir cache (index 1). */
+static rend_cache_stats_t rend_cache_stats[2];
+
+/** Entries in the client cache (index 0) and the HSDir cache (index 1),
+ * least recently stored or looked up first. */
+static TOR_TAILQ_HEAD(rend_cache_lru_s, rend_cache_entry_t) rend_cache_lru[2];
+
 /** Initializes the service descriptor cache.
 */
 void
@@ -32,6 +40,8 @@ rend_cache_init(void)
 {
   rend_cache = strmap_new();
   rend_cache_v2_dir = digestmap_new();
+  TOR_TAILQ_INIT(&rend_cache_lru[0]);
+  TOR_TAILQ_INIT(&rend_cache_lru[1]);
 }
 
 /** Return the approximate number of bytes needed to hold <b>e</b>. */
@@ -45,23 +55,50 @@ rend_cache_entry_allocation(const rend_cache_entry_t *e)
   return sizeof(*e) + e->len + sizeof(*e->parsed);
 }
 
-/** DOCDOC */
+/** Return the number of bytes attributed to both descriptor caches. */
 size_t
 rend_cache_get_total_allocation(void)
 {
   return rend_cache_total_allocation;
 }
 
-/** Decrement the total bytes attributed to the rendezvous cache by n. */
+/** Return the most bytes we'll let the HSDir cache (if <b>as_dir</b>) or
+ * the client cache (otherwise) use before evicting its least recently used
+ * entries, or 0 if there's no limit. */
+size_t
+rend_cache_get_max_allocation(int as_dir)
+{
+  const or_options_t *options = get_options();
+  if (!as_dir)
+    return (size_t) options->RendClientCacheMaxMemory;
+  if (options->RendDirCacheMaxMemory)
+    return (size_t) options->RendDirCacheMaxMemory;
+  /* This is what we'd free the HSDir cache down to if we ran low on
+   * memory anyway. */
+  return (size_t) (options->MaxMemInQueues / 10);
+}
+
+/** Set *<b>stats_out</b> to the counters for the HSDir cache (if
+ * <b>as_dir</b>) or the client cache (otherwise). */
+void
+rend_cache_get_stats(int as_dir, rend_cache_stats_t *stats_out)
+{
+  memcpy(stats_out, &rend_cache_stats[!!as_dir], sizeof(*stats_out));
+}
+
+/** Decrement the total bytes attributed to the HSDir cache (if
+ * <b>as_dir</b>) or the client cache (otherwise) by n. */
 static void
-rend_cache_decrement_allocation(size_t n)
+rend_cache_decrement_allocation(int as_dir, size_t n)
 {
   static int have_underflowed = 0;
+  size_t *alloc = &rend_cache_stats[as_dir].allocation;
 
-  if (rend_cache_total_allocation >= n) {
+  if (rend_cache_total_allocation >= n && *alloc >= n) {
     rend_cache_total_allocation -= n;
+    *alloc -= n;
   } else {
-    rend_cache_total_allocation = 0;
+    rend_cache_total_allocation = *alloc = 0;
     if (! have_underflowed) {
       have_underflowed = 1;
       log_warn(LD_BUG, "Underflow in rend_cache_decrement_allocation");
@@ -69,15 +106,19 @@ rend_cache_decrement_allocation(size_t n)
   }
 }
 
-/** Increase the total bytes attributed to the rendezvous cache by n. */
+/** Increase the total bytes attributed to the HSDir cache (if
+ * <b>as_dir</b>) or the client cache (otherwise) by n. */
 static void
-rend_cache_increment_allocation(size_t n)
+rend_cache_increment_allocation(int as_dir, size_t n)
 {
   static int have_overflowed = 0;
-  if (rend_cache_total_allocation <= SIZE_MAX - n) {
+  size_t *alloc = &rend_cache_stats[as_dir].allocation;
+
+  if (rend_cache_total_allocation <= SIZE_MAX - n && *alloc <= SIZE_MAX - n) {
     rend_cache_total_allocation += n;
+    *alloc += n;
   } else {
-    rend_cache_total_allocation = SIZE_MAX;
+    rend_cache_total_allocation = *alloc = SIZE_MAX;
     if (! have_overflowed) {
       have_overflowed = 1;
       log_warn(LD_BUG, "Overflow in rend_cache_increment_allocation");
@@ -85,18 +126,111 @@ rend_cache_increment_allocation(size_t n)
   }
 }
 
-/** Helper: free storage held by a single service descriptor cache entry. */
+/** Helper: free storage held by a single service descriptor cache entry,
+ * and take it off its cache's list of entries.  Doesn't remove it from its
+ * cache's map. */
 static void
 rend_cache_entry_free(rend_cache_entry_t *e)
 {
   if (!e)
     return;
-  rend_cache_decrement_allocation(rend_cache_entry_allocation(e));
+  rend_cache_decrement_allocation(e->as_dir, rend_cache_entry_allocation(e));
+  TOR_TAILQ_REMOVE(&rend_cache_lru[e->as_dir], e, lru_link);
+  --rend_cache_stats[e->as_dir].n_entries;
   rend_service_descriptor_free(e->parsed);
   tor_free(e->desc);
   tor_free(e);
 }
 
+/** Add the new entry <b>e</b>, whose <b>desc</b> and <b>parsed</b> fields
+ * are already set, to the HSDir cache (if <b>as_dir</b>) or the client
+ * cache (otherwise), under <b>key</b>: a descriptor ID or a
+ * version-prefixed service ID respectively.  There must be no entry
+ * under <b>key</b> yet. */
+STATIC void
+rend_cache_add_entry(rend_cache_entry_t *e, int as_dir, const char *key)
+{
+  e->as_dir = !!as_dir;
+  if (as_dir) {
+    memcpy(e->key, key, DIGEST_LEN);
+    digestmap_set(rend_cache_v2_dir, key, e);
+  } else {
+    strlcpy(e->key, key, sizeof(e->key));
+    strmap_set_lc(rend_cache, key, e);
+  }
+  TOR_TAILQ_INSERT_TAIL(&rend_cache_lru[e->as_dir], e, lru_link);
+  ++rend_cache_stats[e->as_dir].n_entries;
+  rend_cache_increment_allocation(e->as_dir, rend_cache_entry_allocation(e));
+}
+
+/** Note that we've just used <b>e</b>, so that it's the last entry in its
+ * cache we'd evict. */
+static void
+rend_cache_entry_touch(rend_cache_entry_t *e)
+{
+  TOR_TAILQ_REMOVE(&rend_cache_lru[e->as_dir], e, lru_link);
+  TOR_TAILQ_INSERT_TAIL(&rend_cache_lru[e->as_dir], e, lru_link);
+}
+
+/** Replace the descriptor in the cache entry <b>e</b> with <b>parsed</b>,
+ * whose encoded form is the first <b>len</b> bytes of <b>desc</b>. */
+static void
+rend_cache_entry_replace(rend_cache_entry_t *e,
+                         rend_service_descriptor_t *parsed,
+                         const char *desc, size_t len)
+{
+  rend_cache_decrement_allocation(e->as_dir, rend_cache_entry_allocation(e));
+  rend_service_descriptor_free(e->parsed);
+  tor_free(e->desc);
+  e->parsed = parsed;
+  e->desc = tor_strndup(desc, len);
+  e->len = len;
+  rend_cache_increment_allocation(e->as_dir, rend_cache_entry_allocation(e));
+  rend_cache_entry_touch(e);
+}
+
+/** Remove the least recently used entries from the HSDir cache (if
+ * <b>as_dir</b>) or the client cache (otherwise), until it holds no more
+ * than <b>target</b> bytes, or until <b>keep</b> is the least recently used
+ * entry.  Return the number of bytes we freed. */
+STATIC size_t
+rend_cache_evict_lru(int as_dir, size_t target,
+                     const rend_cache_entry_t *keep)
+{
+  rend_cache_entry_t *e;
+  size_t bytes_removed = 0;
+
+  as_dir = !!as_dir;
+  while (rend_cache_stats[as_dir].allocation > target &&
+         (e = TOR_TAILQ_FIRST(&rend_cache_lru[as_dir])) != NULL &&
+         e != keep) {
+    bytes_removed += rend_cache_entry_allocation(e);
+    if (as_dir)
+      digestmap_remove(rend_cache_v2_dir, e->key);
+    else
+      strmap_remove_lc(rend_cache, e->key);
+    rend_cache_entry_free(e);
+    ++rend_cache_stats[as_dir].n_evictions;
+  }
+  return bytes_removed;
+}
+
+/** If the HSDir cache (if <b>as_dir</b>) or the client cache (otherwise) is
+ * over its budget, evict entries other than <b>keep</b> until it isn't. */
+static void
+rend_cache_enforce_budget(int as_dir, const rend_cache_entry_t *keep)
+{
+  const size_t max = rend_cache_get_max_allocation(as_dir);
+  size_t removed;
+  if (!max || rend_cache_stats[as_dir].allocation <= max)
+    return;
+  removed = rend_cache_evict_lru(as_dir, max, keep);
+  log_info(LD_REND, "The %s descriptor cache was over its %lu-byte budget; "
+           "evicted %lu bytes of least recently used descriptors.",
+           as_dir ? "HSDir" : "client", (unsigned long)max,
+           (unsigned long)removed);
+}
+
 /** Helper: deallocate a rend_cache_entry_t.  (Used with strmap_free(), which
  * requires a function pointer whose argument is void*). */
 static void
@@ -114,6 +248,7 @@ rend_cache_free_all(void)
   rend_cache = NULL;
   rend_cache_v2_dir = NULL;
   rend_cache_total_allocation = 0;
+  memset(rend_cache_stats, 0, sizeof(rend_cache_stats));
 }
 
 /** Removes all old entries from the service descriptor cache.
@@ -193,6 +328,36 @@ rend_cache_clean_v2_descs_as_dir(time_t now, size_t force_remove)
   } while (bytes_removed < force_remove);
 }
 
+/** We're low on memory: free at least <b>min_to_remove</b> bytes of
+ * descriptors if we can.  First drop HSDir descriptors that are old, that
+ * we're no longer responsible for, or that nobody has fetched lately; then
+ * the least recently used HSDir descriptors; then the least recently used
+ * client descriptors.  Return the number of bytes we freed. */
+size_t
+rend_cache_handle_oom(time_t now, size_t min_to_remove)
+{
+  const size_t before = rend_cache_total_allocation;
+  size_t removed;
+  int as_dir;
+
+  rend_cache_clean_v2_descs_as_dir(now, min_to_remove);
+  for (as_dir = 1; as_dir >= 0; --as_dir) {
+    removed = before - rend_cache_total_allocation;
+    if (removed >= min_to_remove)
+      break;
+    if (rend_cache_stats[as_dir].allocation > min_to_remove - removed) {
+      rend_cache_evict_lru(as_dir, rend_cache_stats[as_dir].allocation -
+                           (min_to_remove - removed), NULL);
+    } else {
+      rend_cache_evict_lru(as_dir, 0, NULL);
+    }
+  }
+  removed = before - rend_cache_total_allocation;
+  log_info(LD_REND, "Low on memory: removed %lu bytes of hidden service "
+           "descriptors.", (unsigned long)removed);
+  return removed;
+}
+
 /** Lookup in the client cache the given service ID <b>query</b> for
  * <b>version</b>.
  *
@@ -228,10 +393,13 @@ rend_cache_lookup_entry(const char *query, int version, rend_cache_entry_t **e)
       break;
   }
   if (!entry) {
+    ++rend_cache_stats[0].n_misses;
     ret = -ENOENT;
     goto end;
   }
   tor_assert(entry->parsed && entry->parsed->intro_nodes);
+  ++rend_cache_stats[0].n_hits;
+  rend_cache_entry_touch(entry);
 
   if (e) {
     *e = entry;
@@ -264,8 +432,11 @@ rend_cache_lookup_v2_desc_as_dir(const char *desc_id, const char **desc)
   if (e) {
     *desc = e->desc;
     e->last_served = approx_time();
+    ++rend_cache_stats[1].n_hits;
+    rend_cache_entry_touch(e);
     return 1;
   }
+  ++rend_cache_stats[1].n_misses;
   return 0;
 }
 
@@ -348,21 +519,19 @@ rend_cache_store_v2_desc_as_dir(const char *desc)
     /* Store received descriptor. */
     if (!e) {
       e = tor_malloc_zero(sizeof(rend_cache_entry_t));
-      digestmap_set(rend_cache_v2_dir, desc_id, e);
       /* Treat something just uploaded as having been served a little
        * while ago, so that flooding with new descriptors doesn't help
        * too much.
        */
       e->last_served = approx_time() - 3600;
+      e->parsed = parsed;
+      e->desc = tor_strndup(current_desc, encoded_size);
+      e->len = encoded_size;
+      rend_cache_add_entry(e, 1, desc_id);
     } else {
-      rend_cache_decrement_allocation(rend_cache_entry_allocation(e));
-      rend_service_descriptor_free(e->parsed);
-      tor_free(e->desc);
+      rend_cache_entry_replace(e, parsed, current_desc, encoded_size);
     }
-    e->parsed = parsed;
-    e->desc = tor_strndup(current_desc, encoded_size);
-    e->len = encoded_size;
-    rend_cache_increment_allocation(rend_cache_entry_allocation(e));
+    rend_cache_enforce_budget(1, e);
     log_info(LD_REND, "Successfully stored service descriptor with desc ID "
              "'%s' and len %d.",
              safe_str(desc_id_base32), (int)encoded_size);
@@ -548,17 +717,14 @@ rend_cache_store_v2_desc_as_client(const char *desc,
   }
   if (!e) {
     e = tor_malloc_zero(sizeof(rend_cache_entry_t));
-    strmap_set_lc(rend_cache, key, e);
+    e->parsed = parsed;
+    e->desc = tor_strndup(desc, encoded_size);
+    e->len = encoded_size;
+    rend_cache_add_entry(e, 0, key);
   } else {
-    rend_cache_decrement_allocation(rend_cache_entry_allocation(e));
-    rend_service_descriptor_free(e->parsed);
-    tor_free(e->desc);
+    rend_cache_entry_replace(e, parsed, desc, encoded_size);
   }
-  e->parsed = parsed;
-  e->desc = tor_malloc_zero(encoded_size + 1);
-  strlcpy(e->desc, desc, encoded_size + 1);
-  e->len = encoded_size;
-  rend_cache_increment_allocation(rend_cache_entry_allocation(e));
+  rend_cache_enforce_budget(0, e);
   log_debug(LD_REND,"Successfully stored rend desc '%s', len %d.",
             safe_str_client(service_id), (int)encoded_size);
   if (entry) {
@@ -29,8 +29,32 @@ typedef struct rend_cache_entry_t {
                        * (HSDir only) */
   char *desc; /**< Service descriptor */
   rend_service_descriptor_t *parsed; /**< Parsed value of 'desc' */
+  /** True iff this entry is in the HSDir cache rather than the client
+   * cache. */
+  unsigned int as_dir : 1;
+  /** Key for this entry in its cache: a service ID prefixed with its
+   * version for the client cache, or a descriptor ID for the HSDir cache. */
+  char key[DIGEST_LEN];
+  /** Links for its cache's list of entries, least recently used first. */
+  TOR_TAILQ_ENTRY(rend_cache_entry_t) lru_link;
 } rend_cache_entry_t;
 
+/** Counters for one of the descriptor caches. */
+typedef struct rend_cache_stats_t {
+  /** Bytes attributed to the cache, as rend_cache_entry_allocation()
+   * counts them. */
+  size_t allocation;
+  /** Number of entries in the cache. */
+  int n_entries;
+  /** Number of lookups that found an entry. */
+  uint64_t n_hits;
+  /** Number of lookups that found nothing. */
+  uint64_t n_misses;
+  /** Number of entries we've dropped to stay within the cache's budget, or
+   * because we were low on memory. */
+  uint64_t n_evictions;
+} rend_cache_stats_t;
+
 void rend_cache_init(void);
 void rend_cache_clean(time_t now);
 void rend_cache_clean_v2_descs_as_dir(time_t now, size_t min_to_remove);
@@ -52,6 +76,16 @@ rend_cache_store_status_t rend_cache_store_v2_desc_as_client(const char *desc,
                                                 const rend_data_t *rend_query,
                                                 rend_cache_entry_t **entry);
 size_t rend_cache_get_total_allocation(void);
+size_t rend_cache_get_max_allocation(int as_dir);
+void rend_cache_get_stats(int as_dir, rend_cache_stats_t *stats_out);
+size_t rend_cache_handle_oom(time_t now, size_t min_to_remove);
+
+#ifdef RENDCACHE_PRIVATE
+STATIC void rend_cache_add_entry(rend_cache_entry_t *e, int as_dir,
+                                 const char *key);
+STATIC size_t rend_cache_evict_lru(int as_dir, size_t target,
+                                   const rend_cache_entry_t *keep);
+#endif
 
 #endif /* TOR_RENDCACHE_H */
 
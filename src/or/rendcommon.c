@@ -166,7 +166,7 @@ rend_compute_v2_desc_id(char *desc_id_out, const char *service_id,
 /** Encode the introduction points in <b>desc</b> and write the result to a
  * newly allocated string pointed to by <b>encoded</b>. Return 0 for
  * success, -1 otherwise. */
-static int
+int
 rend_encode_v2_intro_points(char **encoded, rend_service_descriptor_t *desc)
 {
   size_t unenc_len;
@@ -16,8 +16,10 @@
 #include "circuituse.h"
 #include "config.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "main.h"
+#include "metrics.h"
 #include "networkstatus.h"
 #include "nodelist.h"
 #include "rendclient.h"
@@ -30,6 +32,7 @@
 #include "routerlist.h"
 #include "routerparse.h"
 #include "routerset.h"
+#include "workqueue.h"
 
 struct rend_service_t;
 static origin_circuit_t *find_intro_circuit(rend_intro_point_t *intro,
@@ -54,6 +57,9 @@ static struct rend_service_t *rend_service_get_by_pk_digest(
 static struct rend_service_t *rend_service_get_by_service_id(const char *id);
 static const char *rend_service_escaped_dir(
     const struct rend_service_t *s);
+static void rend_service_free_pending_intros(void);
+static char *rend_service_instance_fname(const struct rend_service_t *s,
+                                         const char *instance_id);
 
 static ssize_t rend_service_parse_intro_for_v0_or_v1(
     rend_intro_cell_t *intro,
@@ -159,6 +165,25 @@ typedef struct rend_service_t {
   /** If true, we close circuits that exceed the max_streams_per_circuit
    * limit.  */
   int max_streams_close_circuit;
+
+  /* Fields for running one service from several tor instances. */
+  /** A directory that we share with the other tor instances that serve
+   * this service, or NULL.  Each instance writes its established intro
+   * points there, and lists everyone's in the descriptors it publishes. */
+  char *instance_dir;
+  /** Our file's name in instance_dir; empty until we first write it. */
+  char instance_id[REND_INSTANCE_ID_LEN_HEX+1];
+  /** When we last wrote our file in instance_dir, or 0 if it's not there. */
+  time_t instance_file_written;
+  /** Digest of the intro points we last wrote to our file. */
+  char instance_file_digest[DIGEST_LEN];
+  /** When we should next look at instance_dir. */
+  time_t next_instance_sync;
+  /** List of rend_service_instance_t: the other live instances of this
+   * service, sorted by id. */
+  smartlist_t *instances;
+  /** Digest of the intro points in <b>instances</b>. */
+  char instances_digest[DIGEST_LEN];
 } rend_service_t;
 
 /** Returns a escaped string representation of the service, <b>s</b>.
@@ -237,6 +262,12 @@ rend_service_free(rend_service_t *service)
   if (service->accepted_intro_dh_parts) {
     replaycache_free(service->accepted_intro_dh_parts);
   }
+  tor_free(service->instance_dir);
+  if (service->instances) {
+    SMARTLIST_FOREACH(service->instances, rend_service_instance_t *, inst,
+                      rend_service_instance_free(inst));
+    smartlist_free(service->instances);
+  }
   tor_free(service);
 }
 
@@ -245,9 +276,18 @@ rend_service_free(rend_service_t *service)
 void
 rend_service_free_all(void)
 {
+  rend_service_free_pending_intros();
   if (!rend_service_list)
     return;
 
+  /* Tell the other instances of our services that we're gone. */
+  SMARTLIST_FOREACH_BEGIN(rend_service_list, rend_service_t *, s) {
+    if (s->instance_dir && s->instance_file_written) {
+      char *fname = rend_service_instance_fname(s, s->instance_id);
+      unlink(fname);
+      tor_free(fname);
+    }
+  } SMARTLIST_FOREACH_END(s);
   SMARTLIST_FOREACH(rend_service_list, rend_service_t*, ptr,
                     rend_service_free(ptr));
   smartlist_free(rend_service_list);
@@ -715,6 +755,17 @@ rend_config_services(const or_options_t *options, int validate_only)
         rend_service_free(service);
         return -1;
       }
+    } else if (!strcasecmp(line->key, "HiddenServiceInstanceDir")) {
+      if (options->Sandbox) {
+        log_warn(LD_CONFIG, "HiddenServiceInstanceDir is not compatible "
+                 "with Sandbox.");
+        rend_service_free(service);
+        return -1;
+      }
+      tor_free(service->instance_dir);
+      service->instance_dir = tor_strdup(line->value);
+      log_info(LD_CONFIG, "HiddenServiceInstanceDir=%s for %s",
+               service->instance_dir, service->directory);
     } else {
       tor_assert(!strcasecmp(line->key, "HiddenServiceVersion"));
       if (strcmp(line->value, "2")) {
@@ -735,6 +786,12 @@ rend_config_services(const or_options_t *options, int validate_only)
       rend_service_free(service);
       return -1;
     }
+    if (service->instance_dir &&
+        check_private_dir(service->instance_dir,
+                          CPD_CHECK_MODE_ONLY|CPD_CHECK, options->User) < 0) {
+      rend_service_free(service);
+      return -1;
+    }
 
     if (validate_only) {
       rend_service_free(service);
@@ -782,6 +839,20 @@ rend_config_services(const or_options_t *options, int validate_only)
           smartlist_clear(old->intro_nodes);
           smartlist_add_all(new->expiring_nodes, old->expiring_nodes);
           smartlist_clear(old->expiring_nodes);
+          if (new->instance_dir && old->instance_dir &&
+              !strcmp(old->instance_dir, new->instance_dir)) {
+            /* Keep our file, and what we know about the other
+             * instances. */
+            memcpy(new->instance_id, old->instance_id,
+                   sizeof(new->instance_id));
+            new->instance_file_written = old->instance_file_written;
+            memcpy(new->instance_file_digest, old->instance_file_digest,
+                   DIGEST_LEN);
+            new->instances = old->instances;
+            old->instances = NULL;
+            memcpy(new->instances_digest, old->instances_digest,
+                   DIGEST_LEN);
+          }
           smartlist_add(surviving_services, old);
           break;
         }
@@ -945,15 +1016,39 @@ rend_service_del_ephemeral(const char *service_id)
   return 0;
 }
 
+/** Return a new list of the intro points of <b>service</b> whose circuits
+ * are established, and which we can therefore list in a descriptor.  The
+ * list doesn't own its members. */
+static smartlist_t *
+rend_service_get_established_intro_points(rend_service_t *service)
+{
+  smartlist_t *result = smartlist_new();
+  origin_circuit_t *circ;
+
+  SMARTLIST_FOREACH_BEGIN(service->intro_nodes, rend_intro_point_t *,
+                          intro_svc) {
+    circ = find_intro_circuit(intro_svc, service->pk_digest);
+    if (!circ || circ->base_.purpose != CIRCUIT_PURPOSE_S_INTRO) {
+      /* This intro point's circuit isn't finished yet.  Don't list it. */
+      continue;
+    }
+    smartlist_add(result, intro_svc);
+  } SMARTLIST_FOREACH_END(intro_svc);
+  return result;
+}
+
 /** Replace the old value of <b>service</b>-\>desc with one that reflects
  * the other fields in service.
+ *
+ * If the service has other instances, list their intro points too, up to
+ * NUM_INTRO_POINTS_MAX in all; see
+ * rend_service_merge_instance_intro_points().
  */
 static void
 rend_service_update_descriptor(rend_service_t *service)
 {
   rend_service_descriptor_t *d;
-  origin_circuit_t *circ;
-  int i;
+  smartlist_t *established, *listed;
 
   rend_service_descriptor_free(service->desc);
   service->desc = NULL;
@@ -966,37 +1061,356 @@ rend_service_update_descriptor(rend_service_t *service)
   /* Support intro protocols 2 and 3. */
   d->protocols = (1 << 2) + (1 << 3);
 
-  for (i = 0; i < smartlist_len(service->intro_nodes); ++i) {
-    rend_intro_point_t *intro_svc = smartlist_get(service->intro_nodes, i);
-    rend_intro_point_t *intro_desc;
+  established = rend_service_get_established_intro_points(service);
+  if (service->instances && smartlist_len(service->instances)) {
+    smartlist_t *instances = smartlist_new();
+    rend_service_instance_t ours;
+    strlcpy(ours.id, service->instance_id, sizeof(ours.id));
+    ours.intro_nodes = established;
+    smartlist_add_all(instances, service->instances);
+    smartlist_add(instances, &ours);
+    listed = rend_service_merge_instance_intro_points(instances,
+                                                      NUM_INTRO_POINTS_MAX);
+    smartlist_free(instances);
+  } else {
+    listed = smartlist_new();
+    smartlist_add_all(listed, established);
+  }
 
+  SMARTLIST_FOREACH_BEGIN(service->intro_nodes, rend_intro_point_t *,
+                          intro_svc) {
     /* This intro point won't be listed in the descriptor... */
     intro_svc->listed_in_last_desc = 0;
+  } SMARTLIST_FOREACH_END(intro_svc);
 
-    circ = find_intro_circuit(intro_svc, service->pk_digest);
-    if (!circ || circ->base_.purpose != CIRCUIT_PURPOSE_S_INTRO) {
-      /* This intro point's circuit isn't finished yet.  Don't list it. */
-      continue;
-    }
-
-    /* ...unless this intro point is listed in the descriptor. */
-    intro_svc->listed_in_last_desc = 1;
+  SMARTLIST_FOREACH_BEGIN(listed, rend_intro_point_t *, intro) {
+    rend_intro_point_t *intro_desc;
 
-    /* We have an entirely established intro circuit.  Publish it in
-     * our descriptor. */
+    /* We have an entirely established intro circuit, or another instance
+     * of this service does.  Publish it in our descriptor. */
     intro_desc = tor_malloc_zero(sizeof(rend_intro_point_t));
-    intro_desc->extend_info = extend_info_dup(intro_svc->extend_info);
-    if (intro_svc->intro_key)
-      intro_desc->intro_key = crypto_pk_dup_key(intro_svc->intro_key);
+    intro_desc->extend_info = extend_info_dup(intro->extend_info);
+    if (intro->intro_key)
+      intro_desc->intro_key = crypto_pk_dup_key(intro->intro_key);
     smartlist_add(d->intro_nodes, intro_desc);
 
-    if (intro_svc->time_published == -1) {
+    if (!smartlist_contains(established, intro))
+      continue;
+
+    /* ...unless this intro point is listed in the descriptor. */
+    intro->listed_in_last_desc = 1;
+
+    if (intro->time_published == -1) {
       /* We are publishing this intro point in a descriptor for the
        * first time -- note the current time in the service's copy of
        * the intro point. */
-      intro_svc->time_published = time(NULL);
+      intro->time_published = time(NULL);
+    }
+  } SMARTLIST_FOREACH_END(intro);
+
+  smartlist_free(established);
+  smartlist_free(listed);
+}
+
+/*
+ * Running one service from several tor instances.
+ *
+ * Every instance has its own intro points, and handles the INTRODUCE2
+ * cells that arrive on them.  If the instances share a
+ * HiddenServiceInstanceDir, each one writes its established intro points
+ * to a file there, and publishes descriptors that list intro points from
+ * all of the files.  Since every instance merges the lists the same way,
+ * they all publish the same descriptor, and it doesn't matter whose upload
+ * an HSDir keeps.
+ */
+
+/** How often do we look at a service's HiddenServiceInstanceDir? */
+#define INSTANCE_SYNC_INTERVAL 30
+/** Rewrite our instance file at least this often, even if our intro points
+ * haven't changed, so that the other instances know we're still here. */
+#define INSTANCE_REFRESH_INTERVAL (5*60)
+/** Ignore instance files that are older than this: their tor is gone. */
+#define INSTANCE_MAX_AGE (3*INSTANCE_REFRESH_INTERVAL)
+
+/** Release all storage held by <b>inst</b>. */
+STATIC void
+rend_service_instance_free(rend_service_instance_t *inst)
+{
+  if (!inst)
+    return;
+  if (inst->intro_nodes) {
+    SMARTLIST_FOREACH(inst->intro_nodes, rend_intro_point_t *, intro,
+                      rend_intro_point_free(intro));
+    smartlist_free(inst->intro_nodes);
+  }
+  tor_free(inst);
+}
+
+/** Helper for sorting rend_service_instance_t by id. */
+static int
+compare_instances_by_id_(const void **a_, const void **b_)
+{
+  const rend_service_instance_t *a = *a_, *b = *b_;
+  return strcmp(a->id, b->id);
+}
+
+/** Given a list of rend_service_instance_t, return a new list of at most
+ * <b>max</b> of their intro points to put in a descriptor.  We take one
+ * intro point from each instance in order of id, then a second from each,
+ * and so on, so that every instance gets a share of the clients, and every
+ * instance with the same view of the others picks the same intro points.
+ * Sorts <b>instances</b>.  The returned list doesn't own its members.
+ */
+STATIC smartlist_t *
+rend_service_merge_instance_intro_points(smartlist_t *instances, int max)
+{
+  smartlist_t *result = smartlist_new();
+  int round, added;
+
+  smartlist_sort(instances, compare_instances_by_id_);
+  for (round = 0; smartlist_len(result) < max; ++round) {
+    added = 0;
+    SMARTLIST_FOREACH_BEGIN(instances, rend_service_instance_t *, inst) {
+      if (round >= smartlist_len(inst->intro_nodes))
+        continue;
+      smartlist_add(result, smartlist_get(inst->intro_nodes, round));
+      ++added;
+      if (smartlist_len(result) >= max)
+        break;
+    } SMARTLIST_FOREACH_END(inst);
+    if (!added)
+      break;
+  }
+  return result;
+}
+
+/** Return a newly allocated string holding the path of the file for the
+ * instance of <b>s</b> called <b>instance_id</b>. */
+static char *
+rend_service_instance_fname(const rend_service_t *s, const char *instance_id)
+{
+  char *fname = NULL;
+  tor_asprintf(&fname, "%s%s%s", s->instance_dir, PATH_SEPARATOR,
+               instance_id);
+  return fname;
+}
+
+/** Return a newly allocated instance file for an instance of the service
+ * <b>service_id</b>, listing the encoded <b>intro_points</b>. */
+STATIC char *
+rend_service_format_instance_file(const char *service_id, time_t published,
+                                  const char *intro_points)
+{
+  char published_str[ISO_TIME_LEN+1];
+  char *result = NULL;
+
+  format_iso_time(published_str, published);
+  tor_asprintf(&result, "instance-of %s\npublished %s\n%s",
+               service_id, published_str, intro_points);
+  return result;
+}
+
+/** Parse the instance file in <b>body</b>.  If it belongs to the service
+ * <b>service_id</b>, and is recent enough as of <b>now</b> that its tor is
+ * probably still running, return a new list of the rend_intro_point_t that
+ * it lists, and point <b>intro_points_out</b> at their encoded form within
+ * <b>body</b>.  Otherwise return NULL. */
+STATIC smartlist_t *
+rend_service_parse_instance_file(const char *body, const char *service_id,
+                                 time_t now, const char **intro_points_out)
+{
+  const char *cp = body, *eol;
+  char published_str[ISO_TIME_LEN+1];
+  time_t published;
+  rend_service_descriptor_t *d;
+  smartlist_t *result;
+
+  if (strcmpstart(cp, "instance-of "))
+    goto bad;
+  cp += strlen("instance-of ");
+  if (strcmpstart(cp, service_id) || cp[strlen(service_id)] != '\n') {
+    log_info(LD_REND, "Found an instance file for some other service.");
+    return NULL;
+  }
+  cp += strlen(service_id) + 1;
+  if (strcmpstart(cp, "published "))
+    goto bad;
+  cp += strlen("published ");
+  eol = strchr(cp, '\n');
+  if (!eol || eol - cp != ISO_TIME_LEN)
+    goto bad;
+  strlcpy(published_str, cp, sizeof(published_str));
+  if (parse_iso_time(published_str, &published) < 0)
+    goto bad;
+  if (published < now - INSTANCE_MAX_AGE) {
+    log_info(LD_REND, "Ignoring an instance file from %s: that instance is "
+             "probably gone.", published_str);
+    return NULL;
+  }
+  cp = eol + 1;
+
+  d = tor_malloc_zero(sizeof(rend_service_descriptor_t));
+  if (rend_parse_introduction_points(d, cp, strlen(cp)) <= 0) {
+    rend_service_descriptor_free(d);
+    goto bad;
+  }
+  result = d->intro_nodes;
+  d->intro_nodes = NULL;
+  rend_service_descriptor_free(d);
+  if (intro_points_out)
+    *intro_points_out = cp;
+  return result;
+
+ bad:
+  log_warn(LD_REND, "Unparseable instance file for service %s.",
+           service_id);
+  return NULL;
+}
+
+/** Write the established intro points of <b>service</b> to our file in
+ * its instance directory, if they've changed or if it's time to let the
+ * other instances know we're still here.  If we have no intro points,
+ * remove our file. */
+static void
+rend_service_write_instance_file(rend_service_t *service, time_t now)
+{
+  rend_service_descriptor_t *d;
+  char *intro_points = NULL, *body = NULL, *fname;
+  char digest[DIGEST_LEN];
+
+  fname = rend_service_instance_fname(service, service->instance_id);
+  d = tor_malloc_zero(sizeof(rend_service_descriptor_t));
+  d->intro_nodes = rend_service_get_established_intro_points(service);
+
+  if (!smartlist_len(d->intro_nodes)) {
+    if (service->instance_file_written) {
+      unlink(fname);
+      service->instance_file_written = 0;
     }
+    goto done;
+  }
+  if (rend_encode_v2_intro_points(&intro_points, d) < 0)
+    goto done;
+  crypto_digest(digest, intro_points, strlen(intro_points));
+  if (service->instance_file_written > now - INSTANCE_REFRESH_INTERVAL &&
+      tor_memeq(digest, service->instance_file_digest, DIGEST_LEN))
+    goto done;
+
+  body = rend_service_format_instance_file(service->service_id, now,
+                                           intro_points);
+  if (write_str_to_file(fname, body, 0) < 0) {
+    log_warn(LD_REND, "Couldn't write instance file for service %s.",
+             service->service_id);
+    goto done;
+  }
+  service->instance_file_written = now;
+  memcpy(service->instance_file_digest, digest, DIGEST_LEN);
+
+ done:
+  /* The list doesn't own its intro points. */
+  smartlist_free(d->intro_nodes);
+  tor_free(d);
+  tor_free(intro_points);
+  tor_free(body);
+  tor_free(fname);
+}
+
+/** Read the files that the other instances of <b>service</b> have written
+ * to its instance directory.  If the intro points they list have changed,
+ * remember the new ones and mark our descriptor dirty. */
+static void
+rend_service_read_instance_files(rend_service_t *service, time_t now)
+{
+  smartlist_t *files, *instances;
+  crypto_digest_t *d;
+  char digest[DIGEST_LEN];
+
+  files = tor_listdir(service->instance_dir);
+  if (!files) {
+    log_warn(LD_REND, "Couldn't list instance directory %s.",
+             escaped(service->instance_dir));
+    return;
+  }
+  smartlist_sort_strings(files);
+  instances = smartlist_new();
+  d = crypto_digest_new();
+
+  SMARTLIST_FOREACH_BEGIN(files, const char *, name) {
+    char *fname, *body;
+    const char *intro_points = NULL;
+    smartlist_t *intro_nodes;
+    rend_service_instance_t *inst;
+
+    /* Skip our own file, and temporary files from write_str_to_file(). */
+    if (strlen(name) != REND_INSTANCE_ID_LEN_HEX ||
+        strspn(name, HEX_CHARACTERS) != REND_INSTANCE_ID_LEN_HEX ||
+        !strcmp(name, service->instance_id))
+      continue;
+    fname = rend_service_instance_fname(service, name);
+    body = read_file_to_str(fname, 0, NULL);
+    tor_free(fname);
+    if (!body)
+      continue;
+    intro_nodes = rend_service_parse_instance_file(body, service->service_id,
+                                                   now, &intro_points);
+    if (intro_nodes) {
+      inst = tor_malloc_zero(sizeof(rend_service_instance_t));
+      strlcpy(inst->id, name, sizeof(inst->id));
+      inst->intro_nodes = intro_nodes;
+      smartlist_add(instances, inst);
+      crypto_digest_add_bytes(d, name, strlen(name));
+      crypto_digest_add_bytes(d, intro_points, strlen(intro_points));
+    }
+    tor_free(body);
+  } SMARTLIST_FOREACH_END(name);
+
+  crypto_digest_get_digest(d, digest, DIGEST_LEN);
+  crypto_digest_free(d);
+  SMARTLIST_FOREACH(files, char *, cp, tor_free(cp));
+  smartlist_free(files);
+
+  if (service->instances &&
+      tor_memeq(digest, service->instances_digest, DIGEST_LEN)) {
+    SMARTLIST_FOREACH(instances, rend_service_instance_t *, inst,
+                      rend_service_instance_free(inst));
+    smartlist_free(instances);
+    return;
+  }
+
+  log_info(LD_REND, "Service %s now has %d other instance(s).",
+           service->service_id, smartlist_len(instances));
+  if (service->instances) {
+    SMARTLIST_FOREACH(service->instances, rend_service_instance_t *, inst,
+                      rend_service_instance_free(inst));
+    smartlist_free(service->instances);
+  }
+  service->instances = instances;
+  memcpy(service->instances_digest, digest, DIGEST_LEN);
+  service->desc_is_dirty = now;
+}
+
+/** If <b>service</b> shares an instance directory with other tor
+ * instances and it's time to do so, tell them about our intro points and
+ * learn about theirs. */
+static void
+rend_service_sync_instance_dir(rend_service_t *service, time_t now)
+{
+  if (!service->instance_dir || service->next_instance_sync > now)
+    return;
+  service->next_instance_sync = now + INSTANCE_SYNC_INTERVAL;
+
+  if (check_private_dir(service->instance_dir, CPD_CREATE,
+                        get_options()->User) < 0)
+    return;
+  if (!service->instance_id[0]) {
+    char rand_id[REND_INSTANCE_ID_LEN_HEX/2];
+    crypto_rand(rand_id, sizeof(rand_id));
+    base16_encode(service->instance_id, sizeof(service->instance_id),
+                  rand_id, sizeof(rand_id));
   }
+
+  rend_service_write_instance_file(service, now);
+  rend_service_read_instance_files(service, now);
 }
 
 /** Load and/or generate private keys for all hidden services, possibly
@@ -1433,48 +1847,228 @@ rend_check_authorization(rend_service_t *service,
  * Handle cells
  ******/
 
+/** How many INTRODUCE2 cells per CPU may be waiting for, or sitting in, a
+ * worker thread at once.  Past this, we drop the oldest waiting ones. */
+#define MAX_PENDING_INTROS_PER_CPU 32
+
+/** INTRODUCE2 cells that we've handed to a worker thread and haven't
+ * finished handling yet, oldest first. */
+static smartlist_t *pending_intro_jobs = NULL;
+
+/** Return the number of INTRODUCE2 cells waiting for a worker thread. */
+int
+rend_service_num_pending_intros(void)
+{
+  return pending_intro_jobs ? smartlist_len(pending_intro_jobs) : 0;
+}
+
+/** Release all storage held by <b>job</b>. */
+STATIC void
+rend_intro_job_free(rend_intro_job_t *job)
+{
+  if (!job)
+    return;
+  crypto_pk_free(job->intro_key);
+  rend_service_free_intro(job->parsed_req);
+  if (job->dh)
+    crypto_dh_free(job->dh);
+  tor_free(job->err_msg);
+  memwipe(job, 0, sizeof(*job));
+  tor_free(job);
+}
+
+/** Do the expensive part of handling the INTRODUCE2 cell in <b>job</b>:
+ * decrypt it, parse the plaintext, and do our half of the DH handshake.
+ * Return 0 on success, or -1 and set job-\>stage_descr (and maybe
+ * job-\>err_msg) on failure.
+ *
+ * This runs in a worker thread, so it may only touch <b>job</b>.
+ */
+STATIC int
+rend_service_process_intro_job(rend_intro_job_t *job)
+{
+  rend_intro_cell_t *parsed_req = job->parsed_req;
+
+  job->stage_descr = "decryption";
+  if (rend_service_decrypt_intro(parsed_req, job->intro_key,
+                                 &job->err_msg) < 0)
+    goto err;
+  if (job->err_msg) {
+    log_info(LD_REND, "%s on circ %u.", job->err_msg, job->n_circ_id);
+    tor_free(job->err_msg);
+  }
+
+  job->stage_descr = "late parsing";
+  if (rend_service_parse_intro_plaintext(parsed_req, &job->err_msg) < 0)
+    goto err;
+  if (job->err_msg) {
+    log_info(LD_REND, "%s on circ %u.", job->err_msg, job->n_circ_id);
+    tor_free(job->err_msg);
+  }
+
+  job->stage_descr = "DH handshake";
+  if (!job->dh || crypto_dh_generate_public(job->dh)<0) {
+    job->err_msg = tor_strdup("Internal error: couldn't build DH state "
+                              "or generate public key");
+    goto err;
+  }
+  if (crypto_dh_compute_secret(job->dh_severity, job->dh,
+                               (char *)(parsed_req->dh), DH_KEY_LEN,
+                               job->keys, sizeof(job->keys))<0) {
+    job->err_msg = tor_strdup("Internal error: couldn't complete "
+                              "DH handshake");
+    goto err;
+  }
+
+  job->stage_descr = NULL;
+  job->status = 0;
+  return 0;
+
+ err:
+  job->status = -1;
+  return -1;
+}
+
+/** Try to take <b>job</b> out of the threadpool before a worker thread
+ * picks it up.  Return 1 if we did, 0 if it is already running. */
+MOCK_IMPL(STATIC int,
+rend_intro_job_cancel,(rend_intro_job_t *job))
+{
+  if (!job->workqueue_entry ||
+      !workqueue_entry_cancel(job->workqueue_entry))
+    return 0;
+  job->workqueue_entry = NULL;
+  return 1;
+}
+
+/** Drop the oldest jobs in <b>jobs</b> that no worker thread has started
+ * yet, until there are fewer than <b>max_pending</b> left.  Return 0 if
+ * there is room for another job, or -1 if the only jobs left are already
+ * running. */
+STATIC int
+rend_intro_jobs_make_room(smartlist_t *jobs, int max_pending)
+{
+  static ratelim_t drop_warning_limit = RATELIM_INIT(600);
+  int idx = 0, n_dropped = 0;
+
+  while (smartlist_len(jobs) >= max_pending && idx < smartlist_len(jobs)) {
+    rend_intro_job_t *job = smartlist_get(jobs, idx);
+    if (rend_intro_job_cancel(job)) {
+      smartlist_del_keeporder(jobs, idx);
+      rend_intro_job_free(job);
+      metrics_incr(METRICS_INTRODUCE2_DROPPED);
+      ++n_dropped;
+    } else {
+      /* Already in a worker; try the next oldest one. */
+      ++idx;
+    }
+  }
+  if (n_dropped) {
+    log_fn_ratelim(&drop_warning_limit, LOG_NOTICE, LD_REND,
+                   "Too many INTRODUCE2 cells are waiting for a worker "
+                   "thread; dropped the %d oldest.", n_dropped);
+  }
+  return smartlist_len(jobs) < max_pending ? 0 : -1;
+}
+
+static int rend_service_finish_introduction(rend_intro_job_t *job);
+
+/** Worker thread callback: do the expensive part of an INTRODUCE2 job. */
+static int
+rend_intro_job_threadfn(void *state, void *arg)
+{
+  (void)state;
+  rend_service_process_intro_job(arg);
+  return WQ_RPL_REPLY;
+}
+
+/** Main thread callback: finish an INTRODUCE2 job that a worker thread has
+ * processed. */
+static void
+rend_intro_job_replyfn(void *arg)
+{
+  rend_intro_job_t *job = arg;
+  int idx;
+
+  job->workqueue_entry = NULL;
+  if (pending_intro_jobs &&
+      (idx = smartlist_pos(pending_intro_jobs, job)) >= 0)
+    smartlist_del_keeporder(pending_intro_jobs, idx);
+
+  if (rend_service_finish_introduction(job) < 0)
+    metrics_incr(METRICS_INTRODUCE2_FAILED);
+  else
+    metrics_incr(METRICS_INTRODUCE2_PROCESSED);
+  rend_intro_job_free(job);
+}
+
+/** Try to hand <b>job</b> to a worker thread.  Return 1 if we queued it, 0
+ * if there are no worker threads and the caller should do the work itself,
+ * or -1 if too many jobs are already running and we didn't queue it. */
+static int
+rend_service_queue_intro_job(rend_intro_job_t *job)
+{
+  static int started_workers = 0;
+  int max_pending;
+
+  if (!started_workers) {
+    /* Clients don't usually start any worker threads, but a service wants
+     * them as soon as it has introductions to handle. */
+    cpu_init();
+    started_workers = 1;
+  }
+
+  if (!pending_intro_jobs)
+    pending_intro_jobs = smartlist_new();
+  max_pending = get_num_cpus(get_options()) * MAX_PENDING_INTROS_PER_CPU;
+  if (rend_intro_jobs_make_room(pending_intro_jobs, max_pending) < 0)
+    return -1;
+
+  job->workqueue_entry = cpuworker_queue_work(rend_intro_job_threadfn,
+                                              rend_intro_job_replyfn, job);
+  if (!job->workqueue_entry)
+    return 0;
+  smartlist_add(pending_intro_jobs, job);
+  return 1;
+}
+
+/** Forget every INTRODUCE2 cell that is waiting for a worker thread. */
+static void
+rend_service_free_pending_intros(void)
+{
+  if (!pending_intro_jobs)
+    return;
+  SMARTLIST_FOREACH_BEGIN(pending_intro_jobs, rend_intro_job_t *, job) {
+    /* A running job will still get its reply; it just won't find itself
+     * in the list. */
+    if (rend_intro_job_cancel(job))
+      rend_intro_job_free(job);
+  } SMARTLIST_FOREACH_END(job);
+  smartlist_free(pending_intro_jobs);
+  pending_intro_jobs = NULL;
+}
+
 /** Respond to an INTRODUCE2 cell by launching a circuit to the chosen
  * rendezvous point.
+ *
+ * We check the cell against our replay cache here, then do the expensive
+ * part in a worker thread if we can; rend_service_finish_introduction()
+ * does the rest.
  */
 int
 rend_service_receive_introduction(origin_circuit_t *circuit,
                                   const uint8_t *request,
                                   size_t request_len)
 {
-  /* Global status stuff */
-  int status = 0, result;
-  const or_options_t *options = get_options();
   char *err_msg = NULL;
   const char *stage_descr = NULL;
-  int reason = END_CIRC_REASON_TORPROTOCOL;
-  /* Service/circuit/key stuff we can learn before parsing */
   char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
   rend_service_t *service = NULL;
   rend_intro_point_t *intro_point = NULL;
-  crypto_pk_t *intro_key = NULL;
-  /* Parsed cell */
   rend_intro_cell_t *parsed_req = NULL;
-  /* Rendezvous point */
-  extend_info_t *rp = NULL;
-  /*
-   * We need to look up and construct the extend_info_t for v0 and v1,
-   * but all the info is in the cell and it's constructed by the parser
-   * for v2 and v3, so freeing it would be a double-free.  Use this to
-   * keep track of whether we should free it.
-   */
-  uint8_t need_rp_free = 0;
-  /* XXX not handled yet */
-  char buf[RELAY_PAYLOAD_SIZE];
-  char keys[DIGEST_LEN+CPATH_KEY_MATERIAL_LEN]; /* Holds KH, Df, Db, Kf, Kb */
-  int i;
-  crypto_dh_t *dh = NULL;
-  origin_circuit_t *launched = NULL;
-  crypt_path_t *cpath = NULL;
-  char hexcookie[9];
-  int circ_needs_uptime;
-  time_t now = time(NULL);
+  rend_intro_job_t *job = NULL;
   time_t elapsed;
-  int replay;
+  int replay, status;
 
   /* Do some initial validation and logging before we parse the cell */
   if (circuit->base_.purpose != CIRCUIT_PURPOSE_S_INTRO) {
@@ -1520,12 +2114,6 @@ rend_service_receive_introduction(origin_circuit_t *circuit,
   log_info(LD_REND, "Received INTRODUCE2 cell for service %s on circ %u.",
            escaped(serviceid), (unsigned)circuit->base_.n_circ_id);
 
-  /* use intro key instead of service key. */
-  intro_key = circuit->intro_key;
-
-  tor_free(err_msg);
-  stage_descr = NULL;
-
   stage_descr = "early parsing";
   /* Early parsing pass (get pk, ciphertext); type 2 is INTRODUCE2 */
   parsed_req =
@@ -1538,18 +2126,13 @@ rend_service_receive_introduction(origin_circuit_t *circuit,
     tor_free(err_msg);
   }
 
-  /* make sure service replay caches are present */
-  if (!service->accepted_intro_dh_parts) {
-    service->accepted_intro_dh_parts =
-      replaycache_new(REND_REPLAY_TIME_INTERVAL,
-                      REND_REPLAY_TIME_INTERVAL);
-  }
-
+  /* make sure the intro point's replay cache is present */
   if (!intro_point->accepted_intro_rsa_parts) {
     intro_point->accepted_intro_rsa_parts = replaycache_new(0, 0);
   }
 
-  /* check for replay of PK-encrypted portion. */
+  /* check for replay of PK-encrypted portion.  We do this before queueing
+   * the cell, so that replays never cost us a private-key operation. */
   replay = replaycache_add_test_and_elapsed(
     intro_point->accepted_intro_rsa_parts,
     parsed_req->ciphertext, parsed_req->ciphertext_len,
@@ -1564,26 +2147,125 @@ rend_service_receive_introduction(origin_circuit_t *circuit,
     goto err;
   }
 
-  stage_descr = "decryption";
-  /* Now try to decrypt it */
-  result = rend_service_decrypt_intro(parsed_req, intro_key, &err_msg);
-  if (result < 0) {
-    goto log_error;
-  } else if (err_msg) {
-    log_info(LD_REND, "%s on circ %u.", err_msg,
-             (unsigned)circuit->base_.n_circ_id);
-    tor_free(err_msg);
+  /* Everything that the worker thread needs must be in the job: it can't
+   * look at the circuit, the options, or the service. */
+  job = tor_malloc_zero(sizeof(rend_intro_job_t));
+  job->circ_global_id = circuit->global_identifier;
+  job->n_circ_id = (unsigned)circuit->base_.n_circ_id;
+  /* use intro key instead of service key. */
+  job->intro_key = crypto_pk_dup_key(circuit->intro_key);
+  job->dh_severity = LOG_PROTOCOL_WARN;
+  job->parsed_req = parsed_req;
+  parsed_req = NULL;
+  job->dh = crypto_dh_new(DH_TYPE_REND);
+  note_crypto_pk_op(REND_SERVER);
+
+  switch (rend_service_queue_intro_job(job)) {
+    case 1:
+      /* rend_intro_job_replyfn() will take it from here. */
+      return 0;
+    case 0:
+      rend_service_process_intro_job(job);
+      status = rend_service_finish_introduction(job);
+      if (status < 0)
+        metrics_incr(METRICS_INTRODUCE2_FAILED);
+      else
+        metrics_incr(METRICS_INTRODUCE2_PROCESSED);
+      rend_intro_job_free(job);
+      return status;
+    default:
+      log_info(LD_REND, "Dropping INTRODUCE2 cell on circ %u: every worker "
+               "thread is busy with older ones.",
+               (unsigned)circuit->base_.n_circ_id);
+      metrics_incr(METRICS_INTRODUCE2_DROPPED);
+      rend_intro_job_free(job);
+      return -1;
   }
 
-  stage_descr = "late parsing";
-  /* Parse the plaintext */
-  result = rend_service_parse_intro_plaintext(parsed_req, &err_msg);
-  if (result < 0) {
+ log_error:
+  if (!err_msg) {
+    tor_asprintf(&err_msg,
+                 "unknown %s error for INTRODUCE2", stage_descr);
+  }
+
+  log_warn(LD_REND, "%s on circ %u", err_msg,
+           (unsigned)circuit->base_.n_circ_id);
+ err:
+  tor_free(err_msg);
+  memwipe(serviceid, 0, sizeof(serviceid));
+  rend_service_free_intro(parsed_req);
+  return -1;
+}
+
+/** Finish handling the INTRODUCE2 cell in <b>job</b>, once the expensive
+ * part is done: validate what we decrypted, check it against our DH replay
+ * cache and our authorized clients, and launch a circuit to the chosen
+ * rendezvous point.  Return 0 on success, -1 on failure.
+ */
+static int
+rend_service_finish_introduction(rend_intro_job_t *job)
+{
+  /* Global status stuff */
+  int status = 0, result;
+  const or_options_t *options = get_options();
+  char *err_msg = NULL;
+  const char *stage_descr = NULL;
+  int reason = END_CIRC_REASON_TORPROTOCOL;
+  /* Service/circuit/key stuff */
+  origin_circuit_t *circuit = NULL;
+  char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
+  rend_service_t *service = NULL;
+  rend_intro_point_t *intro_point = NULL;
+  /* Parsed cell */
+  rend_intro_cell_t *parsed_req = job->parsed_req;
+  /* Rendezvous point */
+  extend_info_t *rp = NULL;
+  /*
+   * We need to look up and construct the extend_info_t for v0 and v1,
+   * but all the info is in the cell and it's constructed by the parser
+   * for v2 and v3, so freeing it would be a double-free.  Use this to
+   * keep track of whether we should free it.
+   */
+  uint8_t need_rp_free = 0;
+  int i;
+  origin_circuit_t *launched = NULL;
+  crypt_path_t *cpath = NULL;
+  char hexcookie[9];
+  int circ_needs_uptime;
+  time_t now = time(NULL);
+  time_t elapsed;
+  int replay;
+
+  /* The circuit, the service, or the intro point might have gone away
+   * while a worker thread had the cell. */
+  circuit = circuit_get_by_global_id(job->circ_global_id);
+  if (!circuit || circuit->base_.purpose != CIRCUIT_PURPOSE_S_INTRO) {
+    log_info(LD_REND, "Intro circ %u closed before we finished handling "
+             "its INTRODUCE2 cell. Dropping cell.", job->n_circ_id);
+    goto err;
+  }
+  tor_assert(circuit->rend_data);
+  base32_encode(serviceid, REND_SERVICE_ID_LEN_BASE32+1,
+                circuit->rend_data->rend_pk_digest, REND_SERVICE_ID_LEN);
+  service =
+    rend_service_get_by_pk_digest(circuit->rend_data->rend_pk_digest);
+  if (service) {
+    intro_point = find_intro_point(circuit);
+    if (!intro_point)
+      intro_point = find_expiring_intro_point(service, circuit);
+  }
+  if (!intro_point) {
+    log_info(LD_REND, "Service %s stopped using intro circ %u before we "
+             "finished handling its INTRODUCE2 cell. Dropping cell.",
+             serviceid, job->n_circ_id);
+    goto err;
+  }
+
+  if (job->status < 0) {
+    stage_descr = job->stage_descr;
+    err_msg = job->err_msg;
+    job->err_msg = NULL;
     goto log_error;
-  } else if (err_msg) {
-    log_info(LD_REND, "%s on circ %u.", err_msg,
-             (unsigned)circuit->base_.n_circ_id);
-    tor_free(err_msg);
   }
 
   stage_descr = "late validation";
@@ -1619,11 +2301,17 @@ rend_service_receive_introduction(origin_circuit_t *circuit,
 
   /* Check whether there is a past request with the same Diffie-Hellman,
    * part 1. */
+  if (!service->accepted_intro_dh_parts) {
+    service->accepted_intro_dh_parts =
+      replaycache_new_bounded(REND_REPLAY_TIME_INTERVAL,
+                              REND_REPLAY_TIME_INTERVAL,
+                              REND_REPLAY_MAX_ENTRIES,
+                              REND_REPLAY_MAX_FALSE_POSITIVE_RATE);
+  }
   replay = replaycache_add_test_and_elapsed(
       service->accepted_intro_dh_parts,
       parsed_req->dh, DH_KEY_LEN,
       &elapsed);
-
   if (replay) {
     /* A Tor client will send a new INTRODUCE1 cell with the same rend
      * cookie and DH public key as its previous one if its intro circ
@@ -1661,27 +2349,11 @@ rend_service_receive_introduction(origin_circuit_t *circuit,
     }
   }
 
-  /* Try DH handshake... */
-  dh = crypto_dh_new(DH_TYPE_REND);
-  if (!dh || crypto_dh_generate_public(dh)<0) {
-    log_warn(LD_BUG,"Internal error: couldn't build DH state "
-             "or generate public key.");
-    reason = END_CIRC_REASON_INTERNAL;
-    goto err;
-  }
-  if (crypto_dh_compute_secret(LOG_PROTOCOL_WARN, dh,
-                               (char *)(parsed_req->dh),
-                               DH_KEY_LEN, keys,
-                               DIGEST_LEN+CPATH_KEY_MATERIAL_LEN)<0) {
-    log_warn(LD_BUG, "Internal error: couldn't complete DH handshake");
-    reason = END_CIRC_REASON_INTERNAL;
-    goto err;
-  }
-
   circ_needs_uptime = rend_service_requires_uptime(service);
 
   /* help predict this next time */
   rep_hist_note_used_internal(now, circ_needs_uptime, 1);
+  rep_hist_note_hs_introduction(now);
 
   /* Launch a circuit to alice's chosen rendezvous point.
    */
@@ -1720,15 +2392,14 @@ rend_service_receive_introduction(origin_circuit_t *circuit,
   launched->build_state->service_pending_final_cpath_ref->refcount = 1;
 
   launched->build_state->service_pending_final_cpath_ref->cpath = cpath =
-    tor_malloc_zero(sizeof(crypt_path_t));
-  cpath->magic = CRYPT_PATH_MAGIC;
+    crypt_path_new();
   launched->build_state->expiry_time = now + MAX_REND_TIMEOUT;
 
-  cpath->rend_dh_handshake_state = dh;
-  dh = NULL;
-  if (circuit_init_cpath_crypto(cpath,keys+DIGEST_LEN,1)<0)
+  cpath->rend_dh_handshake_state = job->dh;
+  job->dh = NULL;
+  if (circuit_init_cpath_crypto(cpath,job->keys+DIGEST_LEN,1)<0)
     goto err;
-  memcpy(cpath->rend_circ_nonce, keys, DIGEST_LEN);
+  memcpy(cpath->rend_circ_nonce, job->keys, DIGEST_LEN);
 
   goto done;
 
@@ -1746,21 +2417,16 @@ rend_service_receive_introduction(origin_circuit_t *circuit,
            (unsigned)circuit->base_.n_circ_id);
  err:
   status = -1;
-  if (dh) crypto_dh_free(dh);
   if (launched) {
     circuit_mark_for_close(TO_CIRCUIT(launched), reason);
   }
   tor_free(err_msg);
 
  done:
-  memwipe(keys, 0, sizeof(keys));
-  memwipe(buf, 0, sizeof(buf));
+  memwipe(job->keys, 0, sizeof(job->keys));
   memwipe(serviceid, 0, sizeof(serviceid));
   memwipe(hexcookie, 0, sizeof(hexcookie));
 
-  /* Free the parsed cell */
-  rend_service_free_intro(parsed_req);
-
   /* Free rp if we must */
   if (need_rp_free) extend_info_free(rp);
 
@@ -2333,10 +2999,10 @@ rend_service_decrypt_intro(
     if (err_msg_out) {
       base32_encode(service_id, REND_SERVICE_ID_LEN_BASE32 + 1,
                     (char*)(intro->pk), REND_SERVICE_ID_LEN);
+      /* No escaped() here: we might be in a worker thread. */
       tor_asprintf(&err_msg,
                    "got an INTRODUCE%d cell for the wrong service (%s)",
-                   (int)(intro->type),
-                   escaped(service_id));
+                   (int)(intro->type), service_id);
     }
 
     status = -4;
@@ -2360,7 +3026,6 @@ rend_service_decrypt_intro(
 
   /* Decrypt the encrypted part */
 
-  note_crypto_pk_op(REND_SERVER);
   result =
     crypto_pk_private_hybrid_decrypt(
        key, (char *)buf, sizeof(buf),
@@ -3647,6 +4312,11 @@ rend_consider_services_upload(time_t now)
                               MIN_REND_INITIAL_POST_DELAY_TESTING :
                               MIN_REND_INITIAL_POST_DELAY);
 
+  /* Even an instance that doesn't publish descriptors tells the ones that
+   * do about its intro points. */
+  SMARTLIST_FOREACH(rend_service_list, rend_service_t *, s,
+                    rend_service_sync_instance_dir(s, now));
+
   if (!get_options()->PublishHidServDescriptors)
     return;
 
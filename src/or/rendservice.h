@@ -63,6 +63,66 @@ struct rend_intro_cell_s {
   uint8_t dh[DH_KEY_LEN];
 };
 
+/** An INTRODUCE2 cell whose expensive part (decrypting it and doing our
+ * half of the DH handshake) we do in a worker thread. */
+typedef struct rend_intro_job_t {
+  /* Set in the main thread before the job is queued. */
+  /** Global identifier of the intro circuit that the cell arrived on. */
+  uint32_t circ_global_id;
+  /** That circuit's n_circ_id, for log messages. */
+  unsigned int n_circ_id;
+  /** A reference to the intro point key that the cell is encrypted to. */
+  crypto_pk_t *intro_key;
+  /** Severity for warnings about a bad DH public key. */
+  int dh_severity;
+  /** The cell, parsed as far as we can without decrypting it. */
+  rend_intro_cell_t *parsed_req;
+  /** DH state for our half of the handshake. */
+  crypto_dh_t *dh;
+
+  /* Set by rend_service_process_intro_job(). */
+  /** 0 if the cell decrypted and parsed and the handshake worked; -1 if
+   * not. */
+  int status;
+  /** On failure, the stage that failed, and possibly an error message. */
+  const char *stage_descr;
+  char *err_msg;
+  /** Key material from the handshake: KH, Df, Db, Kf, Kb. */
+  char keys[DIGEST_LEN+CPATH_KEY_MATERIAL_LEN];
+
+  /** The queued work if this job is in the threadpool, else NULL. */
+  struct workqueue_entry_s *workqueue_entry;
+} rend_intro_job_t;
+
+/** Length of the random name that each instance of a service uses for its
+ * file in the service's HiddenServiceInstanceDir. */
+#define REND_INSTANCE_ID_LEN_HEX 16
+
+/** The intro points that one instance of a service has established, as
+ * read from (or about to be written to) its HiddenServiceInstanceDir. */
+typedef struct rend_service_instance_t {
+  /** The instance's file name in the instance directory. */
+  char id[REND_INSTANCE_ID_LEN_HEX+1];
+  /** List of rend_intro_point_t. */
+  smartlist_t *intro_nodes;
+} rend_service_instance_t;
+
+STATIC void rend_service_instance_free(rend_service_instance_t *inst);
+STATIC smartlist_t *rend_service_merge_instance_intro_points(
+                                         smartlist_t *instances, int max);
+STATIC char *rend_service_format_instance_file(const char *service_id,
+                                               time_t published,
+                                               const char *intro_points);
+STATIC smartlist_t *rend_service_parse_instance_file(const char *body,
+                                              const char *service_id,
+                                              time_t now,
+                                              const char **intro_points_out);
+
+STATIC int rend_service_process_intro_job(rend_intro_job_t *job);
+STATIC void rend_intro_job_free(rend_intro_job_t *job);
+STATIC int rend_intro_jobs_make_room(smartlist_t *jobs, int max_pending);
+MOCK_DECL(STATIC int, rend_intro_job_cancel, (rend_intro_job_t *job));
+
 #endif
 
 int num_rend_services(void);
@@ -100,6 +160,7 @@ int rend_service_set_connection_addr_port(edge_connection_t *conn,
                                           origin_circuit_t *circ);
 void rend_service_dump_stats(int severity);
 void rend_service_free_all(void);
+int rend_service_num_pending_intros(void);
 
 rend_service_port_config_t *rend_service_parse_port_config(const char *string,
                                                            const char *sep,
@@ -20,6 +20,7 @@
 #include "router.h"
 #include "routerlist.h"
 #include "ht.h"
+#include "histogram.h"
 
 static void bw_arrays_init(void);
 static void predicted_ports_init(void);
@@ -1837,6 +1838,104 @@ rep_hist_get_predicted_internal(time_t now, int *need_uptime,
   return 1;
 }
 
+/** How many seconds of history we use to estimate how often our hidden
+ * services are accepting introductions. */
+#define HS_INTRO_RATE_WINDOW (5*60)
+/** How many seconds each bucket of that history covers. */
+#define HS_INTRO_RATE_BUCKET_LEN 30
+/** How many buckets of history we keep. */
+#define N_HS_INTRO_RATE_BUCKETS (HS_INTRO_RATE_WINDOW/HS_INTRO_RATE_BUCKET_LEN)
+
+/** Number of introductions our hidden services accepted in each of the last
+ * N_HS_INTRO_RATE_BUCKETS buckets; hs_intro_counts[hs_intro_cur_bucket]
+ * is the one we're filling now. */
+static uint32_t hs_intro_counts[N_HS_INTRO_RATE_BUCKETS];
+/** Index of the bucket we're filling now. */
+static int hs_intro_cur_bucket = 0;
+/** When the bucket we're filling now started, or 0 if we haven't seen any
+ * introductions yet. */
+static time_t hs_intro_cur_bucket_start = 0;
+
+/** Move on to the bucket of introduction history that covers <b>now</b>,
+ * emptying any we skip over. */
+static void
+rep_hist_advance_hs_intro_buckets(time_t now)
+{
+  int n_steps;
+  if (!hs_intro_cur_bucket_start) {
+    hs_intro_cur_bucket_start = now;
+    return;
+  }
+  if (now < hs_intro_cur_bucket_start + HS_INTRO_RATE_BUCKET_LEN)
+    return;
+  n_steps = (int)MIN((now - hs_intro_cur_bucket_start) /
+                     HS_INTRO_RATE_BUCKET_LEN, N_HS_INTRO_RATE_BUCKETS);
+  while (n_steps--) {
+    hs_intro_cur_bucket = (hs_intro_cur_bucket + 1) % N_HS_INTRO_RATE_BUCKETS;
+    hs_intro_counts[hs_intro_cur_bucket] = 0;
+  }
+  hs_intro_cur_bucket_start +=
+    ((now - hs_intro_cur_bucket_start) / HS_INTRO_RATE_BUCKET_LEN) *
+    HS_INTRO_RATE_BUCKET_LEN;
+}
+
+/** Remember that one of our hidden services accepted an introduction at
+ * time <b>now</b>, and so needed a circuit to a rendezvous point. */
+void
+rep_hist_note_hs_introduction(time_t now)
+{
+  rep_hist_advance_hs_intro_buckets(now);
+  if (hs_intro_counts[hs_intro_cur_bucket] < UINT32_MAX)
+    ++hs_intro_counts[hs_intro_cur_bucket];
+}
+
+/** Return how many introductions per second our hidden services have been
+ * accepting lately.  We take the higher of the rate over the last
+ * HS_INTRO_RATE_WINDOW seconds and the rate over the last bucket or two,
+ * so that we notice a burst quickly but forget it slowly. */
+static double
+rep_hist_get_hs_intro_rate(time_t now)
+{
+  uint64_t total = 0, recent;
+  time_t cur_len;
+  int i, prev;
+  double rate, recent_rate;
+
+  if (!hs_intro_cur_bucket_start)
+    return 0.0;
+  rep_hist_advance_hs_intro_buckets(now);
+  for (i = 0; i < N_HS_INTRO_RATE_BUCKETS; ++i)
+    total += hs_intro_counts[i];
+  /* The current bucket has only been filling for cur_len seconds. */
+  cur_len = now - hs_intro_cur_bucket_start + 1;
+  rate = total / (double)(HS_INTRO_RATE_WINDOW - HS_INTRO_RATE_BUCKET_LEN +
+                          cur_len);
+  prev = (hs_intro_cur_bucket + N_HS_INTRO_RATE_BUCKETS - 1) %
+    N_HS_INTRO_RATE_BUCKETS;
+  recent = hs_intro_counts[hs_intro_cur_bucket] + hs_intro_counts[prev];
+  recent_rate = recent / (double)(HS_INTRO_RATE_BUCKET_LEN + cur_len);
+  return MAX(rate, recent_rate);
+}
+
+/** Return how many clean internal circuits our hidden services should keep
+ * built, so that most rendezvous circuits can be cannibalized from one and
+ * need only the final extend to the rendezvous point.  Circuits take about
+ * <b>build_time_msec</b> milliseconds to build.  We keep enough to cover
+ * twice the introductions we expect while replacements are being built,
+ * on top of the handful we've always kept. */
+int
+rep_hist_get_predicted_hs_circs(time_t now, double build_time_msec)
+{
+  const double expected =
+    rep_hist_get_hs_intro_rate(now) * build_time_msec / 1000.0;
+  const double wanted = HS_PREDICTED_CIRCS_MIN + 2 * expected;
+  int n;
+  if (wanted >= HS_PREDICTED_CIRCS_MAX)
+    return HS_PREDICTED_CIRCS_MAX;
+  n = (int) wanted;
+  return n < wanted ? n + 1 : n;
+}
+
 /** Any ports used lately? These are pre-seeded if we just started
  * up or if we're running a hidden service. */
 int
@@ -3165,6 +3264,105 @@ rep_hist_log_link_protocol_counts(void)
              U64_PRINTF_ARG(link_proto_count[4][0]));
 }
 
+/* Cell latency section */
+
+/** For each cell_latency_stage_t, how long cells have waited there since
+ * we started. */
+static histogram_t cell_latency[N_CELL_LATENCY_STAGES];
+/** Copy of cell_latency as of the last heartbeat. */
+static histogram_t cell_latency_at_last_heartbeat[N_CELL_LATENCY_STAGES];
+
+/** Short names for each cell_latency_stage_t. */
+static const char *cell_latency_stage_names[N_CELL_LATENCY_STAGES] = {
+  "circuit-queue", "channel-queue", "outbuf",
+};
+
+/** Return a timestamp to store with a cell so that we can later tell, with
+ * rep_hist_note_cell_latency(), how long it waited.  This uses the cached
+ * event-loop time, so it's cheap; the catch is that waits within a single
+ * pass of the event loop count as zero. */
+uint32_t
+cell_latency_timestamp(void)
+{
+  struct timeval now;
+  tor_gettimeofday_cached_monotonic(&now);
+  return (uint32_t)(((uint64_t)now.tv_sec) * 1000000 + now.tv_usec);
+}
+
+/** Note that a cell which got the timestamp <b>inserted</b> from
+ * cell_latency_timestamp() has just left <b>stage</b>. */
+void
+rep_hist_note_cell_latency(cell_latency_stage_t stage, uint32_t inserted)
+{
+  /* Unsigned subtraction handles the timestamp wrapping around, as long as
+   * no cell waits for more than an hour. */
+  const uint32_t usec = cell_latency_timestamp() - inserted;
+  tor_assert(stage < N_CELL_LATENCY_STAGES);
+  histogram_record(&cell_latency[stage], usec);
+}
+
+/** Helper: append to <b>out</b> a summary of <b>h</b>, in microseconds,
+ * labeled with <b>name</b>. */
+static void
+format_cell_latency_line(smartlist_t *out, const char *name,
+                         const histogram_t *h)
+{
+  smartlist_add_asprintf(out,
+         "%s count="U64_FORMAT" mean=%.0f p50=%u p90=%u p99=%u p999=%u "
+         "max=%u",
+         name, U64_PRINTF_ARG(h->n_values), histogram_get_mean(h),
+         histogram_get_percentile(h, 50.0),
+         histogram_get_percentile(h, 90.0),
+         histogram_get_percentile(h, 99.0),
+         histogram_get_percentile(h, 99.9),
+         h->max);
+}
+
+/** Return a newly allocated string describing how long cells have waited
+ * in each stage since we started, in microseconds, with one line per
+ * stage.  Used for the GETINFO stats/cell-latency command. */
+char *
+rep_hist_get_cell_latency_str(void)
+{
+  smartlist_t *lines = smartlist_new();
+  char *result;
+  int i;
+  for (i = 0; i < N_CELL_LATENCY_STAGES; ++i)
+    format_cell_latency_line(lines, cell_latency_stage_names[i],
+                             &cell_latency[i]);
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Log how long cells have waited in each stage since the last time we
+ * were called. */
+void
+rep_hist_log_cell_latency(void)
+{
+  histogram_t *recent = tor_malloc(sizeof(histogram_t));
+  smartlist_t *lines = smartlist_new();
+  char *msg;
+  int i;
+  for (i = 0; i < N_CELL_LATENCY_STAGES; ++i) {
+    histogram_subtract(recent, &cell_latency[i],
+                       &cell_latency_at_last_heartbeat[i]);
+    if (recent->n_values)
+      format_cell_latency_line(lines, cell_latency_stage_names[i], recent);
+  }
+  memcpy(cell_latency_at_last_heartbeat, cell_latency, sizeof(cell_latency));
+
+  if (smartlist_len(lines)) {
+    msg = smartlist_join_strings(lines, "; ", 0, NULL);
+    log_notice(LD_HEARTBEAT, "Cell latency since last time (usec): %s.", msg);
+    tor_free(msg);
+  }
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  tor_free(recent);
+}
+
 /** Free all storage held by the OR/link history caches, by the
  * bandwidth history arrays, by the port history, or by statistics . */
 void
@@ -3190,5 +3388,11 @@ rep_hist_free_all(void)
   }
   rep_hist_desc_stats_term();
   total_descriptor_downloads = 0;
+  memset(cell_latency, 0, sizeof(cell_latency));
+  memset(cell_latency_at_last_heartbeat, 0,
+         sizeof(cell_latency_at_last_heartbeat));
+  memset(hs_intro_counts, 0, sizeof(hs_intro_counts));
+  hs_intro_cur_bucket = 0;
+  hs_intro_cur_bucket_start = 0;
 }
 
@@ -57,6 +57,13 @@ void rep_hist_note_used_internal(time_t now, int need_uptime,
 int rep_hist_get_predicted_internal(time_t now, int *need_uptime,
                                     int *need_capacity);
 
+/** Fewest clean internal circuits we keep for our hidden services. */
+#define HS_PREDICTED_CIRCS_MIN 3
+/** Most clean internal circuits we keep for our hidden services. */
+#define HS_PREDICTED_CIRCS_MAX 12
+void rep_hist_note_hs_introduction(time_t now);
+int rep_hist_get_predicted_hs_circs(time_t now, double build_time_msec);
+
 int any_predicted_circuits(time_t now);
 int rep_hist_circbuilding_dormant(time_t now);
 
@@ -99,6 +106,25 @@ void rep_hist_note_circuit_handshake_requested(uint16_t type);
 void rep_hist_note_circuit_handshake_assigned(uint16_t type);
 void rep_hist_log_circuit_handshake_stats(time_t now);
 
+/** Places where a cell can wait on its way out of Tor, for latency
+ * measurements. */
+typedef enum {
+  /** Waiting on a circuit's cell queue for the circuitmux to pick it. */
+  CELL_LATENCY_CIRCUIT_QUEUE = 0,
+  /** Waiting on a channel's outgoing queue for its connection to have
+   * room. */
+  CELL_LATENCY_CHANNEL_QUEUE = 1,
+  /** Waiting on an OR connection's outbuf to be written to TLS. */
+  CELL_LATENCY_OUTBUF = 2,
+} cell_latency_stage_t;
+/** Number of cell_latency_stage_t values. */
+#define N_CELL_LATENCY_STAGES 3
+
+uint32_t cell_latency_timestamp(void);
+void rep_hist_note_cell_latency(cell_latency_stage_t stage, uint32_t inserted);
+char *rep_hist_get_cell_latency_str(void);
+void rep_hist_log_cell_latency(void);
+
 void rep_hist_hs_stats_init(time_t now);
 void rep_hist_hs_stats_term(void);
 time_t rep_hist_hs_stats_write(time_t now);
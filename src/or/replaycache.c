@@ -12,19 +12,43 @@
 #include "or.h"
 #include "replaycache.h"
 
+/*
+ * We don't keep digests of what we've seen.  Instead, each entry is a short
+ * fingerprint (a keyed hash of the data, so nobody can pick data that
+ * collides on purpose), and when we last saw it.  Entries live in a ring
+ * of generations; when the current generation is old enough, we throw away
+ * the oldest one in constant time instead of walking the cache.
+ */
+
+/** Smallest number of slots to give a generation. */
+#define REPLAYCACHE_MIN_CAPACITY 16
+
+/** Free the storage held by the generation <b>g</b>, and make it empty. */
+static void
+replaycache_gen_clear(replaycache_gen_t *g)
+{
+  tor_free(g->fps);
+  tor_free(g->seen);
+  g->capacity = g->n_entries = 0;
+}
+
 /** Free the replaycache r and all of its entries.
  */
 
 void
 replaycache_free(replaycache_t *r)
 {
+  int i;
+
   if (!r) {
     log_info(LD_BUG, "replaycache_free() called on NULL");
     return;
   }
 
-  if (r->digests_seen) digestmap_free(r->digests_seen, tor_free_);
+  for (i = 0; i < REPLAYCACHE_MAX_GENERATIONS; ++i)
+    replaycache_gen_clear(&r->gens[i]);
 
+  memwipe(r, 0, sizeof(*r));
   tor_free(r);
 }
 
@@ -35,6 +59,23 @@ replaycache_free(replaycache_t *r)
 
 replaycache_t *
 replaycache_new(time_t horizon, time_t interval)
+{
+  return replaycache_new_bounded(horizon, interval, 0, 0.0);
+}
+
+/** As replaycache_new(), but never hold more than <b>max_entries</b>
+ * entries (if it's nonzero), or one per generation if that's more.  When a
+ * generation fills its share of that,
+ * we drop the oldest generation even if it hasn't reached the horizon yet,
+ * which lets replays of the entries in it through.  If <b>max_entries</b>
+ * is low enough that 32-bit fingerprints would give each lookup at most a
+ * <b>max_false_positive_rate</b> chance of a false hit, use those instead
+ * of 64-bit ones, to save space.
+ */
+
+replaycache_t *
+replaycache_new_bounded(time_t horizon, time_t interval,
+                        size_t max_entries, double max_false_positive_rate)
 {
   replaycache_t *r = NULL;
 
@@ -50,16 +91,147 @@ replaycache_new(time_t horizon, time_t interval)
     interval = 0;
   }
 
-  r = tor_malloc(sizeof(*r));
+  r = tor_malloc_zero(sizeof(*r));
   r->scrub_interval = interval;
   r->scrubbed = 0;
   r->horizon = horizon;
-  r->digests_seen = digestmap_new();
+  r->max_entries = max_entries;
+  crypto_rand((char *)&r->key, sizeof(r->key));
+
+  if (horizon == 0) {
+    /* We never expire anything, so one generation will do. */
+    r->gen_length = 0;
+    r->n_gens = 1;
+  } else {
+    /* Each generation lasts one scrub interval, but we need enough
+     * generations to cover the horizon, and we don't want too many. */
+    r->gen_length = interval;
+    if (r->gen_length <= 0 || r->gen_length > horizon)
+      r->gen_length = horizon;
+    if (CEIL_DIV(horizon, r->gen_length) > REPLAYCACHE_MAX_GENERATIONS - 1)
+      r->gen_length = CEIL_DIV(horizon, REPLAYCACHE_MAX_GENERATIONS - 1);
+    r->n_gens = 1 + (int)CEIL_DIV(horizon, r->gen_length);
+  }
+
+  if (max_entries &&
+      (double)max_entries / 4294967296.0 <= max_false_positive_rate)
+    r->fp_bits = 32;
+  else
+    r->fp_bits = 64;
 
  err:
   return r;
 }
 
+/** Return the number of entries in <b>r</b>, counting any that are in more
+ * than one generation once for each. */
+size_t
+replaycache_size(const replaycache_t *r)
+{
+  size_t n = 0;
+  int i;
+  for (i = 0; i < r->n_gens; ++i)
+    n += r->gens[i].n_entries;
+  return n;
+}
+
+/** Return the fingerprint in slot <b>idx</b> of <b>g</b>. */
+static INLINE uint64_t
+replaycache_gen_get_fp(const replaycache_t *r, const replaycache_gen_t *g,
+                       size_t idx)
+{
+  if (r->fp_bits == 32)
+    return ((const uint32_t *)g->fps)[idx];
+  else
+    return ((const uint64_t *)g->fps)[idx];
+}
+
+/** Return the slot in <b>g</b> that holds <b>fp</b>, or the empty slot
+ * where it would go.  <b>g</b> must have at least one empty slot. */
+static size_t
+replaycache_gen_probe(const replaycache_t *r, const replaycache_gen_t *g,
+                      uint64_t fp)
+{
+  const size_t mask = g->capacity - 1;
+  size_t idx = (size_t)(fp ^ (fp >> 32)) & mask;
+  while (g->seen[idx] && replaycache_gen_get_fp(r, g, idx) != fp)
+    idx = (idx + 1) & mask;
+  return idx;
+}
+
+/** Return when <b>fp</b> was last seen according to <b>g</b>, or -1 if
+ * <b>g</b> doesn't have it. */
+static time_t
+replaycache_gen_lookup(const replaycache_t *r, const replaycache_gen_t *g,
+                       uint64_t fp)
+{
+  size_t idx;
+  if (!g->n_entries)
+    return -1;
+  idx = replaycache_gen_probe(r, g, fp);
+  if (!g->seen[idx])
+    return -1;
+  return r->epoch + g->seen[idx] - 1;
+}
+
+/** Note in <b>g</b> that we saw <b>fp</b> at <b>when</b>. */
+static void
+replaycache_gen_set(replaycache_t *r, replaycache_gen_t *g, uint64_t fp,
+                    time_t when)
+{
+  const size_t fp_size = r->fp_bits / 8;
+  size_t idx;
+  time_t offset = when - r->epoch + 1;
+
+  /* Keep the table at most half full, so that probes stay short. */
+  if ((g->n_entries + 1) * 2 > g->capacity) {
+    replaycache_gen_t bigger;
+    size_t i;
+    bigger.capacity = g->capacity ? g->capacity * 2 : REPLAYCACHE_MIN_CAPACITY;
+    bigger.n_entries = g->n_entries;
+    bigger.fps = tor_calloc(bigger.capacity, fp_size);
+    bigger.seen = tor_calloc(bigger.capacity, sizeof(uint32_t));
+    for (i = 0; i < g->capacity; ++i) {
+      size_t j;
+      uint64_t old_fp;
+      if (!g->seen[i])
+        continue;
+      old_fp = replaycache_gen_get_fp(r, g, i);
+      j = replaycache_gen_probe(r, &bigger, old_fp);
+      memcpy((char *)bigger.fps + j*fp_size, (char *)g->fps + i*fp_size,
+             fp_size);
+      bigger.seen[j] = g->seen[i];
+    }
+    replaycache_gen_clear(g);
+    *g = bigger;
+  }
+
+  if (offset < 1)
+    offset = 1;
+  else if (offset > UINT32_MAX)
+    offset = UINT32_MAX;
+
+  idx = replaycache_gen_probe(r, g, fp);
+  if (!g->seen[idx]) {
+    if (r->fp_bits == 32)
+      ((uint32_t *)g->fps)[idx] = (uint32_t)fp;
+    else
+      ((uint64_t *)g->fps)[idx] = fp;
+    ++g->n_entries;
+  }
+  g->seen[idx] = (uint32_t)offset;
+}
+
+/** Make the oldest generation of <b>r</b> into its current generation,
+ * starting at <b>present</b>, and throw away everything in it. */
+static void
+replaycache_rotate(replaycache_t *r, time_t present)
+{
+  r->cur_gen = (r->cur_gen + 1) % r->n_gens;
+  replaycache_gen_clear(&r->gens[r->cur_gen]);
+  r->scrubbed = present;
+}
+
 /** See documentation for replaycache_add_and_test()
  */
 
@@ -68,9 +240,10 @@ replaycache_add_and_test_internal(
     time_t present, replaycache_t *r, const void *data, size_t len,
     time_t *elapsed)
 {
-  int rv = 0;
-  char digest[DIGEST_LEN];
-  time_t *access_time;
+  static ratelim_t full_warning_limit = RATELIM_INIT(600);
+  int rv = 0, i;
+  uint64_t fp;
+  time_t access_time = -1, t;
 
   /* sanity check */
   if (present <= 0 || !r || !data || len == 0) {
@@ -79,46 +252,68 @@ replaycache_add_and_test_internal(
     goto done;
   }
 
-  /* compute digest */
-  crypto_digest(digest, (const char *)data, len);
+  /* Leave plenty of room in our 32-bit offsets for the clock to go
+   * backwards. */
+  if (!r->epoch)
+    r->epoch = present - INT32_MAX;
+
+  /* drop old generations if it's time */
+  replaycache_scrub_if_needed_internal(present, r);
 
-  /* check map */
-  access_time = digestmap_get(r->digests_seen, digest);
+  /* compute fingerprint */
+  fp = siphash24(data, (unsigned long)len, &r->key);
+  if (r->fp_bits == 32)
+    fp &= UINT32_MAX;
+
+  /* check every generation, and use the latest time we find */
+  for (i = 0; i < r->n_gens; ++i) {
+    t = replaycache_gen_lookup(r, &r->gens[i], fp);
+    if (t > access_time)
+      access_time = t;
+  }
 
   /* seen before? */
-  if (access_time != NULL) {
+  if (access_time >= 0) {
     /*
      * If it's far enough in the past, no hit.  If the horizon is zero, we
      * never expire.
      */
-    if (*access_time >= present - r->horizon || r->horizon == 0) {
+    if (access_time >= present - r->horizon || r->horizon == 0) {
       /* replay cache hit, return 1 */
       rv = 1;
       /* If we want to output an elapsed time, do so */
       if (elapsed) {
-        if (present >= *access_time) {
-          *elapsed = present - *access_time;
+        if (present >= access_time) {
+          *elapsed = present - access_time;
         } else {
           /* We shouldn't really be seeing hits from the future, but... */
           *elapsed = 0;
         }
       }
     }
-    /*
-     * If it's ahead of the cached time, update
-     */
-    if (*access_time < present) {
-      *access_time = present;
-    }
-  } else {
-    /* No, so no hit and update the digest map with the current time */
-    access_time = tor_malloc(sizeof(*access_time));
-    *access_time = present;
-    digestmap_set(r->digests_seen, digest, access_time);
   }
 
-  /* now scrub the cache if it's time */
-  replaycache_scrub_if_needed_internal(present, r);
+  /*
+   * If the current generation has used up its share of max_entries, start
+   * a new one, at the cost of forgetting the oldest one early.  Every
+   * generation gets room for at least one entry, even if max_entries is
+   * smaller than the number of generations.
+   */
+  if (r->max_entries && r->n_gens > 1 &&
+      r->gens[r->cur_gen].n_entries >= MAX(r->max_entries / r->n_gens, 1) &&
+      replaycache_gen_lookup(r, &r->gens[r->cur_gen], fp) < 0) {
+    log_fn_ratelim(&full_warning_limit, LOG_NOTICE, LD_REND,
+                   "Replay cache is full; forgetting entries before they "
+                   "reach its %d-second horizon.", (int)r->horizon);
+    replaycache_rotate(r, present);
+  }
+
+  /*
+   * Note it in the current generation, so that it lasts as long as if we'd
+   * just seen it; but if it's ahead of the present, keep that time.
+   */
+  replaycache_gen_set(r, &r->gens[r->cur_gen], fp,
+                      access_time > present ? access_time : present);
 
  done:
   return rv;
@@ -130,43 +325,43 @@ replaycache_add_and_test_internal(
 STATIC void
 replaycache_scrub_if_needed_internal(time_t present, replaycache_t *r)
 {
-  digestmap_iter_t *itr = NULL;
-  const char *digest;
-  void *valp;
-  time_t *access_time;
+  time_t n_steps;
+  int i;
 
   /* sanity check */
-  if (!r || !(r->digests_seen)) {
+  if (!r) {
     log_info(LD_BUG, "replaycache_scrub_if_needed_internal() called with"
         " stupid parameters; please fix this.");
     return;
   }
 
-  /* scrub time yet? (scrubbed == 0 indicates never scrubbed before) */
-  if (present - r->scrubbed < r->scrub_interval && r->scrubbed > 0) return;
-
   /* if we're never expiring, don't bother scrubbing */
   if (r->horizon == 0) return;
 
-  /* okay, scrub time */
-  itr = digestmap_iter_init(r->digests_seen);
-  while (!digestmap_iter_done(itr)) {
-    digestmap_iter_get(itr, &digest, &valp);
-    access_time = (time_t *)valp;
-    /* aged out yet? */
-    if (*access_time < present - r->horizon) {
-      /* Advance the iterator and remove this one */
-      itr = digestmap_iter_next_rmv(r->digests_seen, itr);
-      /* Free the value removed */
-      tor_free(access_time);
-    } else {
-      /* Just advance the iterator */
-      itr = digestmap_iter_next(r->digests_seen, itr);
-    }
+  /* first time?  start the current generation now. */
+  if (r->scrubbed == 0) {
+    r->scrubbed = present;
+    return;
   }
 
-  /* update scrubbed timestamp */
-  if (present > r->scrubbed) r->scrubbed = present;
+  /* has the current generation run its course yet? */
+  if (present - r->scrubbed < r->gen_length) return;
+
+  n_steps = (present - r->scrubbed) / r->gen_length;
+  if (n_steps >= r->n_gens) {
+    /* Everything we have is past the horizon. */
+    for (i = 0; i < r->n_gens; ++i)
+      replaycache_gen_clear(&r->gens[i]);
+    r->scrubbed = present;
+    return;
+  }
+  /* Each step empties the oldest generation, whose entries are all at
+   * least (n_gens-1)*gen_length >= horizon seconds old. */
+  for (i = 0; i < n_steps; ++i) {
+    r->cur_gen = (r->cur_gen + 1) % r->n_gens;
+    replaycache_gen_clear(&r->gens[r->cur_gen]);
+  }
+  r->scrubbed += n_steps * r->gen_length;
 }
 
 /** Test the buffer of length len point to by data against the replay cache r;
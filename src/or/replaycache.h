@@ -9,24 +9,59 @@
 #ifndef TOR_REPLAYCACHE_H
 #define TOR_REPLAYCACHE_H
 
+#include "siphash.h"
+
 typedef struct replaycache_s replaycache_t;
 
 #ifdef REPLAYCACHE_PRIVATE
 
+/** Largest number of generations that a replay cache will keep. */
+#define REPLAYCACHE_MAX_GENERATIONS 8
+
+/** One generation of a replay cache: an open-addressed hash table of
+ * fingerprints, along with when each was last seen. */
+typedef struct replaycache_gen_t {
+  /** Number of slots; a power of two, or 0 if none are allocated yet. */
+  size_t capacity;
+  /** Number of slots in use. */
+  size_t n_entries;
+  /** Fingerprints: uint32_t or uint64_t, as the cache's fp_bits says. */
+  void *fps;
+  /** When each fingerprint was last seen, as one more than an offset from
+   * the cache's epoch; 0 for an empty slot. */
+  uint32_t *seen;
+} replaycache_gen_t;
+
 struct replaycache_s {
-  /* Scrub interval */
+  /* Scrub interval, as passed to replaycache_new() */
   time_t scrub_interval;
-  /* Last scrubbed */
+  /* Start of the current generation, or 0 if we haven't started one */
   time_t scrubbed;
   /*
    * Horizon
    * (don't return true on digests in the cache but older than this)
    */
   time_t horizon;
+  /* How long each generation lasts; 0 if we never expire entries */
+  time_t gen_length;
+  /* How many generations we keep */
+  int n_gens;
+  /* Index of the current generation in gens */
+  int cur_gen;
   /*
-   * Digest map: keys are digests, values are times the digest was last seen
+   * Generations, newest at cur_gen and older ones before it.  When the
+   * current generation is gen_length old, the oldest one is emptied and
+   * becomes the current one: everything in it is past the horizon.
    */
-  digestmap_t *digests_seen;
+  replaycache_gen_t gens[REPLAYCACHE_MAX_GENERATIONS];
+  /* Most entries to keep, across all generations; 0 for no limit */
+  size_t max_entries;
+  /* Width of the fingerprints we store: 32 or 64 */
+  int fp_bits;
+  /* Secret key for computing fingerprints */
+  struct sipkey key;
+  /* Times in gens are offsets from this */
+  time_t epoch;
 };
 
 #endif /* REPLAYCACHE_PRIVATE */
@@ -35,6 +70,10 @@ struct replaycache_s {
 
 void replaycache_free(replaycache_t *r);
 replaycache_t * replaycache_new(time_t horizon, time_t interval);
+replaycache_t * replaycache_new_bounded(time_t horizon, time_t interval,
+                                        size_t max_entries,
+                                        double max_false_positive_rate);
+size_t replaycache_size(const replaycache_t *r);
 
 #ifdef REPLAYCACHE_PRIVATE
 
@@ -684,6 +684,10 @@ router_initialize_tls_context(void)
     else if (!strcasecmp(options->TLSECGroup, "P224"))
       flags |= TOR_TLS_CTX_USE_ECDHE_P224;
   }
+  if (options->TLSSessionResumption && server_mode(options))
+    flags |= TOR_TLS_CTX_USE_SESSION_TICKETS;
+  if (options->KernelTLS)
+    flags |= TOR_TLS_CTX_USE_KTLS;
   if (!lifetime) { /* we should guess a good ssl cert lifetime */
 
     /* choose between 5 and 365 days, and round to the day */
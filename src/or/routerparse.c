@@ -571,17 +571,96 @@ static int check_signature_token(const char *digest,
 
 #undef DEBUG_AREA_ALLOC
 
+/** Totals of what our memory areas held when we finished with them, by the
+ * type of object we parsed; see routerparse_get_area_stats(). */
+static routerparse_area_stats_t area_stats[N_ROUTERPARSE_AREA_TYPES];
+
+/** Add the memory used by <b>area</b>, which we used to parse an object of
+ * type <b>type</b>, to area_stats.  The area's own peak covers every object
+ * we've parsed with it since we made it, so it's the most that any one of
+ * them needed. */
+static void
+note_area_stats(memarea_t *area, routerparse_area_type_t type)
+{
+  size_t alloc=0, used=0, peak_alloc=0, peak_used=0;
+  routerparse_area_stats_t *st = &area_stats[type];
+  memarea_get_stats(area, &alloc, &used);
+  memarea_get_peak_stats(area, &peak_alloc, &peak_used);
+  ++st->n_parsed;
+  st->bytes_allocated += alloc;
+  st->bytes_used += used;
+  if (peak_alloc > st->peak_allocated)
+    st->peak_allocated = peak_alloc;
+  if (peak_used > st->peak_used)
+    st->peak_used = peak_used;
+}
+
 #ifdef DEBUG_AREA_ALLOC
-#define DUMP_AREA(a,name) STMT_BEGIN                              \
+#define DUMP_AREA(a,type) STMT_BEGIN                              \
   size_t alloc=0, used=0;                                         \
   memarea_get_stats((a),&alloc,&used);                            \
   log_debug(LD_MM, "Area for %s has %lu allocated; using %lu.",   \
-            name, (unsigned long)alloc, (unsigned long)used);     \
+            routerparse_area_type_to_string(type),                \
+            (unsigned long)alloc, (unsigned long)used);           \
+  note_area_stats((a), (type));                                   \
   STMT_END
 #else
-#define DUMP_AREA(a,name) STMT_NIL
+#define DUMP_AREA(a,type) note_area_stats((a), (type))
 #endif
 
+/** Return a human-readable name for the parsed object type <b>type</b>. */
+const char *
+routerparse_area_type_to_string(routerparse_area_type_t type)
+{
+  switch (type) {
+    case ROUTERPARSE_AREA_ROUTERINFO: return "routerinfo";
+    case ROUTERPARSE_AREA_EXTRAINFO: return "extrainfo";
+    case ROUTERPARSE_AREA_AUTHORITY_CERT: return "authority cert";
+    case ROUTERPARSE_AREA_NETWORKSTATUS: return "v3 networkstatus";
+    case ROUTERPARSE_AREA_ROUTERSTATUS: return "routerstatus entry";
+    case ROUTERPARSE_AREA_DETACHED_SIGNATURES: return "detached signatures";
+    case ROUTERPARSE_AREA_POLICY: return "policy item";
+    case ROUTERPARSE_AREA_MICRODESC: return "microdescriptor";
+    default: return "unknown";
+  }
+}
+
+/** Set *<b>out</b> to the totals of how much memory-area space we've used
+ * for parsing directory objects since we started, or since the last call
+ * to routerparse_reset_area_stats().  The peaks are the largest for any
+ * single object. */
+void
+routerparse_get_area_stats(routerparse_area_stats_t *out)
+{
+  int i;
+  memset(out, 0, sizeof(*out));
+  for (i = 0; i < N_ROUTERPARSE_AREA_TYPES; ++i) {
+    const routerparse_area_stats_t *st = &area_stats[i];
+    out->n_parsed += st->n_parsed;
+    out->bytes_allocated += st->bytes_allocated;
+    out->bytes_used += st->bytes_used;
+    out->peak_allocated = MAX(out->peak_allocated, st->peak_allocated);
+    out->peak_used = MAX(out->peak_used, st->peak_used);
+  }
+}
+
+/** As routerparse_get_area_stats(), but only count objects of type
+ * <b>type</b>. */
+void
+routerparse_get_area_stats_by_type(routerparse_area_type_t type,
+                                   routerparse_area_stats_t *out)
+{
+  tor_assert((int)type >= 0 && type < N_ROUTERPARSE_AREA_TYPES);
+  memcpy(out, &area_stats[type], sizeof(*out));
+}
+
+/** Reset the totals returned by routerparse_get_area_stats(). */
+void
+routerparse_reset_area_stats(void)
+{
+  memset(area_stats, 0, sizeof(area_stats));
+}
+
 /** Last time we dumped a descriptor to disk. */
 static time_t last_desc_dumped = 0;
 
@@ -1145,7 +1224,7 @@ router_parse_entry_from_string(const char *s, const char *end,
   while (end > s+2 && *(end-1) == '\n' && *(end-2) == '\n')
     --end;
 
-  area = memarea_new();
+  area = memarea_new_sized(end - s);
   tokens = smartlist_new();
   if (prepend_annotations) {
     if (tokenize_string(area,prepend_annotations,NULL,tokens,
@@ -1645,7 +1724,7 @@ router_parse_entry_from_string(const char *s, const char *end,
   }
   smartlist_free(exit_policy_tokens);
   if (area) {
-    DUMP_AREA(area, "routerinfo");
+    DUMP_AREA(area, ROUTERPARSE_AREA_ROUTERINFO);
     memarea_drop_all(area);
   }
   if (can_dl_again_out)
@@ -1694,7 +1773,7 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
     goto err;
   }
   tokens = smartlist_new();
-  area = memarea_new();
+  area = memarea_new_sized(end - s);
   if (tokenize_string(area,s,end,tokens,extrainfo_token_table,0)) {
     log_warn(LD_DIR, "Error tokenizing extra-info document.");
     goto err;
@@ -1864,7 +1943,7 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
     smartlist_free(tokens);
   }
   if (area) {
-    DUMP_AREA(area, "extrainfo");
+    DUMP_AREA(area, ROUTERPARSE_AREA_EXTRAINFO);
     memarea_drop_all(area);
   }
   if (can_dl_again_out)
@@ -1915,7 +1994,7 @@ authority_cert_parse_from_string(const char *s, const char **end_of_string)
   }
 
   tokens = smartlist_new();
-  area = memarea_new();
+  area = memarea_new_sized(len);
   if (tokenize_string(area,s, eos, tokens, dir_key_certificate_table, 0) < 0) {
     log_warn(LD_DIR, "Error tokenizing key certificate");
     goto err;
@@ -2041,7 +2120,7 @@ authority_cert_parse_from_string(const char *s, const char **end_of_string)
   SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
   smartlist_free(tokens);
   if (area) {
-    DUMP_AREA(area, "authority cert");
+    DUMP_AREA(area, ROUTERPARSE_AREA_AUTHORITY_CERT);
     memarea_drop_all(area);
   }
   return cert;
@@ -2051,7 +2130,7 @@ authority_cert_parse_from_string(const char *s, const char **end_of_string)
   SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
   smartlist_free(tokens);
   if (area) {
-    DUMP_AREA(area, "authority cert");
+    DUMP_AREA(area, ROUTERPARSE_AREA_AUTHORITY_CERT);
     memarea_drop_all(area);
   }
   return NULL;
@@ -2417,7 +2496,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
   smartlist_clear(tokens);
   if (area) {
-    DUMP_AREA(area, "routerstatus entry");
+    DUMP_AREA(area, ROUTERPARSE_AREA_ROUTERSTATUS);
     memarea_clear(area);
   }
   *s = eos;
@@ -2856,8 +2935,8 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
     goto err;
   }
 
-  area = memarea_new();
   end_of_header = find_start_of_next_routerstatus(s);
+  area = memarea_new_sized(end_of_header - s);
   if (tokenize_string(area, s, end_of_header, tokens,
                       (ns_type == NS_TYPE_CONSENSUS) ?
                       networkstatus_consensus_token_table :
@@ -3422,7 +3501,7 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
     smartlist_free(footer_tokens);
   }
   if (area) {
-    DUMP_AREA(area, "v3 networkstatus");
+    DUMP_AREA(area, ROUTERPARSE_AREA_NETWORKSTATUS);
     memarea_drop_all(area);
   }
   if (rs_area)
@@ -3481,7 +3560,7 @@ networkstatus_parse_detached_signatures(const char *s, const char *eos)
   if (!eos)
     eos = s + strlen(s);
 
-  area = memarea_new();
+  area = memarea_new_sized(eos - s);
   if (tokenize_string(area,s, eos, tokens,
                       networkstatus_detached_signature_token_table, 0)) {
     log_warn(LD_DIR, "Error tokenizing detached networkstatus signatures");
@@ -3656,7 +3735,7 @@ networkstatus_parse_detached_signatures(const char *s, const char *eos)
   SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
   smartlist_free(tokens);
   if (area) {
-    DUMP_AREA(area, "detached signatures");
+    DUMP_AREA(area, ROUTERPARSE_AREA_DETACHED_SIGNATURES);
     memarea_drop_all(area);
   }
   return sigs;
@@ -3717,7 +3796,7 @@ router_parse_addr_policy_item_from_string,(const char *s, int assume_action))
  done:
   token_clear(tok);
   if (area) {
-    DUMP_AREA(area, "policy item");
+    DUMP_AREA(area, ROUTERPARSE_AREA_POLICY);
     memarea_drop_all(area);
   }
   return r;
@@ -4592,6 +4671,7 @@ microdescs_parse_from_string(const char *s, const char *eos,
     md = NULL;
 
     SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+    DUMP_AREA(area, ROUTERPARSE_AREA_MICRODESC);
     memarea_clear(area);
     smartlist_clear(tokens);
     s = start_of_next_microdesc;
@@ -84,6 +84,44 @@ int rend_parse_introduction_points(rend_service_descriptor_t *parsed,
                                    size_t intro_points_encoded_size);
 int rend_parse_client_keys(strmap_t *parsed_clients, const char *str);
 
+/** The types of directory object whose memory-area use we keep track of. */
+typedef enum routerparse_area_type_t {
+  ROUTERPARSE_AREA_ROUTERINFO,
+  ROUTERPARSE_AREA_EXTRAINFO,
+  ROUTERPARSE_AREA_AUTHORITY_CERT,
+  /** The header and footer of a networkstatus vote or consensus. */
+  ROUTERPARSE_AREA_NETWORKSTATUS,
+  ROUTERPARSE_AREA_ROUTERSTATUS,
+  ROUTERPARSE_AREA_DETACHED_SIGNATURES,
+  ROUTERPARSE_AREA_POLICY,
+  ROUTERPARSE_AREA_MICRODESC
+} routerparse_area_type_t;
+/** How many values are there in routerparse_area_type_t? */
+#define N_ROUTERPARSE_AREA_TYPES (ROUTERPARSE_AREA_MICRODESC + 1)
+
+/** How much memory-area space we've used for parsing directory objects:
+ * the sums of what memarea_get_stats() reported for each object when we
+ * were done with it. */
+typedef struct routerparse_area_stats_t {
+  /** How many objects we've parsed.  (Each routerstatus entry in a
+   * networkstatus counts separately.) */
+  uint64_t n_parsed;
+  /** Total bytes allocated in their memory areas. */
+  uint64_t bytes_allocated;
+  /** Total bytes actually used in their memory areas. */
+  uint64_t bytes_used;
+  /** Most bytes allocated in the memory area for any one object. */
+  uint64_t peak_allocated;
+  /** Most bytes actually used in the memory area for any one object. */
+  uint64_t peak_used;
+} routerparse_area_stats_t;
+
+const char *routerparse_area_type_to_string(routerparse_area_type_t type);
+void routerparse_get_area_stats(routerparse_area_stats_t *out);
+void routerparse_get_area_stats_by_type(routerparse_area_type_t type,
+                                        routerparse_area_stats_t *out);
+void routerparse_reset_area_stats(void);
+
 #ifdef ROUTERPARSE_PRIVATE
 STATIC int routerstatus_parse_guardfraction(const char *guardfraction_str,
                                             networkstatus_t *vote,
@@ -141,6 +141,8 @@ log_heartbeat(time_t now)
     rep_hist_log_link_protocol_counts();
   }
 
+  rep_hist_log_cell_latency();
+
   circuit_log_ancient_one_hop_circuits(1800);
 
   if (options->BridgeRelay) {
@@ -14,9 +14,18 @@ const char tor_git_revision[] = "";
 
 #include "orconfig.h"
 
+#define TOR_CHANNEL_INTERNAL_
+
 #include "or.h"
+#include "buffers.h"
+#include "channel.h"
+#include "circuitlist.h"
+#include "circuitmux.h"
+#include "circuitmux_ewma.h"
+#include "command.h"
 #include "onion_tap.h"
 #include "relay.h"
+#include "scheduler.h"
 #include <openssl/opensslv.h>
 #include <openssl/evp.h>
 #include <openssl/ec.h>
@@ -24,9 +33,25 @@ const char tor_git_revision[] = "";
 #include <openssl/obj_mac.h>
 
 #include "config.h"
+#include "cpuworker.h"
 #include "crypto_curve25519.h"
+#include "dirvote.h"
+#include "microdesc.h"
+#include "networkstatus.h"
+#include "nodelist.h"
+#include "routerlist.h"
+#include "routerparse.h"
 #include "onion_ntor.h"
 #include "crypto_ed25519.h"
+#include "ht.h"
+#include "oaht.h"
+#include "histogram.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -412,6 +437,15 @@ bench_dmap(void)
   printf("False positive rate on digestset: %.2f%%\n",
          (fp/(double)fpostests)*100);
 
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    SMARTLIST_FOREACH(sl, const char *, cp, digestmap_remove(dm, cp));
+    SMARTLIST_FOREACH(sl, const char *, cp, digestmap_set(dm, cp, (void*)1));
+  }
+  end = perftime();
+  printf("digestmap_remove+digestmap_set: %.2f ns per element\n",
+         NANOCOUNT(start, end, iters*elts));
+
   digestmap_free(dm, NULL);
   digestset_free(ds);
   SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
@@ -420,6 +454,126 @@ bench_dmap(void)
   smartlist_free(sl2);
 }
 
+/** An entry in a [channel, circuit ID] map, laid out like the one in
+ * circuitlist.c.  We keep one chained and one open-addressing table of
+ * these, so that bench_circid_map can compare them. */
+typedef struct bench_circid_ent_t {
+  HT_ENTRY(bench_circid_ent_t) node;
+  OAHT_ENTRY(bench_circid_ent_t) oa_node;
+  void *chan;
+  circid_t circ_id;
+} bench_circid_ent_t;
+
+static INLINE unsigned
+bench_circid_ent_hash(const bench_circid_ent_t *a)
+{
+  uint32_t array[2];
+  array[0] = a->circ_id;
+  array[1] = (uint32_t) (((uintptr_t) a->chan) >> 6);
+  return (unsigned) siphash24g(array, sizeof(array));
+}
+
+static INLINE int
+bench_circid_ent_eq(const bench_circid_ent_t *a, const bench_circid_ent_t *b)
+{
+  return a->chan == b->chan && a->circ_id == b->circ_id;
+}
+
+static HT_HEAD(bench_circid_ht, bench_circid_ent_t) bench_circid_ht =
+  HT_INITIALIZER();
+HT_PROTOTYPE(bench_circid_ht, bench_circid_ent_t, node,
+             bench_circid_ent_hash, bench_circid_ent_eq)
+HT_GENERATE2(bench_circid_ht, bench_circid_ent_t, node,
+             bench_circid_ent_hash, bench_circid_ent_eq, 0.6,
+             tor_reallocarray_, tor_free_)
+
+static OAHT_HEAD(bench_circid_oaht, bench_circid_ent_t) bench_circid_oaht =
+  OAHT_INITIALIZER();
+OAHT_PROTOTYPE(bench_circid_oaht, bench_circid_ent_t, oa_node,
+               bench_circid_ent_hash, bench_circid_ent_eq)
+OAHT_GENERATE2(bench_circid_oaht, bench_circid_ent_t, oa_node,
+               bench_circid_ent_hash, bench_circid_ent_eq, 0.75,
+               tor_reallocarray_, tor_free_)
+
+/** Compare lookups in ht.h and oaht.h tables keyed on [channel, circuit ID],
+ * at a few different numbers of circuits. */
+static void
+bench_circid_map(void)
+{
+  const int sizes[] = { 1000, 10000, 100000, -1 };
+  const int n_chans = 1000;
+  const int lookups = 2000000;
+  char *chans = tor_malloc(n_chans * 1024);
+  int s, i, hits;
+  uint64_t start, end;
+
+  for (s = 0; sizes[s] > 0; ++s) {
+    const int n = sizes[s];
+    bench_circid_ent_t *ents = tor_calloc(n, sizeof(bench_circid_ent_t));
+    bench_circid_ent_t *probes = tor_calloc(n, sizeof(bench_circid_ent_t));
+    for (i = 0; i < n; ++i) {
+      ents[i].chan = chans + 1024 * crypto_rand_int(n_chans);
+      ents[i].circ_id = crypto_rand_int(INT32_MAX);
+      if (HT_FIND(bench_circid_ht, &bench_circid_ht, &ents[i]))
+        continue;
+      HT_INSERT(bench_circid_ht, &bench_circid_ht, &ents[i]);
+      HT_INSERT(bench_circid_oaht, &bench_circid_oaht, &ents[i]);
+    }
+    /* Half the probes hit, and half miss. */
+    for (i = 0; i < n; ++i) {
+      probes[i].chan = ents[crypto_rand_int(n)].chan;
+      probes[i].circ_id = (i & 1) ? ents[i].circ_id :
+        (circid_t) crypto_rand_int(INT32_MAX);
+    }
+
+    reset_perftime();
+    hits = 0;
+    start = perftime();
+    for (i = 0; i < lookups; ++i) {
+      if (HT_FIND(bench_circid_ht, &bench_circid_ht, &probes[i % n]))
+        ++hits;
+    }
+    end = perftime();
+    printf("%6d circuits: ht.h lookup:   %.2f ns (%d hits)\n",
+           n, NANOCOUNT(start, end, lookups), hits);
+
+    hits = 0;
+    start = perftime();
+    for (i = 0; i < lookups; ++i) {
+      if (HT_FIND(bench_circid_oaht, &bench_circid_oaht, &probes[i % n]))
+        ++hits;
+    }
+    end = perftime();
+    printf("%6d circuits: oaht.h lookup: %.2f ns (%d hits)\n",
+           n, NANOCOUNT(start, end, lookups), hits);
+
+    start = perftime();
+    for (i = 0; i < n; ++i) {
+      if (HT_REMOVE(bench_circid_ht, &bench_circid_ht, &ents[i]) == &ents[i])
+        HT_INSERT(bench_circid_ht, &bench_circid_ht, &ents[i]);
+    }
+    end = perftime();
+    printf("%6d circuits: ht.h remove+insert:   %.2f ns\n",
+           n, NANOCOUNT(start, end, n));
+
+    start = perftime();
+    for (i = 0; i < n; ++i) {
+      if (HT_REMOVE(bench_circid_oaht, &bench_circid_oaht, &ents[i]) ==
+          &ents[i])
+        HT_INSERT(bench_circid_oaht, &bench_circid_oaht, &ents[i]);
+    }
+    end = perftime();
+    printf("%6d circuits: oaht.h remove+insert: %.2f ns\n",
+           n, NANOCOUNT(start, end, n));
+
+    HT_CLEAR(bench_circid_ht, &bench_circid_ht);
+    HT_CLEAR(bench_circid_oaht, &bench_circid_oaht);
+    tor_free(ents);
+    tor_free(probes);
+  }
+  tor_free(chans);
+}
+
 static void
 bench_siphash(void)
 {
@@ -453,18 +607,17 @@ bench_cell_ops(void)
   cell_t *cell = tor_malloc(sizeof(cell_t));
   int outbound;
   uint64_t start, end;
+  char keys[CPATH_KEY_MATERIAL_LEN];
 
   crypto_rand((char*)cell->payload, sizeof(cell->payload));
+  crypto_rand(keys, sizeof(keys));
 
   /* Mock-up or_circuit_t */
   or_circ->base_.magic = OR_CIRCUIT_MAGIC;
   or_circ->base_.purpose = CIRCUIT_PURPOSE_OR;
 
   /* Initialize crypto */
-  or_circ->p_crypto = crypto_cipher_new(NULL);
-  or_circ->n_crypto = crypto_cipher_new(NULL);
-  or_circ->p_digest = crypto_digest_new();
-  or_circ->n_digest = crypto_digest_new();
+  relay_crypto_init(&or_circ->crypto, keys, 0);
 
   reset_perftime();
 
@@ -483,14 +636,749 @@ bench_cell_ops(void)
            NANOCOUNT(start,end,iters*CELL_PAYLOAD_SIZE));
   }
 
-  crypto_digest_free(or_circ->p_digest);
-  crypto_digest_free(or_circ->n_digest);
-  crypto_cipher_free(or_circ->p_crypto);
-  crypto_cipher_free(or_circ->n_crypto);
+  relay_crypto_clear(&or_circ->crypto);
   tor_free(or_circ);
   tor_free(cell);
 }
 
+/** Kinds of cell that bench_cell_recv() feeds to the last hop of a
+ * circuit. */
+typedef enum {
+  /** Addressed to the last hop, with a valid digest. */
+  RECV_FOR_US,
+  /** Not addressed to the last hop: 'recognized' is nonzero. */
+  RECV_RELAYED,
+  /** 'recognized' is zero, but the digest doesn't match. */
+  RECV_BAD_DIGEST,
+} recv_cell_kind_t;
+
+/** Fill <b>cells</b> with <b>n</b> cells of type <b>kind</b>, encrypted
+ * as the origin of a circuit using <b>client</b> would send them to the
+ * last hop. */
+static void
+make_recv_cells(relay_crypto_t *client, cell_t *cells, int n,
+                recv_cell_kind_t kind)
+{
+  int i;
+  for (i = 0; i < n; ++i) {
+    uint8_t *payload = cells[i].payload;
+    crypto_rand((char*)payload, CELL_PAYLOAD_SIZE);
+    if (kind == RECV_RELAYED) {
+      set_uint16(payload+1, 0xffff);
+    } else {
+      relay_header_t rh;
+      memset(&rh, 0, sizeof(rh));
+      rh.command = RELAY_COMMAND_DATA;
+      rh.stream_id = 1;
+      rh.length = RELAY_PAYLOAD_SIZE;
+      relay_header_pack(payload, &rh);
+      if (kind == RECV_FOR_US) {
+        crypto_digest_t *d = CRYPTO_DIGEST_IN(&client->f_digest);
+        crypto_digest_add_bytes(d, (char*)payload, CELL_PAYLOAD_SIZE);
+        crypto_digest_get_digest(d, (char*)payload+5, 4);
+      } else {
+        crypto_rand((char*)payload+5, 4);
+      }
+    }
+    crypto_cipher_crypt_inplace(CRYPTO_CIPHER_IN(&client->f_crypto),
+                                (char*)payload, CELL_PAYLOAD_SIZE);
+  }
+}
+
+/** Time how long the last hop of a circuit takes to decrypt incoming relay
+ * cells and decide whether they're addressed to it. */
+static void
+bench_cell_recv(void)
+{
+  const int n_cells = 1<<14;
+  static const char *kind_names[] = { "for us", "relayed", "bad digest" };
+  or_circuit_t *or_circ = tor_malloc_zero(sizeof(or_circuit_t));
+  cell_t *cells = tor_calloc(n_cells, sizeof(cell_t));
+  relay_crypto_t client;
+  char keys[CPATH_KEY_MATERIAL_LEN];
+  uint64_t start, end;
+  int i, kind, n_recognized;
+
+  or_circ->base_.magic = OR_CIRCUIT_MAGIC;
+  or_circ->base_.purpose = CIRCUIT_PURPOSE_OR;
+  memset(&client, 0, sizeof(client));
+
+  reset_perftime();
+
+  for (kind = RECV_FOR_US; kind <= RECV_BAD_DIGEST; ++kind) {
+    crypto_rand(keys, sizeof(keys));
+    relay_crypto_init(&client, keys, 0);
+    relay_crypto_init(&or_circ->crypto, keys, 0);
+    make_recv_cells(&client, cells, n_cells, kind);
+
+    n_recognized = 0;
+    start = perftime();
+    for (i = 0; i < n_cells; ++i) {
+      char recognized = 0;
+      crypt_path_t *layer_hint = NULL;
+      relay_crypt(TO_CIRCUIT(or_circ), &cells[i], CELL_DIRECTION_OUT,
+                  &layer_hint, &recognized);
+      n_recognized += recognized;
+    }
+    end = perftime();
+    printf("Received cells (%s): %.2f ns per cell. (%d/%d recognized)\n",
+           kind_names[kind], NANOCOUNT(start, end, n_cells),
+           n_recognized, n_cells);
+
+    relay_crypto_clear(&client);
+    relay_crypto_clear(&or_circ->crypto);
+  }
+
+  tor_free(or_circ);
+  tor_free(cells);
+}
+
+/** How many cells bench_cell_pipeline() delivers before it lets the
+ * scheduler flush them. */
+#define PIPELINE_BATCH 64
+
+/** State for bench_cell_pipeline(), shared with the fake channel that it
+ * flushes cells to. */
+static struct {
+  /** For each circuit, a ring of the times at which its queued cells
+   * arrived: circuit i's ring starts at arrived[i*PIPELINE_BATCH]. */
+  uint64_t *arrived;
+  /** For each circuit, how many cells have arrived on it, and how many
+   * have been written. */
+  unsigned *n_arrived, *n_written;
+  /** How long each cell spent between arriving and being written. */
+  histogram_t latency;
+  /** Where the outbound channel writes its cells. */
+  buf_t *outbuf;
+} pipeline;
+
+/** write_packed_cell method for the outbound channel of
+ * bench_cell_pipeline(): copy the cell onto our buffer, the way a TLS
+ * channel would copy it onto its connection's outbuf, and note how long
+ * the cell took to get here. */
+static int
+pipeline_write_packed_cell(channel_t *chan, packed_cell_t *packed_cell)
+{
+  circid_t circ_id = get_uint32(packed_cell->body);
+  int idx = (int)ntohl(circ_id) - 1;
+  unsigned slot = pipeline.n_written[idx]++ % PIPELINE_BATCH;
+  uint64_t latency = perftime() - pipeline.arrived[idx*PIPELINE_BATCH+slot];
+
+  write_to_buf(packed_cell->body, get_cell_network_size(chan->wide_circ_ids),
+               pipeline.outbuf);
+  histogram_record(&pipeline.latency,
+                   latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency);
+  packed_cell_free(packed_cell);
+  return 1;
+}
+
+/** write_cell method for bench_cell_pipeline()'s channels.  Only cells
+ * from circuits reach our channels, and those arrive packed, so we never
+ * accept anything here. */
+static int
+pipeline_write_cell(channel_t *chan, cell_t *cell)
+{
+  (void)chan;
+  (void)cell;
+  return 0;
+}
+
+/** write_var_cell method for bench_cell_pipeline()'s channels; as
+ * pipeline_write_cell(). */
+static int
+pipeline_write_var_cell(channel_t *chan, var_cell_t *var_cell)
+{
+  (void)chan;
+  (void)var_cell;
+  return 0;
+}
+
+/** num_cells_writeable method for bench_cell_pipeline()'s channels: we can
+ * always take as many cells as the scheduler wants to give us. */
+static int
+pipeline_num_cells_writeable(channel_t *chan)
+{
+  (void)chan;
+  return PIPELINE_BATCH;
+}
+
+/** num_bytes_queued method for bench_cell_pipeline()'s channels.  We
+ * empty pipeline.outbuf after every run of the scheduler, as if the
+ * network took everything at once, so we never have anything queued. */
+static size_t
+pipeline_num_bytes_queued(channel_t *chan)
+{
+  (void)chan;
+  return 0;
+}
+
+/** get_remote_descr method for bench_cell_pipeline()'s channels. */
+static const char *
+pipeline_get_remote_descr(channel_t *chan, int flags)
+{
+  (void)chan;
+  (void)flags;
+  return "benchmark channel";
+}
+
+/** Return a new open channel for bench_cell_pipeline() that writes cells
+ * to pipeline.outbuf. */
+static channel_t *
+pipeline_channel_new(void)
+{
+  channel_t *chan = tor_malloc_zero(sizeof(channel_t));
+  channel_init(chan);
+  chan->state = CHANNEL_STATE_OPEN;
+  chan->wide_circ_ids = 1;
+  chan->get_remote_descr = pipeline_get_remote_descr;
+  chan->num_bytes_queued = pipeline_num_bytes_queued;
+  chan->num_cells_writeable = pipeline_num_cells_writeable;
+  chan->write_cell = pipeline_write_cell;
+  chan->write_packed_cell = pipeline_write_packed_cell;
+  chan->write_var_cell = pipeline_write_var_cell;
+  chan->cmux = circuitmux_alloc();
+  if (cell_ewma_enabled())
+    circuitmux_set_policy(chan->cmux, &ewma_policy);
+  return chan;
+}
+
+/** Release all storage held by <b>chan</b>, a channel from
+ * pipeline_channel_new(). */
+static void
+pipeline_channel_free(channel_t *chan)
+{
+  circuitmux_detach_all_circuits(chan->cmux, NULL);
+  circuitmux_free(chan->cmux);
+  tor_free(chan);
+}
+
+/** Time the whole path that a relay cell takes through a middle relay:
+ * command_process_cell() and circuit_receive_relay_cell() on the way in,
+ * then the circuitmux and the scheduler on the way out, ending with the
+ * cell on an output buffer.  Cells arrive in batches of PIPELINE_BATCH,
+ * spread over all the circuits; after each batch, we run the scheduler.
+ * So a cell's latency includes the time it waits for the rest of its
+ * batch to arrive. */
+static void
+bench_cell_pipeline(void)
+{
+  static const int circ_counts[] = { 1, 16, 256, 4096 };
+  const int n_cells = 1<<17;
+  tor_libevent_cfg cfg;
+  char keys[CPATH_KEY_MATERIAL_LEN];
+  cell_t cell, template_cell;
+  or_options_t *options = get_options_mutable();
+  unsigned i;
+
+  /* We never validated our options, so we have no memory limit: make sure
+   * that the OOM handler stays out of the way. */
+  options->MaxMemInQueues = options->MaxMemInQueues_low_threshold =
+    UINT64_MAX;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  scheduler_init();
+  cell_ewma_set_scale_factor(get_options(), NULL);
+  pipeline.outbuf = buf_new();
+  /* A random payload decrypts to a cell that isn't for us, so we relay
+   * it. */
+  memset(&template_cell, 0, sizeof(template_cell));
+  template_cell.command = CELL_RELAY;
+  crypto_rand((char*)template_cell.payload, sizeof(template_cell.payload));
+
+  for (i = 0; i < ARRAY_LENGTH(circ_counts); ++i) {
+    const int n_circs = circ_counts[i];
+    channel_t *in_chan = pipeline_channel_new();
+    channel_t *out_chan = pipeline_channel_new();
+    uint64_t start, end;
+    int j;
+
+    pipeline.arrived = tor_calloc(n_circs * PIPELINE_BATCH,
+                                  sizeof(uint64_t));
+    pipeline.n_arrived = tor_calloc(n_circs, sizeof(unsigned));
+    pipeline.n_written = tor_calloc(n_circs, sizeof(unsigned));
+    histogram_clear(&pipeline.latency);
+
+    for (j = 0; j < n_circs; ++j) {
+      or_circuit_t *or_circ = or_circuit_new(j+1, in_chan);
+      or_circ->base_.state = CIRCUIT_STATE_OPEN;
+      or_circ->base_.purpose = CIRCUIT_PURPOSE_OR;
+      crypto_rand(keys, sizeof(keys));
+      relay_crypto_init(&or_circ->crypto, keys, 0);
+      circuit_set_n_circid_chan(TO_CIRCUIT(or_circ), j+1, out_chan);
+    }
+    scheduler_channel_wants_writes(out_chan);
+
+    reset_perftime();
+    start = perftime();
+    for (j = 0; j < n_cells; ++j) {
+      int idx = j % n_circs;
+      unsigned slot = pipeline.n_arrived[idx]++ % PIPELINE_BATCH;
+      memcpy(&cell, &template_cell, sizeof(cell));
+      cell.circ_id = idx+1;
+      pipeline.arrived[idx*PIPELINE_BATCH+slot] = perftime();
+      command_process_cell(in_chan, &cell);
+      if ((j+1) % PIPELINE_BATCH == 0) {
+        scheduler_run();
+        buf_clear(pipeline.outbuf);
+      }
+    }
+    end = perftime();
+
+    printf("%4d circuits: %.2f ns per cell (%.0f cells/sec); "
+           "latency p50 %u ns, p99 %u ns. (%d/%d written)\n",
+           n_circs, NANOCOUNT(start, end, n_cells),
+           1e9 / NANOCOUNT(start, end, n_cells),
+           histogram_get_percentile(&pipeline.latency, 50.0),
+           histogram_get_percentile(&pipeline.latency, 99.0),
+           (int)pipeline.latency.n_values, n_cells);
+
+    circuit_free_all();
+    pipeline_channel_free(in_chan);
+    pipeline_channel_free(out_chan);
+    tor_free(pipeline.arrived);
+    tor_free(pipeline.n_arrived);
+    tor_free(pipeline.n_written);
+  }
+
+  buf_free(pipeline.outbuf);
+  scheduler_free_all();
+}
+
+/* Example keys from test_data.c.  They're 1024 bits long, as relay keys
+ * must be. */
+extern const char AUTHORITY_SIGNKEY_1[];
+extern const char AUTHORITY_SIGNKEY_2[];
+extern const char AUTHORITY_SIGNKEY_3[];
+
+/** How many relays the documents from make_dir_corpus() describe: about as
+ * many as the real network has. */
+#define DIRPARSE_N_RELAYS 7000
+/** How many times bench_dirparse() repeats each measurement. */
+#define DIRPARSE_ITERS 5
+
+/** A synthetic set of directory documents, all describing the same relays;
+ * see make_dir_corpus(). */
+typedef struct dir_corpus_t {
+  /** The authority's identity key. */
+  crypto_pk_t *auth_id_key;
+  /** The authority's signing key. */
+  crypto_pk_t *auth_signing_key;
+  /** The identity, signing, and onion key for every relay. */
+  crypto_pk_t *relay_key;
+  /** The authority's key certificate. */
+  char *cert;
+  /** A microdescriptor-flavored consensus, signed by the authority. */
+  char *consensus;
+  /** The microdescriptors for every relay in the consensus. */
+  char *microdescs;
+  /** A signed router descriptor for every relay. */
+  char *descriptors;
+} dir_corpus_t;
+
+/** Return a new crypto_pk_t holding the PEM-encoded private key
+ * <b>s</b>. */
+static crypto_pk_t *
+load_private_key(const char *s)
+{
+  crypto_pk_t *pk = crypto_pk_new();
+  int r = crypto_pk_read_private_key_from_string(pk, s, -1);
+  tor_assert(r == 0);
+  return pk;
+}
+
+/** Return a newly allocated PEM encoding of the public part of <b>pk</b>,
+ * ending with a newline. */
+static char *
+public_key_to_string(crypto_pk_t *pk)
+{
+  char *s = NULL;
+  size_t len;
+  int r = crypto_pk_write_public_key_to_string(pk, &s, &len);
+  tor_assert(r == 0);
+  return s;
+}
+
+/** Return a newly allocated key certificate for the authority with identity
+ * key <b>id_key</b> and signing key <b>signing_key</b>, valid around
+ * <b>now</b>.  This is what tor-gencert would make. */
+static char *
+make_authority_cert(crypto_pk_t *id_key, crypto_pk_t *signing_key,
+                    time_t now)
+{
+  smartlist_t *chunks = smartlist_new();
+  char published[ISO_TIME_LEN+1], expires[ISO_TIME_LEN+1];
+  char fingerprint[FINGERPRINT_LEN+1];
+  char id_digest[DIGEST_LEN], digest[DIGEST_LEN];
+  char sig[1024], sig64[2048];
+  char *id_pem = public_key_to_string(id_key);
+  char *signing_pem = public_key_to_string(signing_key);
+  char *cert;
+  int r;
+
+  crypto_pk_get_fingerprint(id_key, fingerprint, 0);
+  crypto_pk_get_digest(id_key, id_digest);
+  format_iso_time(published, now - 86400);
+  format_iso_time(expires, now + 365*86400);
+  smartlist_add_asprintf(chunks,
+                         "dir-key-certificate-version 3\n"
+                         "fingerprint %s\n"
+                         "dir-key-published %s\n"
+                         "dir-key-expires %s\n"
+                         "dir-identity-key\n%s"
+                         "dir-signing-key\n%s"
+                         "dir-key-crosscert\n"
+                         "-----BEGIN ID SIGNATURE-----\n",
+                         fingerprint, published, expires,
+                         id_pem, signing_pem);
+
+  r = crypto_pk_private_sign(signing_key, sig, sizeof(sig),
+                             id_digest, DIGEST_LEN);
+  tor_assert(r > 0);
+  base64_encode(sig64, sizeof(sig64), sig, r, BASE64_ENCODE_MULTILINE);
+  smartlist_add_asprintf(chunks,
+                         "%s-----END ID SIGNATURE-----\n"
+                         "dir-key-certification\n", sig64);
+
+  crypto_digest_smartlist(digest, DIGEST_LEN, chunks, "", DIGEST_SHA1);
+  smartlist_add(chunks,
+                router_get_dirobj_signature(digest, DIGEST_LEN, id_key));
+
+  cert = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(id_pem);
+  tor_free(signing_pem);
+  return cert;
+}
+
+/** Return a newly allocated microdescriptor for a relay whose onion key
+ * has the PEM encoding <b>onion_pem</b> and whose ntor key has the base64
+ * encoding <b>ntor64</b>.  If <b>is_exit</b>, it allows web traffic. */
+static char *
+make_microdesc(const char *onion_pem, const char *ntor64, int is_exit)
+{
+  char *md;
+  tor_asprintf(&md,
+               "onion-key\n%s"
+               "ntor-onion-key %s\n"
+               "p %s\n",
+               onion_pem, ntor64,
+               is_exit ? "accept 80,443" : "reject 1-65535");
+  return md;
+}
+
+/** qsort comparison function for DIGEST_LEN-byte digests. */
+static int
+compare_digests(const void *a, const void *b)
+{
+  return fast_memcmp(a, b, DIGEST_LEN);
+}
+
+/** Fill in <b>corpus</b> with keys, a certificate, and documents describing
+ * <b>n_relays</b> relays, as they might look at <b>now</b>.  Every fourth
+ * relay is an exit. */
+static void
+make_dir_corpus(dir_corpus_t *corpus, int n_relays, time_t now)
+{
+  smartlist_t *consensus = smartlist_new();
+  smartlist_t *mds = smartlist_new();
+  smartlist_t *descs = smartlist_new();
+  char *ids = tor_calloc(n_relays, DIGEST_LEN);
+  char published[ISO_TIME_LEN+1], valid_after[ISO_TIME_LEN+1];
+  char fresh_until[ISO_TIME_LEN+1], valid_until[ISO_TIME_LEN+1];
+  char auth_fp[FINGERPRINT_LEN+1], signing_fp[FINGERPRINT_LEN+1];
+  char relay_fp[FINGERPRINT_LEN+1], vote_digest[DIGEST_LEN];
+  char digest[DIGEST256_LEN];
+  char *relay_pem;
+  int i;
+
+  tor_assert(n_relays <= 65536);
+  corpus->auth_id_key = load_private_key(AUTHORITY_SIGNKEY_2);
+  corpus->auth_signing_key = load_private_key(AUTHORITY_SIGNKEY_1);
+  corpus->relay_key = load_private_key(AUTHORITY_SIGNKEY_3);
+  corpus->cert = make_authority_cert(corpus->auth_id_key,
+                                     corpus->auth_signing_key, now);
+  relay_pem = public_key_to_string(corpus->relay_key);
+  crypto_pk_get_fingerprint(corpus->auth_id_key, auth_fp, 0);
+  crypto_pk_get_fingerprint(corpus->auth_signing_key, signing_fp, 0);
+  crypto_pk_get_fingerprint(corpus->relay_key, relay_fp, 1);
+
+  format_iso_time(published, now - 3600);
+  format_iso_time(valid_after, now - 600);
+  format_iso_time(fresh_until, now + 3000);
+  format_iso_time(valid_until, now + 10200);
+  crypto_rand(vote_digest, sizeof(vote_digest));
+  smartlist_add_asprintf(consensus,
+                         "network-status-version 3 microdesc\n"
+                         "vote-status consensus\n"
+                         "consensus-method 20\n"
+                         "valid-after %s\n"
+                         "fresh-until %s\n"
+                         "valid-until %s\n"
+                         "voting-delay 300 300\n"
+                         "client-versions 0.2.7.2-alpha\n"
+                         "server-versions 0.2.7.2-alpha\n"
+                         "known-flags Authority BadExit Exit Fast Guard HSDir "
+                         "Running Stable V2Dir Valid\n"
+                         "dir-source benchauth %s 127.0.0.1 127.0.0.1 80 443\n"
+                         "contact bench@example.com\n"
+                         "vote-digest %s\n",
+                         valid_after, fresh_until, valid_until,
+                         auth_fp, hex_str(vote_digest, DIGEST_LEN));
+
+  /* Routerstatus entries must be sorted by identity. */
+  crypto_rand(ids, n_relays * DIGEST_LEN);
+  qsort(ids, n_relays, DIGEST_LEN, compare_digests);
+
+  for (i = 0; i < n_relays; ++i) {
+    const int is_exit = (i % 4) == 0;
+    char ntor_key[DIGEST256_LEN], ntor64[BASE64_DIGEST256_LEN+1];
+    char md_digest64[BASE64_DIGEST256_LEN+1], id64[BASE64_DIGEST_LEN+1];
+    char addr[32];
+    char *md, *desc;
+    size_t desc_len;
+
+    tor_snprintf(addr, sizeof(addr), "198.18.%d.%d", i >> 8, i & 255);
+    crypto_rand(ntor_key, sizeof(ntor_key));
+    digest256_to_base64(ntor64, ntor_key);
+
+    md = make_microdesc(relay_pem, ntor64, is_exit);
+    crypto_digest256(digest, md, strlen(md), DIGEST_SHA256);
+    digest256_to_base64(md_digest64, digest);
+    smartlist_add(mds, md);
+
+    digest_to_base64(id64, ids + i*DIGEST_LEN);
+    smartlist_add_asprintf(consensus,
+                           "r bench%d %s %s %s 9001 0\n"
+                           "m %s\n"
+                           "s %sFast Guard Running Stable Valid\n"
+                           "v Tor 0.2.7.2-alpha\n"
+                           "w Bandwidth=%d\n",
+                           i, id64, published, addr,
+                           md_digest64,
+                           is_exit ? "Exit " : "",
+                           1000 + (i % 100) * 100);
+
+    tor_asprintf(&desc,
+                 "router bench%d %s 9001 0 0\n"
+                 "platform Tor 0.2.7.2-alpha on Linux\n"
+                 "protocols Link 1 2 Circuit 1\n"
+                 "published %s\n"
+                 "fingerprint %s\n"
+                 "uptime 86400\n"
+                 "bandwidth 1048576 2097152 %d\n"
+                 "onion-key\n%s"
+                 "signing-key\n%s"
+                 "ntor-onion-key %s\n"
+                 "%s"
+                 "router-signature\n",
+                 i, addr, published, relay_fp,
+                 1000000 + (i % 100) * 100000,
+                 relay_pem, relay_pem, ntor64,
+                 is_exit ? "accept *:80\naccept *:443\nreject *:*\n"
+                         : "reject *:*\n");
+    desc_len = strlen(desc);
+    router_get_router_hash(desc, desc_len, digest);
+    smartlist_add(descs, desc);
+    smartlist_add(descs, router_get_dirobj_signature(digest, DIGEST_LEN,
+                                                     corpus->relay_key));
+  }
+
+  /* The signature covers everything up through the space after
+   * "directory-signature". */
+  smartlist_add(consensus, tor_strdup("directory-footer\n"
+                                      "directory-signature "));
+  crypto_digest_smartlist(digest, DIGEST256_LEN, consensus, "",
+                          DIGEST_SHA256);
+  smartlist_add_asprintf(consensus, "sha256 %s %s\n", auth_fp, signing_fp);
+  smartlist_add(consensus,
+                router_get_dirobj_signature(digest, DIGEST256_LEN,
+                                            corpus->auth_signing_key));
+
+  corpus->consensus = smartlist_join_strings(consensus, "", 0, NULL);
+  corpus->microdescs = smartlist_join_strings(mds, "", 0, NULL);
+  corpus->descriptors = smartlist_join_strings(descs, "", 0, NULL);
+
+  SMARTLIST_FOREACH(consensus, char *, cp, tor_free(cp));
+  SMARTLIST_FOREACH(mds, char *, cp, tor_free(cp));
+  SMARTLIST_FOREACH(descs, char *, cp, tor_free(cp));
+  smartlist_free(consensus);
+  smartlist_free(mds);
+  smartlist_free(descs);
+  tor_free(relay_pem);
+  tor_free(ids);
+}
+
+/** Release all storage held in <b>corpus</b>. */
+static void
+dir_corpus_clear(dir_corpus_t *corpus)
+{
+  crypto_pk_free(corpus->auth_id_key);
+  crypto_pk_free(corpus->auth_signing_key);
+  crypto_pk_free(corpus->relay_key);
+  tor_free(corpus->cert);
+  tor_free(corpus->consensus);
+  tor_free(corpus->microdescs);
+  tor_free(corpus->descriptors);
+}
+
+/** Print how much memory-area space each of the last <b>iters</b> parses
+ * used, and reset the counts. */
+static void
+print_area_stats(int iters)
+{
+  routerparse_area_stats_t stats;
+  routerparse_get_area_stats(&stats);
+  printf("    memory areas: %d objects; %.1f KB allocated, %.1f KB used; "
+         "largest used %.1f KB\n",
+         (int)(stats.n_parsed / iters),
+         U64_TO_DBL(stats.bytes_allocated) / iters / 1024,
+         U64_TO_DBL(stats.bytes_used) / iters / 1024,
+         U64_TO_DBL(stats.peak_used) / 1024);
+  routerparse_reset_area_stats();
+}
+
+/** Time the directory work that a client does when it bootstraps: parsing
+ * and checking a consensus, microdescriptors, and descriptors, then
+ * building the nodelist and deciding whether it has enough to build
+ * circuits. */
+static void
+bench_dirparse(void)
+{
+  dir_corpus_t corpus;
+  const time_t now = time(NULL);
+  authority_cert_t *cert;
+  networkstatus_t *ns = NULL;
+  smartlist_t *lst;
+  uint64_t start, end;
+  int i, r = 0;
+
+  memset(&corpus, 0, sizeof(corpus));
+  make_dir_corpus(&corpus, DIRPARSE_N_RELAYS, now);
+  printf("%d relays. Consensus: %d KB; microdescriptors: %d KB; "
+         "descriptors: %d KB\n", DIRPARSE_N_RELAYS,
+         (int)(strlen(corpus.consensus) / 1024),
+         (int)(strlen(corpus.microdescs) / 1024),
+         (int)(strlen(corpus.descriptors) / 1024));
+
+  reset_perftime();
+  routerparse_reset_area_stats();
+
+  start = perftime();
+  for (i = 0; i < DIRPARSE_ITERS; ++i) {
+    cert = authority_cert_parse_from_string(corpus.cert, NULL);
+    tor_assert(cert);
+    authority_cert_free(cert);
+  }
+  end = perftime();
+  printf("Authority certificate: %.2f usec to parse and check\n",
+         MICROCOUNT(start, end, DIRPARSE_ITERS));
+  print_area_stats(DIRPARSE_ITERS);
+
+  start = perftime();
+  for (i = 0; i < DIRPARSE_ITERS; ++i) {
+    networkstatus_vote_free(ns);
+    ns = networkstatus_parse_vote_from_string(corpus.consensus, NULL,
+                                              NS_TYPE_CONSENSUS);
+    tor_assert(ns);
+  }
+  end = perftime();
+  printf("Consensus: %.2f msec to parse\n",
+         MICROCOUNT(start, end, DIRPARSE_ITERS) / 1000);
+  print_area_stats(DIRPARSE_ITERS);
+
+  cert = authority_cert_parse_from_string(corpus.cert, NULL);
+  start = perftime();
+  for (i = 0; i < DIRPARSE_ITERS; ++i) {
+    SMARTLIST_FOREACH_BEGIN(ns->voters, networkstatus_voter_info_t *, v) {
+      SMARTLIST_FOREACH_BEGIN(v->sigs, document_signature_t *, sig) {
+        sig->good_signature = sig->bad_signature = 0;
+        r = networkstatus_check_document_signature(ns, sig, cert);
+        tor_assert(r == 0 && sig->good_signature);
+      } SMARTLIST_FOREACH_END(sig);
+    } SMARTLIST_FOREACH_END(v);
+  }
+  end = perftime();
+  printf("Consensus: %.2f usec to check signatures\n",
+         MICROCOUNT(start, end, DIRPARSE_ITERS));
+  networkstatus_vote_free(ns);
+
+  start = perftime();
+  for (i = 0; i < DIRPARSE_ITERS; ++i) {
+    lst = microdescs_parse_from_string(corpus.microdescs, NULL, 0,
+                                       SAVED_NOWHERE, NULL);
+    tor_assert(smartlist_len(lst) == DIRPARSE_N_RELAYS);
+    SMARTLIST_FOREACH(lst, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(lst);
+  }
+  end = perftime();
+  printf("Microdescriptors: %.2f msec to parse\n",
+         MICROCOUNT(start, end, DIRPARSE_ITERS) / 1000);
+  print_area_stats(DIRPARSE_ITERS);
+
+  start = perftime();
+  for (i = 0; i < DIRPARSE_ITERS; ++i) {
+    const char *s = corpus.descriptors;
+    lst = smartlist_new();
+    router_parse_list_from_string(&s, NULL, lst, SAVED_NOWHERE, 0, 0,
+                                  NULL, NULL);
+    tor_assert(smartlist_len(lst) == DIRPARSE_N_RELAYS);
+    SMARTLIST_FOREACH(lst, routerinfo_t *, ri, routerinfo_free(ri));
+    smartlist_free(lst);
+  }
+  end = perftime();
+  printf("Descriptors: %.2f msec to parse and check signatures\n",
+         MICROCOUNT(start, end, DIRPARSE_ITERS) / 1000);
+  print_area_stats(DIRPARSE_ITERS);
+
+  /* Now make our authority the only one we trust, and load everything the
+   * way we would from our cache. */
+  clear_dir_servers();
+  dir_server_add(trusted_dir_server_new("benchauth", "127.0.0.1", 80, 443,
+                                        cert->cache_info.identity_digest,
+                                        cert->cache_info.identity_digest,
+                                        V3_DIRINFO, 1.0));
+  r = trusted_dirs_load_certs_from_string(corpus.cert,
+                                          TRUSTED_DIRS_CERTS_SRC_FROM_STORE,
+                                          0);
+  tor_assert(r == 0);
+  lst = microdescs_add_to_cache(get_microdesc_cache(), corpus.microdescs,
+                                NULL, SAVED_NOWHERE, 1, now, NULL);
+  smartlist_free(lst);
+  start = perftime();
+  r = networkstatus_set_current_consensus(corpus.consensus, "microdesc",
+                                          NSSET_FROM_CACHE |
+                                          NSSET_DONT_DOWNLOAD_CERTS);
+  end = perftime();
+  tor_assert(r == 0);
+  printf("Consensus: %.2f msec to parse, check, and install\n",
+         MICROCOUNT(start, end, 1) / 1000);
+  routerparse_reset_area_stats();
+
+  start = perftime();
+  for (i = 0; i < DIRPARSE_ITERS; ++i) {
+    nodelist_free_all();
+    nodelist_set_consensus(networkstatus_get_latest_consensus(), NULL);
+  }
+  end = perftime();
+  printf("Nodelist: %.2f msec to rebuild\n",
+         MICROCOUNT(start, end, DIRPARSE_ITERS) / 1000);
+
+  start = perftime();
+  for (i = 0; i < DIRPARSE_ITERS; ++i) {
+    router_dir_info_changed();
+    r = router_have_minimum_dir_info();
+  }
+  end = perftime();
+  printf("router_have_minimum_dir_info(): %.2f usec (%s)\n",
+         MICROCOUNT(start, end, DIRPARSE_ITERS),
+         r ? "enough" : "not enough");
+
+  authority_cert_free(cert);
+  dir_corpus_clear(&corpus);
+}
+
 static void
 bench_dh(void)
 {
@@ -526,6 +1414,306 @@ bench_dh(void)
          "      %f millisec each.\n", NANOCOUNT(start, end, iters)/1e6);
 }
 
+/** How many microdescriptors bench_md_cache_rebuild() caches: several
+ * times what a cache holds for the real network, for a cache file of a
+ * few tens of megabytes. */
+#define MD_REBUILD_N_MDS 60000
+/** How many times bench_md_cache_rebuild() repeats each measurement. */
+#define MD_REBUILD_ITERS 3
+
+/** Return the current wall-clock time in microseconds.  Unlike perftime(),
+ * this counts time spent waiting for the disk, and doesn't count time that
+ * other threads spend running. */
+static uint64_t
+wallclock_usec(void)
+{
+  struct timeval now;
+  tor_gettimeofday(&now);
+  return ((uint64_t)now.tv_sec)*1000000 + now.tv_usec;
+}
+
+/** Time rebuilding a large microdescriptor cache, first all at once on the
+ * main thread, and then with a worker thread writing the new cache file.
+ * What matters is how long the main thread is stuck each time. */
+static void
+bench_md_cache_rebuild(void)
+{
+  or_options_t *options = get_options_mutable();
+  crypto_pk_t *onion_key = load_private_key(AUTHORITY_SIGNKEY_3);
+  char *onion_pem = public_key_to_string(onion_key);
+  const char *tmpdir = getenv("TMPDIR");
+  const char *fnames[] = { "cached-microdescs", "cached-microdescs.new",
+                           "cached-microdescs.sealed",
+                           "cached-microdescs.snapshot", NULL };
+  smartlist_t *mds = smartlist_new(), *added;
+  microdesc_cache_t *cache;
+  char *datadir = NULL, *body;
+  uint64_t start, end, total_usec, start_usec, finish_usec;
+  int i, r;
+
+  tor_asprintf(&datadir, "%s"PATH_SEPARATOR"tor-bench-md-%d",
+               tmpdir ? tmpdir : "/tmp", (int)getpid());
+  if (check_private_dir(datadir, CPD_CREATE, NULL) < 0) {
+    printf("Couldn't create %s\n", datadir);
+    goto done;
+  }
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(datadir);
+
+  if (!tor_libevent_get_base()) {
+    tor_libevent_cfg cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    tor_libevent_initialize(&cfg);
+  }
+  cpu_init();
+
+  /* Start from an empty cache, and fill its journal. */
+  nodelist_free_all();
+  microdesc_free_all();
+  cache = get_microdesc_cache();
+  for (i = 0; i < MD_REBUILD_N_MDS; ++i) {
+    char ntor_key[DIGEST256_LEN], ntor64[BASE64_DIGEST256_LEN+1];
+    crypto_rand(ntor_key, sizeof(ntor_key));
+    digest256_to_base64(ntor64, ntor_key);
+    smartlist_add(mds, make_microdesc(onion_pem, ntor64, (i % 4) == 0));
+  }
+  body = smartlist_join_strings(mds, "", 0, NULL);
+  added = microdescs_add_to_cache(cache, body, NULL, SAVED_NOWHERE, 0,
+                                  time(NULL), NULL);
+  tor_assert(smartlist_len(added) == MD_REBUILD_N_MDS);
+  smartlist_free(added);
+  tor_free(body);
+
+  start = wallclock_usec();
+  r = microdesc_cache_rebuild(cache, 1);
+  end = wallclock_usec();
+  tor_assert(r == 0);
+  printf("%d microdescriptors. Folding the journal into the cache file: "
+         "%.2f msec\n", MD_REBUILD_N_MDS, (end - start) / 1000.0);
+
+  start = wallclock_usec();
+  for (i = 0; i < MD_REBUILD_ITERS; ++i) {
+    r = microdesc_cache_rebuild(cache, 1);
+    tor_assert(r == 0);
+  }
+  end = wallclock_usec();
+  printf("Rebuilding on the main thread: %.2f msec, all of it on the "
+         "main thread\n", (end - start) / 1000.0 / MD_REBUILD_ITERS);
+
+  total_usec = start_usec = finish_usec = 0;
+  for (i = 0; i < MD_REBUILD_ITERS; ++i) {
+    uint64_t started, longest = 0;
+    start = started = wallclock_usec();
+    microdesc_cache_rebuild_in_background(cache, 1);
+    end = wallclock_usec();
+    start_usec += end - start;
+    tor_assert(microdesc_cache_rebuild_in_progress(cache));
+    /* Spin the main loop without blocking, so that the longest pass
+     * through it is the one that handles the worker's reply. */
+    while (microdesc_cache_rebuild_in_progress(cache)) {
+      start = wallclock_usec();
+      event_base_loop(tor_libevent_get_base(), EVLOOP_NONBLOCK);
+      end = wallclock_usec();
+      if (end - start > longest)
+        longest = end - start;
+    }
+    finish_usec += longest;
+    total_usec += end - started;
+  }
+  printf("Rebuilding in a worker: %.2f msec in all; %.2f msec on the main "
+         "thread to start and %.2f msec to finish\n",
+         U64_TO_DBL(total_usec) / MD_REBUILD_ITERS / 1000,
+         U64_TO_DBL(start_usec) / MD_REBUILD_ITERS / 1000,
+         U64_TO_DBL(finish_usec) / MD_REBUILD_ITERS / 1000);
+
+  microdesc_free_all();
+  for (i = 0; fnames[i]; ++i) {
+    char *fname = get_datadir_fname(fnames[i]);
+    unlink(fname);
+    tor_free(fname);
+  }
+  rmdir(datadir);
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup("");
+
+ done:
+  SMARTLIST_FOREACH(mds, char *, cp, tor_free(cp));
+  smartlist_free(mds);
+  crypto_pk_free(onion_key);
+  tor_free(onion_pem);
+  tor_free(datadir);
+}
+
+/** How many authorities vote in bench_consensus(). */
+#define CONSENSUS_N_VOTES 9
+/** How many times bench_consensus() repeats each measurement. */
+#define CONSENSUS_ITERS 3
+/** The flags that the votes in bench_consensus() know about. */
+static const char *consensus_bench_flags[] = {
+  "Exit", "Fast", "Guard", "HSDir", "Running", "Stable", "V2Dir", "Valid",
+  NULL
+};
+
+/** Return a new vote from authority number <b>voter_idx</b> about the
+ * <b>n_relays</b> relays whose identity digests are in <b>ids</b>, as it
+ * might look at <b>now</b>.  Each authority leaves out a different tenth
+ * of the relays, and disagrees with the others about some flags and
+ * bandwidths, so that computing the consensus has some work to do. */
+static networkstatus_t *
+make_synthetic_vote(int voter_idx, const char *ids, int n_relays,
+                    time_t now)
+{
+  networkstatus_t *vote = tor_malloc_zero(sizeof(networkstatus_t));
+  networkstatus_voter_info_t *voter =
+    tor_malloc_zero(sizeof(networkstatus_voter_info_t));
+  int i;
+
+  vote->type = NS_TYPE_VOTE;
+  vote->published = now;
+  vote->valid_after = now + 1000;
+  vote->fresh_until = now + 4600;
+  vote->valid_until = now + 11800;
+  vote->vote_seconds = 300;
+  vote->dist_seconds = 300;
+  vote->client_versions = tor_strdup("0.2.6.10,0.2.7.3-rc");
+  vote->server_versions = tor_strdup("0.2.6.10,0.2.7.3-rc");
+  vote->known_flags = smartlist_new();
+  for (i = 0; consensus_bench_flags[i]; ++i)
+    smartlist_add(vote->known_flags, tor_strdup(consensus_bench_flags[i]));
+  vote->supported_methods = smartlist_new();
+  for (i = MIN_SUPPORTED_CONSENSUS_METHOD;
+       i <= MAX_SUPPORTED_CONSENSUS_METHOD; ++i)
+    smartlist_add_asprintf(vote->supported_methods, "%d", i);
+  vote->net_params = smartlist_new();
+  smartlist_add(vote->net_params, tor_strdup("circwindow=1000"));
+
+  crypto_rand(voter->identity_digest, DIGEST_LEN);
+  crypto_rand(voter->vote_digest, DIGEST_LEN);
+  tor_asprintf(&voter->nickname, "bench%d", voter_idx);
+  voter->address = tor_strdup("192.0.2.1");
+  voter->addr = 0xc0000201 + voter_idx;
+  voter->dir_port = 80;
+  voter->or_port = 443;
+  voter->contact = tor_strdup("nobody@example.com");
+  vote->voters = smartlist_new();
+  smartlist_add(vote->voters, voter);
+
+  vote->routerstatus_list = smartlist_new();
+  for (i = 0; i < n_relays; ++i) {
+    vote_routerstatus_t *vrs;
+    routerstatus_t *rs;
+    char md_digest[DIGEST256_LEN], md64[BASE64_DIGEST256_LEN+1];
+
+    if ((i + voter_idx) % 10 == 0)
+      continue;
+    vrs = tor_malloc_zero(sizeof(vote_routerstatus_t));
+    rs = &vrs->status;
+    memcpy(rs->identity_digest, ids + i*DIGEST_LEN, DIGEST_LEN);
+    memcpy(rs->descriptor_digest, ids + i*DIGEST_LEN, DIGEST_LEN);
+    rs->descriptor_digest[0] ^= 0x5a;
+    tor_snprintf(rs->nickname, sizeof(rs->nickname), "relay%d", i);
+    rs->addr = 0x0a000000 + i;
+    rs->or_port = 9001;
+    rs->dir_port = (i % 3) ? 9030 : 0;
+    rs->published_on = now - (i % 3600);
+    rs->has_bandwidth = 1;
+    rs->bandwidth_kb = 100 + (i % 5000) + voter_idx;
+    rs->has_exitsummary = 1;
+    rs->exitsummary = tor_strdup((i % 4) ? "reject 1-65535"
+                                          : "accept 80,443");
+    /* Bits are indices into consensus_bench_flags: start with Fast,
+     * Running, Stable, and Valid. */
+    vrs->flags = 0xb2;
+    if (i % 4 == 0)
+      vrs->flags |= 1;
+    if (i % 3 == 0 || (i + voter_idx) % 7 == 0)
+      vrs->flags |= 4;
+    if (rs->dir_port)
+      vrs->flags |= 0x48;
+    vrs->version = tor_strdup((i % 2) ? "Tor 0.2.6.10" : "Tor 0.2.7.3-rc");
+    if (voter_idx % 2) {
+      vrs->has_measured_bw = 1;
+      vrs->measured_bw_kb = rs->bandwidth_kb * 2;
+    }
+    memcpy(md_digest, rs->identity_digest, DIGEST_LEN);
+    memset(md_digest + DIGEST_LEN, 0, DIGEST256_LEN - DIGEST_LEN);
+    digest256_to_base64(md64, md_digest);
+    vrs->microdesc = tor_malloc_zero(sizeof(vote_microdesc_hash_t));
+    tor_asprintf(&vrs->microdesc->microdesc_hash_line,
+                 "%d,%d sha256=%s", MIN_SUPPORTED_CONSENSUS_METHOD,
+                 MAX_SUPPORTED_CONSENSUS_METHOD, md64);
+    smartlist_add(vote->routerstatus_list, vrs);
+  }
+  return vote;
+}
+
+/** Time computing both flavors of consensus from CONSENSUS_N_VOTES
+ * synthetic votes about 10000 and 50000 relays, splitting the router
+ * entries among more and more threads. */
+static void
+bench_consensus(void)
+{
+  const int n_relays_list[] = { 10000, 50000, 0 };
+  const int n_threads_list[] = { 1, 2, 4, 8, 0 };
+  crypto_pk_t *id_key = load_private_key(AUTHORITY_SIGNKEY_2);
+  crypto_pk_t *signing_key = load_private_key(AUTHORITY_SIGNKEY_1);
+  time_t now = time(NULL);
+  int i, j, k, flav;
+
+  for (i = 0; n_relays_list[i]; ++i) {
+    const int n_relays = n_relays_list[i];
+    char *ids = tor_malloc(n_relays * DIGEST_LEN);
+    smartlist_t *votes = smartlist_new();
+    char *expected[N_CONSENSUS_FLAVORS];
+
+    crypto_rand(ids, n_relays * DIGEST_LEN);
+    for (j = 0; j < CONSENSUS_N_VOTES; ++j)
+      smartlist_add(votes, make_synthetic_vote(j, ids, n_relays, now));
+    /* We're the first authority. */
+    {
+      networkstatus_t *v = smartlist_get(votes, 0);
+      networkstatus_voter_info_t *voter = smartlist_get(v->voters, 0);
+      crypto_pk_get_digest(id_key, voter->identity_digest);
+    }
+    memset(expected, 0, sizeof(expected));
+
+    for (j = 0; n_threads_list[j]; ++j) {
+      const int n_threads = n_threads_list[j];
+      uint64_t start, end;
+      start = wallclock_usec();
+      for (k = 0; k < CONSENSUS_ITERS; ++k) {
+        for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
+          char *body = networkstatus_compute_consensus_threaded(
+                 votes, CONSENSUS_N_VOTES, id_key, signing_key, NULL, NULL,
+                 flav, n_threads);
+          tor_assert(body);
+          /* However we split up the work, the result must be the same. */
+          if (!expected[flav])
+            expected[flav] = body;
+          else {
+            tor_assert(!strcmp(body, expected[flav]));
+            tor_free(body);
+          }
+        }
+      }
+      end = wallclock_usec();
+      printf("%d relays, %d votes, %d thread%s: %.2f msec for both "
+             "flavors\n", n_relays, CONSENSUS_N_VOTES, n_threads,
+             n_threads == 1 ? "" : "s",
+             (end - start) / 1000.0 / CONSENSUS_ITERS);
+    }
+
+    for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav)
+      tor_free(expected[flav]);
+    SMARTLIST_FOREACH(votes, networkstatus_t *, v, networkstatus_vote_free(v));
+    smartlist_free(votes);
+    tor_free(ids);
+  }
+
+  crypto_pk_free(id_key);
+  crypto_pk_free(signing_key);
+}
+
 static void
 bench_ecdh_impl(int nid, const char *name)
 {
@@ -588,6 +1776,7 @@ typedef struct benchmark_t {
 
 static struct benchmark_t benchmarks[] = {
   ENT(dmap),
+  ENT(circid_map),
   ENT(siphash),
   ENT(aes),
   ENT(onion_TAP),
@@ -596,6 +1785,11 @@ static struct benchmark_t benchmarks[] = {
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(cell_recv),
+  ENT(cell_pipeline),
+  ENT(dirparse),
+  ENT(md_cache_rebuild),
+  ENT(consensus),
   ENT(dh),
   ENT(ecdh_p256),
   ENT(ecdh_p224),
@@ -457,6 +457,34 @@ test_circuit_timeout(void *arg)
   or_state_free(state);
 }
 
+/** Test the median circuit build time, which we use as a build time
+ * estimate. */
+static void
+test_circuit_build_median(void *arg)
+{
+  circuit_build_times_t cbt;
+  (void)arg;
+  circuit_build_times_init(&cbt);
+
+  /* Nothing recorded yet. */
+  tt_assert(circuit_build_times_median(&cbt) < 0);
+
+  circuit_build_times_add_time(&cbt, 900);
+  circuit_build_times_add_time(&cbt, 100);
+  /* Abandoned circuits don't count. */
+  circuit_build_times_add_time(&cbt, CBT_BUILD_ABANDONED);
+  circuit_build_times_add_time(&cbt, 500);
+  tt_int_op((int)circuit_build_times_median(&cbt), OP_EQ, 500);
+
+  circuit_build_times_add_time(&cbt, 600);
+  tt_int_op((int)circuit_build_times_median(&cbt), OP_EQ, 500);
+  circuit_build_times_add_time(&cbt, 700);
+  tt_int_op((int)circuit_build_times_median(&cbt), OP_EQ, 600);
+
+ done:
+  circuit_build_times_free_timeouts(&cbt);
+}
+
 /** Test encoding and parsing of rendezvous service descriptors. */
 static void
 test_rend_fns(void *arg)
@@ -1095,6 +1123,43 @@ test_stats(void *arg)
   tor_free(s);
 }
 
+/** Run unit tests for predicting how many circuits our hidden services
+ * need. */
+static void
+test_hs_circ_prediction(void *arg)
+{
+  time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
+  int i;
+  (void)arg;
+
+  /* With no introductions, we keep the minimum. */
+  tt_int_op(rep_hist_get_predicted_hs_circs(now, 2000),OP_EQ,
+            HS_PREDICTED_CIRCS_MIN);
+
+  /* About one introduction a second, and circuits take two seconds to
+   * build: keep about four more. */
+  for (i = 0; i < 30; ++i)
+    rep_hist_note_hs_introduction(now);
+  tt_int_op(rep_hist_get_predicted_hs_circs(now, 2000),OP_EQ, 7);
+  /* Faster circuits mean fewer are needed. */
+  tt_int_op(rep_hist_get_predicted_hs_circs(now, 500),OP_EQ, 4);
+
+  /* A couple of minutes later, we still remember some of the burst... */
+  tt_int_op(rep_hist_get_predicted_hs_circs(now + 120, 2000),OP_EQ, 4);
+  /* ...but after the whole window, we don't. */
+  tt_int_op(rep_hist_get_predicted_hs_circs(now + 1000, 2000),OP_EQ,
+            HS_PREDICTED_CIRCS_MIN);
+
+  /* Never keep more than the maximum. */
+  for (i = 0; i < 10000; ++i)
+    rep_hist_note_hs_introduction(now + 1000);
+  tt_int_op(rep_hist_get_predicted_hs_circs(now + 1000, 2000),OP_EQ,
+            HS_PREDICTED_CIRCS_MAX);
+
+ done:
+  ;
+}
+
 #define ENT(name)                                                       \
   { #name, test_ ## name , 0, NULL, NULL }
 #define FORK(name)                                                      \
@@ -1106,10 +1171,12 @@ static struct testcase_t test_array[] = {
   ENT(onion_queues),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
   ENT(circuit_timeout),
+  ENT(circuit_build_median),
   ENT(rend_fns),
   ENT(geoip),
   FORK(geoip_with_pt),
   FORK(stats),
+  FORK(hs_circ_prediction),
 
   END_OF_TESTCASES
 };
@@ -1126,11 +1193,13 @@ extern struct testcase_t checkdir_tests[];
 extern struct testcase_t circuitlist_tests[];
 extern struct testcase_t circuitmux_tests[];
 extern struct testcase_t config_tests[];
+extern struct testcase_t connection_tests[];
 extern struct testcase_t container_tests[];
 extern struct testcase_t controller_tests[];
 extern struct testcase_t controller_event_tests[];
 extern struct testcase_t crypto_tests[];
 extern struct testcase_t dir_tests[];
+extern struct testcase_t dirsnapshot_tests[];
 extern struct testcase_t entryconn_tests[];
 extern struct testcase_t entrynodes_tests[];
 extern struct testcase_t guardfraction_tests[];
@@ -1140,6 +1209,7 @@ extern struct testcase_t introduce_tests[];
 extern struct testcase_t keypin_tests[];
 extern struct testcase_t link_handshake_tests[];
 extern struct testcase_t logging_tests[];
+extern struct testcase_t metrics_tests[];
 extern struct testcase_t microdesc_tests[];
 extern struct testcase_t nodelist_tests[];
 extern struct testcase_t oom_tests[];
@@ -1148,6 +1218,7 @@ extern struct testcase_t policy_tests[];
 extern struct testcase_t pt_tests[];
 extern struct testcase_t relay_tests[];
 extern struct testcase_t relaycell_tests[];
+extern struct testcase_t rendcache_tests[];
 extern struct testcase_t replaycache_tests[];
 extern struct testcase_t router_tests[];
 extern struct testcase_t routerkeys_tests[];
@@ -1157,6 +1228,7 @@ extern struct testcase_t scheduler_tests[];
 extern struct testcase_t socks_tests[];
 extern struct testcase_t status_tests[];
 extern struct testcase_t thread_tests[];
+extern struct testcase_t tortls_tests[];
 extern struct testcase_t util_tests[];
 
 struct testgroup_t testgroups[] = {
@@ -1173,11 +1245,13 @@ struct testgroup_t testgroups[] = {
   { "circuitlist/", circuitlist_tests },
   { "circuitmux/", circuitmux_tests },
   { "config/", config_tests },
+  { "connection/", connection_tests },
   { "container/", container_tests },
   { "control/", controller_tests },
   { "control/event/", controller_event_tests },
   { "crypto/", crypto_tests },
   { "dir/", dir_tests },
+  { "dirsnapshot/", dirsnapshot_tests },
   { "dir/md/", microdesc_tests },
   { "entryconn/", entryconn_tests },
   { "entrynodes/", entrynodes_tests },
@@ -1187,6 +1261,7 @@ struct testgroup_t testgroups[] = {
   { "introduce/", introduce_tests },
   { "keypin/", keypin_tests },
   { "link-handshake/", link_handshake_tests },
+  { "metrics/", metrics_tests },
   { "nodelist/", nodelist_tests },
   { "oom/", oom_tests },
   { "options/", options_tests },
@@ -1194,6 +1269,7 @@ struct testgroup_t testgroups[] = {
   { "pt/", pt_tests },
   { "relay/" , relay_tests },
   { "relaycell/", relaycell_tests },
+  { "rendcache/", rendcache_tests },
   { "replaycache/", replaycache_tests },
   { "routerkeys/", routerkeys_tests },
   { "routerlist/", routerlist_tests },
@@ -1201,6 +1277,7 @@ struct testgroup_t testgroups[] = {
   { "scheduler/", scheduler_tests },
   { "socks/", socks_tests },
   { "status/" , status_tests },
+  { "tortls/", tortls_tests },
   { "util/", util_tests },
   { "util/logging/", logging_tests },
   { "util/thread/", thread_tests },
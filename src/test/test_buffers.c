@@ -7,6 +7,7 @@
 #include "or.h"
 #include "buffers.h"
 #include "ext_orport.h"
+#include "metrics.h"
 #include "test.h"
 
 /** Run unit tests for buffers.c */
@@ -750,6 +751,154 @@ test_buffers_tls_read_mocked(void *arg)
   buf_free(buf);
 }
 
+/** Sizes of the writes that mock_tls_write() has been asked to do. */
+static size_t tls_write_sizes[16];
+static int n_tls_writes = 0;
+/** Where mock_tls_write() puts the bytes it writes. */
+static char *tls_write_out = NULL;
+static size_t tls_write_out_len = 0;
+/** If nonzero, the value mock_tls_write() returns next time, instead of
+ * writing anything. */
+static int next_write_error = 0;
+/** What mock_tls_get_forced_write_size() says. */
+static size_t tls_forced_write_size = 0;
+
+static int
+mock_tls_write(tor_tls_t *tls, const char *cp, size_t n)
+{
+  (void)tls;
+  if (n_tls_writes < 16)
+    tls_write_sizes[n_tls_writes] = n;
+  ++n_tls_writes;
+  if (next_write_error) {
+    int r = next_write_error;
+    next_write_error = 0;
+    return r;
+  }
+  memcpy(tls_write_out + tls_write_out_len, cp, n);
+  tls_write_out_len += n;
+  return (int)n;
+}
+
+static size_t
+mock_tls_get_forced_write_size(tor_tls_t *tls)
+{
+  (void)tls;
+  return tls_forced_write_size;
+}
+
+/** Queue <b>n_cells</b> cells on <b>buf</b>, one at a time, the way
+ * connection_or_write_cell_to_buf() does, and copy them to <b>copy</b>. */
+static void
+write_test_cells_to_buf(buf_t *buf, int n_cells, char *copy)
+{
+  char cell[CELL_MAX_NETWORK_SIZE];
+  int i;
+  for (i = 0; i < n_cells; ++i) {
+    memset(cell, i & 0xff, sizeof(cell));
+    write_to_buf(cell, sizeof(cell), buf);
+    memcpy(copy + i*sizeof(cell), cell, sizeof(cell));
+  }
+}
+
+static void
+test_buffers_tls_write_full_records(void *arg)
+{
+  buf_t *buf = NULL;
+  char *expected = NULL;
+  const int n_cells = 40;
+  const size_t total = n_cells * CELL_MAX_NETWORK_SIZE;
+  size_t flushlen;
+  uint64_t n_records;
+  (void)arg;
+
+  MOCK(tor_tls_write, mock_tls_write);
+  MOCK(tor_tls_get_forced_write_size, mock_tls_get_forced_write_size);
+  tls_write_out = tor_malloc_zero(total);
+  expected = tor_malloc_zero(total);
+
+  buf = buf_new();
+  write_test_cells_to_buf(buf, n_cells, expected);
+  /* The cells sit in several chunks, none of which holds a record. */
+  tt_assert(buf->head->next);
+  tt_int_op(buf->head->datalen, OP_LT, TOR_TLS_MAX_RECORD_PAYLOAD);
+
+  n_records = metrics_counters_[METRICS_TLS_RECORDS_WRITTEN];
+  flushlen = total;
+  tt_int_op(flush_buf_tls(NULL, buf, total, &flushlen), OP_EQ, total);
+  tt_int_op(flushlen, OP_EQ, 0);
+  tt_int_op(buf_datalen(buf), OP_EQ, 0);
+
+  /* One full record, and what's left over. */
+  tt_int_op(n_tls_writes, OP_EQ, 2);
+  tt_int_op(tls_write_sizes[0], OP_EQ, TOR_TLS_MAX_RECORD_PAYLOAD);
+  tt_int_op(tls_write_sizes[1], OP_EQ, total - TOR_TLS_MAX_RECORD_PAYLOAD);
+  tt_int_op(metrics_counters_[METRICS_TLS_RECORDS_WRITTEN] - n_records,
+            OP_EQ, 2);
+  tt_mem_op(tls_write_out, OP_EQ, expected, total);
+
+ done:
+  UNMOCK(tor_tls_write);
+  UNMOCK(tor_tls_get_forced_write_size);
+  buf_free(buf);
+  tor_free(tls_write_out);
+  tor_free(expected);
+}
+
+static void
+test_buffers_tls_write_retry(void *arg)
+{
+  buf_t *buf = NULL;
+  char *expected = NULL;
+  const int n_cells = 40;
+  const size_t total = n_cells * CELL_MAX_NETWORK_SIZE;
+  size_t flushlen;
+  (void)arg;
+
+  MOCK(tor_tls_write, mock_tls_write);
+  MOCK(tor_tls_get_forced_write_size, mock_tls_get_forced_write_size);
+  tls_write_out = tor_malloc_zero(total);
+  expected = tor_malloc_zero(total);
+
+  buf = buf_new();
+  write_test_cells_to_buf(buf, n_cells, expected);
+
+  /* The first record blocks. */
+  next_write_error = TOR_TLS_WANTWRITE;
+  flushlen = total;
+  tt_int_op(flush_buf_tls(NULL, buf, total, &flushlen), OP_EQ,
+            TOR_TLS_WANTWRITE);
+  tt_int_op(n_tls_writes, OP_EQ, 1);
+  tt_int_op(tls_write_sizes[0], OP_EQ, TOR_TLS_MAX_RECORD_PAYLOAD);
+  tt_int_op(flushlen, OP_EQ, total);
+  tt_int_op(buf_datalen(buf), OP_EQ, total);
+
+  /* When we try again, TLS wants the same record, even if we're asked to
+   * flush less. */
+  tls_forced_write_size = TOR_TLS_MAX_RECORD_PAYLOAD;
+  tt_int_op(flush_buf_tls(NULL, buf, 1000, &flushlen), OP_EQ,
+            TOR_TLS_MAX_RECORD_PAYLOAD);
+  tt_int_op(n_tls_writes, OP_EQ, 2);
+  tt_int_op(tls_write_sizes[1], OP_EQ, TOR_TLS_MAX_RECORD_PAYLOAD);
+  tls_forced_write_size = 0;
+
+  /* And then the rest goes out in one record. */
+  tt_int_op(flush_buf_tls(NULL, buf, flushlen, &flushlen), OP_EQ,
+            total - TOR_TLS_MAX_RECORD_PAYLOAD);
+  tt_int_op(n_tls_writes, OP_EQ, 3);
+  tt_int_op(tls_write_sizes[2], OP_EQ, total - TOR_TLS_MAX_RECORD_PAYLOAD);
+  tt_int_op(flushlen, OP_EQ, 0);
+  tt_int_op(buf_datalen(buf), OP_EQ, 0);
+  tt_mem_op(tls_write_out, OP_EQ, expected, total);
+
+ done:
+  UNMOCK(tor_tls_write);
+  UNMOCK(tor_tls_get_forced_write_size);
+  buf_free(buf);
+  tor_free(tls_write_out);
+  tor_free(expected);
+}
+
 struct testcase_t buffer_tests[] = {
   { "basic", test_buffers_basic, TT_FORK, NULL, NULL },
   { "copy", test_buffer_copy, TT_FORK, NULL, NULL },
@@ -764,6 +913,9 @@ struct testcase_t buffer_tests[] = {
     NULL, NULL},
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
+  { "tls_write_full_records", test_buffers_tls_write_full_records, TT_FORK,
+    NULL, NULL },
+  { "tls_write_retry", test_buffers_tls_write_retry, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
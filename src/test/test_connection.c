@@ -0,0 +1,301 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#include "orconfig.h"
+#include "or.h"
+#include "buffers.h"
+#include "config.h"
+#define CONNECTION_PRIVATE
+#include "connection.h"
+#define CONNECTION_OR_PRIVATE
+#include "connection_or.h"
+#include "compat_libevent.h"
+#include "main.h"
+#include "test.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+static int n_start_writing = 0;
+static int n_stop_writing = 0;
+static connection_t *last_started = NULL;
+
+static void
+mock_connection_start_writing(connection_t *conn)
+{
+  ++n_start_writing;
+  last_started = conn;
+}
+
+static void
+mock_connection_stop_writing(connection_t *conn)
+{
+  (void)conn;
+  ++n_stop_writing;
+}
+
+static int
+mock_flush_buf_tls_wantread(tor_tls_t *tls, buf_t *buf, size_t sz,
+                            size_t *buf_flushlen)
+{
+  (void)tls;
+  (void)buf;
+  (void)sz;
+  (void)buf_flushlen;
+  return TOR_TLS_WANTREAD;
+}
+
+static int n_flushes = 0;
+
+static int
+mock_flush_buf_tls_counting(tor_tls_t *tls, buf_t *buf, size_t sz,
+                            size_t *buf_flushlen)
+{
+  (void)tls;
+  (void)buf;
+  (void)sz;
+  (void)buf_flushlen;
+  ++n_flushes;
+  return TOR_TLS_WANTREAD;
+}
+
+static size_t
+mock_tor_tls_get_forced_write_size(tor_tls_t *tls)
+{
+  (void)tls;
+  return 0;
+}
+
+/** Queue one cell's worth of data on <b>conn</b>. */
+static void
+write_one_cell(or_connection_t *conn)
+{
+  char cell[CELL_MAX_NETWORK_SIZE];
+  memset(cell, 0, sizeof(cell));
+  connection_write_to_buf(cell, sizeof(cell), TO_CONN(conn));
+}
+
+static void
+dummy_event_cb(evutil_socket_t fd, short events, void *arg)
+{
+  (void)fd;
+  (void)events;
+  (void)arg;
+}
+
+/** Make an open OR connection with a live-looking socket and plenty of
+ * bandwidth, and a cell waiting to go out. */
+static or_connection_t *
+make_open_or_conn(void)
+{
+  or_connection_t *conn = or_connection_new(CONN_TYPE_OR, AF_INET);
+
+  conn->base_.state = OR_CONN_STATE_OPEN;
+  conn->base_.s = 0;
+  conn->bandwidthrate = conn->bandwidthburst = 1<<20;
+  conn->read_bucket = conn->write_bucket = 1<<20;
+  write_one_cell(conn);
+  return conn;
+}
+
+/** Free <b>conn</b>, as made by make_open_or_conn(). */
+static void
+free_open_or_conn(or_connection_t *conn)
+{
+  if (!conn)
+    return;
+  conn->base_.s = TOR_INVALID_SOCKET;
+  connection_free_(TO_CONN(conn));
+}
+
+static void
+test_conn_write_wantread_then_refill(void *arg)
+{
+  or_connection_t *conn = NULL;
+  (void)arg;
+
+  MOCK(connection_start_writing, mock_connection_start_writing);
+  MOCK(connection_stop_writing, mock_connection_stop_writing);
+  MOCK(flush_buf_tls, mock_flush_buf_tls_wantread);
+  connection_bucket_init();
+
+  conn = make_open_or_conn();
+  n_start_writing = n_stop_writing = 0;
+  last_started = NULL;
+
+  /* TLS wants to read while we're writing, and we aren't reading: we
+   * should stop writing and wait for the buckets. */
+  tt_assert(!connection_is_reading(TO_CONN(conn)));
+  tt_int_op(connection_handle_write(TO_CONN(conn), 0), OP_EQ, 0);
+  tt_int_op(conn->base_.write_blocked_on_bw, OP_EQ, 1);
+  tt_int_op(n_stop_writing, OP_EQ, 1);
+  tt_int_op(n_start_writing, OP_EQ, 0);
+
+  /* Refilling the buckets has to start writing again. */
+  connection_bucket_refill(1000, approx_time());
+  tt_int_op(conn->base_.write_blocked_on_bw, OP_EQ, 0);
+  tt_int_op(n_start_writing, OP_EQ, 1);
+  tt_ptr_op(last_started, OP_EQ, TO_CONN(conn));
+
+  /* And once is enough: a second refill leaves it alone. */
+  connection_bucket_refill(1000, approx_time());
+  tt_int_op(n_start_writing, OP_EQ, 1);
+
+ done:
+  UNMOCK(connection_start_writing);
+  UNMOCK(connection_stop_writing);
+  UNMOCK(flush_buf_tls);
+  free_open_or_conn(conn);
+}
+
+/** Set up for a test of TLSWriteCoalesceDelay. */
+static void
+setup_hold_write_test(void)
+{
+  tor_libevent_cfg cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  get_options_mutable()->TLSWriteCoalesceDelay = 50;
+
+  MOCK(connection_start_writing, mock_connection_start_writing);
+  MOCK(connection_stop_writing, mock_connection_stop_writing);
+  MOCK(flush_buf_tls, mock_flush_buf_tls_counting);
+  MOCK(tor_tls_get_forced_write_size, mock_tor_tls_get_forced_write_size);
+  n_start_writing = n_stop_writing = n_flushes = 0;
+  last_started = NULL;
+}
+
+static void
+teardown_hold_write_test(void)
+{
+  UNMOCK(connection_start_writing);
+  UNMOCK(connection_stop_writing);
+  UNMOCK(flush_buf_tls);
+  UNMOCK(tor_tls_get_forced_write_size);
+  connection_or_free_held_writes();
+  get_options_mutable()->TLSWriteCoalesceDelay = 0;
+}
+
+static void
+test_conn_or_hold_write_until_full_record(void *arg)
+{
+  or_connection_t *conn = NULL;
+  int n_cells = 1;
+  (void)arg;
+
+  setup_hold_write_test();
+  conn = make_open_or_conn();
+  conn->base_.write_event = tor_event_new(tor_libevent_get_base(), -1, 0,
+                                          dummy_event_cb, NULL);
+  n_start_writing = 0;
+
+  /* With one cell queued, we hold back the write. */
+  tt_int_op(connection_handle_write(TO_CONN(conn), 0), OP_EQ, 0);
+  tt_int_op(n_flushes, OP_EQ, 0);
+  tt_int_op(n_stop_writing, OP_EQ, 1);
+  tt_assert(conn->write_held);
+  tt_assert(connection_or_write_is_held(conn));
+
+  /* More cells don't wake the connection up until there's a full record's
+   * worth of them; then we stop holding back. */
+  while ((n_cells + 1) * CELL_MAX_NETWORK_SIZE < TOR_TLS_MAX_RECORD_PAYLOAD) {
+    write_one_cell(conn);
+    ++n_cells;
+    tt_int_op(n_start_writing, OP_EQ, 0);
+    tt_assert(connection_or_should_hold_write(conn));
+  }
+  write_one_cell(conn);
+  tt_int_op(conn->base_.outbuf_flushlen, OP_GE, TOR_TLS_MAX_RECORD_PAYLOAD);
+  tt_int_op(n_start_writing, OP_EQ, 1);
+  tt_assert(! connection_or_write_is_held(conn));
+  tt_assert(! connection_or_should_hold_write(conn));
+
+  /* Forced writes are never held. */
+  tt_int_op(connection_handle_write(TO_CONN(conn), 1), OP_EQ, 0);
+  tt_int_op(n_flushes, OP_EQ, 1);
+
+ done:
+  teardown_hold_write_test();
+  free_open_or_conn(conn);
+}
+
+static void
+test_conn_or_hold_write_then_release(void *arg)
+{
+  or_connection_t *conn = NULL;
+  (void)arg;
+
+  setup_hold_write_test();
+  conn = make_open_or_conn();
+
+  tt_assert(connection_or_should_hold_write(conn));
+  tt_assert(conn->write_held);
+  /* Asking again doesn't hold it twice. */
+  tt_assert(connection_or_should_hold_write(conn));
+
+  /* When the delay runs out, we start writing again, and the next write
+   * goes through whatever we have. */
+  release_held_writes_cb(-1, 0, NULL);
+  tt_int_op(n_start_writing, OP_EQ, 1);
+  tt_ptr_op(last_started, OP_EQ, TO_CONN(conn));
+  tt_assert(! conn->write_held);
+  tt_assert(conn->write_released);
+  tt_int_op(connection_handle_write(TO_CONN(conn), 0), OP_EQ, 0);
+  tt_int_op(n_flushes, OP_EQ, 1);
+  tt_assert(! conn->write_released);
+
+  /* After that, we can hold it back again. */
+  tt_assert(connection_or_should_hold_write(conn));
+  tt_assert(conn->write_held);
+
+  /* Releasing twice is harmless. */
+  release_held_writes_cb(-1, 0, NULL);
+  release_held_writes_cb(-1, 0, NULL);
+  tt_int_op(n_start_writing, OP_EQ, 2);
+
+ done:
+  teardown_hold_write_test();
+  free_open_or_conn(conn);
+}
+
+static void
+test_conn_or_hold_write_freed(void *arg)
+{
+  or_connection_t *conn1 = NULL, *conn2 = NULL;
+  (void)arg;
+
+  setup_hold_write_test();
+  conn1 = make_open_or_conn();
+  conn2 = make_open_or_conn();
+
+  tt_assert(connection_or_should_hold_write(conn1));
+  tt_assert(connection_or_should_hold_write(conn2));
+
+  /* If a held connection goes away, the release leaves it alone. */
+  free_open_or_conn(conn1);
+  conn1 = NULL;
+  release_held_writes_cb(-1, 0, NULL);
+  tt_int_op(n_start_writing, OP_EQ, 1);
+  tt_ptr_op(last_started, OP_EQ, TO_CONN(conn2));
+
+ done:
+  teardown_hold_write_test();
+  free_open_or_conn(conn1);
+  free_open_or_conn(conn2);
+}
+
+struct testcase_t connection_tests[] = {
+  { "write_wantread_then_refill", test_conn_write_wantread_then_refill,
+    TT_FORK, NULL, NULL },
+  { "or_hold_write_until_full_record",
+    test_conn_or_hold_write_until_full_record, TT_FORK, NULL, NULL },
+  { "or_hold_write_then_release", test_conn_or_hold_write_then_release,
+    TT_FORK, NULL, NULL },
+  { "or_hold_write_freed", test_conn_or_hold_write_freed,
+    TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
+
@@ -7,6 +7,7 @@
 #include "or.h"
 #include "fp_pair.h"
 #include "test.h"
+#include "oaht.h"
 
 /** Helper: return a tristate based on comparing the strings in *<b>a</b> and
  * *<b>b</b>. */
@@ -1078,6 +1079,175 @@ test_container_fp_pair_map(void *arg)
   tor_free(v105);
 }
 
+/** Element type for test_container_oaht. */
+typedef struct oaht_test_ent_t {
+  OAHT_ENTRY(oaht_test_ent_t) node;
+  int key;
+} oaht_test_ent_t;
+
+static INLINE unsigned
+oaht_test_ent_hash(const oaht_test_ent_t *ent)
+{
+  /* A terrible hash function, so that we get lots of long probes. */
+  return (unsigned) (ent->key % 5);
+}
+static INLINE int
+oaht_test_ent_eq(const oaht_test_ent_t *a, const oaht_test_ent_t *b)
+{
+  return a->key == b->key;
+}
+
+static OAHT_HEAD(oaht_test_map, oaht_test_ent_t) oaht_test_map =
+  OAHT_INITIALIZER();
+OAHT_PROTOTYPE(oaht_test_map, oaht_test_ent_t, node, oaht_test_ent_hash,
+               oaht_test_ent_eq)
+OAHT_GENERATE2(oaht_test_map, oaht_test_ent_t, node, oaht_test_ent_hash,
+               oaht_test_ent_eq, 0.75, tor_reallocarray_, tor_free_)
+
+/** Run unit tests for the open-addressing hash table in oaht.h, with a hash
+ * function bad enough that most elements are stored far from their first
+ * bucket, and removals leave tombstones. */
+static void
+test_container_oaht(void *arg)
+{
+  const int N = 300;
+  oaht_test_ent_t *ents = tor_calloc(N, sizeof(oaht_test_ent_t));
+  oaht_test_ent_t search, **ptr, **next;
+  int i, n_seen;
+
+  (void)arg;
+  tt_int_op(HT_SIZE(&oaht_test_map), OP_EQ, 0);
+  tt_int_op(oaht_test_map_HT_REP_IS_BAD_(&oaht_test_map), OP_EQ, 0);
+  search.key = 7;
+  tt_ptr_op(HT_FIND(oaht_test_map, &oaht_test_map, &search), OP_EQ, NULL);
+  tt_ptr_op(HT_REMOVE(oaht_test_map, &oaht_test_map, &search), OP_EQ, NULL);
+  tt_ptr_op(HT_START(oaht_test_map, &oaht_test_map), OP_EQ, NULL);
+
+  for (i = 0; i < N; ++i) {
+    ents[i].key = i;
+    HT_INSERT(oaht_test_map, &oaht_test_map, &ents[i]);
+  }
+  tt_int_op(HT_SIZE(&oaht_test_map), OP_EQ, N);
+  tt_int_op(oaht_test_map_HT_REP_IS_BAD_(&oaht_test_map), OP_EQ, 0);
+  for (i = 0; i < N; ++i) {
+    search.key = i;
+    tt_ptr_op(HT_FIND(oaht_test_map, &oaht_test_map, &search), OP_EQ,
+              &ents[i]);
+  }
+  search.key = N;
+  tt_ptr_op(HT_FIND(oaht_test_map, &oaht_test_map, &search), OP_EQ, NULL);
+
+  /* Remove the odd elements; the even ones must still be reachable past
+   * any tombstones. */
+  for (i = 1; i < N; i += 2) {
+    search.key = i;
+    tt_ptr_op(HT_REMOVE(oaht_test_map, &oaht_test_map, &search), OP_EQ,
+              &ents[i]);
+  }
+  tt_int_op(HT_SIZE(&oaht_test_map), OP_EQ, N/2);
+  tt_int_op(oaht_test_map_HT_REP_IS_BAD_(&oaht_test_map), OP_EQ, 0);
+  for (i = 0; i < N; ++i) {
+    search.key = i;
+    tt_ptr_op(HT_FIND(oaht_test_map, &oaht_test_map, &search), OP_EQ,
+              (i & 1) ? NULL : &ents[i]);
+  }
+
+  /* Replacing an element returns the old one; replacing with a missing
+   * element inserts it. */
+  search.key = 4;
+  tt_ptr_op(HT_REPLACE(oaht_test_map, &oaht_test_map, &search), OP_EQ,
+            &ents[4]);
+  tt_ptr_op(HT_REPLACE(oaht_test_map, &oaht_test_map, &ents[4]), OP_EQ,
+            &search);
+  tt_ptr_op(HT_REPLACE(oaht_test_map, &oaht_test_map, &ents[5]), OP_EQ,
+            NULL);
+  tt_int_op(HT_SIZE(&oaht_test_map), OP_EQ, N/2 + 1);
+  tt_int_op(oaht_test_map_HT_REP_IS_BAD_(&oaht_test_map), OP_EQ, 0);
+
+  /* Put the odd elements back, so that we reuse the tombstones. */
+  for (i = 7; i < N; i += 2) {
+    HT_INSERT(oaht_test_map, &oaht_test_map, &ents[i]);
+  }
+  search.key = 1;
+  tt_ptr_op(HT_FIND(oaht_test_map, &oaht_test_map, &search), OP_EQ, NULL);
+  search.key = 9;
+  tt_ptr_op(HT_FIND(oaht_test_map, &oaht_test_map, &search), OP_EQ,
+            &ents[9]);
+  tt_int_op(oaht_test_map_HT_REP_IS_BAD_(&oaht_test_map), OP_EQ, 0);
+
+  /* Iterate, removing every element whose key is a multiple of 3. */
+  n_seen = 0;
+  for (ptr = HT_START(oaht_test_map, &oaht_test_map); ptr; ptr = next) {
+    ++n_seen;
+    if ((*ptr)->key % 3 == 0)
+      next = HT_NEXT_RMV(oaht_test_map, &oaht_test_map, ptr);
+    else
+      next = HT_NEXT(oaht_test_map, &oaht_test_map, ptr);
+  }
+  tt_int_op(n_seen, OP_EQ, N - 2);
+  tt_int_op(oaht_test_map_HT_REP_IS_BAD_(&oaht_test_map), OP_EQ, 0);
+  for (i = 0; i < N; ++i) {
+    search.key = i;
+    tt_ptr_op(HT_FIND(oaht_test_map, &oaht_test_map, &search), OP_EQ,
+              (i % 3 == 0 || i == 1 || i == 3) ? NULL : &ents[i]);
+  }
+
+ done:
+  HT_CLEAR(oaht_test_map, &oaht_test_map);
+  tor_free(ents);
+}
+
+/** Run unit tests for digestmap_t, with enough entries and removals that
+ * its table has to grow and reuse deleted slots. */
+static void
+test_container_digestmap_churn(void *arg)
+{
+  digestmap_t *map = digestmap_new();
+  smartlist_t *keys = smartlist_new();
+  digestmap_iter_t *iter;
+  const char *k;
+  void *v;
+  char d[DIGEST_LEN];
+  int i, round;
+
+  (void)arg;
+  for (i = 0; i < 2000; ++i) {
+    crypto_rand(d, sizeof(d));
+    smartlist_add(keys, tor_memdup(d, sizeof(d)));
+  }
+
+  for (round = 0; round < 3; ++round) {
+    SMARTLIST_FOREACH(keys, const char *, key,
+      tt_ptr_op(digestmap_set(map, key, (void*)key), OP_EQ, NULL));
+    tt_int_op(digestmap_size(map), OP_EQ, 2000);
+    digestmap_assert_ok(map);
+
+    SMARTLIST_FOREACH_BEGIN(keys, const char *, key) {
+      if (key_sl_idx % 4 == round)
+        tt_ptr_op(digestmap_remove(map, key), OP_EQ, key);
+    } SMARTLIST_FOREACH_END(key);
+    tt_int_op(digestmap_size(map), OP_EQ, 1500);
+    digestmap_assert_ok(map);
+
+    SMARTLIST_FOREACH(keys, const char *, key,
+      tt_ptr_op(digestmap_get(map, key), OP_EQ,
+                (key_sl_idx % 4 == round) ? NULL : key));
+
+    for (iter = digestmap_iter_init(map); !digestmap_iter_done(iter); ) {
+      digestmap_iter_get(iter, &k, &v);
+      tt_mem_op(k, OP_EQ, v, DIGEST_LEN);
+      iter = digestmap_iter_next_rmv(map, iter);
+    }
+    tt_assert(digestmap_isempty(map));
+    digestmap_assert_ok(map);
+  }
+
+ done:
+  digestmap_free(map, NULL);
+  SMARTLIST_FOREACH(keys, char *, key, tor_free(key));
+  smartlist_free(keys);
+}
+
 #define CONTAINER_LEGACY(name)                                          \
   { #name, test_container_ ## name , 0, NULL, NULL }
 
@@ -1099,6 +1269,8 @@ struct testcase_t container_tests[] = {
   CONTAINER_LEGACY(order_functions),
   CONTAINER(di_map, 0),
   CONTAINER_LEGACY(fp_pair_map),
+  CONTAINER(oaht, 0),
+  CONTAINER(digestmap_churn, 0),
   END_OF_TESTCASES
 };
 
@@ -1806,6 +1806,71 @@ test_crypto_siphash(void *arg)
 #define CRYPTO_LEGACY(name)                                            \
   { #name, test_crypto_ ## name , 0, NULL, NULL }
 
+/** Make sure that ciphers and digests set up in caller-provided storage
+ * behave exactly like heap-allocated ones. */
+static void
+test_crypto_storage(void *arg)
+{
+  crypto_cipher_storage_t cipher_storage;
+  crypto_digest_storage_t digest_storage;
+  crypto_cipher_t *heap_cipher = NULL, *inline_cipher = NULL;
+  crypto_digest_t *heap_digest = NULL, *inline_digest = NULL;
+  char key[CIPHER_KEY_LEN];
+  char data1[509], data2[509], d1[DIGEST_LEN], d2[DIGEST_LEN];
+  int i;
+
+  int use_evp = !strcmp(arg,"evp");
+  evaluate_evp_for_aes(use_evp);
+  evaluate_ctr_for_aes();
+
+  crypto_rand(key, sizeof(key));
+  crypto_rand(data1, sizeof(data1));
+  memcpy(data2, data1, sizeof(data1));
+
+  heap_cipher = crypto_cipher_new(key);
+  inline_cipher = crypto_cipher_init_in(&cipher_storage, key);
+  tt_ptr_op(inline_cipher, OP_EQ, CRYPTO_CIPHER_IN(&cipher_storage));
+  tt_mem_op(crypto_cipher_get_key(inline_cipher), OP_EQ, key, sizeof(key));
+
+  /* Same keystream, including across uneven chunk boundaries. */
+  for (i = 0; i < 3; ++i) {
+    crypto_cipher_crypt_inplace(heap_cipher, data1, 17);
+    crypto_cipher_crypt_inplace(heap_cipher, data1+17, sizeof(data1)-17);
+    crypto_cipher_crypt_inplace(inline_cipher, data2, sizeof(data2));
+    tt_mem_op(data1, OP_EQ, data2, sizeof(data1));
+  }
+  crypto_cipher_clear(inline_cipher);
+  tt_assert(tor_mem_is_zero(cipher_storage.mem, CIPHER_KEY_LEN));
+
+  heap_digest = crypto_digest_new();
+  inline_digest = crypto_digest_init_in(&digest_storage);
+  tt_ptr_op(inline_digest, OP_EQ, CRYPTO_DIGEST_IN(&digest_storage));
+  crypto_digest_add_bytes(heap_digest, data1, sizeof(data1));
+  crypto_digest_add_bytes(inline_digest, data1, sizeof(data1));
+  crypto_digest_get_digest(heap_digest, d1, sizeof(d1));
+  crypto_digest_get_digest(inline_digest, d2, sizeof(d2));
+  tt_mem_op(d1, OP_EQ, d2, DIGEST_LEN);
+  crypto_digest(d1, data1, sizeof(data1));
+  tt_mem_op(d1, OP_EQ, d2, DIGEST_LEN);
+
+  /* Checkpoint and restore. */
+  {
+    crypto_digest_checkpoint_t checkpoint;
+    crypto_digest_checkpoint(&checkpoint, inline_digest);
+    crypto_digest_add_bytes(inline_digest, "xyzzy", 5);
+    crypto_digest_get_digest(inline_digest, d1, sizeof(d1));
+    tt_mem_op(d1, OP_NE, d2, DIGEST_LEN);
+    crypto_digest_restore(inline_digest, &checkpoint);
+    crypto_digest_get_digest(inline_digest, d1, sizeof(d1));
+    tt_mem_op(d1, OP_EQ, d2, DIGEST_LEN);
+  }
+  crypto_digest_clear(inline_digest);
+
+ done:
+  crypto_cipher_free(heap_cipher);
+  crypto_digest_free(heap_digest);
+}
+
 struct testcase_t crypto_tests[] = {
   CRYPTO_LEGACY(formats),
   CRYPTO_LEGACY(rng),
@@ -1822,6 +1887,10 @@ struct testcase_t crypto_tests[] = {
     (void*)"aes" },
   { "aes_iv_EVP", test_crypto_aes_iv, TT_FORK, &passthrough_setup,
     (void*)"evp" },
+  { "storage_AES", test_crypto_storage, TT_FORK, &passthrough_setup,
+    (void*)"aes" },
+  { "storage_EVP", test_crypto_storage, TT_FORK, &passthrough_setup,
+    (void*)"evp" },
   CRYPTO_LEGACY(base32_decode),
   { "kdf_TAP", test_crypto_kdf_TAP, 0, NULL, NULL },
   { "hkdf_sha256", test_crypto_hkdf_sha256, 0, NULL, NULL },
@@ -2114,6 +2114,29 @@ test_a_networkstatus(
   tt_assert(con_md);
   tt_int_op(con_md->flavor,OP_EQ, FLAV_MICRODESC);
 
+  /* Splitting the routers among threads must not change the result. */
+  {
+    int n_threads;
+    for (n_threads = 2; n_threads <= 8; n_threads *= 2) {
+      char *threaded = networkstatus_compute_consensus_threaded(votes, 3,
+                                                   cert3->identity_key,
+                                                   sign_skey_3,
+                                                   "AAAAAAAAAAAAAAAAAAAA",
+                                                   sign_skey_leg1,
+                                                   FLAV_NS, n_threads);
+      tt_str_op(threaded, OP_EQ, consensus_text);
+      tor_free(threaded);
+      threaded = networkstatus_compute_consensus_threaded(votes, 3,
+                                                   cert3->identity_key,
+                                                   sign_skey_3,
+                                                   "AAAAAAAAAAAAAAAAAAAA",
+                                                   sign_skey_leg1,
+                                                   FLAV_MICRODESC, n_threads);
+      tt_str_op(threaded, OP_EQ, consensus_text_md);
+      tor_free(threaded);
+    }
+  }
+
   /* Check consensus contents. */
   tt_assert(con->type == NS_TYPE_CONSENSUS);
   tt_int_op(con->published,OP_EQ, 0); /* this field only appears in votes. */
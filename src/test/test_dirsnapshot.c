@@ -0,0 +1,379 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define DIRSNAPSHOT_PRIVATE
+#include "or.h"
+#include "dirsnapshot.h"
+#include "microdesc.h"
+#include "networkstatus.h"
+#include "policies.h"
+#include "test.h"
+
+/** Helper: return a new consensus with <b>n_rs</b> entries and a single
+ * voter, filled with recognizable values. */
+static networkstatus_t *
+make_consensus(int n_rs)
+{
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  networkstatus_voter_info_t *voter;
+  document_signature_t *sig;
+  int i;
+
+  ns->type = NS_TYPE_CONSENSUS;
+  ns->flavor = FLAV_MICRODESC;
+  ns->valid_after = 1400000000;
+  ns->fresh_until = 1400003600;
+  ns->valid_until = 1400010800;
+  ns->consensus_method = 20;
+  ns->vote_seconds = 300;
+  ns->dist_seconds = 301;
+  ns->client_versions = tor_strdup("0.2.7.1-alpha,0.2.7.2-alpha");
+  ns->known_flags = smartlist_new();
+  smartlist_add(ns->known_flags, tor_strdup("Exit"));
+  smartlist_add(ns->known_flags, tor_strdup("Running"));
+  ns->net_params = smartlist_new();
+  smartlist_add(ns->net_params, tor_strdup("circwindow=80"));
+  ns->weight_params = smartlist_new();
+  memset(ns->digests.d[DIGEST_SHA1], 'x', DIGEST_LEN);
+  memset(ns->digests.d[DIGEST_SHA256], 'y', DIGEST256_LEN);
+
+  ns->voters = smartlist_new();
+  voter = tor_malloc_zero(sizeof(networkstatus_voter_info_t));
+  memset(voter->identity_digest, 'a', DIGEST_LEN);
+  voter->nickname = tor_strdup("moria1");
+  voter->address = tor_strdup("128.31.0.34");
+  voter->addr = 0x801f0022;
+  voter->dir_port = 9131;
+  voter->or_port = 9101;
+  voter->contact = tor_strdup("arma");
+  memset(voter->vote_digest, 'v', DIGEST_LEN);
+  voter->sigs = smartlist_new();
+  sig = tor_malloc_zero(sizeof(document_signature_t));
+  memset(sig->identity_digest, 'a', DIGEST_LEN);
+  memset(sig->signing_key_digest, 'k', DIGEST_LEN);
+  sig->alg = DIGEST_SHA256;
+  sig->signature = tor_strdup("a signature");
+  sig->signature_len = 11;
+  sig->good_signature = 1;
+  smartlist_add(voter->sigs, sig);
+  smartlist_add(ns->voters, voter);
+
+  ns->routerstatus_list = smartlist_new();
+  for (i = 0; i < n_rs; ++i) {
+    routerstatus_t *rs = tor_malloc_zero(sizeof(routerstatus_t));
+    rs->published_on = 1399990000 + i;
+    tor_snprintf(rs->nickname, sizeof(rs->nickname), "relay%d", i);
+    memset(rs->identity_digest, i, DIGEST_LEN);
+    memset(rs->descriptor_digest, 255-i, DIGEST256_LEN);
+    rs->addr = 0x0a000000 + i;
+    rs->or_port = 9001;
+    rs->dir_port = i ? 0 : 9030;
+    if (i == 1) {
+      tor_addr_parse(&rs->ipv6_addr, "[2001:db8::1]");
+      rs->ipv6_orport = 9002;
+    }
+    rs->is_exit = (i % 2) == 0;
+    rs->is_flagged_running = 1;
+    rs->is_hs_dir = (i == 2);
+    rs->has_guardfraction = (i == 2);
+    rs->guardfraction_percentage = 42;
+    rs->has_bandwidth = 1;
+    rs->bandwidth_kb = 1000 * i;
+    if (i == 0)
+      rs->exitsummary = tor_strdup("accept 80,443");
+    smartlist_add(ns->routerstatus_list, rs);
+  }
+  return ns;
+}
+
+static void
+test_dirsnapshot_consensus(void *arg)
+{
+  networkstatus_t *ns = NULL, *ns2 = NULL;
+  networkstatus_voter_info_t *voter;
+  document_signature_t *sig;
+  routerstatus_t *rs, *rs2;
+  char *body = NULL;
+  size_t len, i;
+  int j;
+  (void) arg;
+
+  ns = make_consensus(3);
+  body = dirsnapshot_encode_consensus(ns, &len);
+  tt_assert(body);
+  ns2 = dirsnapshot_decode_consensus(body, len);
+  tt_assert(ns2);
+
+  tt_int_op(ns2->type, OP_EQ, NS_TYPE_CONSENSUS);
+  tt_int_op(ns2->flavor, OP_EQ, FLAV_MICRODESC);
+  tt_int_op(ns2->valid_after, OP_EQ, ns->valid_after);
+  tt_int_op(ns2->fresh_until, OP_EQ, ns->fresh_until);
+  tt_int_op(ns2->valid_until, OP_EQ, ns->valid_until);
+  tt_int_op(ns2->consensus_method, OP_EQ, 20);
+  tt_int_op(ns2->vote_seconds, OP_EQ, 300);
+  tt_int_op(ns2->dist_seconds, OP_EQ, 301);
+  tt_str_op(ns2->client_versions, OP_EQ, ns->client_versions);
+  tt_ptr_op(ns2->server_versions, OP_EQ, NULL);
+  tt_ptr_op(ns2->package_lines, OP_EQ, NULL);
+  tt_int_op(smartlist_len(ns2->known_flags), OP_EQ, 2);
+  tt_str_op(smartlist_get(ns2->known_flags, 1), OP_EQ, "Running");
+  tt_int_op(smartlist_len(ns2->net_params), OP_EQ, 1);
+  tt_str_op(smartlist_get(ns2->net_params, 0), OP_EQ, "circwindow=80");
+  tt_assert(ns2->weight_params);
+  tt_int_op(smartlist_len(ns2->weight_params), OP_EQ, 0);
+  tt_mem_op(&ns2->digests, OP_EQ, &ns->digests, sizeof(ns->digests));
+
+  tt_int_op(smartlist_len(ns2->voters), OP_EQ, 1);
+  voter = smartlist_get(ns2->voters, 0);
+  tt_str_op(voter->nickname, OP_EQ, "moria1");
+  tt_str_op(voter->address, OP_EQ, "128.31.0.34");
+  tt_int_op(voter->addr, OP_EQ, 0x801f0022);
+  tt_int_op(voter->dir_port, OP_EQ, 9131);
+  tt_int_op(voter->or_port, OP_EQ, 9101);
+  tt_str_op(voter->contact, OP_EQ, "arma");
+  tt_int_op(smartlist_len(voter->sigs), OP_EQ, 1);
+  sig = smartlist_get(voter->sigs, 0);
+  tt_int_op(sig->alg, OP_EQ, DIGEST_SHA256);
+  tt_int_op(sig->signature_len, OP_EQ, 11);
+  tt_mem_op(sig->signature, OP_EQ, "a signature", 11);
+  tt_int_op(sig->good_signature, OP_EQ, 1);
+  tt_int_op(sig->bad_signature, OP_EQ, 0);
+
+  tt_int_op(smartlist_len(ns2->routerstatus_list), OP_EQ, 3);
+  for (j = 0; j < 3; ++j) {
+    rs = smartlist_get(ns->routerstatus_list, j);
+    rs2 = smartlist_get(ns2->routerstatus_list, j);
+    tt_int_op(rs2->published_on, OP_EQ, rs->published_on);
+    tt_str_op(rs2->nickname, OP_EQ, rs->nickname);
+    tt_mem_op(rs2->identity_digest, OP_EQ, rs->identity_digest, DIGEST_LEN);
+    tt_mem_op(rs2->descriptor_digest, OP_EQ, rs->descriptor_digest,
+              DIGEST256_LEN);
+    tt_int_op(rs2->addr, OP_EQ, rs->addr);
+    tt_int_op(rs2->or_port, OP_EQ, rs->or_port);
+    tt_int_op(rs2->dir_port, OP_EQ, rs->dir_port);
+    tt_assert(tor_addr_eq(&rs2->ipv6_addr, &rs->ipv6_addr));
+    tt_int_op(rs2->ipv6_orport, OP_EQ, rs->ipv6_orport);
+    tt_int_op(rs2->is_exit, OP_EQ, rs->is_exit);
+    tt_int_op(rs2->is_flagged_running, OP_EQ, 1);
+    tt_int_op(rs2->is_stable, OP_EQ, 0);
+    tt_int_op(rs2->is_hs_dir, OP_EQ, rs->is_hs_dir);
+    tt_int_op(rs2->has_guardfraction, OP_EQ, rs->has_guardfraction);
+    tt_int_op(rs2->guardfraction_percentage, OP_EQ, 42);
+    tt_int_op(rs2->bandwidth_kb, OP_EQ, rs->bandwidth_kb);
+    tt_str_op(rs2->exitsummary ? rs2->exitsummary : "", OP_EQ,
+              rs->exitsummary ? rs->exitsummary : "");
+  }
+  networkstatus_vote_free(ns2);
+  ns2 = NULL;
+
+  /* Every truncation is rejected, and so is trailing junk. */
+  for (i = 0; i < len; ++i) {
+    ns2 = dirsnapshot_decode_consensus(body, i);
+    tt_ptr_op(ns2, OP_EQ, NULL);
+  }
+  body = tor_realloc(body, len + 1);
+  body[len] = 0;
+  ns2 = dirsnapshot_decode_consensus(body, len + 1);
+  tt_ptr_op(ns2, OP_EQ, NULL);
+
+  /* So is an unknown flavor. */
+  body[0] = N_CONSENSUS_FLAVORS;
+  ns2 = dirsnapshot_decode_consensus(body, len);
+  tt_ptr_op(ns2, OP_EQ, NULL);
+
+ done:
+  tor_free(body);
+  networkstatus_vote_free(ns);
+  networkstatus_vote_free(ns2);
+}
+
+static void
+test_dirsnapshot_microdescs(void *arg)
+{
+  const char cache[] = "@last-listed 2015-06-01 00:00:00\n"
+    "onion-key\nfirst\n"
+    "onion-key\nsecond\n";
+  smartlist_t *mds = smartlist_new(), *mds2 = NULL;
+  microdesc_t *md, *md2;
+  curve25519_public_key_t ntor;
+  char *body = NULL, *policy = NULL;
+  size_t len;
+  (void) arg;
+
+  md = tor_malloc_zero(sizeof(microdesc_t));
+  md->saved_location = SAVED_IN_CACHE;
+  md->body = (char *)strstr(cache, "onion-key");
+  md->bodylen = 16;
+  md->off = md->body - cache;
+  memset(md->digest, 1, DIGEST256_LEN);
+  md->last_listed = 1433116800;
+  md->onion_pkey = pk_generate(0);
+  memset(&ntor, 7, sizeof(ntor));
+  md->onion_curve25519_pkey = tor_memdup(&ntor, sizeof(ntor));
+  md->family = smartlist_new();
+  smartlist_add(md->family, tor_strdup("relay7"));
+  md->exit_policy = parse_short_policy("accept 80,443");
+  smartlist_add(mds, md);
+
+  md = tor_malloc_zero(sizeof(microdesc_t));
+  md->saved_location = SAVED_IN_CACHE;
+  md->body = (char *)strstr(cache, "onion-key\nsecond");
+  md->bodylen = 17;
+  md->off = md->body - cache;
+  memset(md->digest, 2, DIGEST256_LEN);
+  md->onion_pkey = pk_generate(1);
+  tor_addr_parse(&md->ipv6_addr, "[2001:db8::2]");
+  md->ipv6_orport = 9050;
+  md->ipv6_exit_policy = parse_short_policy("reject 25");
+  smartlist_add(mds, md);
+
+  body = dirsnapshot_encode_microdescs(mds, &len);
+  tt_assert(body);
+  mds2 = dirsnapshot_decode_microdescs(body, len, cache, strlen(cache));
+  tt_assert(mds2);
+  tt_int_op(smartlist_len(mds2), OP_EQ, 2);
+
+  md = smartlist_get(mds, 0);
+  md2 = smartlist_get(mds2, 0);
+  tt_int_op(md2->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_ptr_op(md2->body, OP_EQ, md->body);
+  tt_int_op(md2->bodylen, OP_EQ, 16);
+  tt_int_op(md2->off, OP_EQ, md->off);
+  tt_mem_op(md2->digest, OP_EQ, md->digest, DIGEST256_LEN);
+  tt_int_op(md2->last_listed, OP_EQ, 1433116800);
+  tt_int_op(crypto_pk_cmp_keys(md2->onion_pkey, md->onion_pkey), OP_EQ, 0);
+  tt_assert(md2->onion_curve25519_pkey);
+  tt_mem_op(md2->onion_curve25519_pkey, OP_EQ, &ntor, sizeof(ntor));
+  tt_ptr_op(md2->ed25519_identity_pkey, OP_EQ, NULL);
+  tt_int_op(smartlist_len(md2->family), OP_EQ, 1);
+  tt_str_op(smartlist_get(md2->family, 0), OP_EQ, "relay7");
+  tt_assert(md2->exit_policy);
+  policy = write_short_policy(md2->exit_policy);
+  tt_str_op(policy, OP_EQ, "accept 80,443");
+  tor_free(policy);
+  tt_ptr_op(md2->ipv6_exit_policy, OP_EQ, NULL);
+
+  md = smartlist_get(mds, 1);
+  md2 = smartlist_get(mds2, 1);
+  tt_ptr_op(md2->body, OP_EQ, md->body);
+  tt_int_op(md2->last_listed, OP_EQ, 0);
+  tt_int_op(crypto_pk_cmp_keys(md2->onion_pkey, md->onion_pkey), OP_EQ, 0);
+  tt_ptr_op(md2->onion_curve25519_pkey, OP_EQ, NULL);
+  tt_ptr_op(md2->family, OP_EQ, NULL);
+  tt_ptr_op(md2->exit_policy, OP_EQ, NULL);
+  tt_assert(tor_addr_eq(&md2->ipv6_addr, &md->ipv6_addr));
+  tt_int_op(md2->ipv6_orport, OP_EQ, 9050);
+  tt_assert(md2->ipv6_exit_policy);
+  policy = write_short_policy(md2->ipv6_exit_policy);
+  tt_str_op(policy, OP_EQ, "reject 25");
+  tor_free(policy);
+  SMARTLIST_FOREACH(mds2, microdesc_t *, m, microdesc_free(m));
+  smartlist_free(mds2);
+
+  /* A snapshot of a different, shorter cache file is no good. */
+  mds2 = dirsnapshot_decode_microdescs(body, len, cache, strlen(cache) - 1);
+  tt_ptr_op(mds2, OP_EQ, NULL);
+  mds2 = dirsnapshot_decode_microdescs(body, len - 1, cache, strlen(cache));
+  tt_ptr_op(mds2, OP_EQ, NULL);
+
+ done:
+  tor_free(body);
+  tor_free(policy);
+  SMARTLIST_FOREACH(mds, microdesc_t *, m, microdesc_free(m));
+  smartlist_free(mds);
+  if (mds2) {
+    SMARTLIST_FOREACH(mds2, microdesc_t *, m, microdesc_free(m));
+    smartlist_free(mds2);
+  }
+}
+
+static void
+test_dirsnapshot_file(void *arg)
+{
+  const char *fname = get_fname("snapshot");
+  const char body[] = "the parsed document";
+  char source[DIGEST256_LEN], context[DIGEST256_LEN];
+  char other[DIGEST256_LEN];
+  const char *body_out = NULL;
+  size_t body_len = 0;
+  tor_mmap_t *mm = NULL;
+  char *contents = NULL;
+  size_t size;
+  (void) arg;
+
+  memset(source, 's', sizeof(source));
+  memset(context, 'c', sizeof(context));
+  memset(other, 'o', sizeof(other));
+
+  /* No file at all. */
+  mm = dirsnapshot_open_file(fname, DIRSNAPSHOT_TYPE_CONSENSUS, source,
+                             context, 1000, &body_out, &body_len);
+  tt_ptr_op(mm, OP_EQ, NULL);
+
+  tt_int_op(0, OP_EQ, dirsnapshot_write_file(fname,
+                                             DIRSNAPSHOT_TYPE_CONSENSUS,
+                                             source, context, 2000,
+                                             body, strlen(body)));
+  mm = dirsnapshot_open_file(fname, DIRSNAPSHOT_TYPE_CONSENSUS, source,
+                             context, 1000, &body_out, &body_len);
+  tt_assert(mm);
+  tt_int_op(body_len, OP_EQ, strlen(body));
+  tt_mem_op(body_out, OP_EQ, body, body_len);
+  tor_munmap_file(mm);
+
+  /* Any mismatch makes us ignore the snapshot. */
+  mm = dirsnapshot_open_file(fname, DIRSNAPSHOT_TYPE_MICRODESCS, source,
+                             context, 1000, &body_out, &body_len);
+  tt_ptr_op(mm, OP_EQ, NULL);
+  mm = dirsnapshot_open_file(fname, DIRSNAPSHOT_TYPE_CONSENSUS, other,
+                             context, 1000, &body_out, &body_len);
+  tt_ptr_op(mm, OP_EQ, NULL);
+  mm = dirsnapshot_open_file(fname, DIRSNAPSHOT_TYPE_CONSENSUS, source,
+                             other, 1000, &body_out, &body_len);
+  tt_ptr_op(mm, OP_EQ, NULL);
+  mm = dirsnapshot_open_file(fname, DIRSNAPSHOT_TYPE_CONSENSUS, source,
+                             context, 2001, &body_out, &body_len);
+  tt_ptr_op(mm, OP_EQ, NULL);
+
+  /* So does damage to the file. */
+  contents = read_file_to_str(fname, RFTS_BIN, NULL);
+  tt_assert(contents);
+  size = DIRSNAPSHOT_HEADER_LEN + strlen(body);
+  contents[size - 1] ^= 1;
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, contents, size, 1));
+  mm = dirsnapshot_open_file(fname, DIRSNAPSHOT_TYPE_CONSENSUS, source,
+                             context, 1000, &body_out, &body_len);
+  tt_ptr_op(mm, OP_EQ, NULL);
+  contents[size - 1] ^= 1;
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, contents, size - 1, 1));
+  mm = dirsnapshot_open_file(fname, DIRSNAPSHOT_TYPE_CONSENSUS, source,
+                             context, 1000, &body_out, &body_len);
+  tt_ptr_op(mm, OP_EQ, NULL);
+  contents[DIRSNAPSHOT_MAGIC_LEN + 3] += 1; /* version */
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, contents, size, 1));
+  mm = dirsnapshot_open_file(fname, DIRSNAPSHOT_TYPE_CONSENSUS, source,
+                             context, 1000, &body_out, &body_len);
+  tt_ptr_op(mm, OP_EQ, NULL);
+
+  /* A snapshot that never expires. */
+  tt_int_op(0, OP_EQ, dirsnapshot_write_file(fname,
+                                             DIRSNAPSHOT_TYPE_MICRODESCS,
+                                             source, context, 0,
+                                             body, strlen(body)));
+  mm = dirsnapshot_open_file(fname, DIRSNAPSHOT_TYPE_MICRODESCS, source,
+                             context, time(NULL), &body_out, &body_len);
+  tt_assert(mm);
+
+ done:
+  if (mm)
+    tor_munmap_file(mm);
+  tor_free(contents);
+}
+
+struct testcase_t dirsnapshot_tests[] = {
+  { "consensus", test_dirsnapshot_consensus, 0, NULL, NULL },
+  { "microdescs", test_dirsnapshot_microdescs, 0, NULL, NULL },
+  { "file", test_dirsnapshot_file, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
+
@@ -8,12 +8,14 @@
 
 #define CONTROL_PRIVATE
 #define CIRCUITBUILD_PRIVATE
+#define RENDSERVICE_PRIVATE
 
 #include "or.h"
 #include "test.h"
 #include "control.h"
 #include "config.h"
 #include "rendcommon.h"
+#include "rendservice.h"
 #include "routerset.h"
 #include "circuitbuild.h"
 #include "test_helpers.h"
@@ -437,6 +439,122 @@ test_hs_rend_data(void *arg)
   rend_data_free(client_dup);
 }
 
+/** Helper: make a rend_service_instance_t called <b>id</b> with
+ * <b>n</b> empty intro points. */
+static rend_service_instance_t *
+make_instance(const char *id, int n)
+{
+  rend_service_instance_t *inst = tor_malloc_zero(sizeof(*inst));
+  strlcpy(inst->id, id, sizeof(inst->id));
+  inst->intro_nodes = smartlist_new();
+  while (n--)
+    smartlist_add(inst->intro_nodes,
+                  tor_malloc_zero(sizeof(rend_intro_point_t)));
+  return inst;
+}
+
+/* Make sure that merging the intro points of several instances of a
+ * service takes them from each instance in turn, in order of id. */
+static void
+test_hs_merge_instances(void *arg)
+{
+  smartlist_t *instances = smartlist_new(), *merged = NULL;
+  rend_service_instance_t *a, *b, *c;
+  (void)arg;
+
+  c = make_instance("cccccccccccccccc", 4);
+  a = make_instance("aaaaaaaaaaaaaaaa", 1);
+  b = make_instance("bbbbbbbbbbbbbbbb", 3);
+  smartlist_add(instances, c);
+  smartlist_add(instances, a);
+  smartlist_add(instances, b);
+
+  merged = rend_service_merge_instance_intro_points(instances, 5);
+  tt_int_op(smartlist_len(merged), OP_EQ, 5);
+  tt_ptr_op(smartlist_get(merged, 0), OP_EQ, smartlist_get(a->intro_nodes, 0));
+  tt_ptr_op(smartlist_get(merged, 1), OP_EQ, smartlist_get(b->intro_nodes, 0));
+  tt_ptr_op(smartlist_get(merged, 2), OP_EQ, smartlist_get(c->intro_nodes, 0));
+  tt_ptr_op(smartlist_get(merged, 3), OP_EQ, smartlist_get(b->intro_nodes, 1));
+  tt_ptr_op(smartlist_get(merged, 4), OP_EQ, smartlist_get(c->intro_nodes, 1));
+  smartlist_free(merged);
+
+  /* With room for everything, we list everything. */
+  merged = rend_service_merge_instance_intro_points(instances, 10);
+  tt_int_op(smartlist_len(merged), OP_EQ, 8);
+  tt_ptr_op(smartlist_get(merged, 7), OP_EQ, smartlist_get(c->intro_nodes, 3));
+
+ done:
+  smartlist_free(merged);
+  SMARTLIST_FOREACH(instances, rend_service_instance_t *, inst,
+                    rend_service_instance_free(inst));
+  smartlist_free(instances);
+}
+
+/* Make sure that instance files round-trip, and that we ignore the ones
+ * for other services and for instances that have gone away. */
+static void
+test_hs_instance_file(void *arg)
+{
+  rend_service_descriptor_t *desc = NULL;
+  rend_intro_point_t *intro;
+  char *encoded = NULL, *body = NULL;
+  const char *intro_points = NULL;
+  smartlist_t *parsed = NULL;
+  time_t now = time(NULL);
+  (void)arg;
+
+  desc = tor_malloc_zero(sizeof(rend_service_descriptor_t));
+  desc->intro_nodes = smartlist_new();
+  intro = tor_malloc_zero(sizeof(rend_intro_point_t));
+  intro->extend_info = tor_malloc_zero(sizeof(extend_info_t));
+  memset(intro->extend_info->identity_digest, 0x42, DIGEST_LEN);
+  tor_addr_from_ipv4h(&intro->extend_info->addr, 0x01020304);
+  intro->extend_info->port = 9001;
+  intro->extend_info->onion_key = pk_generate(0);
+  intro->intro_key = pk_generate(1);
+  smartlist_add(desc->intro_nodes, intro);
+  tt_int_op(rend_encode_v2_intro_points(&encoded, desc), OP_EQ, 0);
+
+  body = rend_service_format_instance_file(STR_HS_ADDR, now, encoded);
+  parsed = rend_service_parse_instance_file(body, STR_HS_ADDR, now,
+                                            &intro_points);
+  tt_assert(parsed);
+  tt_str_op(intro_points, OP_EQ, encoded);
+  tt_int_op(smartlist_len(parsed), OP_EQ, 1);
+  intro = smartlist_get(parsed, 0);
+  tt_mem_op(intro->extend_info->identity_digest, OP_EQ,
+            ((rend_intro_point_t *)smartlist_get(desc->intro_nodes, 0))
+              ->extend_info->identity_digest, DIGEST_LEN);
+  tt_int_op(intro->extend_info->port, OP_EQ, 9001);
+  tt_assert(crypto_pk_eq_keys(intro->intro_key,
+            ((rend_intro_point_t *)smartlist_get(desc->intro_nodes, 0))
+              ->intro_key));
+  SMARTLIST_FOREACH(parsed, rend_intro_point_t *, ip,
+                    rend_intro_point_free(ip));
+  smartlist_free(parsed);
+  parsed = NULL;
+
+  /* Some other service's file. */
+  tt_ptr_op(NULL, OP_EQ, rend_service_parse_instance_file(body,
+                                       "aaaaaaaaaaaaaaaa", now, NULL));
+  /* An instance that stopped updating its file an hour ago. */
+  tt_ptr_op(NULL, OP_EQ, rend_service_parse_instance_file(body,
+                                       STR_HS_ADDR, now + 3600, NULL));
+  /* Junk. */
+  tt_ptr_op(NULL, OP_EQ, rend_service_parse_instance_file("instance-of\n",
+                                       STR_HS_ADDR, now, NULL));
+
+ done:
+  if (parsed) {
+    SMARTLIST_FOREACH(parsed, rend_intro_point_t *, ip,
+                      rend_intro_point_free(ip));
+    smartlist_free(parsed);
+  }
+  rend_service_descriptor_free(desc);
+  tor_free(encoded);
+  tor_free(body);
+}
+
 struct testcase_t hs_tests[] = {
   { "hs_rend_data", test_hs_rend_data, TT_FORK,
     NULL, NULL },
@@ -447,6 +565,8 @@ struct testcase_t hs_tests[] = {
   { "pick_bad_tor2web_rendezvous_node",
     test_pick_bad_tor2web_rendezvous_node, TT_FORK,
     NULL, NULL },
+  { "merge_instances", test_hs_merge_instances, 0, NULL, NULL },
+  { "instance_file", test_hs_instance_file, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -519,6 +519,117 @@ test_introduce_late_parse_v3(void *arg)
       v3_basic_auth_test_plaintext, sizeof(v3_basic_auth_test_plaintext));
 }
 
+/** Test that the worker-thread half of INTRODUCE2 handling decrypts and
+ * parses a v3 cell and does the DH handshake, and fails cleanly when the
+ * cell is for some other key.
+ */
+
+static void
+test_introduce_process_job(void *arg)
+{
+  crypto_pk_t *k = NULL, *other = NULL;
+  uint8_t *cell = NULL;
+  ssize_t r;
+  char *err_msg = NULL;
+  rend_intro_job_t *job = NULL;
+  char zero[DIGEST_LEN+CPATH_KEY_MATERIAL_LEN];
+  (void)arg;
+
+  memset(zero, 0, sizeof(zero));
+  k = crypto_pk_new();
+  tt_assert(!crypto_pk_read_private_key_from_string(k, AUTHORITY_SIGNKEY_1,
+                                                     -1));
+  r = make_intro_from_plaintext(v3_no_auth_test_plaintext,
+                                sizeof(v3_no_auth_test_plaintext),
+                                k, (void **)(&cell));
+  tt_assert(r > 0);
+
+  job = tor_malloc_zero(sizeof(rend_intro_job_t));
+  job->intro_key = crypto_pk_dup_key(k);
+  job->dh_severity = LOG_WARN;
+  job->dh = crypto_dh_new(DH_TYPE_REND);
+  job->parsed_req = rend_service_begin_parse_intro(cell, r, 2, &err_msg);
+  tt_assert(job->parsed_req);
+  tt_int_op(rend_service_process_intro_job(job), OP_EQ, 0);
+  tt_int_op(job->status, OP_EQ, 0);
+  tt_ptr_op(job->err_msg, OP_EQ, NULL);
+  tt_assert(job->parsed_req->parsed);
+  tt_int_op(job->parsed_req->version, OP_EQ, 3);
+  tt_mem_op(job->keys, OP_NE, zero, sizeof(zero));
+  rend_intro_job_free(job);
+
+  /* Now try a job whose cell is encrypted to a different key. */
+  other = pk_generate(0);
+  job = tor_malloc_zero(sizeof(rend_intro_job_t));
+  job->intro_key = crypto_pk_dup_key(other);
+  job->dh = crypto_dh_new(DH_TYPE_REND);
+  job->parsed_req = rend_service_begin_parse_intro(cell, r, 2, &err_msg);
+  tt_assert(job->parsed_req);
+  tt_int_op(rend_service_process_intro_job(job), OP_EQ, -1);
+  tt_int_op(job->status, OP_EQ, -1);
+  tt_str_op(job->stage_descr, OP_EQ, "decryption");
+  tt_assert(job->err_msg);
+  tt_assert(!job->parsed_req->parsed);
+
+ done:
+  rend_intro_job_free(job);
+  crypto_pk_free(k);
+  crypto_pk_free(other);
+  tor_free(cell);
+  tor_free(err_msg);
+}
+
+/** Mock for rend_intro_job_cancel(): pretend that jobs with an odd
+ * n_circ_id are already running in a worker thread. */
+static int
+mock_rend_intro_job_cancel(rend_intro_job_t *job)
+{
+  return !(job->n_circ_id & 1);
+}
+
+/** Test that when too many INTRODUCE2 jobs are pending, we drop the oldest
+ * ones that haven't started yet, and keep the rest in order.
+ */
+
+static void
+test_introduce_drop_oldest(void *arg)
+{
+  smartlist_t *jobs = smartlist_new();
+  int i;
+  (void)arg;
+
+  MOCK(rend_intro_job_cancel, mock_rend_intro_job_cancel);
+
+  /* Jobs 1, 3 and 5 are running; 2, 4 and 6 are waiting. */
+  for (i = 1; i <= 6; ++i) {
+    rend_intro_job_t *job = tor_malloc_zero(sizeof(rend_intro_job_t));
+    job->n_circ_id = i;
+    smartlist_add(jobs, job);
+  }
+
+  /* Under the limit: nothing happens. */
+  tt_int_op(rend_intro_jobs_make_room(jobs, 7), OP_EQ, 0);
+  tt_int_op(smartlist_len(jobs), OP_EQ, 6);
+
+  /* Two over the limit: drop 2 and 4, the oldest waiting jobs. */
+  tt_int_op(rend_intro_jobs_make_room(jobs, 5), OP_EQ, 0);
+  tt_int_op(smartlist_len(jobs), OP_EQ, 4);
+  tt_int_op(((rend_intro_job_t*)smartlist_get(jobs, 0))->n_circ_id,OP_EQ,1);
+  tt_int_op(((rend_intro_job_t*)smartlist_get(jobs, 1))->n_circ_id,OP_EQ,3);
+  tt_int_op(((rend_intro_job_t*)smartlist_get(jobs, 2))->n_circ_id,OP_EQ,5);
+  tt_int_op(((rend_intro_job_t*)smartlist_get(jobs, 3))->n_circ_id,OP_EQ,6);
+
+  /* Only running jobs would be left: there's no room. */
+  tt_int_op(rend_intro_jobs_make_room(jobs, 3), OP_EQ, -1);
+  tt_int_op(smartlist_len(jobs), OP_EQ, 3);
+  tt_int_op(((rend_intro_job_t*)smartlist_get(jobs, 2))->n_circ_id,OP_EQ,5);
+
+ done:
+  UNMOCK(rend_intro_job_cancel);
+  SMARTLIST_FOREACH(jobs, rend_intro_job_t *, job, rend_intro_job_free(job));
+  smartlist_free(jobs);
+}
+
 #define INTRODUCE_LEGACY(name) \
   { #name, test_introduce_ ## name , 0, NULL, NULL }
 
@@ -535,6 +646,8 @@ struct testcase_t introduce_tests[] = {
   INTRODUCE_LEGACY(late_parse_v1),
   INTRODUCE_LEGACY(late_parse_v2),
   INTRODUCE_LEGACY(late_parse_v3),
+  { "process_job", test_introduce_process_job, TT_FORK, NULL, NULL },
+  { "drop_oldest", test_introduce_drop_oldest, 0, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -5,14 +5,18 @@
 
 #define CHANNELTLS_PRIVATE
 #define CONNECTION_PRIVATE
+#define CONNECTION_OR_PRIVATE
 #define TOR_CHANNEL_INTERNAL_
 #include "or.h"
 #include "config.h"
 #include "connection.h"
 #include "connection_or.h"
 #include "channeltls.h"
+#include "cpuworker.h"
 #include "link_handshake.h"
+#include "main.h"
 #include "scheduler.h"
+#include "workqueue.h"
 
 #include "test.h"
 
@@ -793,6 +797,238 @@ test_link_handshake_auth_cell(void *arg)
   crypto_pk_free(auth_pubkey);
 }
 
+static void
+test_link_handshake_auth_signed_later(void *arg)
+{
+  authenticate_data_t *d = arg;
+  or_auth_job_t *job = NULL;
+
+  /* Make another authenticate cell, but sign it the way a worker thread
+   * would. */
+  job = or_auth_job_new(d->c1, tor_tls_get_my_client_auth_key());
+  tt_assert(job);
+  tt_int_op(job->body_len, ==, V3_AUTH_BODY_LEN);
+  tt_int_op(job->auth_len, ==, -1);
+  tt_int_op(or_auth_job_sign(job), ==, 0);
+  tt_int_op(job->auth_len, ==, d->cell->payload_len - 4);
+  tt_int_op(job->cell->payload_len, ==, d->cell->payload_len);
+  tt_int_op(ntohs(get_uint16(job->cell->payload + 2)), ==, job->auth_len);
+
+  /* c2 should like it just as much as the one we signed in one go. */
+  tor_free(d->cell);
+  d->cell = job->cell;
+  job->cell = NULL;
+  tt_int_op(d->c2->handshake_state->authenticated, ==, 0);
+  channel_tls_process_authenticate_cell(d->cell, d->chan2);
+  tt_int_op(mock_close_called, ==, 0);
+  tt_int_op(d->c2->handshake_state->authenticated, ==, 1);
+
+ done:
+  or_auth_job_free(job);
+}
+
+/* A stand-in for the work we pretend to queue. */
+static char mock_workqueue_entry;
+static int (*mock_queued_fn)(void *, void *) = NULL;
+static void (*mock_queued_reply_fn)(void *) = NULL;
+static void *mock_queued_arg = NULL;
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work(int (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  mock_queued_fn = fn;
+  mock_queued_reply_fn = reply_fn;
+  mock_queued_arg = arg;
+  return (workqueue_entry_t *)&mock_workqueue_entry;
+}
+
+static int mock_cancel_called = 0;
+static int mock_cancel_succeeds = 0;
+static void *
+mock_workqueue_entry_cancel(workqueue_entry_t *ent)
+{
+  tt_ptr_op(ent, ==, (workqueue_entry_t *)&mock_workqueue_entry);
+  ++mock_cancel_called;
+  return mock_cancel_succeeds ? mock_queued_arg : NULL;
+ done:
+  return NULL;
+}
+
+static int mock_stop_reading_called = 0;
+static void
+mock_stop_reading(connection_t *conn)
+{
+  (void)conn;
+  ++mock_stop_reading_called;
+}
+
+static int mock_start_reading_called = 0;
+static void
+mock_start_reading(connection_t *conn)
+{
+  (void)conn;
+  ++mock_start_reading_called;
+}
+
+static void
+test_link_handshake_auth_queue_sync(void *arg)
+{
+  authenticate_data_t *d = arg;
+
+  /* With AsyncLinkHandshakes off, the caller signs the cell itself. */
+  get_options_mutable()->AsyncLinkHandshakes = 0;
+  tt_int_op(connection_or_queue_authenticate_cell(d->c1,
+                                    AUTHTYPE_RSA_SHA256_TLSSECRET), ==, 0);
+  tt_ptr_op(d->c1->handshake_state->auth_job, ==, NULL);
+
+  /* Likewise when there are no worker threads to give it to... */
+  get_options_mutable()->AsyncLinkHandshakes = 1;
+  tt_int_op(connection_or_queue_authenticate_cell(d->c1,
+                                    AUTHTYPE_RSA_SHA256_TLSSECRET), ==, 0);
+  tt_ptr_op(d->c1->handshake_state->auth_job, ==, NULL);
+
+  /* ...or when it's an authentication type we don't know how to sign. */
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  tt_int_op(connection_or_queue_authenticate_cell(d->c1, 0xff), ==, 0);
+  tt_ptr_op(d->c1->handshake_state->auth_job, ==, NULL);
+  tt_ptr_op(mock_queued_arg, ==, NULL);
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  get_options_mutable()->AsyncLinkHandshakes = 0;
+}
+
+static void
+test_link_handshake_auth_queue_async(void *arg)
+{
+  authenticate_data_t *d = arg;
+  or_auth_job_t *job;
+
+  get_options_mutable()->AsyncLinkHandshakes = 1;
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  MOCK(connection_stop_reading, mock_stop_reading);
+  MOCK(connection_start_reading, mock_start_reading);
+  MOCK(connection_or_send_netinfo, mock_send_netinfo);
+
+  /* Queueing the job stops us reading until it's done. */
+  tt_int_op(connection_or_queue_authenticate_cell(d->c1,
+                                    AUTHTYPE_RSA_SHA256_TLSSECRET), ==, 1);
+  job = d->c1->handshake_state->auth_job;
+  tt_assert(job);
+  tt_ptr_op(mock_queued_arg, ==, job);
+  tt_ptr_op(job->workqueue_entry, ==,
+            (workqueue_entry_t *)&mock_workqueue_entry);
+  tt_int_op(mock_stop_reading_called, ==, 1);
+  tt_ptr_op(mock_got_var_cell, ==, NULL);
+
+  /* Run it the way the threadpool would. */
+  tt_int_op(mock_queued_fn(NULL, mock_queued_arg), ==, WQ_RPL_REPLY);
+  mock_queued_reply_fn(mock_queued_arg);
+
+  /* The reply sends the AUTHENTICATE cell and then NETINFO, and starts
+   * reading again. */
+  tt_ptr_op(d->c1->handshake_state->auth_job, ==, NULL);
+  tt_assert(mock_got_var_cell);
+  tt_int_op(mock_got_var_cell->command, ==, CELL_AUTHENTICATE);
+  tt_int_op(mock_got_var_cell->payload_len, ==, d->cell->payload_len);
+  tt_int_op(mock_send_netinfo_called, ==, 1);
+  tt_int_op(mock_start_reading_called, ==, 1);
+  tt_int_op(mock_close_called, ==, 0);
+
+  /* And c2 accepts it. */
+  tor_free(d->cell);
+  d->cell = mock_got_var_cell;
+  mock_got_var_cell = NULL;
+  channel_tls_process_authenticate_cell(d->cell, d->chan2);
+  tt_int_op(mock_close_called, ==, 0);
+  tt_int_op(d->c2->handshake_state->authenticated, ==, 1);
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(connection_stop_reading);
+  UNMOCK(connection_start_reading);
+  UNMOCK(connection_or_send_netinfo);
+  get_options_mutable()->AsyncLinkHandshakes = 0;
+}
+
+/** Queue an AUTHENTICATE cell on c1 in <b>d</b>, and then free c1 while
+ * the job is still pending.  If <b>cancel_succeeds</b>, no worker has
+ * picked the job up yet; else one is busy with it.  Return the job. */
+static or_auth_job_t *
+queue_auth_job_and_free_conn(authenticate_data_t *d, int cancel_succeeds)
+{
+  or_auth_job_t *job = NULL;
+
+  get_options_mutable()->AsyncLinkHandshakes = 1;
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  MOCK(workqueue_entry_cancel, mock_workqueue_entry_cancel);
+  MOCK(connection_stop_reading, mock_stop_reading);
+  MOCK(connection_start_reading, mock_start_reading);
+  MOCK(connection_or_send_netinfo, mock_send_netinfo);
+
+  mock_cancel_succeeds = cancel_succeeds;
+  tt_int_op(connection_or_queue_authenticate_cell(d->c1,
+                                    AUTHTYPE_RSA_SHA256_TLSSECRET), ==, 1);
+  job = d->c1->handshake_state->auth_job;
+  tt_assert(job);
+  connection_free_(TO_CONN(d->c1));
+  d->c1 = NULL;
+  tt_int_op(mock_cancel_called, ==, 1);
+ done:
+  return job;
+}
+
+static void
+unmock_auth_job(void)
+{
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(workqueue_entry_cancel);
+  UNMOCK(connection_stop_reading);
+  UNMOCK(connection_start_reading);
+  UNMOCK(connection_or_send_netinfo);
+  get_options_mutable()->AsyncLinkHandshakes = 0;
+}
+
+static void
+test_link_handshake_auth_queue_cancelled(void *arg)
+{
+  authenticate_data_t *d = arg;
+
+  /* If no worker has picked the job up yet, freeing the connection
+   * cancels the job and frees it; nothing else will ever see it. */
+  tt_assert(queue_auth_job_and_free_conn(d, 1));
+  tt_ptr_op(d->c1, ==, NULL);
+
+ done:
+  unmock_auth_job();
+}
+
+static void
+test_link_handshake_auth_queue_detached(void *arg)
+{
+  authenticate_data_t *d = arg;
+  or_auth_job_t *job;
+
+  /* If a worker is already busy with the job, it outlives the connection,
+   * which lets go of it... */
+  job = queue_auth_job_and_free_conn(d, 0);
+  tt_assert(job);
+  tt_ptr_op(job->conn, ==, NULL);
+
+  /* ...and the reply just frees it, without sending anything. */
+  tt_int_op(mock_queued_fn(NULL, mock_queued_arg), ==, WQ_RPL_REPLY);
+  mock_queued_reply_fn(mock_queued_arg);
+  tt_ptr_op(mock_got_var_cell, ==, NULL);
+  tt_int_op(mock_send_netinfo_called, ==, 0);
+  tt_int_op(mock_start_reading_called, ==, 0);
+  tt_int_op(mock_close_called, ==, 0);
+
+ done:
+  unmock_auth_job();
+}
+
 #define AUTHENTICATE_FAIL(name, code)                           \
   static void                                                   \
   test_link_handshake_auth_ ## name(void *arg)                  \
@@ -906,6 +1142,11 @@ struct testcase_t link_handshake_tests[] = {
   TEST_RCV_AUTHCHALLENGE(nonzero_circid),
 
   TEST_AUTHENTICATE(cell),
+  TEST_AUTHENTICATE(signed_later),
+  TEST_AUTHENTICATE(queue_sync),
+  TEST_AUTHENTICATE(queue_async),
+  TEST_AUTHENTICATE(queue_cancelled),
+  TEST_AUTHENTICATE(queue_detached),
   TEST_AUTHENTICATE(badstate),
   TEST_AUTHENTICATE(badproto),
   TEST_AUTHENTICATE(atclient),
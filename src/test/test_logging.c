@@ -127,9 +127,113 @@ test_sigsafe_err(void *arg)
   smartlist_free(lines);
 }
 
+static void
+test_async(void *arg)
+{
+  const char *fn = get_fname("async_log");
+  char *content = NULL;
+  log_severity_list_t include_info;
+  smartlist_t *lines = smartlist_new();
+  uint64_t n_dropped;
+  int i, n_found = 0, last = -1;
+  (void)arg;
+
+  set_log_severity_config(LOG_INFO, LOG_ERR, &include_info);
+
+  init_logging(1);
+  mark_logs_temp();
+  tt_int_op(0, OP_EQ, add_file_log(&include_info, fn, 1));
+  close_temp_logs();
+
+  /* Use a small buffer, so that we probably drop some messages. */
+  tt_int_op(0, OP_EQ, logs_set_async(1, 4096));
+  for (i = 0; i < 1000; ++i)
+    log_info(LD_GENERAL, "Async message %d", i);
+  tt_int_op(0, OP_EQ, logs_set_async(0, 0));
+  n_dropped = logs_get_n_async_dropped();
+
+  content = read_file_to_str(fn, 0, NULL);
+  tt_assert(content != NULL);
+  tor_split_lines(lines, content, (int)strlen(content));
+  SMARTLIST_FOREACH_BEGIN(lines, const char *, line) {
+    const char *cp = strstr(line, "Async message ");
+    if (!cp)
+      continue;
+    i = atoi(cp + strlen("Async message "));
+    /* Messages come out in order, with none repeated. */
+    tt_int_op(i, OP_GT, last);
+    last = i;
+    ++n_found;
+  } SMARTLIST_FOREACH_END(line);
+
+  /* Every message was either written or counted as dropped. */
+  tt_u64_op(n_found + n_dropped, OP_EQ, 1000);
+
+  /* Messages that arrive after we turn async logging off are written
+   * immediately. */
+  log_info(LD_GENERAL, "Synchronous message");
+  tor_free(content);
+  content = read_file_to_str(fn, 0, NULL);
+  tt_assert(content != NULL);
+  tt_assert(strstr(content, "Synchronous message"));
+
+ done:
+  logs_set_async(0, 0);
+  tor_free(content);
+  smartlist_free(lines);
+}
+
+static void
+test_async_dead_log(void *arg)
+{
+  const char *fn = get_fname("async_dead_log");
+  char *content = NULL;
+  log_severity_list_t include_info;
+  int fd = -1, fd2 = -1;
+  (void)arg;
+
+  set_log_severity_config(LOG_INFO, LOG_ERR, &include_info);
+
+  init_logging(1);
+  mark_logs_temp();
+  close_temp_logs();
+  fd = tor_open_cloexec(fn, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  tt_int_op(fd, OP_GE, 0);
+  add_stream_log(&include_info, "dead log", fd);
+
+  /* If the writer thread can't write to a log... */
+  tt_int_op(0, OP_EQ, logs_set_async(1, 4096));
+  close(fd);
+  log_info(LD_GENERAL, "Lost message");
+  tt_int_op(0, OP_EQ, logs_set_async(0, 0));
+
+  /* ...we stop using it, even once the fd works again. */
+  fd2 = tor_open_cloexec(fn, O_WRONLY|O_TRUNC, 0644);
+  tt_int_op(fd2, OP_GE, 0);
+  if (fd2 != fd) {
+    tt_int_op(dup2(fd2, fd), OP_EQ, fd);
+    close(fd2);
+  }
+  fd2 = -1;
+  log_info(LD_GENERAL, "Ignored message");
+  content = read_file_to_str(fn, 0, NULL);
+  tt_assert(content != NULL);
+  tt_str_op(content, OP_EQ, "");
+
+ done:
+  logs_set_async(0, 0);
+  mark_logs_temp();
+  close_temp_logs();
+  if (fd2 >= 0)
+    close(fd2);
+  tor_free(content);
+}
+
 struct testcase_t logging_tests[] = {
   { "sigsafe_err_fds", test_get_sigsafe_err_fds, TT_FORK, NULL, NULL },
   { "sigsafe_err", test_sigsafe_err, TT_FORK, NULL, NULL },
+  { "async", test_async, TT_FORK, NULL, NULL },
+  { "async_dead_log", test_async_dead_log, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
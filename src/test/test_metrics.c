@@ -0,0 +1,163 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define CONNECTION_PRIVATE
+#include "or.h"
+#include "buffers.h"
+#include "connection.h"
+#include "main.h"
+#include "metrics.h"
+#include "test.h"
+
+static void
+test_metrics_format(void *arg)
+{
+  char *s = NULL;
+  (void) arg;
+
+  metrics_reset_counters();
+  metrics_note_cell_received(CELL_RELAY);
+  metrics_note_cell_received(CELL_RELAY);
+  metrics_note_cell_received(CELL_CREATE2);
+  metrics_note_cell_received(200);
+  metrics_note_cell_received(201);
+  metrics_note_cell_sent(CELL_DESTROY);
+  metrics_incr(METRICS_ONIONSKINS_DROPPED);
+  metrics_add(METRICS_OOM_BYTES_RECOVERED, 12345);
+  metrics_incr(METRICS_DNS_CACHE_HITS);
+  metrics_incr(METRICS_TLS_HANDSHAKES_RESUMED);
+  metrics_incr(METRICS_TLS_KTLS_SEND);
+  metrics_add(METRICS_TLS_RECORDS_WRITTEN, 4);
+  metrics_add(METRICS_TLS_RECORD_BYTES_WRITTEN, 40000);
+
+  s = metrics_format();
+  tt_assert(strstr(s, "# TYPE tor_cells_received_total counter\n"));
+  tt_assert(strstr(s, "tor_cells_received_total{command=\"relay\"} 2\n"));
+  tt_assert(strstr(s, "tor_cells_received_total{command=\"create2\"} 1\n"));
+  tt_assert(strstr(s,
+                   "tor_cells_received_total{command=\"unrecognized\"} 2\n"));
+  /* Commands we never saw aren't listed. */
+  tt_assert(!strstr(s, "tor_cells_received_total{command=\"padding\"}"));
+  tt_assert(strstr(s, "tor_cells_sent_total{command=\"destroy\"} 1\n"));
+  tt_assert(strstr(s, "tor_onionskins_total{result=\"dropped\"} 1\n"));
+  tt_assert(strstr(s, "tor_onionskins_total{result=\"processed\"} 0\n"));
+  tt_assert(strstr(s, "tor_oom_bytes_recovered_total 12345\n"));
+  tt_assert(strstr(s, "tor_dns_cache_total{result=\"hit\"} 1\n"));
+  tt_assert(strstr(s,
+                   "tor_tls_handshakes_by_kind_total{kind=\"resumed\"} 1\n"));
+  tt_assert(strstr(s, "tor_tls_handshakes_by_kind_total{kind=\"full\"} 0\n"));
+  tt_assert(strstr(s,
+                   "tor_tls_ktls_offloads_total{direction=\"send\"} 1\n"));
+  tt_assert(strstr(s,
+                   "tor_tls_ktls_offloads_total{direction=\"recv\"} 0\n"));
+  tt_assert(strstr(s, "tor_tls_records_written_total 4\n"));
+  tt_assert(strstr(s, "tor_tls_record_average_bytes 10000\n"));
+  tt_assert(strstr(s, "tor_circuits{state=\"open\"} 0\n"));
+  tt_int_op(s[strlen(s)-1], OP_EQ, '\n');
+  tor_free(s);
+
+  metrics_reset_counters();
+  s = metrics_format();
+  tt_assert(!strstr(s, "tor_cells_received_total{"));
+  tt_assert(strstr(s, "tor_dns_cache_total{result=\"hit\"} 0\n"));
+  tt_assert(strstr(s, "tor_tls_record_average_bytes 0\n"));
+
+ done:
+  tor_free(s);
+}
+
+static void
+connection_write_to_buf_impl_replacement(const char *string, size_t len,
+                                         connection_t *conn, int zlib)
+{
+  (void) zlib;
+  write_to_buf(string, len, conn->outbuf);
+}
+
+static int n_stop_reading = 0;
+static void
+connection_stop_reading_replacement(connection_t *conn)
+{
+  (void) conn;
+  ++n_stop_reading;
+}
+
+/** Helper: return a newly allocated copy of everything on <b>buf</b>, and
+ * empty it. */
+static char *
+buf_get_all(buf_t *buf)
+{
+  size_t sz = buf_datalen(buf);
+  char *out = tor_malloc(sz + 1);
+  fetch_from_buf(out, sz, buf);
+  out[sz] = '\0';
+  return out;
+}
+
+static void
+test_metrics_http(void *arg)
+{
+  connection_t *conn = NULL;
+  char *reply = NULL;
+  (void) arg;
+
+  MOCK(connection_write_to_buf_impl_,
+       connection_write_to_buf_impl_replacement);
+  MOCK(connection_stop_reading, connection_stop_reading_replacement);
+
+  conn = connection_new(CONN_TYPE_METRICS, AF_INET);
+  conn->state = METRICS_CONN_STATE_READING;
+  conn->address = tor_strdup("127.0.0.1");
+
+  /* Partial request: wait for more. */
+  write_to_buf("GET /metrics HTTP/1.0\r\n", 23, conn->inbuf);
+  tt_int_op(0, OP_EQ, connection_metrics_process_inbuf(conn));
+  tt_int_op(conn->state, OP_EQ, METRICS_CONN_STATE_READING);
+  tt_int_op(buf_datalen(conn->outbuf), OP_EQ, 0);
+
+  write_to_buf("Host: x\r\n\r\n", 11, conn->inbuf);
+  tt_int_op(0, OP_EQ, connection_metrics_process_inbuf(conn));
+  tt_int_op(conn->state, OP_EQ, METRICS_CONN_STATE_WRITING);
+  tt_int_op(n_stop_reading, OP_EQ, 1);
+  reply = buf_get_all(conn->outbuf);
+  tt_assert(!strcmpstart(reply, "HTTP/1.0 200 OK\r\n"));
+  tt_assert(strstr(reply, "\r\n\r\n# HELP tor_uptime_seconds "));
+  tor_free(reply);
+
+  /* Anything after the first request is ignored. */
+  write_to_buf("GET /metrics HTTP/1.0\r\n\r\n", 25, conn->inbuf);
+  tt_int_op(0, OP_EQ, connection_metrics_process_inbuf(conn));
+  tt_int_op(buf_datalen(conn->outbuf), OP_EQ, 0);
+  connection_free_(conn);
+
+  /* Other paths and methods get errors. */
+  conn = connection_new(CONN_TYPE_METRICS, AF_INET);
+  conn->state = METRICS_CONN_STATE_READING;
+  write_to_buf("GET /metricsfoo HTTP/1.0\r\n\r\n", 28, conn->inbuf);
+  tt_int_op(0, OP_EQ, connection_metrics_process_inbuf(conn));
+  reply = buf_get_all(conn->outbuf);
+  tt_assert(!strcmpstart(reply, "HTTP/1.0 404 Not Found\r\n"));
+  tor_free(reply);
+  connection_free_(conn);
+
+  conn = connection_new(CONN_TYPE_METRICS, AF_INET);
+  conn->state = METRICS_CONN_STATE_READING;
+  write_to_buf("POST /metrics HTTP/1.0\r\n\r\n", 26, conn->inbuf);
+  tt_int_op(0, OP_EQ, connection_metrics_process_inbuf(conn));
+  reply = buf_get_all(conn->outbuf);
+  tt_assert(!strcmpstart(reply, "HTTP/1.0 405 Method Not Allowed\r\n"));
+
+ done:
+  UNMOCK(connection_write_to_buf_impl_);
+  UNMOCK(connection_stop_reading);
+  tor_free(reply);
+  if (conn)
+    connection_free_(conn);
+}
+
+struct testcase_t metrics_tests[] = {
+  { "format", test_metrics_format, TT_FORK, NULL, NULL },
+  { "http", test_metrics_http, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
+
@@ -294,6 +294,81 @@ test_md_cache_broken(void *data)
   microdesc_free_all();
 }
 
+/** Make sure that if we stopped in the middle of rebuilding the cache, we
+ * load the sealed journal that the rebuild left behind, and fold it into
+ * the cache file next time. */
+static void
+test_md_cache_sealed_journal(void *data)
+{
+  or_options_t *options;
+  char *fn = NULL, *sealed_fn = NULL, *s = NULL;
+  microdesc_cache_t *mc = NULL;
+  microdesc_t *md1, *md2;
+  char d1[DIGEST256_LEN], d2[DIGEST256_LEN];
+
+  (void)data;
+
+  options = get_options_mutable();
+  tt_assert(options);
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_datadir_test3"));
+
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory, 0700));
+#endif
+
+  crypto_digest256(d1, test_md1, strlen(test_md1), DIGEST_SHA256);
+  crypto_digest256(d2, test_md2, strlen(test_md2), DIGEST_SHA256);
+
+  tor_asprintf(&fn, "%s"PATH_SEPARATOR"cached-microdescs.new",
+               options->DataDirectory);
+  tor_asprintf(&sealed_fn, "%s"PATH_SEPARATOR"cached-microdescs.sealed",
+               options->DataDirectory);
+  tt_int_op(0, OP_EQ, write_str_to_file(sealed_fn, test_md1, 1));
+  tt_int_op(0, OP_EQ, write_str_to_file(fn, test_md2, 1));
+
+  /* Both journals get loaded. */
+  mc = get_microdesc_cache();
+  md1 = microdesc_cache_lookup_by_digest256(mc, d1);
+  md2 = microdesc_cache_lookup_by_digest256(mc, d2);
+  tt_assert(md1);
+  tt_assert(md2);
+  tt_int_op(md1->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  tt_int_op(md2->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+
+  /* Rebuilding puts everything in the cache file, and gets rid of both
+   * journals. */
+  tt_int_op(microdesc_cache_rebuild(mc, 1), OP_EQ, 0);
+  tt_assert(!microdesc_cache_rebuild_in_progress(mc));
+  tt_int_op(md1->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_int_op(md2->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_int_op(file_status(sealed_fn), OP_EQ, FN_NOENT);
+  s = read_file_to_str(fn, RFTS_BIN, NULL);
+  tt_str_op(s, OP_EQ, "");
+  tor_free(s);
+
+  /* They're still there when we reload. */
+  microdesc_free_all();
+  mc = get_microdesc_cache();
+  md1 = microdesc_cache_lookup_by_digest256(mc, d1);
+  md2 = microdesc_cache_lookup_by_digest256(mc, d2);
+  tt_assert(md1);
+  tt_assert(md2);
+  tt_int_op(md1->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_mem_op(md1->body, OP_EQ, test_md1, strlen(test_md1));
+  tt_mem_op(md2->body, OP_EQ, test_md2, strlen(test_md2));
+
+ done:
+  if (options)
+    tor_free(options->DataDirectory);
+  tor_free(fn);
+  tor_free(sealed_fn);
+  tor_free(s);
+  microdesc_free_all();
+}
+
 /* Generated by chutney. */
 static const char test_ri[] =
   "router test005r 127.0.0.1 5005 0 7005\n"
@@ -843,6 +918,7 @@ test_md_corrupt_desc(void *arg)
 struct testcase_t microdesc_tests[] = {
   { "cache", test_md_cache, TT_FORK, NULL, NULL },
   { "broken_cache", test_md_cache_broken, TT_FORK, NULL, NULL },
+  { "sealed_journal", test_md_cache_sealed_journal, TT_FORK, NULL, NULL },
   { "generate", test_md_generate, 0, NULL, NULL },
   { "parse", test_md_parse, 0, NULL, NULL },
   { "reject_cache", test_md_reject_cache, TT_FORK, NULL, NULL },
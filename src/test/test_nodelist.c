@@ -7,6 +7,8 @@
  **/
 
 #include "or.h"
+#include "geoip.h"
+#include "networkstatus.h"
 #include "nodelist.h"
 #include "test.h"
 
@@ -60,12 +62,145 @@ test_nodelist_node_get_verbose_nickname_not_named(void *arg)
   return;
 }
 
+/** Helper: return a new routerstatus whose identity digest is all
+ * <b>id</b> bytes, with address <b>addr</b>. */
+static routerstatus_t *
+make_rs(char id, uint32_t addr, int running)
+{
+  routerstatus_t *rs = tor_malloc_zero(sizeof(routerstatus_t));
+  memset(rs->identity_digest, id, DIGEST_LEN);
+  memset(rs->descriptor_digest, id, DIGEST256_LEN);
+  tor_snprintf(rs->nickname, sizeof(rs->nickname), "router%02x", id);
+  rs->addr = addr;
+  rs->or_port = 9001;
+  rs->is_valid = 1;
+  rs->is_flagged_running = running;
+  return rs;
+}
+
+/** Helper: return a new ns-flavored consensus with digest all
+ * <b>digest</b> bytes, holding <b>rs_list</b> (sorted by identity). */
+static networkstatus_t *
+make_consensus(char digest, routerstatus_t **rs_list, int n)
+{
+  int i;
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->type = NS_TYPE_CONSENSUS;
+  ns->flavor = FLAV_NS;
+  memset(ns->digests.d[DIGEST_SHA1], digest, DIGEST_LEN);
+  ns->routerstatus_list = smartlist_new();
+  for (i = 0; i < n; ++i)
+    smartlist_add(ns->routerstatus_list, rs_list[i]);
+  return ns;
+}
+
+static int n_country_lookups = 0;
+static int
+geoip_get_country_by_addr_counting(const tor_addr_t *addr)
+{
+  (void) addr;
+  ++n_country_lookups;
+  return -1;
+}
+
+static networkstatus_t *mock_consensus = NULL;
+static networkstatus_t *
+networkstatus_get_latest_consensus_mock(void)
+{
+  return mock_consensus;
+}
+
+static void
+test_nodelist_set_consensus_incremental(void *arg)
+{
+  networkstatus_t *ns1 = NULL, *ns2 = NULL, *ns3 = NULL;
+  routerstatus_t *rs1[3], *rs2[3], *rs3[3];
+  char id[DIGEST_LEN];
+  const node_t *node;
+  (void) arg;
+
+  MOCK(geoip_get_country_by_addr, geoip_get_country_by_addr_counting);
+  MOCK(networkstatus_get_latest_consensus,
+       networkstatus_get_latest_consensus_mock);
+
+  rs1[0] = make_rs(1, 0x01010101, 1);
+  rs1[1] = make_rs(2, 0x02020202, 1);
+  rs1[2] = make_rs(3, 0x03030303, 1);
+  ns1 = make_consensus('a', rs1, 3);
+
+  /* Our first consensus: every node is new. */
+  mock_consensus = ns1;
+  nodelist_set_consensus(ns1, NULL);
+  tt_int_op(n_country_lookups, OP_EQ, 3);
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 3);
+
+  /* We decide for ourselves that router 1 is down. */
+  memset(id, 1, DIGEST_LEN);
+  router_set_status(id, 0);
+  tt_assert(! node_get_by_id(id)->is_running);
+
+  /* Router 1 is unchanged, router 2 has gone down, router 3 is gone, and
+   * router 4 is new. */
+  rs2[0] = make_rs(1, 0x01010101, 1);
+  rs2[1] = make_rs(2, 0x02020202, 0);
+  rs2[2] = make_rs(4, 0x04040404, 1);
+  ns2 = make_consensus('b', rs2, 3);
+
+  n_country_lookups = 0;
+  mock_consensus = ns2;
+  nodelist_set_consensus(ns2, ns1);
+  tt_int_op(n_country_lookups, OP_EQ, 2);
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 3);
+  memset(id, 1, DIGEST_LEN);
+  node = node_get_by_id(id);
+  tt_assert(node);
+  tt_ptr_op(node->rs, OP_EQ, rs2[0]);
+  /* The new consensus says router 1 is running, so we believe it again. */
+  tt_assert(node->is_running);
+  memset(id, 2, DIGEST_LEN);
+  node = node_get_by_id(id);
+  tt_assert(node);
+  tt_ptr_op(node->rs, OP_EQ, rs2[1]);
+  tt_assert(! node->is_running);
+  memset(id, 3, DIGEST_LEN);
+  tt_ptr_op(node_get_by_id(id), OP_EQ, NULL);
+  memset(id, 4, DIGEST_LEN);
+  node = node_get_by_id(id);
+  tt_assert(node);
+  tt_ptr_op(node->rs, OP_EQ, rs2[2]);
+  networkstatus_vote_free(ns1);
+  ns1 = NULL;
+
+  /* If the nodes don't come from the consensus we're told they come from,
+   * we have to rebuild everything. */
+  rs3[0] = make_rs(1, 0x01010101, 1);
+  rs3[1] = make_rs(2, 0x02020202, 0);
+  rs3[2] = make_rs(4, 0x04040404, 1);
+  ns3 = make_consensus('c', rs3, 3);
+  memset(ns2->digests.d[DIGEST_SHA1], 'x', DIGEST_LEN);
+  n_country_lookups = 0;
+  mock_consensus = ns3;
+  nodelist_set_consensus(ns3, ns2);
+  tt_int_op(n_country_lookups, OP_EQ, 3);
+  memset(id, 1, DIGEST_LEN);
+  tt_ptr_op(node_get_by_id(id)->rs, OP_EQ, rs3[0]);
+
+ done:
+  UNMOCK(geoip_get_country_by_addr);
+  UNMOCK(networkstatus_get_latest_consensus);
+  nodelist_free_all();
+  networkstatus_vote_free(ns1);
+  networkstatus_vote_free(ns2);
+  networkstatus_vote_free(ns3);
+}
+
 #define NODE(name, flags) \
   { #name, test_nodelist_##name, (flags), NULL, NULL }
 
 struct testcase_t nodelist_tests[] = {
   NODE(node_get_verbose_nickname_by_id_null_node, TT_FORK),
   NODE(node_get_verbose_nickname_not_named, TT_FORK),
+  NODE(set_consensus_incremental, TT_FORK),
   END_OF_TESTCASES
 };
 
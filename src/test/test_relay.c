@@ -16,6 +16,7 @@
 static or_circuit_t * new_fake_orcirc(channel_t *nchan, channel_t *pchan);
 
 static void test_relay_append_cell_to_circuit_queue(void *arg);
+static void test_relay_crypt(void *arg);
 
 static or_circuit_t *
 new_fake_orcirc(channel_t *nchan, channel_t *pchan)
@@ -118,9 +119,113 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   return;
 }
 
+/** Package a cell the way a client would for the last hop of a circuit, and
+ * make sure that relay_crypt() at that hop decrypts and recognizes it. */
+static void
+test_relay_crypt(void *arg)
+{
+  or_circuit_t *orcirc = NULL;
+  relay_crypto_t client;
+  cell_t cell, orig;
+  relay_header_t rh;
+  char keys[CPATH_KEY_MATERIAL_LEN], integrity[4];
+  char recognized;
+  crypt_path_t *layer_hint = NULL;
+  int i;
+
+  (void)arg;
+  memset(&client, 0, sizeof(client));
+  crypto_rand(keys, sizeof(keys));
+  orcirc = tor_malloc_zero(sizeof(*orcirc));
+  orcirc->base_.magic = OR_CIRCUIT_MAGIC;
+  orcirc->base_.purpose = CIRCUIT_PURPOSE_OR;
+
+  tt_int_op(relay_crypto_init(&client, keys, 0), OP_EQ, 0);
+  tt_int_op(relay_crypto_init(&orcirc->crypto, keys, 0), OP_EQ, 0);
+  tt_assert(orcirc->crypto.is_initialized);
+
+  for (i = 0; i < 3; ++i) {
+    memset(&cell, 0, sizeof(cell));
+    memset(&rh, 0, sizeof(rh));
+    rh.command = RELAY_COMMAND_DATA;
+    rh.stream_id = 7;
+    rh.length = 100;
+    relay_header_pack(cell.payload, &rh);
+    crypto_rand((char*)cell.payload+RELAY_HEADER_SIZE, 100);
+
+    /* Set the digest and encrypt, as circuit_package_relay_cell() does. */
+    crypto_digest_add_bytes(CRYPTO_DIGEST_IN(&client.f_digest),
+                            (char*)cell.payload, CELL_PAYLOAD_SIZE);
+    crypto_digest_get_digest(CRYPTO_DIGEST_IN(&client.f_digest),
+                             integrity, 4);
+    memcpy(rh.integrity, integrity, 4);
+    relay_header_pack(cell.payload, &rh);
+    memcpy(&orig, &cell, sizeof(cell));
+    crypto_cipher_crypt_inplace(CRYPTO_CIPHER_IN(&client.f_crypto),
+                                (char*)cell.payload, CELL_PAYLOAD_SIZE);
+
+    recognized = 0;
+    tt_int_op(relay_crypt(TO_CIRCUIT(orcirc), &cell, CELL_DIRECTION_OUT,
+                          &layer_hint, &recognized), OP_EQ, 0);
+    tt_int_op(recognized, OP_EQ, 1);
+    tt_mem_op(cell.payload, OP_EQ, orig.payload, CELL_PAYLOAD_SIZE);
+  }
+
+  /* A cell that isn't for us isn't recognized, and doesn't disturb the
+   * digest state for the next one. */
+  memset(&cell, 0, sizeof(cell));
+  crypto_rand((char*)cell.payload, CELL_PAYLOAD_SIZE);
+  crypto_cipher_crypt_inplace(CRYPTO_CIPHER_IN(&client.f_crypto),
+                              (char*)cell.payload, CELL_PAYLOAD_SIZE);
+  recognized = 0;
+  tt_int_op(relay_crypt(TO_CIRCUIT(orcirc), &cell, CELL_DIRECTION_OUT,
+                        &layer_hint, &recognized), OP_EQ, 0);
+  tt_int_op(recognized, OP_EQ, 0);
+
+  /* Nor is one whose 'recognized' field is zero but whose digest is
+   * wrong. */
+  memset(&cell, 0, sizeof(cell));
+  memset(&rh, 0, sizeof(rh));
+  rh.command = RELAY_COMMAND_DATA;
+  memcpy(rh.integrity, "XXXX", 4);
+  relay_header_pack(cell.payload, &rh);
+  memcpy(&orig, &cell, sizeof(cell));
+  crypto_cipher_crypt_inplace(CRYPTO_CIPHER_IN(&client.f_crypto),
+                              (char*)cell.payload, CELL_PAYLOAD_SIZE);
+  recognized = 0;
+  tt_int_op(relay_crypt(TO_CIRCUIT(orcirc), &cell, CELL_DIRECTION_OUT,
+                        &layer_hint, &recognized), OP_EQ, 0);
+  tt_int_op(recognized, OP_EQ, 0);
+  tt_mem_op(cell.payload, OP_EQ, orig.payload, CELL_PAYLOAD_SIZE);
+
+  memset(&cell, 0, sizeof(cell));
+  memset(&rh, 0, sizeof(rh));
+  rh.command = RELAY_COMMAND_DROP;
+  relay_header_pack(cell.payload, &rh);
+  crypto_digest_add_bytes(CRYPTO_DIGEST_IN(&client.f_digest),
+                          (char*)cell.payload, CELL_PAYLOAD_SIZE);
+  crypto_digest_get_digest(CRYPTO_DIGEST_IN(&client.f_digest),
+                           integrity, 4);
+  memcpy(rh.integrity, integrity, 4);
+  relay_header_pack(cell.payload, &rh);
+  crypto_cipher_crypt_inplace(CRYPTO_CIPHER_IN(&client.f_crypto),
+                              (char*)cell.payload, CELL_PAYLOAD_SIZE);
+  recognized = 0;
+  tt_int_op(relay_crypt(TO_CIRCUIT(orcirc), &cell, CELL_DIRECTION_OUT,
+                        &layer_hint, &recognized), OP_EQ, 0);
+  tt_int_op(recognized, OP_EQ, 1);
+
+ done:
+  relay_crypto_clear(&client);
+  if (orcirc)
+    relay_crypto_clear(&orcirc->crypto);
+  tor_free(orcirc);
+}
+
 struct testcase_t relay_tests[] = {
   { "append_cell_to_circuit_queue", test_relay_append_cell_to_circuit_queue,
     TT_FORK, NULL, NULL },
+  { "crypt", test_relay_crypt, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -0,0 +1,171 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#include "orconfig.h"
+#include "or.h"
+#include "test.h"
+
+#include "config.h"
+#define RENDCACHE_PRIVATE
+#include "rendcache.h"
+
+/** Return a new cache entry holding an empty descriptor that's <b>len</b>
+ * bytes long. */
+static rend_cache_entry_t *
+make_entry(size_t len)
+{
+  rend_cache_entry_t *e = tor_malloc_zero(sizeof(rend_cache_entry_t));
+  e->parsed = tor_malloc_zero(sizeof(rend_service_descriptor_t));
+  e->parsed->intro_nodes = smartlist_new();
+  e->desc = tor_malloc_zero(len + 1);
+  memset(e->desc, 'x', len);
+  e->len = len;
+  return e;
+}
+
+static void
+test_rendcache_client_lru(void *arg)
+{
+  rend_cache_entry_t *e1, *e2, *e3, *found = NULL;
+  rend_cache_stats_t stats;
+  size_t one_entry;
+  (void)arg;
+
+  rend_cache_init();
+
+  e1 = make_entry(1000);
+  rend_cache_add_entry(e1, 0, "2aaaaaaaaaaaaaaaa");
+  one_entry = rend_cache_get_total_allocation();
+  tt_int_op(one_entry, OP_GT, 1000);
+  e2 = make_entry(1000);
+  rend_cache_add_entry(e2, 0, "2bbbbbbbbbbbbbbbb");
+  e3 = make_entry(1000);
+  rend_cache_add_entry(e3, 0, "2cccccccccccccccc");
+  tt_int_op(rend_cache_get_total_allocation(), OP_EQ, 3 * one_entry);
+
+  /* Using the first entry makes the second the least recently used. */
+  tt_int_op(rend_cache_lookup_entry("aaaaaaaaaaaaaaaa", 2, &found),
+            OP_EQ, 0);
+  tt_ptr_op(found, OP_EQ, e1);
+  tt_int_op(rend_cache_lookup_entry("dddddddddddddddd", 2, NULL),
+            OP_EQ, -ENOENT);
+
+  tt_int_op(rend_cache_evict_lru(0, 2 * one_entry, NULL), OP_EQ, one_entry);
+  tt_int_op(rend_cache_lookup_entry("bbbbbbbbbbbbbbbb", 2, NULL),
+            OP_EQ, -ENOENT);
+  tt_int_op(rend_cache_lookup_entry("aaaaaaaaaaaaaaaa", 2, NULL), OP_EQ, 0);
+  tt_int_op(rend_cache_lookup_entry("cccccccccccccccc", 2, NULL), OP_EQ, 0);
+
+  /* We never evict the entry we're told to keep. */
+  tt_int_op(rend_cache_evict_lru(0, 0, e3), OP_EQ, one_entry);
+  tt_int_op(rend_cache_lookup_entry("cccccccccccccccc", 2, NULL), OP_EQ, 0);
+
+  rend_cache_get_stats(0, &stats);
+  tt_int_op(stats.n_entries, OP_EQ, 1);
+  tt_int_op(stats.allocation, OP_EQ, one_entry);
+  tt_u64_op(stats.n_hits, OP_EQ, 4);
+  tt_u64_op(stats.n_misses, OP_EQ, 2);
+  tt_u64_op(stats.n_evictions, OP_EQ, 2);
+
+  /* The HSDir cache is counted separately. */
+  rend_cache_get_stats(1, &stats);
+  tt_int_op(stats.n_entries, OP_EQ, 0);
+  tt_int_op(stats.allocation, OP_EQ, 0);
+
+ done:
+  rend_cache_free_all();
+}
+
+static void
+test_rendcache_dir_lru(void *arg)
+{
+  rend_cache_entry_t *e;
+  rend_cache_stats_t stats;
+  char desc_id[DIGEST_LEN];
+  char desc_id_base32[REND_DESC_ID_V2_LEN_BASE32 + 1];
+  const char *desc = NULL;
+  int i;
+  (void)arg;
+
+  rend_cache_init();
+
+  for (i = 0; i < 4; ++i) {
+    memset(desc_id, 'a' + i, sizeof(desc_id));
+    rend_cache_add_entry(make_entry(500), 1, desc_id);
+  }
+  /* Fetch the oldest descriptor, so that it's no longer the first to go. */
+  memset(desc_id, 'a', sizeof(desc_id));
+  base32_encode(desc_id_base32, sizeof(desc_id_base32),
+                desc_id, DIGEST_LEN);
+  tt_int_op(rend_cache_lookup_v2_desc_as_dir(desc_id_base32, &desc),
+            OP_EQ, 1);
+  tt_assert(desc);
+
+  rend_cache_get_stats(1, &stats);
+  rend_cache_evict_lru(1, stats.allocation / 2, NULL);
+
+  tt_int_op(rend_cache_lookup_v2_desc_as_dir(desc_id_base32, &desc),
+            OP_EQ, 1);
+  for (i = 1; i < 4; ++i) {
+    memset(desc_id, 'a' + i, sizeof(desc_id));
+    base32_encode(desc_id_base32, sizeof(desc_id_base32),
+                  desc_id, DIGEST_LEN);
+    tt_int_op(rend_cache_lookup_v2_desc_as_dir(desc_id_base32, &desc),
+              OP_EQ, i < 3 ? 0 : 1);
+  }
+
+  rend_cache_get_stats(1, &stats);
+  tt_int_op(stats.n_entries, OP_EQ, 2);
+  tt_u64_op(stats.n_evictions, OP_EQ, 2);
+  tt_u64_op(stats.n_hits, OP_EQ, 3);
+  tt_u64_op(stats.n_misses, OP_EQ, 2);
+
+  /* Entries that aren't there any more can still be stored again. */
+  memset(desc_id, 'b', sizeof(desc_id));
+  e = make_entry(500);
+  rend_cache_add_entry(e, 1, desc_id);
+  rend_cache_get_stats(1, &stats);
+  tt_int_op(stats.n_entries, OP_EQ, 3);
+
+ done:
+  rend_cache_free_all();
+}
+
+static void
+test_rendcache_oom(void *arg)
+{
+  rend_cache_stats_t stats;
+  char key[REND_SERVICE_ID_LEN_BASE32 + 2];
+  size_t before, removed;
+  int i;
+  (void)arg;
+
+  rend_cache_init();
+
+  for (i = 0; i < 10; ++i) {
+    tor_snprintf(key, sizeof(key), "2%016d", i);
+    rend_cache_add_entry(make_entry(1000), 0, key);
+  }
+  before = rend_cache_get_total_allocation();
+
+  /* We free at least what we're asked to, and not much more. */
+  removed = rend_cache_handle_oom(time(NULL), before / 3);
+  tt_int_op(removed, OP_GE, before / 3);
+  tt_int_op(removed, OP_LT, before / 2);
+  tt_int_op(rend_cache_get_total_allocation(), OP_EQ, before - removed);
+
+  rend_cache_get_stats(0, &stats);
+  tt_int_op(stats.n_entries, OP_EQ, 6);
+  tt_u64_op(stats.n_evictions, OP_EQ, 4);
+
+ done:
+  rend_cache_free_all();
+}
+
+struct testcase_t rendcache_tests[] = {
+  { "client_lru", test_rendcache_client_lru, TT_FORK, NULL, NULL },
+  { "dir_lru", test_rendcache_dir_lru, TT_FORK, NULL, NULL },
+  { "oom", test_rendcache_oom, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
+
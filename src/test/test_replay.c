@@ -245,7 +245,7 @@ test_replaycache_scrub(void *arg)
   /* Make sure we hit the aging-out case too */
   replaycache_scrub_if_needed_internal(1500, r);
   /* Assert that we aged it */
-  tt_int_op(digestmap_size(r->digests_seen),OP_EQ, 0);
+  tt_int_op(replaycache_size(r),OP_EQ, 0);
 
  done:
   if (r) replaycache_free(r);
@@ -339,6 +339,126 @@ test_replaycache_realtime(void *arg)
   return;
 }
 
+static void
+test_replaycache_generations(void *arg)
+{
+  replaycache_t *r = NULL;
+  int result;
+  time_t elapsed = 0;
+
+  (void)arg;
+  r = replaycache_new(600, 300);
+  tt_assert(r != NULL);
+  tt_int_op(r->n_gens,OP_EQ, 3);
+
+  result =
+    replaycache_add_and_test_internal(100, r, test_buffer,
+        strlen(test_buffer), NULL);
+  tt_int_op(result,OP_EQ, 0);
+
+  /* A hit in a later generation should carry the entry forward... */
+  result =
+    replaycache_add_and_test_internal(450, r, test_buffer,
+        strlen(test_buffer), &elapsed);
+  tt_int_op(result,OP_EQ, 1);
+  tt_int_op(elapsed,OP_EQ, 350);
+  tt_int_op(r->scrubbed,OP_EQ, 400);
+
+  /* ...so that it's still there after its first generation is gone. */
+  result =
+    replaycache_add_and_test_internal(1000, r, test_buffer,
+        strlen(test_buffer), &elapsed);
+  tt_int_op(result,OP_EQ, 1);
+  tt_int_op(elapsed,OP_EQ, 550);
+  tt_int_op(replaycache_size(r),OP_EQ, 2);
+
+  /* Once it has aged out, it's a miss again, even if the generation it's
+   * in hasn't been dropped yet. */
+  result =
+    replaycache_add_and_test_internal(1700, r, test_buffer,
+        strlen(test_buffer), NULL);
+  tt_int_op(result,OP_EQ, 0);
+  tt_int_op(replaycache_size(r),OP_EQ, 2);
+
+ done:
+  if (r) replaycache_free(r);
+
+  return;
+}
+
+static void
+test_replaycache_bounded(void *arg)
+{
+  replaycache_t *r = NULL;
+  int result, i;
+  char buf[32];
+
+  (void)arg;
+  r = replaycache_new_bounded(600, 300, 100, 1e-3);
+  tt_assert(r != NULL);
+  /* 100 entries is few enough for 32-bit fingerprints... */
+  tt_int_op(r->fp_bits,OP_EQ, 32);
+
+  for (i = 0; i < 250; ++i) {
+    tor_snprintf(buf, sizeof(buf), "entry %d", i);
+    result = replaycache_add_and_test_internal(100, r, buf, strlen(buf),
+                                               NULL);
+    tt_int_op(result,OP_EQ, 0);
+    tt_int_op(replaycache_size(r),OP_LE, 100);
+  }
+
+  /* The newest entries are still there; the oldest have been dropped. */
+  result = replaycache_add_and_test_internal(101, r, "entry 249", 9, NULL);
+  tt_int_op(result,OP_EQ, 1);
+  result = replaycache_add_and_test_internal(101, r, "entry 0", 7, NULL);
+  tt_int_op(result,OP_EQ, 0);
+  replaycache_free(r);
+
+  /* ...but a million isn't. */
+  r = replaycache_new_bounded(600, 300, 1<<20, 1e-6);
+  tt_assert(r != NULL);
+  tt_int_op(r->fp_bits,OP_EQ, 64);
+  replaycache_free(r);
+
+  /* Fewer entries than generations: each generation still holds one, so
+   * we only rotate when we have to. */
+  r = replaycache_new_bounded(600, 60, 2, 1e-3);
+  tt_assert(r != NULL);
+  tt_int_op(r->n_gens,OP_GT, 2);
+  result = replaycache_add_and_test_internal(100, r, "entry 0", 7, NULL);
+  tt_int_op(result,OP_EQ, 0);
+  tt_int_op(r->cur_gen,OP_EQ, 0);
+  result = replaycache_add_and_test_internal(100, r, "entry 0", 7, NULL);
+  tt_int_op(result,OP_EQ, 1);
+  tt_int_op(r->cur_gen,OP_EQ, 0);
+  result = replaycache_add_and_test_internal(100, r, "entry 1", 7, NULL);
+  tt_int_op(result,OP_EQ, 0);
+  tt_int_op(r->cur_gen,OP_EQ, 1);
+  tt_int_op(replaycache_size(r),OP_EQ, 2);
+  /* Entries last until every generation has been used once. */
+  for (i = 2; i < r->n_gens; ++i) {
+    tor_snprintf(buf, sizeof(buf), "entry %d", i);
+    result = replaycache_add_and_test_internal(100, r, buf, strlen(buf),
+                                               NULL);
+    tt_int_op(result,OP_EQ, 0);
+  }
+  tt_int_op(replaycache_size(r),OP_EQ, r->n_gens);
+  result = replaycache_add_and_test_internal(101, r, "entry 0", 7, NULL);
+  tt_int_op(result,OP_EQ, 1);
+  replaycache_free(r);
+
+  /* Long horizons with short intervals still use a few generations. */
+  r = replaycache_new(3600, 1);
+  tt_assert(r != NULL);
+  tt_int_op(r->n_gens,OP_LE, REPLAYCACHE_MAX_GENERATIONS);
+  tt_int_op((r->n_gens - 1) * r->gen_length,OP_GE, 3600);
+
+ done:
+  if (r) replaycache_free(r);
+
+  return;
+}
+
 #define REPLAYCACHE_LEGACY(name) \
   { #name, test_replaycache_ ## name , 0, NULL, NULL }
 
@@ -354,6 +474,8 @@ struct testcase_t replaycache_tests[] = {
   REPLAYCACHE_LEGACY(scrub),
   REPLAYCACHE_LEGACY(future),
   REPLAYCACHE_LEGACY(realtime),
+  REPLAYCACHE_LEGACY(generations),
+  REPLAYCACHE_LEGACY(bounded),
   END_OF_TESTCASES
 };
 
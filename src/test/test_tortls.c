@@ -0,0 +1,241 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#include "orconfig.h"
+#define TORTLS_PRIVATE
+#include "or.h"
+#include "test.h"
+
+#include <openssl/ssl.h>
+
+/** Return a new SSL_SESSION that we established at <b>when</b>, and that
+ * the server will let us resume for <b>timeout</b> seconds. */
+static SSL_SESSION *
+new_test_session(time_t when, long timeout)
+{
+  static uint32_t n_sessions = 0;
+  SSL_SESSION *session = SSL_SESSION_new();
+#if OPENSSL_VERSION_NUMBER >= OPENSSL_V_SERIES(1,1,0)
+  unsigned char session_id[8];
+  /* Sessions without an ID or a ticket can't be resumed. */
+  memset(session_id, 0, sizeof(session_id));
+  set_uint32(session_id, ++n_sessions);
+  SSL_SESSION_set1_id(session, session_id, sizeof(session_id));
+#else
+  (void)n_sessions;
+#endif
+  SSL_SESSION_set_time(session, (long)when);
+  SSL_SESSION_set_timeout(session, timeout);
+  return session;
+}
+
+/** Set <b>id</b> to a fake identity digest derived from <b>n</b>. */
+static void
+set_test_peer_id(char *id, uint32_t n)
+{
+  memset(id, 0x5a, DIGEST_LEN);
+  set_uint32(id, n);
+}
+
+static void
+test_tortls_session_save_and_resume(void *arg)
+{
+  SSL_CTX *ctx = NULL;
+  SSL *ssl = NULL;
+  SSL_SESSION *session;
+  char id1[DIGEST_LEN], id2[DIGEST_LEN];
+  const time_t now = 1433000000;
+  (void)arg;
+
+  set_test_peer_id(id1, 1);
+  set_test_peer_id(id2, 2);
+  ctx = SSL_CTX_new(SSLv23_client_method());
+  tt_assert(ctx);
+  ssl = SSL_new(ctx);
+  tt_assert(ssl);
+
+  /* Nothing saved yet. */
+  tt_int_op(tor_tls_session_cache_offer(ssl, id1, now), OP_EQ, 0);
+  tt_ptr_op(SSL_get_session(ssl), OP_EQ, NULL);
+
+  session = new_test_session(now, 600);
+  tor_tls_session_cache_add(session, id1, now);
+  tt_int_op(tor_tls_session_cache_size(), OP_EQ, 1);
+
+  /* We offer the session to the relay we made it with, and nobody else. */
+  tt_int_op(tor_tls_session_cache_offer(ssl, id2, now), OP_EQ, 0);
+  tt_int_op(tor_tls_session_cache_offer(ssl, id1, now), OP_EQ, 1);
+  tt_ptr_op(SSL_get_session(ssl), OP_EQ, session);
+  /* Offering it doesn't use it up. */
+  tt_int_op(tor_tls_session_cache_size(), OP_EQ, 1);
+
+  /* Saving another session with the same relay replaces the first. */
+  session = new_test_session(now + 10, 600);
+  tor_tls_session_cache_add(session, id1, now + 10);
+  tt_int_op(tor_tls_session_cache_size(), OP_EQ, 1);
+  tt_int_op(tor_tls_session_cache_offer(ssl, id1, now + 10), OP_EQ, 1);
+  tt_ptr_op(SSL_get_session(ssl), OP_EQ, session);
+
+ done:
+  tor_tls_session_cache_free_all();
+  if (ssl)
+    SSL_free(ssl);
+  if (ctx)
+    SSL_CTX_free(ctx);
+}
+
+static void
+test_tortls_session_forget(void *arg)
+{
+  SSL_CTX *ctx = NULL;
+  SSL *ssl = NULL;
+  char id1[DIGEST_LEN], id2[DIGEST_LEN];
+  const time_t now = 1433000000;
+  (void)arg;
+
+  set_test_peer_id(id1, 1);
+  set_test_peer_id(id2, 2);
+  ctx = SSL_CTX_new(SSLv23_client_method());
+  tt_assert(ctx);
+  ssl = SSL_new(ctx);
+  tt_assert(ssl);
+
+  /* Forgetting when we have no cache at all is fine. */
+  tor_tls_forget_session(id1);
+
+  tor_tls_session_cache_add(new_test_session(now, 600), id1, now);
+  tor_tls_session_cache_add(new_test_session(now, 600), id2, now);
+  tt_int_op(tor_tls_session_cache_size(), OP_EQ, 2);
+
+  tor_tls_forget_session(id1);
+  tt_int_op(tor_tls_session_cache_size(), OP_EQ, 1);
+  tt_int_op(tor_tls_session_cache_offer(ssl, id1, now), OP_EQ, 0);
+  tt_int_op(tor_tls_session_cache_offer(ssl, id2, now), OP_EQ, 1);
+
+  /* Forgetting it twice is harmless. */
+  tor_tls_forget_session(id1);
+  tt_int_op(tor_tls_session_cache_size(), OP_EQ, 1);
+
+ done:
+  tor_tls_session_cache_free_all();
+  if (ssl)
+    SSL_free(ssl);
+  if (ctx)
+    SSL_CTX_free(ctx);
+}
+
+static void
+test_tortls_session_expiry(void *arg)
+{
+  SSL_CTX *ctx = NULL;
+  SSL *ssl = NULL;
+  char id1[DIGEST_LEN], id2[DIGEST_LEN];
+  const time_t now = 1433000000;
+  (void)arg;
+
+  set_test_peer_id(id1, 1);
+  set_test_peer_id(id2, 2);
+  ctx = SSL_CTX_new(SSLv23_client_method());
+  tt_assert(ctx);
+  ssl = SSL_new(ctx);
+  tt_assert(ssl);
+
+  /* The server's timeout wins if it's shorter than ours... */
+  tor_tls_session_cache_add(new_test_session(now, 60), id1, now);
+  /* ...and ours wins if it's longer. */
+  tor_tls_session_cache_add(new_test_session(now, 86400), id2, now);
+
+  tt_int_op(tor_tls_session_cache_offer(ssl, id1, now + 59), OP_EQ, 1);
+  tt_int_op(tor_tls_session_cache_offer(ssl, id1, now + 60), OP_EQ, 0);
+  /* Expired sessions get removed when we notice them. */
+  tt_int_op(tor_tls_session_cache_size(), OP_EQ, 1);
+
+  tt_int_op(tor_tls_session_cache_offer(ssl, id2,
+                                        now + TOR_TLS_SESSION_LIFETIME - 1),
+            OP_EQ, 1);
+  tt_int_op(tor_tls_session_cache_offer(ssl, id2,
+                                        now + TOR_TLS_SESSION_LIFETIME),
+            OP_EQ, 0);
+  tt_int_op(tor_tls_session_cache_size(), OP_EQ, 0);
+
+  /* A session we only get to save late still lasts no longer than its
+   * lifetime from when it was made. */
+  tor_tls_session_cache_add(new_test_session(now, 600), id1, now + 300);
+  tt_int_op(tor_tls_session_cache_offer(ssl, id1, now + 599), OP_EQ, 1);
+  tt_int_op(tor_tls_session_cache_offer(ssl, id1, now + 600), OP_EQ, 0);
+
+ done:
+  tor_tls_session_cache_free_all();
+  if (ssl)
+    SSL_free(ssl);
+  if (ctx)
+    SSL_CTX_free(ctx);
+}
+
+static void
+test_tortls_session_cache_lru(void *arg)
+{
+  SSL_CTX *ctx = NULL;
+  SSL *ssl = NULL;
+  char id[DIGEST_LEN];
+  const time_t now = 1433000000;
+  uint32_t i;
+  (void)arg;
+
+  ctx = SSL_CTX_new(SSLv23_client_method());
+  tt_assert(ctx);
+  ssl = SSL_new(ctx);
+  tt_assert(ssl);
+
+  for (i = 0; i < TOR_TLS_SESSION_CACHE_MAX; ++i) {
+    set_test_peer_id(id, i);
+    tor_tls_session_cache_add(new_test_session(now, 600), id, now);
+  }
+  tt_int_op(tor_tls_session_cache_size(), OP_EQ, TOR_TLS_SESSION_CACHE_MAX);
+
+  /* Saving a new session with relay 0 makes it the most recent one. */
+  set_test_peer_id(id, 0);
+  tor_tls_session_cache_add(new_test_session(now, 600), id, now);
+  tt_int_op(tor_tls_session_cache_size(), OP_EQ, TOR_TLS_SESSION_CACHE_MAX);
+
+  /* So when the cache overflows, relay 1 is the one to go. */
+  set_test_peer_id(id, TOR_TLS_SESSION_CACHE_MAX);
+  tor_tls_session_cache_add(new_test_session(now, 600), id, now);
+  tt_int_op(tor_tls_session_cache_size(), OP_EQ, TOR_TLS_SESSION_CACHE_MAX);
+
+  set_test_peer_id(id, 1);
+  tt_int_op(tor_tls_session_cache_offer(ssl, id, now), OP_EQ, 0);
+  set_test_peer_id(id, 0);
+  tt_int_op(tor_tls_session_cache_offer(ssl, id, now), OP_EQ, 1);
+  set_test_peer_id(id, 2);
+  tt_int_op(tor_tls_session_cache_offer(ssl, id, now), OP_EQ, 1);
+  set_test_peer_id(id, TOR_TLS_SESSION_CACHE_MAX);
+  tt_int_op(tor_tls_session_cache_offer(ssl, id, now), OP_EQ, 1);
+
+  /* And then relay 2. */
+  set_test_peer_id(id, TOR_TLS_SESSION_CACHE_MAX + 1);
+  tor_tls_session_cache_add(new_test_session(now, 600), id, now);
+  set_test_peer_id(id, 2);
+  tt_int_op(tor_tls_session_cache_offer(ssl, id, now), OP_EQ, 0);
+  set_test_peer_id(id, 3);
+  tt_int_op(tor_tls_session_cache_offer(ssl, id, now), OP_EQ, 1);
+
+ done:
+  tor_tls_session_cache_free_all();
+  if (ssl)
+    SSL_free(ssl);
+  if (ctx)
+    SSL_CTX_free(ctx);
+}
+
+#define TORTLS_TEST(name) \
+  { #name, test_tortls_##name, TT_FORK, NULL, NULL }
+
+struct testcase_t tortls_tests[] = {
+  TORTLS_TEST(session_save_and_resume),
+  TORTLS_TEST(session_forget),
+  TORTLS_TEST(session_expiry),
+  TORTLS_TEST(session_cache_lru),
+  END_OF_TESTCASES
+};
+
@@ -6,12 +6,16 @@
 #include "orconfig.h"
 #define COMPAT_PRIVATE
 #define CONTROL_PRIVATE
+#define HISTOGRAM_PRIVATE
 #define UTIL_PRIVATE
 #include "or.h"
 #include "config.h"
 #include "control.h"
 #include "test.h"
+#include "histogram.h"
 #include "memarea.h"
+#include "mempool.h"
+#include "trace.h"
 #include "util_process.h"
 
 #ifdef _WIN32
@@ -2737,6 +2741,319 @@ test_util_memarea(void *arg)
   tor_free(malloced_ptr);
 }
 
+/** Test memareas with bigger chunks, reuse of big chunks, and peak
+ * statistics. */
+static void
+test_util_memarea_sized(void *arg)
+{
+  memarea_t *area = NULL;
+  char *p1, *p2, *big;
+  size_t allocated, used, peak_allocated, peak_used;
+  int i;
+  (void)arg;
+
+  memarea_clear_freelist();
+
+  /* Chunk sizes round up to a size class: 10000 bytes becomes 16 KB. */
+  area = memarea_new_sized(10000);
+  memarea_get_stats(area, &allocated, &used);
+  tt_int_op(allocated, OP_LE, 16384);
+  tt_int_op(allocated, OP_GT, 16000);
+  /* So 12 KB of allocations fit in one chunk. */
+  p1 = memarea_alloc(area, 6000);
+  p2 = memarea_alloc(area, 6000);
+  tt_assert(memarea_owns_ptr(area, p1));
+  tt_assert(memarea_owns_ptr(area, p2));
+  tt_ptr_op(p2, OP_EQ, p1 + 6000);
+  memarea_get_stats(area, &allocated, &used);
+  tt_int_op(allocated, OP_LE, 16384);
+  tt_int_op(used, OP_GT, 12000);
+
+  /* Clearing the area resets its usage, but not its peak. */
+  memarea_clear(area);
+  memarea_get_stats(area, &allocated, &used);
+  tt_int_op(used, OP_LT, 100);
+  memarea_get_peak_stats(area, &peak_allocated, &peak_used);
+  tt_int_op(peak_used, OP_GT, 12000);
+  tt_int_op(peak_allocated, OP_EQ, allocated);
+
+  /* A too-big allocation gets its own chunk from a bigger size class... */
+  big = memarea_alloc(area, 100000);
+  tt_assert(memarea_owns_ptr(area, big));
+  memarea_get_peak_stats(area, &peak_allocated, &peak_used);
+  tt_int_op(peak_allocated, OP_GT, 100000);
+  tt_int_op(peak_allocated, OP_LE, 16384 + 131072);
+  memarea_drop_all(area);
+
+  /* ...which we reuse for the next one. */
+  area = memarea_new_sized(10000);
+  p1 = memarea_alloc(area, 90000);
+  tt_ptr_op(p1, OP_EQ, big);
+  memarea_drop_all(area);
+
+  /* Ordinary chunks from a default-sized area don't get mixed up with
+   * the bigger ones. */
+  area = memarea_new();
+  memarea_get_stats(area, &allocated, &used);
+  tt_int_op(allocated, OP_LE, 4096);
+  memarea_drop_all(area);
+
+  /* The totals we keep as we add chunks match the chunks themselves (which
+   * memarea_assert_ok() checks), and the peaks survive memarea_clear(). */
+  area = memarea_new();
+  for (i = 0; i < 200; ++i) {
+    memarea_alloc(area, 100 + i);
+    if (i % 50 == 0)
+      memarea_alloc(area, 10000);
+  }
+  memarea_assert_ok(area);
+  memarea_get_stats(area, &allocated, &used);
+  memarea_get_peak_stats(area, &peak_allocated, &peak_used);
+  tt_int_op(allocated, OP_GT, 40000);
+  tt_int_op(peak_allocated, OP_EQ, allocated);
+  tt_int_op(peak_used, OP_EQ, used);
+  memarea_clear(area);
+  memarea_alloc(area, 100);
+  memarea_assert_ok(area);
+  memarea_get_peak_stats(area, &peak_allocated, &peak_used);
+  tt_int_op(peak_allocated, OP_EQ, allocated);
+  tt_int_op(peak_used, OP_EQ, used);
+  memarea_drop_all(area);
+
+  /* Chunks are never bigger than the biggest size class. */
+  area = memarea_new_sized(4*1024*1024);
+  memarea_get_stats(area, &allocated, &used);
+  tt_int_op(allocated, OP_LE, 2*1024*1024);
+  tt_int_op(allocated, OP_GT, 2*1024*1024 - 100);
+  p1 = memarea_alloc_zero(area, 1024*1024);
+  p2 = memarea_alloc_zero(area, 3*1024*1024);
+  tt_assert(memarea_owns_ptr(area, p1));
+  tt_assert(memarea_owns_ptr(area, p2));
+  memarea_assert_ok(area);
+  memarea_drop_all(area);
+  area = NULL;
+
+ done:
+  if (area)
+    memarea_drop_all(area);
+  memarea_clear_freelist();
+}
+
+/** Run unittests for memory pool allocator */
+static void
+test_util_mempool(void *arg)
+{
+  mp_pool_t *pool = NULL;
+  smartlist_t *allocated = NULL;
+  size_t n_alloc, n_peak, n_chunks, n_bytes;
+  int i;
+
+  (void)arg;
+  pool = mp_pool_new("test", 1, 100);
+  tt_assert(pool);
+  mp_pool_destroy(pool);
+
+  pool = mp_pool_new("test", 241, 2500);
+  tt_assert(pool);
+  mp_pool_destroy(pool);
+
+  pool = mp_pool_new("test", 3, 0);
+  allocated = smartlist_new();
+  for (i = 0; i < 20000; ++i) {
+    if (smartlist_len(allocated) < 20 || crypto_rand_int(2)) {
+      void *m = mp_pool_get(pool);
+      memset(m, 0x09, 3);
+      smartlist_add(allocated, m);
+    } else {
+      int idx = crypto_rand_int(smartlist_len(allocated));
+      void *m = smartlist_get(allocated, idx);
+      tt_int_op(((uint8_t*)m)[2], OP_EQ, 0x09);
+      mp_pool_release(m);
+      smartlist_del(allocated, idx);
+    }
+    if (crypto_rand_int(777) == 0)
+      mp_pool_clean(pool, 1);
+    if (i % 777 == 0)
+      mp_pool_assert_ok(pool);
+  }
+  mp_pool_assert_ok(pool);
+
+  mp_pool_get_stats(pool, &n_alloc, &n_peak, &n_chunks, &n_bytes);
+  tt_int_op(n_alloc, OP_EQ, smartlist_len(allocated));
+  tt_int_op(n_peak, OP_GE, n_alloc);
+  tt_int_op(n_chunks, OP_GT, 0);
+  tt_int_op(n_bytes, OP_GE, n_alloc * 3);
+
+  SMARTLIST_FOREACH(allocated, void *, m, mp_pool_release(m));
+  smartlist_clear(allocated);
+  mp_pool_assert_ok(pool);
+  mp_pool_get_stats(pool, &n_alloc, &n_peak, NULL, NULL);
+  tt_int_op(n_alloc, OP_EQ, 0);
+
+  /* Cleaning with nothing allocated leaves only the chunks we asked for. */
+  mp_pool_clean(pool, 1);
+  mp_pool_assert_ok(pool);
+  mp_pool_get_stats(pool, NULL, NULL, &n_chunks, NULL);
+  tt_int_op(n_chunks, OP_LE, 1);
+  mp_pool_clean(pool, 0);
+  mp_pool_get_stats(pool, NULL, NULL, &n_chunks, NULL);
+  tt_int_op(n_chunks, OP_EQ, 0);
+
+  /* A fresh item after cleaning should still be usable. */
+  {
+    uint64_t *u = mp_pool_get(pool);
+    tt_assert(((uintptr_t)u % sizeof(uint64_t)) == 0);
+    *u = 7;
+    mp_pool_release(u);
+  }
+  mp_pool_get_stats(pool, NULL, &n_peak, NULL, NULL);
+  tt_int_op(n_peak, OP_GE, 20);
+
+ done:
+  if (allocated) {
+    SMARTLIST_FOREACH(allocated, void *, m, mp_pool_release(m));
+    smartlist_free(allocated);
+  }
+  if (pool)
+    mp_pool_destroy(pool);
+}
+
+static void
+test_util_trace(void *arg)
+{
+  const char *fname = get_fname("trace");
+  char *body = NULL;
+  struct stat st;
+  const tor_trace_file_header_t *hdr;
+  const tor_trace_record_t *recs;
+  size_t n_recs;
+  int i;
+
+  (void)arg;
+  tt_str_op(tor_trace_event_name(TRACE_EV_CELL_RECV), OP_EQ, "cell_recv");
+  tt_ptr_op(tor_trace_event_name(N_TRACE_EVENTS), OP_EQ, NULL);
+
+  /* Nothing is recorded until we start. */
+  tor_trace(TRACE_EV_CELL_RECV, 1, 2);
+
+  tt_int_op(0, OP_EQ, tor_trace_start(fname, 0));
+  for (i = 0; i < 10; ++i)
+    tor_trace(TRACE_EV_CELL_QUEUE, i, 100+i);
+  tor_trace_flush();
+  /* Overflow the (minimum-size, 1024-record) ring. */
+  for (i = 0; i < 3000; ++i)
+    tor_trace(TRACE_EV_BUF_FLUSH, i, 0);
+  tor_trace_stop();
+  /* Nothing is recorded after we stop. */
+  tor_trace(TRACE_EV_CELL_RECV, 1, 2);
+  tor_trace_flush();
+
+  body = read_file_to_str(fname, RFTS_BIN, &st);
+  tt_assert(body);
+  hdr = (const tor_trace_file_header_t *)body;
+  tt_mem_op(hdr->magic, OP_EQ, TOR_TRACE_FILE_MAGIC, 8);
+  tt_int_op(hdr->version, OP_EQ, TOR_TRACE_FILE_VERSION);
+  tt_int_op(hdr->record_size, OP_EQ, sizeof(tor_trace_record_t));
+  n_recs = (st.st_size - sizeof(*hdr)) / sizeof(tor_trace_record_t);
+  tt_int_op(n_recs, OP_EQ, 10 + 1 + 1024);
+  recs = (const tor_trace_record_t *)(body + sizeof(*hdr));
+
+  for (i = 0; i < 10; ++i) {
+    tt_int_op(recs[i].event, OP_EQ, TRACE_EV_CELL_QUEUE);
+    tt_u64_op(recs[i].a, OP_EQ, i);
+    tt_u64_op(recs[i].b, OP_EQ, 100+i);
+    if (i)
+      tt_u64_op(recs[i].timestamp, OP_GE, recs[i-1].timestamp);
+  }
+  tt_int_op(recs[10].event, OP_EQ, TRACE_EV_LOST);
+  tt_u64_op(recs[10].a, OP_EQ, 3000 - 1024);
+  for (i = 0; i < 1024; ++i) {
+    tt_int_op(recs[11+i].event, OP_EQ, TRACE_EV_BUF_FLUSH);
+    tt_u64_op(recs[11+i].a, OP_EQ, 3000 - 1024 + i);
+  }
+
+ done:
+  tor_trace_free_all();
+  tor_free(body);
+}
+
+static void
+test_util_histogram(void *arg)
+{
+  histogram_t *h = tor_malloc_zero(sizeof(histogram_t));
+  histogram_t *h2 = tor_malloc_zero(sizeof(histogram_t));
+  histogram_t *diff = tor_malloc_zero(sizeof(histogram_t));
+  uint32_t v;
+  int i;
+
+  (void)arg;
+
+  /* Small values get their own buckets. */
+  for (i = 0; i < 16; ++i) {
+    tt_int_op(histogram_bucket_for_value(i), OP_EQ, i);
+    tt_int_op(histogram_bucket_max(i), OP_EQ, i);
+  }
+  tt_int_op(histogram_bucket_for_value(16), OP_EQ, 16);
+  tt_int_op(histogram_bucket_for_value(17), OP_EQ, 16);
+  tt_int_op(histogram_bucket_for_value(18), OP_EQ, 17);
+  tt_int_op(histogram_bucket_max(16), OP_EQ, 17);
+  tt_int_op(histogram_bucket_for_value(UINT32_MAX), OP_EQ,
+            HISTOGRAM_N_BUCKETS - 1);
+  tt_u64_op(histogram_bucket_max(HISTOGRAM_N_BUCKETS - 1), OP_EQ,
+            UINT32_MAX);
+
+  /* Every value lands in the bucket whose range contains it, and buckets
+   * are never wider than 1/8 of their values. */
+  for (v = 1; v < UINT32_MAX / 3; v = v * 3 + 1) {
+    int b = histogram_bucket_for_value(v);
+    tt_u64_op(histogram_bucket_max(b), OP_GE, v);
+    tt_u64_op(histogram_bucket_max(b-1), OP_LT, v);
+    tt_u64_op(histogram_bucket_max(b) - histogram_bucket_max(b-1), OP_LE,
+              v / 8 + 1);
+  }
+
+  /* Empty histograms. */
+  tt_int_op(histogram_get_percentile(h, 50.0), OP_EQ, 0);
+  tt_double_op(histogram_get_mean(h), OP_LT, .00001);
+
+  /* 1..1000 */
+  for (i = 1; i <= 1000; ++i)
+    histogram_record(h, i);
+  tt_u64_op(h->n_values, OP_EQ, 1000);
+  tt_int_op(h->max, OP_EQ, 1000);
+  tt_double_op(fabs(histogram_get_mean(h) - 500.5), OP_LT, .00001);
+  v = histogram_get_percentile(h, 50.0);
+  tt_int_op(v, OP_GE, 500);
+  tt_int_op(v, OP_LE, 500 + 500/8);
+  v = histogram_get_percentile(h, 99.0);
+  tt_int_op(v, OP_GE, 990);
+  tt_int_op(v, OP_LE, 1000);
+  tt_int_op(histogram_get_percentile(h, 100.0), OP_EQ, 1000);
+  tt_int_op(histogram_get_percentile(h, 0.0), OP_EQ, 1);
+
+  /* Subtracting an earlier snapshot leaves only the new values. */
+  memcpy(h2, h, sizeof(histogram_t));
+  for (i = 0; i < 10; ++i)
+    histogram_record(h2, 100000);
+  histogram_subtract(diff, h2, h);
+  tt_u64_op(diff->n_values, OP_EQ, 10);
+  tt_u64_op(diff->total, OP_EQ, 1000000);
+  tt_int_op(diff->max, OP_EQ, 100000);
+  tt_int_op(histogram_get_percentile(diff, 50.0), OP_EQ, 100000);
+  histogram_subtract(diff, h2, h2);
+  tt_u64_op(diff->n_values, OP_EQ, 0);
+  tt_int_op(diff->max, OP_EQ, 0);
+
+  histogram_clear(h);
+  tt_u64_op(h->n_values, OP_EQ, 0);
+  tt_int_op(histogram_get_percentile(h, 50.0), OP_EQ, 0);
+
+ done:
+  tor_free(h);
+  tor_free(h2);
+  tor_free(diff);
+}
+
 /** Run unit tests for utility functions to get file names relative to
  * the data directory. */
 static void
@@ -4364,6 +4681,10 @@ struct testcase_t util_tests[] = {
   UTIL_LEGACY(gzip),
   UTIL_LEGACY(datadir),
   UTIL_LEGACY(memarea),
+  UTIL_TEST(memarea_sized, TT_FORK),
+  UTIL_TEST(mempool, 0),
+  UTIL_TEST(trace, TT_FORK),
+  UTIL_TEST(histogram, 0),
   UTIL_LEGACY(control_formats),
   UTIL_LEGACY(mmap),
   UTIL_LEGACY(sscanf),
@@ -0,0 +1,160 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file tor-tracedump.c
+ * \brief Print the binary event trace that Tor writes when TraceFile is set.
+ *
+ * Records from all threads are merged and printed in time order, one per
+ * line, with times in microseconds since the first record.  With -s, print
+ * only a count of each event.
+ */
+
+#include "orconfig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#include "compat.h"
+#include "util.h"
+#include "torlog.h"
+#include "trace.h"
+
+/** qsort helper: order pointers to trace records by timestamp, keeping
+ * records with the same timestamp in file order. */
+static int
+compare_record_ptrs_(const void **a_, const void **b_)
+{
+  const tor_trace_record_t *a = *a_, *b = *b_;
+  if (a->timestamp < b->timestamp)
+    return -1;
+  else if (a->timestamp > b->timestamp)
+    return 1;
+  else if (a < b)
+    return -1;
+  else if (a > b)
+    return 1;
+  else
+    return 0;
+}
+
+/** Print a name for <b>event</b> to stdout, padded to a fixed width. */
+static void
+print_event_name(int event)
+{
+  const char *name = tor_trace_event_name(event);
+  if (name)
+    printf("%-20s", name);
+  else
+    printf("unknown-%-12d", event);
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr, "Syntax: tor-tracedump [-s] FILE\n"
+          "Print the events in a trace file written by Tor's TraceFile "
+          "option.\n"
+          "  -s   Print only the number of each kind of event.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *fname = NULL;
+  int summary_only = 0;
+  char *body = NULL;
+  struct stat st;
+  const tor_trace_file_header_t *hdr;
+  const tor_trace_record_t **recs = NULL;
+  size_t n_recs, i;
+  uint64_t counts[N_TRACE_EVENTS+1], n_lost = 0;
+  int result = 1;
+
+  init_logging(1);
+
+  if (argc == 3 && !strcmp(argv[1], "-s")) {
+    summary_only = 1;
+    fname = argv[2];
+  } else if (argc == 2 && argv[1][0] != '-') {
+    fname = argv[1];
+  } else {
+    usage();
+    return 1;
+  }
+
+  body = read_file_to_str(fname, RFTS_BIN, &st);
+  if (!body) {
+    fprintf(stderr, "Couldn't read %s\n", fname);
+    goto done;
+  }
+  if ((size_t)st.st_size < sizeof(tor_trace_file_header_t)) {
+    fprintf(stderr, "%s is too short to be a trace file.\n", fname);
+    goto done;
+  }
+  hdr = (const tor_trace_file_header_t *)body;
+  if (memcmp(hdr->magic, TOR_TRACE_FILE_MAGIC, sizeof(hdr->magic))) {
+    fprintf(stderr, "%s is not a trace file.\n", fname);
+    goto done;
+  }
+  if (hdr->version != TOR_TRACE_FILE_VERSION ||
+      hdr->record_size != sizeof(tor_trace_record_t)) {
+    fprintf(stderr, "%s has an unsupported version or record size, or was "
+            "written on a host with a different byte order.\n", fname);
+    goto done;
+  }
+
+  n_recs = ((size_t)st.st_size - sizeof(*hdr)) / sizeof(tor_trace_record_t);
+  if (n_recs * sizeof(tor_trace_record_t) + sizeof(*hdr) !=
+      (size_t)st.st_size)
+    fprintf(stderr, "Ignoring partial record at the end of %s.\n", fname);
+
+  recs = tor_calloc(n_recs ? n_recs : 1, sizeof(*recs));
+  for (i = 0; i < n_recs; ++i)
+    recs[i] = (const tor_trace_record_t *)
+      (body + sizeof(*hdr) + i*sizeof(tor_trace_record_t));
+  qsort(recs, n_recs, sizeof(*recs),
+        (int (*)(const void *, const void *))compare_record_ptrs_);
+
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < n_recs; ++i) {
+    const tor_trace_record_t *r = recs[i];
+    int ev = r->event < N_TRACE_EVENTS ? r->event : N_TRACE_EVENTS;
+    ++counts[ev];
+    if (r->event == TRACE_EV_LOST)
+      n_lost += r->a;
+    if (summary_only)
+      continue;
+    printf("%14.3f %3u ",
+           (r->timestamp - recs[0]->timestamp) / 1000.0, (unsigned)r->thread);
+    print_event_name(r->event);
+    printf(" "U64_FORMAT" "U64_FORMAT"\n",
+           U64_PRINTF_ARG(r->a), U64_PRINTF_ARG(r->b));
+  }
+
+  if (summary_only) {
+    for (i = 1; i <= N_TRACE_EVENTS; ++i) {
+      if (!counts[i])
+        continue;
+      print_event_name((int)i);
+      printf(" "U64_FORMAT"\n", U64_PRINTF_ARG(counts[i]));
+    }
+    if (n_recs) {
+      printf("%-20s %.3f usec\n", "duration",
+             (recs[n_recs-1]->timestamp - recs[0]->timestamp) / 1000.0);
+    }
+  }
+  if (n_lost)
+    fprintf(stderr, "Warning: "U64_FORMAT" records were lost.\n",
+            U64_PRINTF_ARG(n_lost));
+  result = 0;
+
+ done:
+  tor_free(recs);
+  tor_free(body);
+  return result;
+}
+